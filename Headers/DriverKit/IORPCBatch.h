@@ -0,0 +1,328 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IORPCBATCH_H
+#define _IORPCBATCH_H
+
+#include <stddef.h>
+#include <DriverKit/IORPC.h>
+#include <DriverKit/IOReturn.h>
+
+/*
+ * A batch ring carries many small IORPCMessage records through memory shared
+ * by a driver and the service it calls, so that they cost one transition
+ * instead of one IORPCMessageMach round trip each.  The caller appends records
+ * to the ring, then signals the other side once, for example with a single
+ * external method call; the callee processes every published record in that
+ * one call with IORPCBatchProcess().
+ *
+ * Records marked kIORPCMessageOneway have no reply, and a failure is only
+ * counted in the ring's errors.  Other records reserve space for a reply; once
+ * the signal returns, IORPCBatchGetResult() yields the record's result and
+ * reply, which stay valid until the caller appends again.
+ *
+ * The ring has one producer and one consumer; head and tail are byte offsets
+ * that only grow, the consumer writing head and the producer tail.  The
+ * consumer does not trust the ring's size field: it derives the size from the
+ * length of its own mapping with IORPCBatchRingSize() and passes it to
+ * IORPCBatchProcess().
+ */
+
+#define kIORPCBatchVersion      1
+#define kIORPCBatchAlignment    8
+
+struct IORPCBatchRing {
+	uint32_t          version;
+	uint32_t          size;         // bytes of record space, a power of 2
+	volatile uint64_t head;         // bytes consumed
+	volatile uint64_t tail;         // bytes published
+	volatile uint64_t errors;       // failed oneway records
+	uint64_t          reserved[4];
+	uint8_t           records[0];
+};
+typedef struct IORPCBatchRing IORPCBatchRing;
+
+struct IORPCBatchRecord {
+	uint32_t      size;             // bytes of the record, including this header
+	uint32_t      messageSize;      // bytes of message, 0 for padding up to the end of the ring
+	uint32_t      replySize;        // reply capacity, then bytes of reply
+	kern_return_t result;
+	IORPCMessage  message;
+};
+typedef struct IORPCBatchRecord IORPCBatchRecord;
+
+/*
+ * Handles one record on the consumer side.  reply is NULL for oneway records;
+ * otherwise *replySize holds its capacity and is set to the bytes written.
+ */
+typedef kern_return_t (*IORPCBatchHandler)(void * context, IORPCMessage * message, uint32_t messageSize,
+    IORPCMessage * reply, uint32_t * replySize);
+
+static inline uint32_t
+IORPCBatchAlign(uint32_t size)
+{
+	return (size + kIORPCBatchAlignment - 1) & ~(uint32_t) (kIORPCBatchAlignment - 1);
+}
+
+static inline IORPCBatchRecord *
+IORPCBatchRecordAt(IORPCBatchRing * ring, uint64_t offset)
+{
+	return (IORPCBatchRecord *) &ring->records[offset & (ring->size - 1)];
+}
+
+static inline IORPCMessage *
+IORPCBatchReply(IORPCBatchRecord * record)
+{
+	return (IORPCMessage *) ((uint8_t *) &record->message + IORPCBatchAlign(record->messageSize));
+}
+
+/*!
+ * @function IORPCBatchRingSize
+ * @abstract Computes the record space of a ring laid out in length bytes.
+ * @return The largest power of 2 of record space that fits, or 0 if length is too small.
+ */
+static inline uint32_t
+IORPCBatchRingSize(size_t length)
+{
+	uint32_t size = 256;
+
+	if (length < sizeof(IORPCBatchRing) + size) {
+		return 0;
+	}
+	while (size < (1U << 30) && sizeof(IORPCBatchRing) + 2 * (size_t) size <= length) {
+		size <<= 1;
+	}
+	return size;
+}
+
+/*!
+ * @function IORPCBatchRingInit
+ * @abstract Lays out a ring in shared memory.
+ * @param memory Memory shared by both sides, 8-byte aligned.
+ * @param length Bytes of memory; IORPCBatchRingSize(length) bytes of record space are used.
+ * @return The ring, or NULL if length is too small.
+ */
+static inline IORPCBatchRing *
+IORPCBatchRingInit(void * memory, size_t length)
+{
+	IORPCBatchRing * ring = (IORPCBatchRing *) memory;
+	uint32_t         size = IORPCBatchRingSize(length);
+
+	if (size == 0) {
+		return NULL;
+	}
+
+	__builtin_memset(ring, 0, sizeof(IORPCBatchRing));
+	ring->version = kIORPCBatchVersion;
+	ring->size    = size;
+
+	return ring;
+}
+
+/*!
+ * @function IORPCBatchReserve
+ * @abstract Reserves a record for a message the caller builds in place.
+ * @param messageSize Bytes of the message, including its IORPCMessage header.
+ * @param replySize Bytes reserved for the reply; 0 makes the record oneway.
+ * @param ticket Receives the record's identity, for IORPCBatchCommit() and IORPCBatchGetResult().
+ * @return The message to fill in, or NULL if the ring is full and must be signaled first.
+ */
+static inline IORPCMessage *
+IORPCBatchReserve(IORPCBatchRing * ring, uint32_t messageSize, uint32_t replySize, uint64_t * ticket)
+{
+	// Sized in 64 bits so that no message or reply size can wrap it below the ring's limit.
+	uint64_t           recordSize = (offsetof(IORPCBatchRecord, message) + (uint64_t) messageSize + replySize +
+	    2 * (kIORPCBatchAlignment - 1)) & ~(uint64_t) (kIORPCBatchAlignment - 1);
+	uint64_t           head       = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t           tail       = ring->tail;
+	uint32_t           toEnd      = ring->size - (uint32_t) (tail & (ring->size - 1));
+	IORPCBatchRecord * record;
+
+	if (messageSize < sizeof(IORPCMessage) || recordSize > ring->size / 2) {
+		return NULL;
+	}
+
+	// Records never wrap; pad to the end of the ring if this one would.
+	if (toEnd < recordSize) {
+		if (tail + toEnd + recordSize - head > ring->size) {
+			return NULL;
+		}
+		record = IORPCBatchRecordAt(ring, tail);
+		record->size        = toEnd;
+		record->messageSize = 0;
+		tail += toEnd;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	} else if (tail + recordSize - head > ring->size) {
+		return NULL;
+	}
+
+	record = IORPCBatchRecordAt(ring, tail);
+	record->size        = (uint32_t) recordSize;
+	record->messageSize = messageSize;
+	record->replySize   = replySize;
+	record->result      = kIOReturnNotReady;
+	*ticket = tail;
+
+	return &record->message;
+}
+
+/*!
+ * @function IORPCBatchCommit
+ * @abstract Publishes a reserved record to the consumer.
+ */
+static inline void
+IORPCBatchCommit(IORPCBatchRing * ring, uint64_t ticket)
+{
+	IORPCBatchRecord * record = IORPCBatchRecordAt(ring, ticket);
+
+	if (record->replySize == 0) {
+		record->message.flags |= kIORPCMessageOneway;
+	} else {
+		record->message.flags &= ~(uint64_t) kIORPCMessageOneway;
+	}
+	__atomic_store_n(&ring->tail, ticket + record->size, __ATOMIC_RELEASE);
+}
+
+/*!
+ * @function IORPCBatchEnqueue
+ * @abstract Copies a built message into the ring and publishes it.
+ * @return false if the ring is full and must be signaled first.
+ */
+static inline bool
+IORPCBatchEnqueue(IORPCBatchRing * ring, const IORPCMessage * message, uint32_t messageSize,
+    uint32_t replySize, uint64_t * ticket)
+{
+	uint64_t       reserved;
+	IORPCMessage * copy = IORPCBatchReserve(ring, messageSize, replySize, &reserved);
+
+	if (copy == NULL) {
+		return false;
+	}
+	__builtin_memcpy(copy, message, messageSize);
+	IORPCBatchCommit(ring, reserved);
+	if (ticket) {
+		*ticket = reserved;
+	}
+	return true;
+}
+
+/*!
+ * @function IORPCBatchGetResult
+ * @abstract Reads the outcome of a processed record.
+ * @param reply Receives the reply, or NULL for a oneway record.
+ * @param replySize Receives the bytes of reply.
+ * @return The record's result, or kIOReturnNotReady if it has not been processed.
+ */
+static inline kern_return_t
+IORPCBatchGetResult(IORPCBatchRing * ring, uint64_t ticket, IORPCMessage ** reply, uint32_t * replySize)
+{
+	IORPCBatchRecord * record = IORPCBatchRecordAt(ring, ticket);
+
+	if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) < ticket + record->size) {
+		return kIOReturnNotReady;
+	}
+	if (reply) {
+		*reply = record->replySize ? IORPCBatchReply(record) : NULL;
+	}
+	if (replySize) {
+		*replySize = record->replySize;
+	}
+	return record->result;
+}
+
+/*!
+ * @function IORPCBatchProcess
+ * @abstract Consumes every published record, calling handler for each.
+ * @discussion
+ * Record sizes come from the other side and are checked before use; a ring
+ * found corrupt is left unprocessed from that record on.  The handler must
+ * validate message contents, which the producer can still write.
+ * @param ringSize The ring's record space, from IORPCBatchRingSize() of the consumer's own mapping.
+ * @return The number of records processed.
+ */
+static inline uint32_t
+IORPCBatchProcess(IORPCBatchRing * ring, uint32_t ringSize, IORPCBatchHandler handler, void * context)
+{
+	uint64_t head  = ring->head;
+	uint64_t tail  = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint32_t count = 0;
+
+	if (ringSize < kIORPCBatchAlignment || (ringSize & (ringSize - 1)) || tail - head > ringSize) {
+		return 0;
+	}
+
+	while (head < tail) {
+		IORPCBatchRecord * record  = (IORPCBatchRecord *) &ring->records[head & (ringSize - 1)];
+		uint32_t           size    = record->size;
+		uint32_t           toEnd   = ringSize - (uint32_t) (head & (ringSize - 1));
+		uint32_t           message;
+		uint32_t           reply;
+
+		// A padding record may be no larger than size and messageSize.
+		if (size < kIORPCBatchAlignment || size > toEnd || size > tail - head ||
+		    (size & (kIORPCBatchAlignment - 1))) {
+			break;
+		}
+		message = record->messageSize;
+
+		if (message) {
+			uint32_t capacity;
+
+			if (size < offsetof(IORPCBatchRecord, message)) {
+				break;
+			}
+			reply    = record->replySize;
+			capacity = reply;
+
+			// Checking message against size first keeps IORPCBatchAlign() from wrapping.
+			if (message < sizeof(IORPCMessage) || message > size ||
+			    offsetof(IORPCBatchRecord, message) + (uint64_t) IORPCBatchAlign(message) + reply > size) {
+				record->result = kIOReturnBadArgument;
+			} else if (reply) {
+				record->result = handler(context, &record->message, message,
+				    (IORPCMessage *) ((uint8_t *) &record->message + IORPCBatchAlign(message)), &reply);
+				if (reply > capacity) {
+					record->result = kIOReturnOverrun;
+					reply = capacity;
+				}
+				record->replySize = reply;
+			} else {
+				record->result = handler(context, &record->message, message, NULL, NULL);
+			}
+			if (reply == 0 && record->result != kIOReturnSuccess) {
+				ring->errors = ring->errors + 1;
+			}
+			count++;
+		}
+
+		head += size;
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	}
+
+	return count;
+}
+
+#endif /* _IORPCBATCH_H */
@@ -0,0 +1,847 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOKIT_IOLOCKPROFILE_H
+#define _IOKIT_IOLOCKPROFILE_H
+
+#include <libkern/c++/OSContainers.h>
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOService.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOKernelReportStructs.h>
+#include <kern/locks.h>
+#include <kern/clock.h>
+#include <mach/mach_time.h>
+
+/*!
+ * @header IOLockProfile
+ * @abstract
+ * Per call site contention profiling for a driver's own locks.
+ * @discussion
+ * The lck_grp statistics say how contended a lock group is, not which of a
+ * driver's call sites wait for it or hold it too long.  IOProfiledMutex,
+ * IOProfiledSpinLock and IOProfiledRWLock wrap an IOLock, an IOSimpleLock and
+ * a lck_rw_t; each acquisition names its call site, usually with
+ * IOLockProfileSite(), and while the IOLockProfile they report to is enabled,
+ * counts acquisitions and contended acquisitions for that site and keeps
+ * histograms of its wait and hold times.  Hold times are not measured for
+ * shared read-write lock acquisitions.  While the profile is disabled an
+ * acquisition costs two extra loads, of the profile and of its enabled flag,
+ * and a branch.
+ *
+ * Detecting contention takes a try-lock, which the kernel exports for mutexes
+ * and spin locks only through IOLockTryLock() and IOSimpleLockTryLock(), so
+ * those two wrappers are built on IOLocks, in the IOKit lock group, rather
+ * than on lck_mtx_t and lck_spin_t in a lock group of the driver's.
+ *
+ * The profile is exported through IOReport: publishLegend() advertises one
+ * counter channel and two histogram channels per site seen so far, and the
+ * driver forwards its configureReport() and updateReport() calls to the
+ * profile's.
+ */
+
+#define __IOLockProfileString(x)        #x
+#define __IOLockProfileLine(x)          __IOLockProfileString(x)
+
+/*!
+ * @defined IOLockProfileSite
+ * @abstract Names the calling line as a lock profiling site.
+ */
+#define IOLockProfileSite()             (__FILE__ ":" __IOLockProfileLine(__LINE__))
+
+class IOLockProfile
+{
+public:
+
+	enum Kind
+	{
+		kKindMutex,
+		kKindSpin,
+		kKindShared,
+		kKindExclusive
+	};
+
+	static const UInt32 kSitesMax   = 256;
+	static const UInt32 kBuckets    = 24;       // bucket n holds times up to 2^(n+1) ns
+
+	// Channel IDs are the type, followed by the site index.
+	static const UInt64 kChannelCounts = IOREPORT_MAKEID('L', 'c', 'k', 'C', 'n', 't', 0, 0);
+	static const UInt64 kChannelWait   = IOREPORT_MAKEID('L', 'c', 'k', 'W', 'a', 'i', 0, 0);
+	static const UInt64 kChannelHold   = IOREPORT_MAKEID('L', 'c', 'k', 'H', 'o', 'l', 0, 0);
+
+	IOLockProfile()
+	{
+		bzero(this, sizeof(*this));
+	}
+
+	/*!
+	 * @function init
+	 * @abstract Prepares the profile, disabled.
+	 * @param provider Service whose registry entry ID identifies the channels.
+	 * @param groupName IOReport group name of the channels.
+	 * @param sitesMax Number of call sites profiled, a power of 2 up to kSitesMax.
+	 * @result kIOReturnSuccess, kIOReturnBadArgument or kIOReturnNoMemory.
+	 */
+
+	IOReturn
+	init(IOService * provider, const char * groupName, UInt32 sitesMax = 32)
+	{
+		if (provider == NULL || groupName == NULL || sitesMax == 0 || sitesMax > kSitesMax ||
+		    (sitesMax & (sitesMax - 1))) {
+			return kIOReturnBadArgument;
+		}
+
+		_sites = (Site *) IOMalloc(sitesMax * sizeof(Site));
+		if (_sites == NULL) {
+			return kIOReturnNoMemory;
+		}
+		bzero(_sites, sitesMax * sizeof(Site));
+
+		_providerID = provider->getRegistryEntryID();
+		_sitesMax = sitesMax;
+		strlcpy(_groupName, groupName, sizeof(_groupName));
+
+		return kIOReturnSuccess;
+	}
+
+	/*!
+	 * @function free
+	 * @abstract Releases the profile; no lock may still report to it.
+	 */
+
+	void
+	free()
+	{
+		if (_sites) {
+			IOFree(_sites, _sitesMax * sizeof(Site));
+		}
+		_sites = NULL;
+		_sitesMax = 0;
+	}
+
+	/*!
+	 * @function setEnabled
+	 * @abstract Starts or stops profiling; counts are kept while stopped.
+	 */
+
+	void
+	setEnabled(bool enabled)
+	{
+		_enabled = enabled && _sites;
+	}
+
+	bool
+	isEnabled() const
+	{
+		return _enabled;
+	}
+
+	/*!
+	 * @function reset
+	 * @abstract Clears the counts of every site; call while profiling is stopped.
+	 */
+
+	void
+	reset()
+	{
+		for (UInt32 index = 0; index < _sitesMax; index++) {
+			const char * name = _sites[index].name;
+			UInt32       kind = _sites[index].kind;
+
+			bzero(&_sites[index], sizeof(Site));
+			_sites[index].name = name;
+			_sites[index].kind = kind;
+		}
+	}
+
+	/*!
+	 * @function publishLegend
+	 * @abstract Advertises the channels of the sites seen so far in the provider's IOReport legend.
+	 * @discussion
+	 * Sites are discovered as they are first profiled, so call this again once
+	 * the driver has run its workload to advertise new sites.
+	 */
+
+	IOReturn
+	publishLegend(IOService * provider)
+	{
+		OSArray *      legend;
+		OSArray *      counts   = OSArray::withCapacity(_siteCount);
+		OSArray *      times    = OSArray::withCapacity(_siteCount * 2);
+		OSDictionary * info     = OSDictionary::withCapacity(2);
+		OSNumber *     unit     = OSNumber::withNumber(kIOReportUnit_ns, 64);
+		OSData *       config;
+		IOReturn       status   = kIOReturnNoMemory;
+
+		IOHistogramSegmentConfig segment = { 2, kIOHistogramScaleExponential, 0, kBuckets };
+
+		config = OSData::withBytes(&segment, sizeof(segment));
+
+		if (counts && times && info && unit && config && info->setObject(kIOReportLegendUnitKey, unit) &&
+		    info->setObject(kIOReportLegendConfigKey, config)) {
+			status = kIOReturnSuccess;
+
+			for (UInt32 index = 0; index < _sitesMax && status == kIOReturnSuccess; index++) {
+				if (_sites[index].name == NULL) {
+					continue;
+				}
+				if (!addChannel(counts, kChannelCounts + index, kIOReportFormatSimpleArray, 2, _sites[index].name) ||
+				    !addChannel(times, kChannelWait + index, kIOReportFormatHistogram, kBuckets, _sites[index].name) ||
+				    !addChannel(times, kChannelHold + index, kIOReportFormatHistogram, kBuckets, _sites[index].name)) {
+					status = kIOReturnNoMemory;
+				}
+			}
+		}
+
+		if (status == kIOReturnSuccess) {
+			legend = OSArray::withCapacity(2);
+			if (legend && addGroup(legend, counts, "Counts", NULL) && addGroup(legend, times, "Times", info)) {
+				provider->setProperty(kIOReportLegendKey, legend);
+				provider->setProperty(kIOReportLegendPublicKey, true);
+			} else {
+				status = kIOReturnNoMemory;
+			}
+			if (legend) {
+				legend->release();
+			}
+		}
+
+		if (counts) {
+			counts->release();
+		}
+		if (times) {
+			times->release();
+		}
+		if (info) {
+			info->release();
+		}
+		if (unit) {
+			unit->release();
+		}
+		if (config) {
+			config->release();
+		}
+
+		return status;
+	}
+
+	/*!
+	 * @function configureReport
+	 * @abstract Handles the profile's channels in the driver's configureReport().
+	 */
+
+	IOReturn
+	configureReport(IOReportChannelList * channels, IOReportConfigureAction action, void * result, void * destination)
+	{
+		(void) destination;
+
+		if (action != kIOReportGetDimensions) {
+			return kIOReturnSuccess;
+		}
+
+		for (UInt32 index = 0; index < channels->nchannels; index++) {
+			UInt32 count;
+
+			if (channelSite(channels->channels[index].channel_id, &count) != NULL) {
+				*(int *) result += count;
+			}
+		}
+
+		return kIOReturnSuccess;
+	}
+
+	/*!
+	 * @function updateReport
+	 * @abstract Handles the profile's channels in the driver's updateReport().
+	 * @discussion
+	 * A histogram bucket's minimum and maximum report the bucket's bounds
+	 * rather than the extremes of the times it holds.
+	 */
+
+	IOReturn
+	updateReport(IOReportChannelList * channels, IOReportUpdateAction action, void * result, void * destination)
+	{
+		IOBufferMemoryDescriptor * buffer = (IOBufferMemoryDescriptor *) destination;
+		IOReportElement            element;
+		UInt64                     timestamp = mach_absolute_time();
+
+		if (action != kIOReportCopyChannelData) {
+			return kIOReturnSuccess;
+		}
+
+		for (UInt32 index = 0; index < channels->nchannels; index++) {
+			UInt64 channelID = channels->channels[index].channel_id;
+			Site * site;
+			UInt32 count;
+
+			site = channelSite(channelID, &count);
+			if (site == NULL) {
+				continue;
+			}
+
+			for (UInt32 elementIndex = 0; elementIndex < count; elementIndex++) {
+				bzero(&element, sizeof(element));
+
+				element.provider_id = _providerID;
+				element.channel_id = channelID;
+				element.channel_type.categories = kIOReportCategoryPerformance | kIOReportCategoryDebug;
+				element.channel_type.nelements = count;
+				element.channel_type.element_idx = elementIndex;
+				element.timestamp = timestamp;
+
+				if ((channelID & ~0xFFFFULL) == kChannelCounts) {
+					element.channel_type.report_format = kIOReportFormatSimpleArray;
+					for (UInt32 value = 0; value < IOR_VALUES_PER_ELEMENT; value++) {
+						element.values.v[value] = site->counts[elementIndex * IOR_VALUES_PER_ELEMENT + value];
+					}
+				} else {
+					Bucket *                  bucket = ((channelID & ~0xFFFFULL) == kChannelWait) ? site->wait : site->hold;
+					IOHistogramReportValues * values = (IOHistogramReportValues *) &element.values;
+
+					element.channel_type.report_format = kIOReportFormatHistogram;
+					values->bucket_hits = bucket[elementIndex].hits;
+					values->bucket_sum  = bucket[elementIndex].sum;
+					values->bucket_min  = elementIndex ? (1LL << elementIndex) + 1 : 0;
+					values->bucket_max  = 1LL << (elementIndex + 1);
+				}
+
+				if (!buffer->appendBytes(&element, sizeof(element))) {
+					return kIOReturnOverrun;
+				}
+				*(int *) result += 1;
+			}
+		}
+
+		return kIOReturnSuccess;
+	}
+
+	/*!
+	 * @function getSiteCount
+	 * @abstract Reports the number of sites profiled, and the acquisitions lost because every site was taken.
+	 */
+
+	UInt32
+	getSiteCount(UInt64 * overflows = NULL) const
+	{
+		if (overflows) {
+			*overflows = _overflows;
+		}
+		return _siteCount;
+	}
+
+protected:
+
+	friend class IOProfiledMutex;
+	friend class IOProfiledSpinLock;
+	friend class IOProfiledRWLock;
+
+	enum
+	{
+		kCountAcquires,
+		kCountContended,
+		kCountWaitTime,
+		kCountWaitMax,
+		kCountHolds,
+		kCountHoldTime,
+		kCountHoldMax,
+		kCountKind,
+		kCountCount
+	};
+
+	struct Bucket
+	{
+		UInt64 hits;
+		UInt64 sum;
+	};
+
+	struct Site
+	{
+		const char *          name;
+		UInt32                kind;
+		UInt64                counts[kCountCount];
+		Bucket                wait[kBuckets];
+		Bucket                hold[kBuckets];
+	};
+
+	Site *
+	lookup(const char * name, UInt32 kind)
+	{
+		UInt32 mask  = _sitesMax - 1;
+		UInt32 index = (UInt32) (((uintptr_t) name * 0x9E3779B97F4A7C15ULL) >> 40) & mask;
+
+		for (UInt32 probe = 0; probe <= mask; probe++, index = (index + 1) & mask) {
+			Site *       site    = &_sites[index];
+			const char * current = __atomic_load_n(&site->name, __ATOMIC_ACQUIRE);
+
+			if (current == name) {
+				return site;
+			}
+			if (current == NULL) {
+				if (__atomic_compare_exchange_n(&site->name, &current, name, false,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+					site->kind = kind;
+					site->counts[kCountKind] = kind;
+					__atomic_fetch_add(&_siteCount, 1, __ATOMIC_RELAXED);
+					return site;
+				}
+				if (current == name) {
+					return site;
+				}
+			}
+		}
+
+		__atomic_fetch_add(&_overflows, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	static UInt64
+	nanoseconds(UInt64 start, UInt64 end)
+	{
+		UInt64 ns;
+
+		absolutetime_to_nanoseconds(end - start, &ns);
+		return ns;
+	}
+
+	static void
+	tally(Bucket * histogram, UInt64 * total, UInt64 * maximum, UInt64 ns)
+	{
+		UInt32 bucket = (ns <= 2) ? 0 : 63 - __builtin_clzll(ns - 1);
+		UInt64 current;
+
+		if (bucket >= kBuckets) {
+			bucket = kBuckets - 1;
+		}
+
+		__atomic_fetch_add(&histogram[bucket].hits, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&histogram[bucket].sum, ns, __ATOMIC_RELAXED);
+		__atomic_fetch_add(total, ns, __ATOMIC_RELAXED);
+
+		current = __atomic_load_n(maximum, __ATOMIC_RELAXED);
+		while (ns > current && !__atomic_compare_exchange_n(maximum, &current, ns, true,
+		    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		}
+	}
+
+	Site *
+	recordAcquire(const char * name, UInt32 kind, bool contended, UInt64 start, UInt64 end)
+	{
+		Site * site = lookup(name, kind);
+
+		if (site) {
+			__atomic_fetch_add(&site->counts[kCountAcquires], 1, __ATOMIC_RELAXED);
+			if (contended) {
+				__atomic_fetch_add(&site->counts[kCountContended], 1, __ATOMIC_RELAXED);
+			}
+			tally(site->wait, &site->counts[kCountWaitTime], &site->counts[kCountWaitMax],
+			    contended ? nanoseconds(start, end) : 0);
+		}
+
+		return site;
+	}
+
+	void
+	recordRelease(Site * site, UInt64 acquired)
+	{
+		__atomic_fetch_add(&site->counts[kCountHolds], 1, __ATOMIC_RELAXED);
+		tally(site->hold, &site->counts[kCountHoldTime], &site->counts[kCountHoldMax],
+		    nanoseconds(acquired, mach_absolute_time()));
+	}
+
+	Site *
+	channelSite(UInt64 channelID, UInt32 * count)
+	{
+		UInt64 type  = channelID & ~0xFFFFULL;
+		UInt64 index = channelID & 0xFFFFULL;
+
+		if (type != kChannelCounts && type != kChannelWait && type != kChannelHold) {
+			return NULL;
+		}
+		if (index >= _sitesMax || _sites[index].name == NULL) {
+			return NULL;
+		}
+
+		*count = (type == kChannelCounts) ? kCountCount / IOR_VALUES_PER_ELEMENT : kBuckets;
+		return &_sites[index];
+	}
+
+	static bool
+	addChannel(OSArray * channels, UInt64 channelID, UInt8 format, UInt16 count, const char * name)
+	{
+		IOReportChannelType type     = { format, 0, kIOReportCategoryPerformance | kIOReportCategoryDebug, count, 0 };
+		UInt64              typeBits = 0;
+		OSArray *           channel  = OSArray::withCapacity(3);
+		OSNumber *          idNumber = OSNumber::withNumber(channelID, 64);
+		OSNumber *          typeNumber;
+		OSString *          nameString = OSString::withCString(name);
+		bool                added;
+
+		bcopy(&type, &typeBits, sizeof(type));
+		typeNumber = OSNumber::withNumber(typeBits, 64);
+
+		added = channel && idNumber && typeNumber && nameString &&
+		    channel->setObject(kIOReportChannelIDIdx, idNumber) &&
+		    channel->setObject(kIOReportChannelTypeIdx, typeNumber) &&
+		    channel->setObject(kIOReportChannelNameIdx, nameString) &&
+		    channels->setObject(channel);
+
+		if (channel) {
+			channel->release();
+		}
+		if (idNumber) {
+			idNumber->release();
+		}
+		if (typeNumber) {
+			typeNumber->release();
+		}
+		if (nameString) {
+			nameString->release();
+		}
+
+		return added;
+	}
+
+	bool
+	addGroup(OSArray * legend, OSArray * channels, const char * subGroup, OSDictionary * info)
+	{
+		OSDictionary * group        = OSDictionary::withCapacity(4);
+		OSString *     groupName    = OSString::withCString(_groupName);
+		OSString *     subGroupName = OSString::withCString(subGroup);
+		bool           added;
+
+		added = group && groupName && subGroupName &&
+		    group->setObject(kIOReportLegendChannelsKey, channels) &&
+		    group->setObject(kIOReportLegendGroupNameKey, groupName) &&
+		    group->setObject(kIOReportLegendSubGroupNameKey, subGroupName) &&
+		    (info == NULL || group->setObject(kIOReportLegendInfoKey, info)) &&
+		    legend->setObject(group);
+
+		if (group) {
+			group->release();
+		}
+		if (groupName) {
+			groupName->release();
+		}
+		if (subGroupName) {
+			subGroupName->release();
+		}
+
+		return added;
+	}
+
+	Site *          _sites;
+	UInt32          _sitesMax;
+	UInt32          _siteCount;
+	UInt64          _overflows;
+	UInt64          _providerID;
+	volatile bool   _enabled;
+	char            _groupName[64];
+};
+
+/*!
+ * @class IOProfiledMutex
+ * @abstract An IOLock whose acquisitions are profiled by call site.
+ */
+
+class IOProfiledMutex
+{
+public:
+
+	IOProfiledMutex()
+	{
+		bzero(this, sizeof(*this));
+	}
+
+	IOReturn
+	init(IOLockProfile * profile)
+	{
+		_lock = IOLockAlloc();
+		if (_lock == NULL) {
+			return kIOReturnNoMemory;
+		}
+
+		_profile = profile;
+
+		return kIOReturnSuccess;
+	}
+
+	void
+	free()
+	{
+		if (_lock) {
+			IOLockFree(_lock);
+		}
+		_lock = NULL;
+	}
+
+	void
+	lock(const char * site)
+	{
+		UInt64 start;
+		bool   contended;
+
+		if (__builtin_expect(!_profile->_enabled, 1)) {
+			IOLockLock(_lock);
+			return;
+		}
+
+		start = mach_absolute_time();
+		contended = !IOLockTryLock(_lock);
+		if (contended) {
+			IOLockLock(_lock);
+		}
+
+		_acquired = contended ? mach_absolute_time() : start;
+		_site = _profile->recordAcquire(site, IOLockProfile::kKindMutex, contended, start, _acquired);
+	}
+
+	void
+	unlock()
+	{
+		IOLockProfile::Site * site = _site;
+
+		if (site) {
+			_site = NULL;
+			_profile->recordRelease(site, _acquired);
+		}
+
+		IOLockUnlock(_lock);
+	}
+
+	lck_mtx_t *
+	getLock() const
+	{
+		return IOLockGetMachLock(_lock);
+	}
+
+protected:
+
+	IOLock *                _lock;
+	IOLockProfile *         _profile;
+	IOLockProfile::Site *   _site;          // set while held by a profiled acquisition
+	UInt64                  _acquired;
+};
+
+/*!
+ * @class IOProfiledSpinLock
+ * @abstract An IOSimpleLock whose acquisitions are profiled by call site.
+ */
+
+class IOProfiledSpinLock
+{
+public:
+
+	IOProfiledSpinLock()
+	{
+		bzero(this, sizeof(*this));
+	}
+
+	IOReturn
+	init(IOLockProfile * profile)
+	{
+		_lock = IOSimpleLockAlloc();
+		if (_lock == NULL) {
+			return kIOReturnNoMemory;
+		}
+
+		_profile = profile;
+
+		return kIOReturnSuccess;
+	}
+
+	void
+	free()
+	{
+		if (_lock) {
+			IOSimpleLockFree(_lock);
+		}
+		_lock = NULL;
+	}
+
+	void
+	lock(const char * site)
+	{
+		UInt64 start;
+		bool   contended;
+
+		if (__builtin_expect(!_profile->_enabled, 1)) {
+			IOSimpleLockLock(_lock);
+			return;
+		}
+
+		start = mach_absolute_time();
+		contended = !IOSimpleLockTryLock(_lock);
+		if (contended) {
+			IOSimpleLockLock(_lock);
+		}
+
+		_acquired = contended ? mach_absolute_time() : start;
+		_site = _profile->recordAcquire(site, IOLockProfile::kKindSpin, contended, start, _acquired);
+	}
+
+	void
+	unlock()
+	{
+		IOLockProfile::Site * site = _site;
+
+		if (site) {
+			_site = NULL;
+			_profile->recordRelease(site, _acquired);
+		}
+
+		IOSimpleLockUnlock(_lock);
+	}
+
+	lck_spin_t *
+	getLock() const
+	{
+		return IOSimpleLockGetMachLock(_lock);
+	}
+
+protected:
+
+	IOSimpleLock *          _lock;
+	IOLockProfile *         _profile;
+	IOLockProfile::Site *   _site;
+	UInt64                  _acquired;
+};
+
+/*!
+ * @class IOProfiledRWLock
+ * @abstract A lck_rw_t whose acquisitions are profiled by call site.
+ * @discussion Hold times are only measured for exclusive acquisitions.
+ */
+
+class IOProfiledRWLock
+{
+public:
+
+	IOProfiledRWLock()
+	{
+		bzero(this, sizeof(*this));
+	}
+
+	IOReturn
+	init(IOLockProfile * profile, lck_grp_t * group, lck_attr_t * attributes = LCK_ATTR_NULL)
+	{
+		_lock = lck_rw_alloc_init(group, attributes);
+		if (_lock == NULL) {
+			return kIOReturnNoMemory;
+		}
+
+		_profile = profile;
+		_group = group;
+
+		return kIOReturnSuccess;
+	}
+
+	void
+	free()
+	{
+		if (_lock) {
+			lck_rw_free(_lock, _group);
+		}
+		_lock = NULL;
+	}
+
+	void
+	lockShared(const char * site)
+	{
+		UInt64 start;
+		bool   contended;
+
+		if (__builtin_expect(!_profile->_enabled, 1)) {
+			lck_rw_lock_shared(_lock);
+			return;
+		}
+
+		start = mach_absolute_time();
+		contended = !lck_rw_try_lock(_lock, LCK_RW_TYPE_SHARED);
+		if (contended) {
+			lck_rw_lock_shared(_lock);
+		}
+
+		_profile->recordAcquire(site, IOLockProfile::kKindShared, contended, start,
+		    contended ? mach_absolute_time() : start);
+	}
+
+	void
+	unlockShared()
+	{
+		lck_rw_unlock_shared(_lock);
+	}
+
+	void
+	lockExclusive(const char * site)
+	{
+		UInt64 start;
+		bool   contended;
+
+		if (__builtin_expect(!_profile->_enabled, 1)) {
+			lck_rw_lock_exclusive(_lock);
+			return;
+		}
+
+		start = mach_absolute_time();
+		contended = !lck_rw_try_lock(_lock, LCK_RW_TYPE_EXCLUSIVE);
+		if (contended) {
+			lck_rw_lock_exclusive(_lock);
+		}
+
+		_acquired = contended ? mach_absolute_time() : start;
+		_site = _profile->recordAcquire(site, IOLockProfile::kKindExclusive, contended, start, _acquired);
+	}
+
+	void
+	unlockExclusive()
+	{
+		IOLockProfile::Site * site = _site;
+
+		if (site) {
+			_site = NULL;
+			_profile->recordRelease(site, _acquired);
+		}
+
+		lck_rw_unlock_exclusive(_lock);
+	}
+
+	lck_rw_t *
+	getLock() const
+	{
+		return _lock;
+	}
+
+protected:
+
+	lck_rw_t *              _lock;
+	lck_grp_t *             _group;
+	IOLockProfile *         _profile;
+	IOLockProfile::Site *   _site;          // set while held exclusive by a profiled acquisition
+	UInt64                  _acquired;
+};
+
+#endif /* !_IOKIT_IOLOCKPROFILE_H */
@@ -0,0 +1,485 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOKIT_IOTRACERING_H
+#define _IOKIT_IOTRACERING_H
+
+#include <libkern/OSTypes.h>
+#include <sys/kdebug.h>
+
+/*!
+ * @header IOTraceRing
+ * @abstract
+ * Private per-CPU trace buffers for drivers, in kdebug record format.
+ * @discussion
+ * An IOTraceRing gives a driver a tracing path that costs a few stores per
+ * event and does not depend on global kdebug tracing being enabled.  Events are
+ * identified by KDBG_EVENTID() or KDBG_CODE() debugids and carry a timestamp,
+ * four arguments and the thread ID, laid out like a kdebug kd_buf so drained
+ * records can be merged into, or decoded alongside, a kdebug trace.
+ *
+ * Each CPU has its own single producer / single consumer ring, so recording
+ * takes no lock and shares no cache line with other CPUs.  The rings live in
+ * one buffer that, like an IOSharedDataQueue, the driver returns from its user
+ * client's clientMemoryForType() for a tool to map; the tool drains every ring
+ * in bulk with IOTraceRingDrain().  Only one consumer may drain a ring at a time.
+ *
+ * When a ring is full, new events are either dropped and counted, or overwrite
+ * the oldest events, which the consumer then reports as lost.
+ *
+ * The buffer is writable by the tool, so the kernel reads nothing back from it
+ * but each ring's head: the geometry, options and enabled state it publishes
+ * there are copies of its own.
+ */
+
+/*!
+ * @enum IOTraceRingOptions
+ * @constant kIOTraceRingOptionOverwrite New events overwrite the oldest when a ring is full, instead of being dropped.
+ */
+enum {
+	kIOTraceRingOptionOverwrite = 0x00000001
+};
+
+#define kIOTraceRingVersion     1
+
+/*!
+ * @typedef IOTraceRingEntry
+ * @abstract One trace event, laid out like a 64-bit kdebug kd_buf.
+ */
+typedef struct _IOTraceRingEntry {
+	UInt64  timestamp;
+	UInt64  arg1;
+	UInt64  arg2;
+	UInt64  arg3;
+	UInt64  arg4;
+	UInt64  arg5;           /* the thread ID */
+	UInt32  debugid;
+	UInt32  cpuid;
+	UInt64  unused;
+} IOTraceRingEntry;
+
+/*!
+ * @typedef IOTraceRingCPU
+ * @abstract Indices of one CPU's ring.
+ * @discussion
+ * head and tail count events since the ring was created; an event's slot is
+ * its index modulo the ring size.  head is only written by the consumer, tail
+ * and dropped only by the producer, and they are kept on separate cache lines.
+ */
+typedef struct _IOTraceRingCPU {
+	volatile UInt64 head;
+	UInt8           reserved0[56];
+	volatile UInt64 tail;
+	volatile UInt64 dropped;
+	UInt8           reserved1[48];
+} IOTraceRingCPU;
+
+/*!
+ * @typedef IOTraceRingMemory
+ * @abstract Header of the shared trace buffer.
+ * @discussion
+ * The header is followed by cpuCount IOTraceRingCPU structures, then by
+ * cpuCount rings of entryCount IOTraceRingEntry structures each.  Every field
+ * but the rings' head is written by the kernel and only read by the consumer.
+ */
+typedef struct _IOTraceRingMemory {
+	UInt32          version;
+	UInt32          cpuCount;
+	UInt32          entryCount;     /* per CPU, a power of 2 */
+	UInt32          options;
+	volatile UInt32 enabled;
+	UInt8           reserved[44];
+	IOTraceRingCPU  cpus[0];
+} IOTraceRingMemory;
+
+#define IOTRACERING_MEMORY_SIZE(cpuCount, entryCount) \
+	(sizeof(IOTraceRingMemory) + (cpuCount) * (sizeof(IOTraceRingCPU) + (entryCount) * sizeof(IOTraceRingEntry)))
+
+static inline IOTraceRingEntry *
+IOTraceRingGetEntries(IOTraceRingMemory * memory, UInt32 cpu)
+{
+	return (IOTraceRingEntry *) &memory->cpus[memory->cpuCount] + (UInt64) cpu * memory->entryCount;
+}
+
+/* Drains one ring whose geometry the caller has established */
+static inline UInt32
+IOTraceRingDrainSlots(IOTraceRingCPU * ring, const IOTraceRingEntry * slots, UInt64 size,
+    UInt32 options, IOTraceRingEntry * entries, UInt32 entriesMax, UInt64 * lost)
+{
+	UInt64             head  = ring->head;
+	UInt64             tail  = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	UInt64             count;
+	UInt64             first;
+	UInt64             skip;
+
+	if (tail - head > size) {
+		*lost += tail - head - size;
+		head   = tail - size;
+	}
+
+	count = tail - head;
+	if (count > entriesMax) {
+		count = entriesMax;
+	}
+
+	for (UInt64 index = 0; index < count; index++) {
+		entries[index] = slots[(head + index) & (size - 1)];
+	}
+
+	// In overwrite mode the producer may have reused slots while they were
+	// copied; every event older than the one it may be writing now is suspect.
+
+	if (options & kIOTraceRingOptionOverwrite) {
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		tail  = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		first = (tail + 1 > size) ? tail + 1 - size : 0;
+		skip  = (first > head) ? first - head : 0;
+		if (skip > count) {
+			skip = count;
+		}
+		if (skip) {
+			for (UInt64 index = skip; index < count; index++) {
+				entries[index - skip] = entries[index];
+			}
+			*lost += skip;
+		}
+		__atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+		return (UInt32) (count - skip);
+	}
+
+	__atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+
+	return (UInt32) count;
+}
+
+/*!
+ * @function IOTraceRingDrainCPU
+ * @abstract Copies out and consumes the events of one CPU's ring.
+ * @param memory The trace buffer.
+ * @param cpu The CPU whose ring is drained.
+ * @param entries Buffer receiving the events, oldest first.
+ * @param entriesMax Capacity of the buffer.
+ * @param lost Incremented by the number of events overwritten before they could be drained.
+ * @result The number of events copied.
+ */
+static inline UInt32
+IOTraceRingDrainCPU(IOTraceRingMemory * memory, UInt32 cpu, IOTraceRingEntry * entries,
+    UInt32 entriesMax, UInt64 * lost)
+{
+	return IOTraceRingDrainSlots(&memory->cpus[cpu], IOTraceRingGetEntries(memory, cpu),
+	           memory->entryCount, memory->options, entries, entriesMax, lost);
+}
+
+/*!
+ * @function IOTraceRingDrain
+ * @abstract Copies out and consumes the events of every CPU's ring.
+ * @discussion
+ * Events are grouped by CPU and ordered by time within each CPU; sort them by
+ * timestamp to interleave the CPUs.
+ * @param memory The trace buffer.
+ * @param entries Buffer receiving the events.
+ * @param entriesMax Capacity of the buffer.
+ * @param lost Incremented by the number of events overwritten before they could be drained.
+ * @result The number of events copied.
+ */
+static inline UInt32
+IOTraceRingDrain(IOTraceRingMemory * memory, IOTraceRingEntry * entries, UInt32 entriesMax, UInt64 * lost)
+{
+	UInt32 count = 0;
+
+	for (UInt32 cpu = 0; cpu < memory->cpuCount && count < entriesMax; cpu++) {
+		count += IOTraceRingDrainCPU(memory, cpu, &entries[count], entriesMax - count, lost);
+	}
+
+	return count;
+}
+
+#if defined(KERNEL) && defined(__cplusplus)
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <mach/mach_time.h>
+#include <kern/thread.h>
+#include <machine/machine_routines.h>
+
+/* Exported by the kernel, but not declared by its public headers */
+extern "C" int cpu_number(void);
+
+/*!
+ * @class IOTraceRing
+ * @abstract Kernel side of a trace buffer.
+ * @discussion
+ * A driver embeds an IOTraceRing, calls init() when it starts and free() when
+ * it stops, and records events with record() from any context, including
+ * primary interrupt handlers.
+ */
+class IOTraceRing
+{
+public:
+
+	IOTraceRing()
+	{
+		bzero(this, sizeof(*this));
+	}
+
+	/*!
+	 * @function init
+	 * @abstract Allocates the trace buffer.
+	 * @param cpuCount Number of CPUs, which must cover every CPU number the system can report.
+	 * @param entryCount Number of events each CPU's ring holds, a power of 2.
+	 * @param options kIOTraceRingOptionOverwrite, or 0 to drop events when a ring is full.
+	 * @result kIOReturnSuccess, kIOReturnBadArgument or kIOReturnNoMemory.
+	 */
+
+	IOReturn
+	init(UInt32 cpuCount, UInt32 entryCount, IOOptionBits options = 0)
+	{
+		IOTraceRingMemory * memory;
+
+		if (cpuCount == 0 || cpuCount > 1024 || entryCount < 2 || entryCount > (1U << 24) ||
+		    (entryCount & (entryCount - 1))) {
+			return kIOReturnBadArgument;
+		}
+
+		_buffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task,
+		    kIODirectionOutIn | kIOMemoryKernelUserShared,
+		    IOTRACERING_MEMORY_SIZE(cpuCount, entryCount), page_size);
+		if (_buffer == NULL) {
+			return kIOReturnNoMemory;
+		}
+
+		memory = (IOTraceRingMemory *) _buffer->getBytesNoCopy();
+		bzero(memory, _buffer->getLength());
+
+		memory->version    = kIOTraceRingVersion;
+		memory->cpuCount   = cpuCount;
+		memory->entryCount = entryCount;
+		memory->options    = options & kIOTraceRingOptionOverwrite;
+		memory->enabled    = 1;
+
+		_memory = memory;
+		_rings = memory->cpus;
+		_entries = (IOTraceRingEntry *) &memory->cpus[cpuCount];
+		_cpuCount = cpuCount;
+		_mask = entryCount - 1;
+		_shift = __builtin_ctz(entryCount);
+		_options = options & kIOTraceRingOptionOverwrite;
+		_enabled = true;
+
+		return kIOReturnSuccess;
+	}
+
+	/*!
+	 * @function free
+	 * @abstract Releases the trace buffer; user mappings of it stay valid until unmapped.
+	 * @discussion Calls to record() already past their enabled check are waited for, so free()
+	 * may race with record() but must not be called from a primary interrupt handler.
+	 */
+
+	void
+	free()
+	{
+		__atomic_store_n(&_enabled, false, __ATOMIC_SEQ_CST);
+
+		for (UInt32 shard = 0; shard < kWriterShards; shard++) {
+			while (__atomic_load_n(&_writers[shard].count, __ATOMIC_ACQUIRE)) {
+				IODelay(1);
+			}
+		}
+
+		if (_buffer) {
+			_buffer->release();
+		}
+
+		_buffer = NULL;
+		_memory = NULL;
+		_rings = NULL;
+		_entries = NULL;
+	}
+
+	/*!
+	 * @function record
+	 * @abstract Records an event on the current CPU's ring.
+	 * @param debugid Event ID, built with KDBG_EVENTID() or KDBG_CODE() and a DBG_FUNC_ qualifier.
+	 */
+
+	void
+	record(UInt32 debugid, UInt64 arg1 = 0, UInt64 arg2 = 0, UInt64 arg3 = 0, UInt64 arg4 = 0)
+	{
+		IOTraceRingCPU *    ring;
+		IOTraceRingEntry *  entry;
+		boolean_t           state;
+		UInt64              tail;
+		UInt32              cpu;
+		volatile UInt32 *   writers;
+
+		if (_enabled == false) {
+			return;
+		}
+
+		// Interrupts are disabled so that neither migration nor an interrupt
+		// handler tracing on the same CPU can interleave with the update.
+
+		state = ml_set_interrupts_enabled(FALSE);
+
+		cpu = (UInt32) cpu_number();
+		if (cpu >= _cpuCount) {
+			ml_set_interrupts_enabled(state);
+			return;
+		}
+
+		// free() clears _enabled, then waits for the writer counts: either it
+		// sees this writer, or this writer sees the buffer going away.
+
+		writers = &_writers[cpu % kWriterShards].count;
+		__atomic_add_fetch(writers, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&_enabled, __ATOMIC_SEQ_CST) == false) {
+			__atomic_sub_fetch(writers, 1, __ATOMIC_RELEASE);
+			ml_set_interrupts_enabled(state);
+			return;
+		}
+
+		ring = &_rings[cpu];
+		tail = ring->tail;
+
+		if (_options & kIOTraceRingOptionOverwrite) {
+			// Orders the previous tail update before the slot is reused.
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+		} else if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > _mask) {
+			ring->dropped = ring->dropped + 1;
+			__atomic_sub_fetch(writers, 1, __ATOMIC_RELEASE);
+			ml_set_interrupts_enabled(state);
+			return;
+		}
+
+		entry = &_entries[((UInt64) cpu << _shift) + (tail & _mask)];
+
+		entry->timestamp = mach_absolute_time();
+		entry->arg1      = arg1;
+		entry->arg2      = arg2;
+		entry->arg3      = arg3;
+		entry->arg4      = arg4;
+		entry->arg5      = thread_tid(current_thread());
+		entry->debugid   = debugid;
+		entry->cpuid     = cpu;
+		entry->unused    = 0;
+
+		__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+		__atomic_sub_fetch(writers, 1, __ATOMIC_RELEASE);
+		ml_set_interrupts_enabled(state);
+	}
+
+	/*!
+	 * @function setEnabled
+	 * @abstract Starts or stops recording; the enabled field of the trace buffer reflects the state.
+	 */
+
+	void
+	setEnabled(bool enabled)
+	{
+		if (_memory) {
+			__atomic_store_n(&_enabled, enabled, __ATOMIC_RELEASE);
+			_memory->enabled = enabled;
+		}
+	}
+
+	/*!
+	 * @function drain
+	 * @abstract Drains the trace buffer from the kernel, as IOTraceRingDrain() does.
+	 */
+
+	UInt32
+	drain(IOTraceRingEntry * entries, UInt32 entriesMax, UInt64 * lost)
+	{
+		UInt32 count = 0;
+
+		for (UInt32 cpu = 0; _memory && cpu < _cpuCount && count < entriesMax; cpu++) {
+			count += IOTraceRingDrainSlots(&_rings[cpu], &_entries[(UInt64) cpu << _shift], _mask + 1,
+			    _options, &entries[count], entriesMax - count, lost);
+		}
+
+		return count;
+	}
+
+	/*!
+	 * @function getDropped
+	 * @abstract Reports the number of events dropped because a ring was full.
+	 */
+
+	UInt64
+	getDropped() const
+	{
+		UInt64 dropped = 0;
+
+		for (UInt32 cpu = 0; _memory && cpu < _cpuCount; cpu++) {
+			dropped += _rings[cpu].dropped;
+		}
+
+		return dropped;
+	}
+
+	/*!
+	 * @function getMemoryDescriptor
+	 * @abstract Returns the trace buffer, for a user client's clientMemoryForType() to return with a reference.
+	 */
+
+	IOMemoryDescriptor *
+	getMemoryDescriptor() const
+	{
+		return _buffer;
+	}
+
+protected:
+
+	// Writers in record(), counted in a few cache lines rather than one so
+	// that CPUs tracing at once rarely share a count.
+
+	static const UInt32 kWriterShards = 16;
+
+	struct Writers {
+		volatile UInt32 count;
+		UInt32          reserved[15];
+	};
+
+	// Recording and draining locate the rings from these copies only, never
+	// from the geometry published in the shared buffer.
+
+	IOBufferMemoryDescriptor * _buffer;
+	IOTraceRingMemory *        _memory;
+	IOTraceRingCPU *           _rings;
+	IOTraceRingEntry *         _entries;
+	UInt32                     _cpuCount;
+	UInt32                     _mask;
+	UInt32                     _shift;         /* log2 of the ring size */
+	UInt32                     _options;
+	volatile bool              _enabled;
+	Writers                    _writers[kWriterShards] __attribute__((aligned(64)));
+};
+
+#endif /* KERNEL && __cplusplus */
+
+#endif /* _IOKIT_IOTRACERING_H */
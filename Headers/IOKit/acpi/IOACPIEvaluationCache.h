@@ -0,0 +1,554 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOKIT_IOACPIEVALUATIONCACHE_H
+#define _IOKIT_IOACPIEVALUATIONCACHE_H
+
+#include <libkern/c++/OSContainers.h>
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/acpi/IOACPIPlatformDevice.h>
+#include <kern/clock.h>
+
+/*!
+ * @class IOACPIEvaluationCache
+ * @abstract
+ * Memoizes the results of ACPI method evaluations for a driver.
+ * @discussion
+ * Every IOACPIPlatformDevice::evaluateObject() or evaluateInteger() call runs
+ * the AML interpreter, which battery, thermal and embedded controller drivers
+ * polling _BST, _TMP and vendor methods pay for many times a second.  A driver
+ * embeds an IOACPIEvaluationCache, gives each method it wants cached a time to
+ * live with setTTL(), and evaluates through the cache.  Results are keyed by
+ * the method name and the values of its arguments, which may be OSNumbers,
+ * OSStrings, OSDatas or OSBooleans; evaluations of other methods, or with
+ * other arguments, go straight to the device.
+ *
+ * Cached results expire after their time to live, are dropped by invalidate(),
+ * and, for methods registered to do so, by an ACPI notification that the
+ * driver forwards from its message() override.  A result object returned from
+ * the cache is shared with the cache and with other callers: it is retained
+ * for the caller as evaluateObject() would, but must not be modified.
+ */
+
+class IOACPIEvaluationCache
+{
+public:
+
+    /*!
+     * @enum Statistics
+     * @discussion
+     * Indices for the different statistics that getStatistics() can report.
+     * @constant kStatisticsHits Number of evaluations served from the cache.
+     * @constant kStatisticsMisses Number of cacheable evaluations run by the interpreter.
+     * @constant kStatisticsBypassed Number of evaluations not eligible for the cache.
+     * @constant kStatisticsInvalidations Number of results dropped before expiring.
+     * @constant kStatisticsMissTime Nanoseconds spent in cacheable evaluations.
+     */
+
+    enum Statistics
+    {
+        kStatisticsHits,
+        kStatisticsMisses,
+        kStatisticsBypassed,
+        kStatisticsInvalidations,
+        kStatisticsMissTime
+    };
+
+    static const UInt32 kStatisticsCount = kStatisticsMissTime + 1;
+
+    static const UInt32 kMethodsMax    = 16;
+    static const UInt32 kEntriesMax    = 64;
+    static const UInt32 kNameMax       = 64;
+    static const UInt32 kArgumentsMax  = 48;
+
+    IOACPIEvaluationCache()
+    {
+        bzero(this, sizeof(*this));
+    }
+
+    /*!
+     * @function init
+     * @abstract
+     * Prepares the cache.
+     * @param device
+     * ACPI device whose methods are evaluated, retained by the cache.
+     * @param entryCount
+     * Number of results kept, at most kEntriesMax.
+     * @result
+     * kIOReturnSuccess, kIOReturnBadArgument or kIOReturnNoMemory.
+     */
+
+    IOReturn init(IOACPIPlatformDevice * device, UInt32 entryCount = 16)
+    {
+        if (device == 0 || entryCount == 0 || entryCount > kEntriesMax) return kIOReturnBadArgument;
+
+        _lock = IOLockAlloc();
+        if (_lock == 0) return kIOReturnNoMemory;
+
+        device->retain();
+
+        _device     = device;
+        _entryCount = entryCount;
+
+        return kIOReturnSuccess;
+    }
+
+    /*!
+     * @function free
+     * @abstract
+     * Releases the cached results and the device.
+     */
+
+    void free()
+    {
+        for (UInt32 index = 0; index < kEntriesMax; index++)
+        {
+            if (_entries[index].object) _entries[index].object->release();
+            _entries[index].object = 0;
+        }
+
+        if (_device) _device->release();
+        if (_lock) IOLockFree(_lock);
+
+        _device = 0;
+        _lock   = 0;
+    }
+
+    /*!
+     * @function setTTL
+     * @abstract
+     * Makes a method cacheable.
+     * @param objectName
+     * Name of the method, as passed to evaluateObject().
+     * @param ttlMS
+     * Time to live of its results in milliseconds; 0 makes it uncacheable again.
+     * @param invalidateOnNotify
+     * Whether an ACPI notification drops its results.
+     * @result
+     * kIOReturnSuccess, kIOReturnBadArgument or kIOReturnNoSpace.
+     */
+
+    IOReturn setTTL(const char * objectName, UInt32 ttlMS, bool invalidateOnNotify = true)
+    {
+        Method * method;
+
+        if (objectName == 0 || strlen(objectName) >= kNameMax) return kIOReturnBadArgument;
+
+        IOLockLock(_lock);
+
+        method = findMethod(objectName);
+        if (method == 0)
+        {
+            if (_methodCount == kMethodsMax)
+            {
+                IOLockUnlock(_lock);
+                return kIOReturnNoSpace;
+            }
+
+            method = &_methods[_methodCount++];
+            strlcpy(method->name, objectName, sizeof(method->name));
+        }
+
+        nanoseconds_to_absolutetime((UInt64) ttlMS * 1000000ULL, &method->ttl);
+        method->notify = invalidateOnNotify;
+
+        drop(method, false);
+
+        IOLockUnlock(_lock);
+
+        return kIOReturnSuccess;
+    }
+
+    /*!
+     * @function evaluateObject
+     * @abstract
+     * Evaluates a method, or returns its cached result.
+     * @discussion
+     * Takes the same arguments as IOACPIPlatformDevice::evaluateObject().
+     */
+
+    IOReturn evaluateObject(const char * objectName, OSObject ** result = 0, OSObject * params[] = 0,
+                            IOItemCount paramCount = 0, IOOptionBits options = 0)
+    {
+        UInt8      arguments[kArgumentsMax];
+        UInt32     argumentsLength;
+        Method *   method;
+        Entry *    entry;
+        UInt64     now;
+        UInt64     end;
+        UInt64     nanoseconds;
+        UInt32     generation;
+        OSObject * object = 0;
+        IOReturn   status;
+
+        argumentsLength = fingerprint(params, paramCount, arguments);
+
+        clock_get_uptime(&now);
+
+        IOLockLock(_lock);
+
+        method = findMethod(objectName);
+        if (method == 0 || method->ttl == 0 || argumentsLength == (UInt32) -1)
+        {
+            _statistics[kStatisticsBypassed]++;
+            IOLockUnlock(_lock);
+            return _device->evaluateObject(objectName, result, params, paramCount, options);
+        }
+
+        entry = findEntry(method, arguments, argumentsLength);
+        if (entry && now < entry->expiry)
+        {
+            entry->used = now;
+            if (result)
+            {
+                if (entry->object) entry->object->retain();
+                *result = entry->object;
+            }
+            status = entry->status;
+            _statistics[kStatisticsHits]++;
+            IOLockUnlock(_lock);
+            return status;
+        }
+
+        generation = _generation;
+        _statistics[kStatisticsMisses]++;
+
+        IOLockUnlock(_lock);
+
+        status = _device->evaluateObject(objectName, &object, params, paramCount, options);
+
+        clock_get_uptime(&end);
+        absolutetime_to_nanoseconds(end - now, &nanoseconds);
+
+        IOLockLock(_lock);
+
+        _statistics[kStatisticsMissTime] += nanoseconds;
+
+        // An invalidation during the evaluation may have made the result
+        // stale; return it, but do not keep it.
+
+        if (generation == _generation && status == kIOReturnSuccess)
+        {
+            entry = findEntry(method, arguments, argumentsLength);
+            if (entry == 0) entry = allocateEntry();
+
+            if (entry->object) entry->object->release();
+            if (object) object->retain();
+
+            entry->method          = method;
+            entry->object          = object;
+            entry->status          = status;
+            entry->expiry          = end + method->ttl;
+            entry->used            = end;
+            entry->argumentsLength = argumentsLength;
+            bcopy(arguments, entry->arguments, argumentsLength);
+        }
+
+        IOLockUnlock(_lock);
+
+        if (result) *result = object;
+        else if (object) object->release();
+
+        return status;
+    }
+
+    /*!
+     * @function evaluateInteger
+     * @abstract
+     * Evaluates a method returning an integer, or returns its cached result.
+     * @discussion
+     * Takes the same arguments as IOACPIPlatformDevice::evaluateInteger().
+     */
+
+    IOReturn evaluateInteger(const char * objectName, UInt64 * resultInt64, OSObject * params[] = 0,
+                             IOItemCount paramCount = 0, IOOptionBits options = 0)
+    {
+        OSObject * object = 0;
+        OSNumber * number;
+        IOReturn   status;
+
+        status = evaluateObject(objectName, &object, params, paramCount, options);
+        if (status != kIOReturnSuccess) return status;
+
+        number = OSDynamicCast(OSNumber, object);
+        if (number && resultInt64) *resultInt64 = number->unsigned64BitValue();
+        if (object) object->release();
+
+        return number ? kIOReturnSuccess : kIOReturnBadArgument;
+    }
+
+    /*!
+     * @function evaluateInteger
+     * @abstract
+     * 32-bit variant of evaluateInteger().
+     */
+
+    IOReturn evaluateInteger(const char * objectName, UInt32 * resultInt32, OSObject * params[] = 0,
+                             IOItemCount paramCount = 0, IOOptionBits options = 0)
+    {
+        UInt64   value = 0;
+        IOReturn status;
+
+        status = evaluateInteger(objectName, &value, params, paramCount, options);
+        if (status == kIOReturnSuccess && resultInt32) *resultInt32 = (UInt32) value;
+
+        return status;
+    }
+
+    /*!
+     * @function invalidate
+     * @abstract
+     * Drops the cached results of a method, or of every method if objectName is NULL.
+     */
+
+    void invalidate(const char * objectName = 0)
+    {
+        IOLockLock(_lock);
+
+        if (objectName == 0)
+        {
+            for (UInt32 index = 0; index < _methodCount; index++) drop(&_methods[index], false);
+        }
+        else
+        {
+            Method * method = findMethod(objectName);
+            if (method) drop(method, false);
+        }
+
+        IOLockUnlock(_lock);
+    }
+
+    /*!
+     * @function message
+     * @abstract
+     * Handles a message forwarded from the driver's message() override.
+     * @discussion
+     * A kIOACPIMessageDeviceNotification drops the results of every method
+     * registered with invalidateOnNotify.
+     * @result
+     * true if the message was an ACPI notification.
+     */
+
+    bool message(UInt32 type, void * argument = 0)
+    {
+        (void) argument;
+
+        if (type != kIOACPIMessageDeviceNotification) return false;
+
+        IOLockLock(_lock);
+        for (UInt32 index = 0; index < _methodCount; index++) drop(&_methods[index], true);
+        IOLockUnlock(_lock);
+
+        return true;
+    }
+
+    /*!
+     * @function getStatistics
+     * @abstract
+     * Reports the cache statistics, indexed by Statistics.
+     * @param statistics
+     * Buffer that will receive the UInt64 statistic values.
+     * @param statisticsMaxCount
+     * Maximum number of statistic values that can be held in the buffer.
+     * @result
+     * Actual number of statistic values copied to the buffer, or if no buffer
+     * is given, the total number of statistic values available.
+     */
+
+    UInt32 getStatistics(UInt64 * statistics, UInt32 statisticsMaxCount) const
+    {
+        UInt32 count = (statisticsMaxCount < kStatisticsCount) ? statisticsMaxCount : kStatisticsCount;
+
+        if (statistics == 0 || statisticsMaxCount == 0) return kStatisticsCount;
+
+        for (UInt32 index = 0; index < count; index++)
+        {
+            statistics[index] = _statistics[index];
+        }
+
+        return count;
+    }
+
+    /*!
+     * @function getStatistic
+     * @abstract
+     * Reports one of the cache statistics.
+     */
+
+    UInt64 getStatistic(Statistics statistic) const
+    {
+        return (statistic < kStatisticsCount) ? _statistics[statistic] : 0;
+    }
+
+protected:
+
+    struct Method
+    {
+        char   name[kNameMax];
+        UInt64 ttl;                     // absolute time units
+        bool   notify;
+    };
+
+    struct Entry
+    {
+        Method *   method;
+        OSObject * object;
+        IOReturn   status;
+        UInt64     expiry;
+        UInt64     used;
+        UInt32     argumentsLength;
+        UInt8      arguments[kArgumentsMax];
+    };
+
+    Method * findMethod(const char * objectName)
+    {
+        for (UInt32 index = 0; objectName && index < _methodCount; index++)
+        {
+            if (strncmp(_methods[index].name, objectName, kNameMax) == 0) return &_methods[index];
+        }
+
+        return 0;
+    }
+
+    Entry * findEntry(Method * method, const UInt8 * arguments, UInt32 argumentsLength)
+    {
+        for (UInt32 index = 0; index < _entryCount; index++)
+        {
+            Entry * entry = &_entries[index];
+
+            if (entry->method == method && entry->argumentsLength == argumentsLength &&
+                bcmp(entry->arguments, arguments, argumentsLength) == 0)
+            {
+                return entry;
+            }
+        }
+
+        return 0;
+    }
+
+    Entry * allocateEntry()
+    {
+        Entry * victim = &_entries[0];
+
+        for (UInt32 index = 0; index < _entryCount; index++)
+        {
+            Entry * entry = &_entries[index];
+
+            if (entry->method == 0) return entry;
+            if (entry->used < victim->used) victim = entry;
+        }
+
+        return victim;
+    }
+
+    void drop(Method * method, bool notification)
+    {
+        if (notification && method->notify == false) return;
+
+        for (UInt32 index = 0; index < _entryCount; index++)
+        {
+            Entry * entry = &_entries[index];
+
+            if (entry->method != method) continue;
+
+            if (entry->object) entry->object->release();
+            bzero(entry, sizeof(*entry));
+
+            _statistics[kStatisticsInvalidations]++;
+        }
+
+        _generation++;
+    }
+
+    // Serializes the arguments into a key; (UInt32) -1 if they cannot be.
+    static UInt32 fingerprint(OSObject * params[], IOItemCount paramCount, UInt8 * key)
+    {
+        UInt32 length = 0;
+
+        for (IOItemCount index = 0; params && index < paramCount; index++)
+        {
+            OSObject *   param = params[index];
+            const void * bytes;
+            UInt32       size;
+            UInt64       value;
+            UInt8        type;
+
+            if (OSNumber * number = OSDynamicCast(OSNumber, param))
+            {
+                value = number->unsigned64BitValue();
+                bytes = &value;
+                size  = sizeof(value);
+                type  = 'N';
+            }
+            else if (OSString * string = OSDynamicCast(OSString, param))
+            {
+                bytes = string->getCStringNoCopy();
+                size  = string->getLength();
+                type  = 'S';
+            }
+            else if (OSData * data = OSDynamicCast(OSData, param))
+            {
+                bytes = data->getBytesNoCopy();
+                size  = data->getLength();
+                type  = 'D';
+            }
+            else if (OSBoolean * boolean = OSDynamicCast(OSBoolean, param))
+            {
+                value = boolean->isTrue();
+                bytes = &value;
+                size  = 1;
+                type  = 'B';
+            }
+            else
+            {
+                return (UInt32) -1;
+            }
+
+            if (size > 0xFF || length + 2 + size > kArgumentsMax) return (UInt32) -1;
+
+            key[length++] = type;
+            key[length++] = (UInt8) size;
+            if (size) bcopy(bytes, &key[length], size);
+            length += size;
+        }
+
+        return length;
+    }
+
+    IOACPIPlatformDevice * _device;
+    IOLock *               _lock;
+    UInt32                 _generation;     // bumped by every invalidation
+
+    Method                 _methods[kMethodsMax];
+    UInt32                 _methodCount;
+    Entry                  _entries[kEntriesMax];
+    UInt32                 _entryCount;
+
+    UInt64                 _statistics[kStatisticsCount];
+};
+
+#endif /* !_IOKIT_IOACPIEVALUATIONCACHE_H */
@@ -0,0 +1,463 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOKIT_HID_IOHIDDIGITIZERFRAME_H
+#define _IOKIT_HID_IOHIDDIGITIZERFRAME_H
+
+#include <IOKit/IOLib.h>
+#include <IOKit/hid/IOHIDEvent.h>
+#include <IOKit/hid/IOHIDEventService.h>
+
+/*!
+ @struct IOHIDDigitizerContact
+ @abstract One transducer of a digitizer scan.
+ @discussion Positions, pressures and angles use the units of
+             IOHIDEventService::dispatchDigitizerEventWithTiltOrientation.
+ */
+struct IOHIDDigitizerContact {
+    UInt32      transducerID;
+    UInt32      buttonState;
+    bool        inRange;
+    bool        touch;
+    IOFixed     x;
+    IOFixed     y;
+    IOFixed     z;
+    IOFixed     tipPressure;
+    IOFixed     auxPressure;
+    IOFixed     twist;
+    IOFixed     tiltX;
+    IOFixed     tiltY;
+    IOFixed     majorRadius;
+    IOFixed     minorRadius;
+};
+
+/*! @class IOHIDDigitizerFrame
+ @abstract Builds one collection event per digitizer scan.
+ @discussion IOHIDEventService::dispatchDigitizerEvent() builds and dispatches
+             an event per contact, so a ten finger panel scanned at 240 Hz
+             allocates and delivers thousands of events a second.  An
+             IOHIDEventService subclass embeds an IOHIDDigitizerFrame, adds the
+             contacts of each scan between begin() and end(), and passes the
+             event returned by end() to dispatchEvent().  That event is a hand
+             collection whose children are the contacts, with range, touch,
+             position and identity changes computed against the previous scan
+             and lift-off children generated for contacts that disappeared.
+
+             Collection events are kept in a pool indexed by child count.  An
+             event returned by end() is in use until the service hands it back
+             with recycle(), after which it is refilled in place, so a steady
+             stream of scans with the same number of contacts allocates
+             nothing.  A scan whose pooled event is still in use gets a
+             separate event that recycle() releases.  A frame is not
+             thread-safe; it is meant to be driven from the service's report
+             handler on its work loop.
+
+             <pre>
+             event = _frame.end();
+             if (event) {
+                 dispatchEvent(event);
+                 _frame.recycle(event);
+             }
+             </pre>
+ */
+class IOHIDDigitizerFrame
+{
+public:
+
+    /*!
+     @enum Statistics
+     @discussion Indices for the different statistics that getStatistics() can report.
+     @constant kStatisticsFrames Number of collection events returned by end().
+     @constant kStatisticsContacts Number of child events filled, lift-offs included.
+     @constant kStatisticsAllocations Number of events allocated.
+     @constant kStatisticsReuses Number of collection events refilled from the pool.
+     @constant kStatisticsDropped Number of contacts beyond the frame capacity.
+     */
+    enum Statistics
+    {
+        kStatisticsFrames,
+        kStatisticsContacts,
+        kStatisticsAllocations,
+        kStatisticsReuses,
+        kStatisticsDropped
+    };
+
+    static const UInt32 kStatisticsCount = kStatisticsDropped + 1;
+
+    static const UInt32 kContactsMax = 16;
+
+    IOHIDDigitizerFrame()
+    {
+        bzero(this, sizeof(*this));
+    }
+
+/*!
+    @function init
+    @abstract Prepares the frame.
+    @param type         Transducer type of the contacts.
+    @param contactsMax  Largest number of contacts in one scan, at most kContactsMax.
+    @result true on success, false if contactsMax is out of range.
+*/
+    bool init(IOHIDDigitizerTransducerType type = kIOHIDDigitizerTransducerTypeFinger,
+              UInt32 contactsMax = kContactsMax)
+    {
+        if (contactsMax == 0 || contactsMax > kContactsMax) return false;
+
+        _type        = type;
+        _contactsMax = contactsMax;
+
+        return true;
+    }
+
+/*!
+    @function free
+    @abstract Releases the pooled events.
+    @discussion Events returned by end() must have been passed to recycle() first.
+*/
+    void free()
+    {
+        for (UInt32 index = 0; index <= 2 * kContactsMax; index++)
+        {
+            if (_pool[index]) _pool[index]->release();
+            _pool[index] = 0;
+            _busy[index] = false;
+        }
+    }
+
+/*!
+    @function begin
+    @abstract Starts a scan.
+    @param timeStamp    AbsoluteTime representing origination of the scan.
+    @param options      kHIDDispatchOptionPointerDisplayIntegrated, if applicable.
+*/
+    void begin(AbsoluteTime timeStamp, IOOptionBits options = 0)
+    {
+        _timeStamp = timeStamp;
+        _options   = options;
+        _count     = 0;
+    }
+
+/*!
+    @function addContact
+    @abstract Adds a contact to the current scan.
+    @result false if the scan already holds contactsMax contacts.
+*/
+    bool addContact(const IOHIDDigitizerContact & contact)
+    {
+        if (_count == _contactsMax)
+        {
+            _statistics[kStatisticsDropped]++;
+            return false;
+        }
+
+        _contacts[_count++] = contact;
+
+        return true;
+    }
+
+/*!
+    @function end
+    @abstract Completes a scan.
+    @discussion The event stays owned by the frame and is in use until it is
+                passed to recycle().  Events that clients retain beyond
+                dispatchEvent() must not be recycled until they are released.
+    @result The collection event to dispatch, or NULL if the scan is empty
+            and no contact was lifted.
+*/
+    IOHIDEvent * end()
+    {
+        IOHIDDigitizerContact lifts[kContactsMax];
+        UInt32                liftCount = 0;
+        UInt32                total;
+        IOHIDEvent *          collection;
+        OSArray *             children;
+        UInt32                eventMask = 0;
+        UInt32                buttonState = 0;
+        bool                  inRange = false;
+        bool                  touch = false;
+        SInt64                x = 0;
+        SInt64                y = 0;
+        UInt32                positions = 0;
+
+        // Contacts of the previous scan missing from this one are lifted.
+        for (UInt32 index = 0; index < _trackedCount; index++)
+        {
+            const IOHIDDigitizerContact * tracked = &_tracked[index];
+
+            if (find(tracked->transducerID) < 0 && (tracked->inRange || tracked->touch))
+            {
+                lifts[liftCount] = *tracked;
+                lifts[liftCount].inRange = false;
+                lifts[liftCount].touch = false;
+                lifts[liftCount].tipPressure = 0;
+                liftCount++;
+            }
+        }
+
+        total = _count + liftCount;
+        if (total == 0) return 0;
+
+        collection = acquire(total);
+        if (collection == 0)
+        {
+            _statistics[kStatisticsDropped] += _count;
+            return 0;
+        }
+
+        children = collection->getChildren();
+
+        for (UInt32 index = 0; index < total; index++)
+        {
+            const IOHIDDigitizerContact * contact = (index < _count) ? &_contacts[index] : &lifts[index - _count];
+            IOHIDEvent *                  child = OSDynamicCast(IOHIDEvent, children->getObject(index));
+            UInt32                        mask = changes(contact);
+
+            fill(child, contact, _type, mask);
+
+            eventMask   |= mask;
+            buttonState |= contact->buttonState;
+            inRange     |= contact->inRange;
+            touch       |= contact->touch;
+
+            if (contact->inRange)
+            {
+                x += contact->x;
+                y += contact->y;
+                positions++;
+            }
+        }
+
+        collection->setTimeStamp(_timeStamp);
+        collection->setIntegerValue(kIOHIDEventFieldDigitizerCollection, 1);
+        collection->setIntegerValue(kIOHIDEventFieldDigitizerType, kIOHIDDigitizerTransducerTypeHand);
+        collection->setIntegerValue(kIOHIDEventFieldDigitizerRange, inRange);
+        collection->setIntegerValue(kIOHIDEventFieldDigitizerTouch, touch);
+        collection->setIntegerValue(kIOHIDEventFieldDigitizerButtonMask, buttonState);
+        collection->setIntegerValue(kIOHIDEventFieldDigitizerEventMask, eventMask);
+        collection->setIntegerValue(kIOHIDEventFieldDigitizerIsDisplayIntegrated,
+                                    (_options & kHIDDispatchOptionPointerDisplayIntegrated) ? 1 : 0);
+        if (positions)
+        {
+            collection->setFixedValue(kIOHIDEventFieldDigitizerX, (IOFixed) (x / positions));
+            collection->setFixedValue(kIOHIDEventFieldDigitizerY, (IOFixed) (y / positions));
+        }
+
+        // The contacts of this scan become the reference for the next one.
+        for (UInt32 index = 0; index < _count; index++)
+        {
+            _tracked[index] = _contacts[index];
+        }
+        _trackedCount = _count;
+
+        _statistics[kStatisticsFrames]++;
+        _statistics[kStatisticsContacts] += total;
+
+        return collection;
+    }
+
+/*!
+    @function recycle
+    @abstract Hands back an event returned by end() once it is no longer referenced.
+    @discussion A pooled event becomes available to the next scan with as many
+                children; any other event is released.
+*/
+    void recycle(IOHIDEvent * event)
+    {
+        for (UInt32 index = 0; index <= 2 * kContactsMax; index++)
+        {
+            if (_pool[index] == event)
+            {
+                _busy[index] = false;
+                return;
+            }
+        }
+
+        event->release();
+    }
+
+/*!
+    @function getStatistics
+    @abstract Reports the frame statistics, indexed by Statistics.
+    @param statistics           Buffer that will receive the UInt64 statistic values.
+    @param statisticsMaxCount   Maximum number of statistic values that can be held in the buffer.
+    @result Actual number of statistic values copied to the buffer, or if no buffer
+            is given, the total number of statistic values available.
+*/
+    UInt32 getStatistics(UInt64 * statistics, UInt32 statisticsMaxCount) const
+    {
+        UInt32 count = (statisticsMaxCount < kStatisticsCount) ? statisticsMaxCount : kStatisticsCount;
+
+        if (statistics == 0 || statisticsMaxCount == 0) return kStatisticsCount;
+
+        for (UInt32 index = 0; index < count; index++)
+        {
+            statistics[index] = _statistics[index];
+        }
+
+        return count;
+    }
+
+/*!
+    @function getStatistic
+    @abstract Reports one of the frame statistics.
+*/
+    UInt64 getStatistic(Statistics statistic) const
+    {
+        return (statistic < kStatisticsCount) ? _statistics[statistic] : 0;
+    }
+
+protected:
+
+    int find(UInt32 transducerID) const
+    {
+        for (UInt32 index = 0; index < _count; index++)
+        {
+            if (_contacts[index].transducerID == transducerID) return (int) index;
+        }
+
+        return -1;
+    }
+
+    UInt32 changes(const IOHIDDigitizerContact * contact) const
+    {
+        for (UInt32 index = 0; index < _trackedCount; index++)
+        {
+            const IOHIDDigitizerContact * tracked = &_tracked[index];
+            UInt32                        mask = 0;
+
+            if (tracked->transducerID != contact->transducerID) continue;
+
+            if (tracked->inRange != contact->inRange) mask |= kIOHIDDigitizerEventRange;
+            if (tracked->touch != contact->touch) mask |= kIOHIDDigitizerEventTouch;
+            if (tracked->x != contact->x || tracked->y != contact->y || tracked->z != contact->z)
+            {
+                mask |= kIOHIDDigitizerEventPosition;
+            }
+
+            return mask;
+        }
+
+        return kIOHIDDigitizerEventIdentity | kIOHIDDigitizerEventPosition |
+               (contact->inRange ? kIOHIDDigitizerEventRange : 0) |
+               (contact->touch ? kIOHIDDigitizerEventTouch : 0);
+    }
+
+    IOHIDEvent * create(UInt32 total)
+    {
+        IOHIDEvent * collection;
+
+        collection = IOHIDEvent::digitizerEventWithTiltOrientation(_timeStamp, 0, kIOHIDDigitizerTransducerTypeHand,
+                                                                   false, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                                                   kIOHIDEventOptionIsCollection);
+        if (collection == 0) return 0;
+
+        _statistics[kStatisticsAllocations]++;
+
+        for (UInt32 index = 0; index < total; index++)
+        {
+            IOHIDEvent * child;
+
+            child = IOHIDEvent::digitizerEventWithTiltOrientation(_timeStamp, 0, _type, false, 0, 0, 0);
+            if (child == 0)
+            {
+                collection->release();
+                return 0;
+            }
+
+            collection->appendChild(child);
+            child->release();
+
+            _statistics[kStatisticsAllocations]++;
+        }
+
+        return collection;
+    }
+
+    IOHIDEvent * acquire(UInt32 total)
+    {
+        IOHIDEvent * collection = _pool[total];
+
+        // The pooled event is still in use; it stays pooled and this scan gets
+        // one of its own, released by recycle().
+        if (collection && _busy[total]) return create(total);
+
+        if (collection)
+        {
+            _statistics[kStatisticsReuses]++;
+        }
+        else
+        {
+            collection = create(total);
+            if (collection == 0) return 0;
+            _pool[total] = collection;
+        }
+
+        _busy[total] = true;
+
+        return collection;
+    }
+
+    void fill(IOHIDEvent * child, const IOHIDDigitizerContact * contact, IOHIDDigitizerTransducerType type, UInt32 mask)
+    {
+        child->setTimeStamp(_timeStamp);
+        child->setIntegerValue(kIOHIDEventFieldDigitizerType, type);
+        child->setIntegerValue(kIOHIDEventFieldDigitizerIndex, contact->transducerID);
+        child->setIntegerValue(kIOHIDEventFieldDigitizerIdentity, contact->transducerID);
+        child->setIntegerValue(kIOHIDEventFieldDigitizerRange, contact->inRange);
+        child->setIntegerValue(kIOHIDEventFieldDigitizerTouch, contact->touch);
+        child->setIntegerValue(kIOHIDEventFieldDigitizerButtonMask, contact->buttonState);
+        child->setIntegerValue(kIOHIDEventFieldDigitizerEventMask, mask);
+        child->setIntegerValue(kIOHIDEventFieldDigitizerIsDisplayIntegrated,
+                               (_options & kHIDDispatchOptionPointerDisplayIntegrated) ? 1 : 0);
+        child->setFixedValue(kIOHIDEventFieldDigitizerX, contact->x);
+        child->setFixedValue(kIOHIDEventFieldDigitizerY, contact->y);
+        child->setFixedValue(kIOHIDEventFieldDigitizerZ, contact->z);
+        child->setFixedValue(kIOHIDEventFieldDigitizerPressure, contact->tipPressure);
+        child->setFixedValue(kIOHIDEventFieldDigitizerAuxiliaryPressure, contact->auxPressure);
+        child->setFixedValue(kIOHIDEventFieldDigitizerTwist, contact->twist);
+        child->setFixedValue(kIOHIDEventFieldDigitizerTiltX, contact->tiltX);
+        child->setFixedValue(kIOHIDEventFieldDigitizerTiltY, contact->tiltY);
+        child->setFixedValue(kIOHIDEventFieldDigitizerMajorRadius, contact->majorRadius);
+        child->setFixedValue(kIOHIDEventFieldDigitizerMinorRadius, contact->minorRadius);
+    }
+
+    IOHIDDigitizerTransducerType _type;
+    UInt32                       _contactsMax;
+    AbsoluteTime                 _timeStamp;
+    IOOptionBits                 _options;
+
+    IOHIDDigitizerContact        _contacts[kContactsMax];
+    UInt32                       _count;
+    IOHIDDigitizerContact        _tracked[kContactsMax];
+    UInt32                       _trackedCount;
+
+    IOHIDEvent *                 _pool[2 * kContactsMax + 1];    // indexed by child count
+    bool                         _busy[2 * kContactsMax + 1];    // returned by end(), not yet recycled
+
+    UInt64                       _statistics[kStatisticsCount];
+};
+
+#endif /* !_IOKIT_HID_IOHIDDIGITIZERFRAME_H */
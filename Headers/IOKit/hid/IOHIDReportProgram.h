@@ -0,0 +1,655 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef IOHIDReportProgram_h
+#define IOHIDReportProgram_h
+
+/*
+ * Precompiled HID report decoding.
+ *
+ * IOHIDReportProgramCompile() parses a report descriptor once into a flat
+ * table of fields, grouped by report type and report ID and sorted by bit
+ * offset, each with its usage, logical range and the byte offset, shift,
+ * mask and sign bit needed to extract it. IOHIDReportProgramDecode() then
+ * decodes a whole report into an array of values, one per field, without
+ * walking an element tree.
+ *
+ * Variable items yield one field per report count, each with its own usage.
+ * Array items yield one field per report count as well, whose value is a
+ * selector into the item's usage list (see IOHIDReportProgramArrayUsage()).
+ * The lists are kept in the program, so an array may mix usages, usage
+ * ranges and usage pages.
+ * Constant items (padding) yield no field. Fields are limited to 32 bits;
+ * wider fields are skipped like padding and counted in skippedCount, so the
+ * rest of the report still decodes.
+ */
+
+#include <IOKit/hid/IOHIDDeviceTypes.h>
+#include <IOKit/hid/IOHIDUsageTables.h>
+
+#if TARGET_OS_DRIVERKIT
+#include <DriverKit/IOLib.h>
+#else
+#include <string.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define kIOHIDReportProgramReportsMax   64
+#define kIOHIDReportProgramUsagesMax    64
+#define kIOHIDReportProgramArrayUsagesMax 256
+#define kIOHIDReportProgramStackMax     4
+
+enum {
+    kIOHIDReportFieldSigned     = 0x01,
+    kIOHIDReportFieldArray      = 0x02,
+    kIOHIDReportFieldRelative   = 0x04,
+    kIOHIDReportFieldNullState  = 0x08
+};
+
+typedef struct IOHIDReportField {
+    uint32_t    usagePage;
+    uint32_t    usage;          /* usage of a variable field, first usage of an array */
+    uint32_t    usageMax;       /* same as usage, or the last usage of an array field's first range */
+    int32_t     logicalMin;
+    int32_t     logicalMax;
+    uint32_t    bitOffset;      /* from the start of the report, after the report ID */
+    uint32_t    byteOffset;     /* of the first byte holding the field, ID included */
+    uint32_t    mask;
+    uint32_t    signBit;        /* 0 for unsigned fields */
+    uint16_t    collection;     /* index of the enclosing collection, in descriptor order */
+    uint8_t     shift;
+    uint8_t     bitSize;
+    uint8_t     flags;          /* kIOHIDReportField* */
+    uint8_t     reportType;     /* IOHIDReportType */
+    uint8_t     reportID;
+    uint8_t     reserved;
+    uint16_t    usageStart;     /* of an array field's usage list, in program->usages */
+    uint16_t    usageCount;     /* ranges in the list, 0 for variable fields */
+} IOHIDReportField;
+
+typedef struct IOHIDReportLayout {
+    uint32_t    fieldStart;     /* index of the first field of the report */
+    uint32_t    fieldCount;
+    uint32_t    bitCount;       /* report size without the report ID */
+    uint8_t     reportType;
+    uint8_t     reportID;
+    uint16_t    reserved;
+} IOHIDReportLayout;
+
+typedef struct IOHIDReportProgramUsageRange {
+    uint32_t    usagePage;      /* 0 when the usage page global applies */
+    uint32_t    min;
+    uint32_t    max;
+} IOHIDReportProgramUsageRange;
+
+typedef struct IOHIDReportProgram {
+    IOHIDReportField *  fields;
+    uint32_t            fieldCapacity;
+    uint32_t            fieldCount;
+    uint32_t            reportCount;
+    uint32_t            skippedCount;   /* fields left out for being wider than 32 bits */
+    uint32_t            usageCount;
+    bool                reportIDs;      /* reports are prefixed with their ID */
+    IOHIDReportProgramUsageRange usages[kIOHIDReportProgramArrayUsagesMax];  /* array usage lists, pages resolved */
+    IOHIDReportLayout   reports[kIOHIDReportProgramReportsMax];
+    uint8_t             reportIndex[kIOHIDReportTypeCount][256];   /* slot + 1, 0 if none */
+} IOHIDReportProgram;
+
+typedef struct IOHIDReportProgramGlobals {
+    uint32_t    usagePage;
+    int32_t     logicalMin;
+    int32_t     logicalMax;
+    uint32_t    reportSize;
+    uint32_t    reportCount;
+    uint32_t    reportID;
+    bool        logicalMaxUnsigned;
+    uint32_t    logicalMaxRaw;
+} IOHIDReportProgramGlobals;
+
+static inline uint32_t
+IOHIDReportProgramItemData(const uint8_t *data, uint32_t size, bool sign)
+{
+    uint32_t value = 0;
+
+    for (uint32_t i = 0; i < size; i++) {
+        value |= (uint32_t)data[i] << (8 * i);
+    }
+    if (sign && size > 0 && size < 4 && (value & (1U << (8 * size - 1)))) {
+        value |= ~0U << (8 * size);
+    }
+    return value;
+}
+
+static inline IOHIDReportLayout *
+IOHIDReportProgramSlot(IOHIDReportProgram *program, uint32_t type, uint32_t reportID)
+{
+    uint8_t *index = &program->reportIndex[type][reportID];
+
+    if (*index == 0) {
+        IOHIDReportLayout *layout;
+
+        if (program->reportCount == kIOHIDReportProgramReportsMax) {
+            return NULL;
+        }
+        layout = &program->reports[program->reportCount++];
+        memset(layout, 0, sizeof(*layout));
+        layout->reportType = (uint8_t)type;
+        layout->reportID = (uint8_t)reportID;
+        *index = (uint8_t)program->reportCount;
+    }
+    return &program->reports[*index - 1];
+}
+
+/* Appends the fields of one main item */
+static inline IOReturn
+IOHIDReportProgramAddItem(IOHIDReportProgram *program, uint32_t type, uint32_t itemFlags,
+    const IOHIDReportProgramGlobals *globals, const IOHIDReportProgramUsageRange *usages,
+    uint32_t usageCount, uint16_t collection)
+{
+    IOHIDReportLayout *layout;
+    int32_t logicalMax = globals->logicalMax;
+    uint32_t i, u, n;
+    uint8_t flags = 0;
+
+    if (globals->reportSize == 0 || globals->reportCount == 0) {
+        return kIOReturnSuccess;
+    }
+    if (globals->reportID > 255 || (uint64_t)globals->reportSize * globals->reportCount > 0xffff * 8) {
+        return kIOReturnBadArgument;
+    }
+
+    layout = IOHIDReportProgramSlot(program, type, globals->reportID);
+    if (layout == NULL) {
+        return kIOReturnNoSpace;
+    }
+
+    /* Constant items only pad, and so do fields too wide to extract */
+    if (itemFlags & 0x01) {
+        layout->bitCount += globals->reportSize * globals->reportCount;
+        return kIOReturnSuccess;
+    }
+    if (globals->reportSize > 32) {
+        layout->bitCount += globals->reportSize * globals->reportCount;
+        program->skippedCount += globals->reportCount;
+        return kIOReturnSuccess;
+    }
+
+    if (globals->logicalMin >= 0 && logicalMax < globals->logicalMin) {
+        logicalMax = (int32_t)globals->logicalMaxRaw;
+    }
+    if (globals->logicalMin < 0) {
+        flags |= kIOHIDReportFieldSigned;
+    }
+    if ((itemFlags & 0x02) == 0) {
+        flags |= kIOHIDReportFieldArray;
+    }
+    if (itemFlags & 0x04) {
+        flags |= kIOHIDReportFieldRelative;
+    }
+    if (itemFlags & 0x40) {
+        flags |= kIOHIDReportFieldNullState;
+    }
+
+    if (program->fieldCount + globals->reportCount > program->fieldCapacity) {
+        return kIOReturnNoSpace;
+    }
+
+    /* The fields of an array item share one copy of its usage list */
+    if ((flags & kIOHIDReportFieldArray) && usageCount > 0) {
+        if (program->usageCount + usageCount > kIOHIDReportProgramArrayUsagesMax) {
+            return kIOReturnNoSpace;
+        }
+        for (u = 0; u < usageCount; u++) {
+            IOHIDReportProgramUsageRange *range = &program->usages[program->usageCount + u];
+
+            *range = usages[u];
+            if (range->usagePage == 0) {
+                range->usagePage = globals->usagePage;
+            }
+        }
+    }
+
+    /* u walks the usage ranges, n the usage within the current range */
+    for (i = 0, u = 0, n = 0; i < globals->reportCount; i++) {
+        IOHIDReportField *field = &program->fields[program->fieldCount++];
+        uint32_t bitOffset = layout->bitCount;
+        uint32_t byteBase = program->reportIDs ? 1 : 0;
+
+        memset(field, 0, sizeof(*field));
+        field->usagePage = globals->usagePage;
+
+        if (usageCount > 0) {
+            const IOHIDReportProgramUsageRange *range = &usages[u];
+
+            if (range->usagePage) {
+                field->usagePage = range->usagePage;
+            }
+            if (flags & kIOHIDReportFieldArray) {
+                field->usage = usages[0].min;
+                field->usageMax = usages[0].max;
+                field->usageStart = (uint16_t)program->usageCount;
+                field->usageCount = (uint16_t)usageCount;
+            } else {
+                field->usage = range->min + n;
+                field->usageMax = field->usage;
+                /* The last usage repeats for the remaining counts */
+                if (range->min + n < range->max) {
+                    n++;
+                } else if (u + 1 < usageCount) {
+                    u++;
+                    n = 0;
+                }
+            }
+        }
+
+        field->logicalMin = globals->logicalMin;
+        field->logicalMax = logicalMax;
+        field->bitOffset = bitOffset;
+        field->byteOffset = byteBase + bitOffset / 8;
+        field->shift = (uint8_t)(bitOffset % 8);
+        field->bitSize = (uint8_t)globals->reportSize;
+        field->mask = globals->reportSize == 32 ? ~0U : (1U << globals->reportSize) - 1;
+        field->signBit = (flags & kIOHIDReportFieldSigned) ? 1U << (globals->reportSize - 1) : 0;
+        field->collection = collection;
+        field->flags = flags;
+        field->reportType = (uint8_t)type;
+        field->reportID = (uint8_t)globals->reportID;
+
+        layout->bitCount += globals->reportSize;
+    }
+    if (flags & kIOHIDReportFieldArray) {
+        program->usageCount += usageCount;
+    }
+    return kIOReturnSuccess;
+}
+
+/* Groups the fields by report, keeping descriptor order within a report */
+static inline void
+IOHIDReportProgramSort(IOHIDReportProgram *program)
+{
+    uint32_t slot, i, j, start = 0;
+
+    for (slot = 0; slot < program->reportCount; slot++) {
+        IOHIDReportLayout *layout = &program->reports[slot];
+
+        layout->fieldStart = start;
+        for (i = start; i < program->fieldCount; i++) {
+            IOHIDReportField field = program->fields[i];
+
+            if (program->reportIndex[field.reportType][field.reportID] != slot + 1) {
+                continue;
+            }
+            for (j = i; j > start; j--) {
+                program->fields[j] = program->fields[j - 1];
+            }
+            program->fields[start++] = field;
+        }
+        layout->fieldCount = start - layout->fieldStart;
+    }
+}
+
+/*!
+ * @function IOHIDReportProgramCompile
+ * @abstract
+ * Compiles a HID report descriptor.
+ * @param descriptor
+ * Report descriptor.
+ * @param length
+ * Length of the descriptor in bytes.
+ * @param program
+ * Program to initialize.
+ * @param fields
+ * Storage for the fields, which must outlive the program.
+ * @param fieldCapacity
+ * Number of entries in fields.
+ * @result
+ * kIOReturnSuccess, kIOReturnNoSpace if fields or report slots run out, or
+ * kIOReturnBadArgument for a malformed descriptor. Fields wider than 32 bits
+ * do not fail the compile; they are counted in program->skippedCount.
+ */
+static inline IOReturn
+IOHIDReportProgramCompile(const uint8_t *descriptor, size_t length, IOHIDReportProgram *program,
+    IOHIDReportField *fields, uint32_t fieldCapacity)
+{
+    IOHIDReportProgramGlobals globals, stack[kIOHIDReportProgramStackMax];
+    IOHIDReportProgramUsageRange usages[kIOHIDReportProgramUsagesMax];
+    uint32_t usageCount = 0, usageMin = 0, stackDepth = 0, depth = 0;
+    uint16_t collection = 0, collections = 0;
+    uint16_t collectionStack[32];
+    bool haveUsageMin = false;
+    size_t offset = 0;
+    IOReturn ret;
+
+    memset(program, 0, sizeof(*program));
+    memset(&globals, 0, sizeof(globals));
+    program->fields = fields;
+    program->fieldCapacity = fieldCapacity;
+
+    while (offset < length) {
+        uint8_t prefix = descriptor[offset];
+        uint32_t size = prefix & 0x03;
+        uint32_t kind = (prefix >> 2) & 0x03;
+        uint32_t tag = prefix >> 4;
+        const uint8_t *data;
+        uint32_t value;
+
+        if (prefix == 0xfe) {
+            /* Long item: size, tag, data */
+            if (offset + 2 >= length) {
+                return kIOReturnBadArgument;
+            }
+            offset += 3 + descriptor[offset + 1];
+            continue;
+        }
+
+        size = size == 3 ? 4 : size;
+        if (offset + 1 + size > length) {
+            return kIOReturnBadArgument;
+        }
+        data = &descriptor[offset + 1];
+        offset += 1 + size;
+        value = IOHIDReportProgramItemData(data, size, false);
+
+        if (kind == 0) {                                /* main */
+            switch (tag) {
+            case 0x8:                                   /* Input */
+            case 0x9:                                   /* Output */
+            case 0xb:                                   /* Feature */
+                ret = IOHIDReportProgramAddItem(program,
+                    tag == 0x8 ? kIOHIDReportTypeInput : tag == 0x9 ? kIOHIDReportTypeOutput : kIOHIDReportTypeFeature,
+                    value, &globals, usages, usageCount, collection);
+                if (ret != kIOReturnSuccess) {
+                    return ret;
+                }
+                break;
+            case 0xa:                                   /* Collection */
+                if (depth == sizeof(collectionStack) / sizeof(collectionStack[0])) {
+                    return kIOReturnBadArgument;
+                }
+                collectionStack[depth++] = collection;
+                collection = ++collections;
+                break;
+            case 0xc:                                   /* End Collection */
+                if (depth == 0) {
+                    return kIOReturnBadArgument;
+                }
+                collection = collectionStack[--depth];
+                break;
+            default:
+                break;
+            }
+            usageCount = 0;
+            haveUsageMin = false;
+        } else if (kind == 1) {                         /* global */
+            switch (tag) {
+            case 0x0:
+                globals.usagePage = value;
+                break;
+            case 0x1:
+                globals.logicalMin = (int32_t)IOHIDReportProgramItemData(data, size, true);
+                break;
+            case 0x2:
+                globals.logicalMax = (int32_t)IOHIDReportProgramItemData(data, size, true);
+                globals.logicalMaxRaw = value;
+                break;
+            case 0x7:
+                globals.reportSize = value;
+                break;
+            case 0x8:
+                if (value == 0 || value > 255) {
+                    return kIOReturnBadArgument;
+                }
+                globals.reportID = value;
+                if (program->fieldCount == 0 && program->reportCount == 0) {
+                    program->reportIDs = true;
+                } else if (!program->reportIDs) {
+                    return kIOReturnBadArgument;
+                }
+                break;
+            case 0x9:
+                globals.reportCount = value;
+                break;
+            case 0xa:                                   /* Push */
+                if (stackDepth == kIOHIDReportProgramStackMax) {
+                    return kIOReturnBadArgument;
+                }
+                stack[stackDepth++] = globals;
+                break;
+            case 0xb:                                   /* Pop */
+                if (stackDepth == 0) {
+                    return kIOReturnBadArgument;
+                }
+                globals = stack[--stackDepth];
+                break;
+            default:
+                break;
+            }
+        } else if (kind == 2) {                         /* local */
+            uint32_t page = size == 4 ? value >> 16 : 0;
+            uint32_t usage = size == 4 ? value & 0xffff : value;
+
+            switch (tag) {
+            case 0x0:                                   /* Usage */
+                if (usageCount < kIOHIDReportProgramUsagesMax) {
+                    usages[usageCount].usagePage = page;
+                    usages[usageCount].min = usage;
+                    usages[usageCount].max = usage;
+                    usageCount++;
+                }
+                break;
+            case 0x1:                                   /* Usage Minimum */
+                usageMin = value;
+                haveUsageMin = true;
+                break;
+            case 0x2:                                   /* Usage Maximum */
+                if (haveUsageMin && usageCount < kIOHIDReportProgramUsagesMax) {
+                    usages[usageCount].usagePage = size == 4 ? page : (usageMin >> 16);
+                    usages[usageCount].min = usageMin & 0xffff;
+                    usages[usageCount].max = usage;
+                    if (usages[usageCount].max < usages[usageCount].min) {
+                        return kIOReturnBadArgument;
+                    }
+                    usageCount++;
+                }
+                haveUsageMin = false;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    /* An item that was never given a report ID still sits in report 0 */
+    if (program->reportIDs) {
+        for (uint32_t type = 0; type < kIOHIDReportTypeCount; type++) {
+            if (program->reportIndex[type][0]) {
+                return kIOReturnBadArgument;
+            }
+        }
+    }
+
+    IOHIDReportProgramSort(program);
+    return kIOReturnSuccess;
+}
+
+/*!
+ * @function IOHIDReportProgramGetReport
+ * @result
+ * The layout of a report, or NULL if the descriptor does not define it.
+ */
+static inline const IOHIDReportLayout *
+IOHIDReportProgramGetReport(const IOHIDReportProgram *program, IOHIDReportType type, uint8_t reportID)
+{
+    uint8_t index = program->reportIndex[type][reportID];
+
+    return index ? &program->reports[index - 1] : NULL;
+}
+
+/* Whether a field carries a usage, for an array field anywhere in its list */
+static inline bool
+IOHIDReportProgramFieldHasUsage(const IOHIDReportProgram *program, const IOHIDReportField *field,
+    uint32_t usagePage, uint32_t usage)
+{
+    if (field->usageCount == 0) {
+        return field->usagePage == usagePage && usage >= field->usage && usage <= field->usageMax;
+    }
+    for (uint32_t i = field->usageStart; i < (uint32_t)field->usageStart + field->usageCount; i++) {
+        const IOHIDReportProgramUsageRange *range = &program->usages[i];
+
+        if (range->usagePage == usagePage && usage >= range->min && usage <= range->max) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*!
+ * @function IOHIDReportProgramFindField
+ * @abstract
+ * Finds the instance-th field of a report type with the given usage.
+ * @result
+ * Index of the field (and of its value), or -1 if there is none.
+ */
+static inline int32_t
+IOHIDReportProgramFindField(const IOHIDReportProgram *program, IOHIDReportType type,
+    uint32_t usagePage, uint32_t usage, uint32_t instance)
+{
+    for (uint32_t i = 0; i < program->fieldCount; i++) {
+        const IOHIDReportField *field = &program->fields[i];
+
+        if (field->reportType == type && IOHIDReportProgramFieldHasUsage(program, field, usagePage, usage) &&
+            instance-- == 0) {
+            return (int32_t)i;
+        }
+    }
+    return -1;
+}
+
+/*!
+ * @function IOHIDReportProgramDecode
+ * @abstract
+ * Decodes a report into values[fieldStart, fieldStart + fieldCount) of its
+ * layout.
+ * @param program
+ * Compiled program.
+ * @param type
+ * Type of the report.
+ * @param report
+ * Report, starting with its ID if the descriptor uses report IDs.
+ * @param length
+ * Length of the report in bytes.  Fields beyond it are left unchanged.
+ * @param values
+ * Array of program->fieldCount values.  Signed fields are sign extended,
+ * others zero extended.
+ * @result
+ * Number of fields decoded, or -1 if the report is not defined.
+ */
+static inline int32_t
+IOHIDReportProgramDecode(const IOHIDReportProgram *program, IOHIDReportType type,
+    const uint8_t *report, size_t length, int32_t *values)
+{
+    const IOHIDReportLayout *layout;
+    const IOHIDReportField *field, *end;
+    int32_t count = 0;
+
+    if (length == 0 || (uint32_t)type >= kIOHIDReportTypeCount) {
+        return -1;
+    }
+    layout = IOHIDReportProgramGetReport(program, type, program->reportIDs ? report[0] : 0);
+    if (layout == NULL) {
+        return -1;
+    }
+
+    field = &program->fields[layout->fieldStart];
+    end = field + layout->fieldCount;
+    for (; field < end; field++) {
+        uint64_t word = 0;
+        uint32_t raw;
+
+        if (field->byteOffset + sizeof(word) <= length) {
+            memcpy(&word, report + field->byteOffset, sizeof(word));
+        } else {
+            if (field->byteOffset + (field->shift + field->bitSize + 7U) / 8 > length) {
+                break;
+            }
+            for (size_t i = field->byteOffset; i < length; i++) {
+                word |= (uint64_t)report[i] << (8 * (i - field->byteOffset));
+            }
+        }
+        raw = (uint32_t)(word >> field->shift) & field->mask;
+        /* Sign extension: (x ^ s) - s with s the sign bit, 0 for unsigned fields */
+        values[field - program->fields] = (int32_t)((raw ^ field->signBit) - field->signBit);
+        count++;
+    }
+    return count;
+}
+
+/*!
+ * @function IOHIDReportProgramArrayUsage
+ * @param program
+ * Program the field belongs to.
+ * @param field
+ * Array field.
+ * @param value
+ * Decoded value of the field.
+ * @param usagePage
+ * Receives the page of the selected usage, if not NULL.
+ * @result
+ * Usage selected by the value of an array field, or 0 for none.
+ */
+static inline uint32_t
+IOHIDReportProgramArrayUsage(const IOHIDReportProgram *program, const IOHIDReportField *field,
+    int32_t value, uint32_t *usagePage)
+{
+    uint32_t index;
+
+    if (value < field->logicalMin || value > field->logicalMax) {
+        return 0;
+    }
+    /* The selector counts through the usages of the list, range after range */
+    index = (uint32_t)((int64_t)value - field->logicalMin);
+    for (uint32_t i = field->usageStart; i < (uint32_t)field->usageStart + field->usageCount; i++) {
+        const IOHIDReportProgramUsageRange *range = &program->usages[i];
+
+        if (index <= range->max - range->min) {
+            if (usagePage) {
+                *usagePage = range->usagePage;
+            }
+            return range->min + index;
+        }
+        index -= range->max - range->min + 1;
+    }
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IOHIDReportProgram_h */
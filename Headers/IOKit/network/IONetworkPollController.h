@@ -0,0 +1,592 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IONETWORKPOLLCONTROLLER_H
+#define _IONETWORKPOLLCONTROLLER_H
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOService.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOKernelReportStructs.h>
+#include <IOKit/IOReportMacros.h>
+#include <IOKit/network/IONetworkInterface.h>
+#include <kern/clock.h>
+#include <mach/mach_time.h>
+
+/*! @class IONetworkPollController
+    @abstract Decides when a controller's receive path should switch
+    between interrupts and polling, and how many packets each poll takes.
+    @discussion IONetworkInterface::configureInputPacketPolling() lets a
+    driver receive in polled mode, but what load justifies it is left to
+    the driver.  An IONetworkPollController measures it: the driver calls
+    inputInterrupt() with the packets each receive interrupt handled and
+    inputPolled() with the packets each pollInputPackets() call returned.
+    Every sample interval the controller computes the smoothed packet
+    rate and the work done per interrupt, and recommends polling once the
+    rate or the work per interrupt has stayed above its entry threshold
+    for holdSamples intervals, and interrupts once the rate has stayed
+    below a lower exit threshold without a poll using its whole budget.
+    The gap between the thresholds and the hold keep the mode from
+    flapping on bursts.  The poll budget is sized from the rate so that
+    one poll interval's packets fit twice over, and doubles while polls
+    keep exhausting it.
+    <br>
+    A driver that schedules its own polling follows
+    getRecommendedMode(); one that lets the stack poll passes
+    getPollingParameters() to setPacketPollingParameters().  Either way
+    it reports the mode actually in effect with setMode(), typically
+    from setInputPacketPollingEnable().
+    <br>
+    The mode and the counters are exported through IOReport:
+    publishLegend() advertises a state channel with the time spent in
+    each mode and a counter channel, and the driver forwards its
+    configureReport() and updateReport() calls to the controller's.
+    <br>
+    inputInterrupt() and inputPolled() may run concurrently with each
+    other and from interrupt context; the sample is evaluated by
+    whichever call ends it.
+*/
+
+class IONetworkPollController
+{
+public:
+
+/*! @enum Mode
+    @constant kModeInterrupt Packets are pushed from the receive interrupt.
+    @constant kModePoll Receive interrupts are masked and packets are polled.
+*/
+
+    enum Mode
+    {
+        kModeInterrupt,
+        kModePoll
+    };
+
+/*! @struct Parameters
+    @field sampleInterval Nanoseconds between decisions.
+    @field pollEnterRate Packets per second at which polling is recommended.
+    @field pollExitRate Packets per second below which interrupts are
+    recommended again; below pollEnterRate.
+    @field pollEnterWork Packets per interrupt at which polling is
+    recommended even below pollEnterRate, as long as the rate is at least
+    pollExitRate.
+    @field holdSamples Consecutive samples a condition must hold before
+    the recommended mode changes.
+    @field pollInterval Nanoseconds between polls.
+    @field budgetMin Smallest poll budget.
+    @field budgetMax Largest poll budget, at most the receive ring size.
+*/
+
+    struct Parameters
+    {
+        UInt64  sampleInterval;
+        UInt32  pollEnterRate;
+        UInt32  pollExitRate;
+        UInt32  pollEnterWork;
+        UInt32  holdSamples;
+        UInt64  pollInterval;
+        UInt32  budgetMin;
+        UInt32  budgetMax;
+    };
+
+    // Channel IDs of the mode and of the counters.
+    static const UInt64 kChannelMode   = IOREPORT_MAKEID('N', 'e', 't', 'P', 'o', 'l', 'M', 'd');
+    static const UInt64 kChannelCounts = IOREPORT_MAKEID('N', 'e', 't', 'P', 'o', 'l', 'C', 't');
+
+/*! @enum Counters
+    @abstract Values of the counter channel, in order.
+    @constant kCountInterrupts Receive interrupts.
+    @constant kCountInterruptPackets Packets received from interrupts.
+    @constant kCountPolls Polls.
+    @constant kCountPollPackets Packets received from polls.
+    @constant kCountPollsEmpty Polls that found no packet.
+    @constant kCountPollsExhausted Polls that used their whole budget.
+    @constant kCountRate Current smoothed rate in packets per second.
+    @constant kCountBudget Current poll budget.
+*/
+
+    enum Counters
+    {
+        kCountInterrupts,
+        kCountInterruptPackets,
+        kCountPolls,
+        kCountPollPackets,
+        kCountPollsEmpty,
+        kCountPollsExhausted,
+        kCountRate,
+        kCountBudget,
+        kCountCount
+    };
+
+    IONetworkPollController()
+    {
+        bzero(this, sizeof(*this));
+    }
+
+/*! @function getDefaultParameters
+    @abstract Fills in parameters suited to a 1 to 10 Gb/s controller.
+    @param params The parameters.
+    @param driverQueueSize Number of packets the receive ring holds.
+*/
+
+    static void getDefaultParameters(Parameters * params, UInt32 driverQueueSize)
+    {
+        params->sampleInterval = 10 * 1000 * 1000;
+        params->pollEnterRate  = 20000;
+        params->pollExitRate   = 5000;
+        params->pollEnterWork  = 16;
+        params->holdSamples    = 2;
+        params->pollInterval   = 1000 * 1000;
+        params->budgetMin      = 8;
+        params->budgetMax      = driverQueueSize;
+    }
+
+/*! @function init
+    @abstract Prepares the controller, recommending interrupts.
+    @param provider Service whose registry entry ID identifies the channels.
+    @param driverQueueSize Number of packets the receive ring holds, as
+    passed to configureInputPacketPolling().
+    @param params Parameters, or 0 for getDefaultParameters().
+    @result Returns kIOReturnSuccess, kIOReturnBadArgument or
+    kIOReturnNoMemory.
+*/
+
+    IOReturn init(IOService * provider, UInt32 driverQueueSize, const Parameters * params = 0)
+    {
+        if (provider == 0 || driverQueueSize == 0) return kIOReturnBadArgument;
+
+        if (params) _params = *params;
+        else getDefaultParameters(&_params, driverQueueSize);
+
+        if (_params.budgetMax > driverQueueSize) _params.budgetMax = driverQueueSize;
+        if (_params.budgetMin == 0) _params.budgetMin = 1;
+        if (_params.sampleInterval == 0 || _params.pollExitRate > _params.pollEnterRate ||
+            _params.budgetMin > _params.budgetMax)
+            return kIOReturnBadArgument;
+
+        _stateReport = IOMalloc(STATEREPORT_BUFSIZE(2));
+        _reportLock  = IOSimpleLockAlloc();
+        if (_stateReport == 0 || _reportLock == 0)
+        {
+            free();
+            return kIOReturnNoMemory;
+        }
+
+        _providerID = provider->getRegistryEntryID();
+        STATEREPORT_INIT(2, _stateReport, STATEREPORT_BUFSIZE(2), _providerID, kChannelMode,
+                         kIOReportCategoryPerformance | kIOReportCategoryTraffic);
+        STATEREPORT_SETSTATEID(_stateReport, kModeInterrupt, IOREPORT_MAKEID(0, 0, 0, 0, 'I', 'n', 't', 'r'));
+        STATEREPORT_SETSTATEID(_stateReport, kModePoll, IOREPORT_MAKEID(0, 0, 0, 0, 'P', 'o', 'l', 'l'));
+        STATEREPORT_SETSTATE(_stateReport, kModeInterrupt, mach_absolute_time());
+
+        nanoseconds_to_absolutetime(_params.sampleInterval, &_sampleTicks);
+        _sampleStart          = mach_absolute_time();
+        _budget               = _params.budgetMin;
+        _counts[kCountBudget] = _budget;
+
+        return kIOReturnSuccess;
+    }
+
+/*! @function free
+    @abstract Frees the controller's report buffers.
+*/
+
+    void free()
+    {
+        if (_stateReport) IOFree(_stateReport, STATEREPORT_BUFSIZE(2));
+        if (_reportLock) IOSimpleLockFree(_reportLock);
+        _stateReport = 0;
+        _reportLock  = 0;
+    }
+
+/*! @function inputInterrupt
+    @abstract Counts the packets one receive interrupt handled.
+*/
+
+    void inputInterrupt(UInt32 packets)
+    {
+        __atomic_fetch_add(&_counts[kCountInterrupts], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&_counts[kCountInterruptPackets], packets, __ATOMIC_RELAXED);
+        sample();
+    }
+
+/*! @function inputPolled
+    @abstract Counts the packets one poll returned.
+    @param packets Packets returned.
+    @param budget The budget the poll was given.
+*/
+
+    void inputPolled(UInt32 packets, UInt32 budget)
+    {
+        __atomic_fetch_add(&_counts[kCountPolls], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&_counts[kCountPollPackets], packets, __ATOMIC_RELAXED);
+        if (packets == 0)
+            __atomic_fetch_add(&_counts[kCountPollsEmpty], 1, __ATOMIC_RELAXED);
+        else if (packets >= budget)
+            __atomic_fetch_add(&_counts[kCountPollsExhausted], 1, __ATOMIC_RELAXED);
+        sample();
+    }
+
+/*! @function getPollBudget
+    @abstract Returns how many packets the next poll should take.
+    @param maxCount The most the poller accepts, as passed to
+    pollInputPackets(), or 0 for no limit.
+*/
+
+    UInt32 getPollBudget(UInt32 maxCount = 0) const
+    {
+        UInt32 budget = __atomic_load_n(&_budget, __ATOMIC_RELAXED);
+
+        return (maxCount && maxCount < budget) ? maxCount : budget;
+    }
+
+/*! @function getRecommendedMode
+    @abstract Returns the mode the measured load calls for.
+*/
+
+    Mode getRecommendedMode() const
+    {
+        return (Mode) __atomic_load_n(&_recommended, __ATOMIC_RELAXED);
+    }
+
+/*! @function setMode
+    @abstract Records the mode now in effect, for the state channel.
+*/
+
+    void setMode(Mode mode)
+    {
+        IOInterruptState state;
+
+        if (_reportLock == 0 || mode == _mode) return;
+
+        state = IOSimpleLockLockDisableInterrupt(_reportLock);
+        _mode = mode;
+        STATEREPORT_SETSTATE(_stateReport, mode, mach_absolute_time());
+        IOSimpleLockUnlockEnableInterrupt(_reportLock, state);
+    }
+
+    Mode getMode() const
+    {
+        return _mode;
+    }
+
+/*! @function getRate
+    @abstract Returns the smoothed receive rate in packets per second.
+*/
+
+    UInt64 getRate() const
+    {
+        return __atomic_load_n(&_counts[kCountRate], __ATOMIC_RELAXED);
+    }
+
+#ifdef __PRIVATE_SPI__
+/*! @function getPollingParameters
+    @abstract Expresses the controller's thresholds and budget as the
+    stack's polling parameters.
+    @discussion The stack compares its packet thresholds with the packets
+    it counts per sampling period, so the rates are scaled to that
+    period.  Byte thresholds are left 0.  The budget changes with the
+    load; a driver passing these parameters to
+    setPacketPollingParameters() calls it again when
+    getParametersGeneration() changes.
+    @param params The parameters.
+    @param stackSamplePeriod The stack's sampling period in nanoseconds.
+*/
+
+    void getPollingParameters(IONetworkPacketPollingParameters * params,
+                              UInt64 stackSamplePeriod = 10 * 1000 * 1000) const
+    {
+        bzero(params, sizeof(*params));
+        params->maxPacketCount       = getPollBudget();
+        params->lowThresholdPackets  = (UInt32) ((_params.pollExitRate * stackSamplePeriod) / 1000000000ULL);
+        params->highThresholdPackets = (UInt32) ((_params.pollEnterRate * stackSamplePeriod) / 1000000000ULL);
+        params->pollIntervalTime     = _params.pollInterval;
+    }
+#endif
+
+/*! @function getParametersGeneration
+    @abstract Returns a number that changes whenever the poll budget does.
+*/
+
+    UInt32 getParametersGeneration() const
+    {
+        return __atomic_load_n(&_generation, __ATOMIC_RELAXED);
+    }
+
+/*! @function publishLegend
+    @abstract Adds the controller's channels to the provider's IOReport
+    legend.
+*/
+
+    IOReturn publishLegend(IOService * provider)
+    {
+        OSArray *  existing = OSDynamicCast(OSArray, provider->getProperty(kIOReportLegendKey));
+        OSArray *  legend   = existing ? OSArray::withArray(existing) : OSArray::withCapacity(2);
+        OSArray *  modes    = OSArray::withCapacity(1);
+        OSArray *  counts   = OSArray::withCapacity(1);
+        IOReturn   status   = kIOReturnNoMemory;
+
+        if (legend && modes && counts &&
+            addChannel(modes, kChannelMode, kIOReportFormatState, 2, "Mode") &&
+            addChannel(counts, kChannelCounts, kIOReportFormatSimpleArray,
+                       kCountCount / IOR_VALUES_PER_ELEMENT, "Counts") &&
+            addGroup(legend, modes, "Mode") && addGroup(legend, counts, "Counts"))
+        {
+            provider->setProperty(kIOReportLegendKey, legend);
+            provider->setProperty(kIOReportLegendPublicKey, true);
+            status = kIOReturnSuccess;
+        }
+
+        if (legend) legend->release();
+        if (modes) modes->release();
+        if (counts) counts->release();
+
+        return status;
+    }
+
+/*! @function configureReport
+    @abstract Handles the controller's channels in the driver's
+    configureReport().
+*/
+
+    IOReturn configureReport(IOReportChannelList * channels, IOReportConfigureAction action,
+                             void * result, void * destination)
+    {
+        (void) destination;
+
+        if (action != kIOReportGetDimensions) return kIOReturnSuccess;
+
+        for (UInt32 index = 0; index < channels->nchannels; index++)
+        {
+            UInt64 channelID = channels->channels[index].channel_id;
+
+            if (channelID == kChannelMode) *(int *) result += 2;
+            else if (channelID == kChannelCounts) *(int *) result += kCountCount / IOR_VALUES_PER_ELEMENT;
+        }
+
+        return kIOReturnSuccess;
+    }
+
+/*! @function updateReport
+    @abstract Handles the controller's channels in the driver's
+    updateReport().
+*/
+
+    IOReturn updateReport(IOReportChannelList * channels, IOReportUpdateAction action,
+                          void * result, void * destination)
+    {
+        IOBufferMemoryDescriptor * buffer = (IOBufferMemoryDescriptor *) destination;
+        UInt64                     timestamp = mach_absolute_time();
+
+        if (action != kIOReportCopyChannelData || _reportLock == 0) return kIOReturnSuccess;
+
+        for (UInt32 index = 0; index < channels->nchannels; index++)
+        {
+            UInt64 channelID = channels->channels[index].channel_id;
+
+            if (channelID == kChannelMode)
+            {
+                IOReportElement  elements[2];
+                IOInterruptState state;
+                void *           data;
+                size_t           size;
+
+                state = IOSimpleLockLockDisableInterrupt(_reportLock);
+                STATEREPORT_UPDATEPREP(_stateReport, timestamp, data, size);
+                bcopy(data, elements, size);
+                IOSimpleLockUnlockEnableInterrupt(_reportLock, state);
+
+                if (!buffer->appendBytes(elements, size)) return kIOReturnOverrun;
+                *(int *) result += 2;
+            }
+            else if (channelID == kChannelCounts)
+            {
+                for (UInt32 element = 0; element < kCountCount / IOR_VALUES_PER_ELEMENT; element++)
+                {
+                    IOReportElement data;
+
+                    bzero(&data, sizeof(data));
+                    data.provider_id                   = _providerID;
+                    data.channel_id                    = kChannelCounts;
+                    data.channel_type.report_format    = kIOReportFormatSimpleArray;
+                    data.channel_type.categories       = kIOReportCategoryPerformance | kIOReportCategoryTraffic;
+                    data.channel_type.nelements        = kCountCount / IOR_VALUES_PER_ELEMENT;
+                    data.channel_type.element_idx      = element;
+                    data.timestamp                     = timestamp;
+                    for (UInt32 value = 0; value < IOR_VALUES_PER_ELEMENT; value++)
+                    {
+                        data.values.v[value] = __atomic_load_n(
+                            &_counts[element * IOR_VALUES_PER_ELEMENT + value], __ATOMIC_RELAXED);
+                    }
+
+                    if (!buffer->appendBytes(&data, sizeof(data))) return kIOReturnOverrun;
+                    *(int *) result += 1;
+                }
+            }
+        }
+
+        return kIOReturnSuccess;
+    }
+
+protected:
+
+    void sample()
+    {
+        UInt64 now = mach_absolute_time();
+
+        if (now - __atomic_load_n(&_sampleStart, __ATOMIC_RELAXED) < _sampleTicks) return;
+        if (__atomic_exchange_n(&_evaluating, 1, __ATOMIC_ACQUIRE)) return;
+
+        // Another caller may have ended the sample meanwhile.
+        if (now - _sampleStart >= _sampleTicks) evaluate(now);
+
+        __atomic_store_n(&_evaluating, 0, __ATOMIC_RELEASE);
+    }
+
+    void evaluate(UInt64 now)
+    {
+        UInt64 delta[kCountRate];
+        UInt64 elapsed, rate, perPoll;
+        UInt32 work, budget;
+        UInt32 wanted = _recommended;
+
+        for (UInt32 index = 0; index < kCountRate; index++)
+        {
+            UInt64 count = __atomic_load_n(&_counts[index], __ATOMIC_RELAXED);
+
+            delta[index] = count - _last[index];
+            _last[index] = count;
+        }
+        absolutetime_to_nanoseconds(now - _sampleStart, &elapsed);
+        __atomic_store_n(&_sampleStart, now, __ATOMIC_RELAXED);
+        if (elapsed == 0) return;
+
+        rate = (delta[kCountInterruptPackets] + delta[kCountPollPackets]) * 1000000000ULL / elapsed;
+        rate = (_counts[kCountRate] + rate) / 2;
+        work = delta[kCountInterrupts] ?
+               (UInt32) (delta[kCountInterruptPackets] / delta[kCountInterrupts]) : 0;
+
+        if (_recommended == kModeInterrupt)
+        {
+            if (rate >= _params.pollEnterRate ||
+                (work >= _params.pollEnterWork && rate >= _params.pollExitRate))
+                wanted = kModePoll;
+        }
+        else if (rate < _params.pollExitRate && delta[kCountPollsExhausted] == 0)
+        {
+            wanted = kModeInterrupt;
+        }
+
+        if (wanted == _recommended) _pending = 0;
+        else if (++_pending >= _params.holdSamples)
+        {
+            __atomic_store_n(&_recommended, wanted, __ATOMIC_RELAXED);
+            _pending = 0;
+        }
+
+        // Room for twice the packets of a poll interval, more while polls
+        // keep running out of budget.
+        perPoll = rate * _params.pollInterval / 1000000000ULL;
+        budget  = _params.budgetMin;
+        while (budget < perPoll * 2 && budget < _params.budgetMax) budget *= 2;
+        if (delta[kCountPollsExhausted] * 8 > delta[kCountPolls] && budget < _budget * 2)
+            budget = _budget * 2;
+        if (budget > _params.budgetMax) budget = _params.budgetMax;
+
+        if (budget != _budget)
+        {
+            __atomic_store_n(&_budget, budget, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&_generation, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&_counts[kCountRate], rate, __ATOMIC_RELAXED);
+        __atomic_store_n(&_counts[kCountBudget], budget, __ATOMIC_RELAXED);
+    }
+
+    bool addChannel(OSArray * channels, UInt64 channelID, UInt8 format, UInt16 count, const char * name)
+    {
+        IOReportChannelType type       = { format, 0, kIOReportCategoryPerformance | kIOReportCategoryTraffic, count, 0 };
+        UInt64              typeBits   = 0;
+        OSArray *           channel    = OSArray::withCapacity(3);
+        OSNumber *          idNumber   = OSNumber::withNumber(channelID, 64);
+        OSNumber *          typeNumber;
+        OSString *          nameString = OSString::withCString(name);
+        bool                added;
+
+        bcopy(&type, &typeBits, sizeof(type));
+        typeNumber = OSNumber::withNumber(typeBits, 64);
+
+        added = channel && idNumber && typeNumber && nameString &&
+                channel->setObject(kIOReportChannelIDIdx, idNumber) &&
+                channel->setObject(kIOReportChannelTypeIdx, typeNumber) &&
+                channel->setObject(kIOReportChannelNameIdx, nameString) &&
+                channels->setObject(channel);
+
+        if (channel) channel->release();
+        if (idNumber) idNumber->release();
+        if (typeNumber) typeNumber->release();
+        if (nameString) nameString->release();
+
+        return added;
+    }
+
+    bool addGroup(OSArray * legend, OSArray * channels, const char * subGroup)
+    {
+        OSDictionary * group        = OSDictionary::withCapacity(3);
+        OSString *     groupName    = OSString::withCString("Network Polling");
+        OSString *     subGroupName = OSString::withCString(subGroup);
+        bool           added;
+
+        added = group && groupName && subGroupName &&
+                group->setObject(kIOReportLegendChannelsKey, channels) &&
+                group->setObject(kIOReportLegendGroupNameKey, groupName) &&
+                group->setObject(kIOReportLegendSubGroupNameKey, subGroupName) &&
+                legend->setObject(group);
+
+        if (group) group->release();
+        if (groupName) groupName->release();
+        if (subGroupName) subGroupName->release();
+
+        return added;
+    }
+
+    Parameters      _params;
+    UInt64          _providerID;
+    UInt64          _sampleTicks;
+    UInt64          _sampleStart;
+    UInt64          _counts[kCountCount];
+    UInt64          _last[kCountRate];
+    UInt32          _evaluating;
+    UInt32          _pending;
+    UInt32          _recommended;
+    UInt32          _budget;
+    UInt32          _generation;
+    Mode            _mode;
+    void *          _stateReport;
+    IOSimpleLock *  _reportLock;
+};
+
+#endif /* !_IONETWORKPOLLCONTROLLER_H */
@@ -0,0 +1,923 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IONETWORKRSS_H
+#define _IONETWORKRSS_H
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <libkern/OSByteOrder.h>
+#include <libkern/c++/OSObject.h>
+extern "C" {
+#include <sys/kpi_mbuf.h>
+#include <kern/thread_call.h>
+}
+#if defined(__x86_64__)
+#include <i386/simd_state.h>
+#endif
+
+/*! @defined kIONetworkRSSKeyLength
+    @abstract Length of a Toeplitz key, enough for an IPv6 4-tuple. */
+
+#define kIONetworkRSSKeyLength          40
+
+/*! @defined kIONetworkRSSMaxInput
+    @abstract Longest hash input, an IPv6 4-tuple. */
+
+#define kIONetworkRSSMaxInput           36
+
+/*! @class IONetworkRSSHash
+    @abstract Computes the Toeplitz hash used for receive-side scaling.
+    @discussion The hash is the one NICs compute to pick a receive queue:
+    the input is the source and destination addresses, then for TCP and
+    UDP the source and destination ports, all in network byte order.  A
+    driver uses it to steer packets in software, or to check the hash a
+    NIC reports against hashPacket().
+    <br>
+    Hashing is table driven: for each input byte position a 256-entry
+    table holds the XOR of the key windows its bits select, so a hash
+    costs one lookup per input byte.  The tables take 36KB.
+    <br>
+    On x86_64 processors with PCLMULQDQ, hashBatch() instead computes each
+    4 input bytes' share with one carry-less multiply by the 64 key bits
+    they can select.  Vector registers are only used between
+    simd_state_save() and simd_state_restore(), which costs more than a
+    table lookup hash, so that path serves batches of inputs.
+*/
+
+class IONetworkRSSHash
+{
+public:
+
+/*! @enum HashType
+    @abstract What hashPacket() hashed.
+    @constant kHashTypeNone Not IP; the hash is 0.
+    @constant kHashTypeIPv4 IPv4 addresses.
+    @constant kHashTypeTCPIPv4 IPv4 addresses and TCP ports.
+    @constant kHashTypeUDPIPv4 IPv4 addresses and UDP ports.
+    @constant kHashTypeIPv6 IPv6 addresses.
+    @constant kHashTypeTCPIPv6 IPv6 addresses and TCP ports.
+    @constant kHashTypeUDPIPv6 IPv6 addresses and UDP ports.
+*/
+
+    enum HashType
+    {
+        kHashTypeNone,
+        kHashTypeIPv4,
+        kHashTypeTCPIPv4,
+        kHashTypeUDPIPv4,
+        kHashTypeIPv6,
+        kHashTypeTCPIPv6,
+        kHashTypeUDPIPv6
+    };
+
+    IONetworkRSSHash()
+    {
+        bzero(this, sizeof(*this));
+    }
+
+/*! @function getDefaultKey
+    @abstract Returns the widely used default key, which NICs are often
+    programmed with.
+*/
+
+    static const UInt8 * getDefaultKey()
+    {
+        static const UInt8 key[kIONetworkRSSKeyLength] =
+        {
+            0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+            0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+            0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+            0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+            0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+        };
+
+        return key;
+    }
+
+/*! @function init
+    @abstract Builds the tables for a key.
+    @discussion Calling init() again rekeys the hash in the tables already
+    allocated; it must not race with hashing.
+    @param key kIONetworkRSSKeyLength bytes of key, or 0 for the default key.
+    @result Returns kIOReturnSuccess or kIOReturnNoMemory.
+*/
+
+    IOReturn init(const UInt8 * key = 0)
+    {
+        if (key == 0) key = getDefaultKey();
+
+        if (_table == 0)
+        {
+            _table = (UInt32 (*)[256]) IOMalloc(kIONetworkRSSMaxInput * sizeof(*_table));
+            if (_table == 0) return kIOReturnNoMemory;
+        }
+
+        for (UInt32 position = 0; position < kIONetworkRSSMaxInput; position++)
+        {
+            UInt32 windows[8];
+
+            // The key's 32 bits starting at each bit of this input byte.
+            for (UInt32 bit = 0; bit < 8; bit++)
+            {
+                windows[bit] = window(key, position * 8 + bit);
+            }
+            for (UInt32 value = 0; value < 256; value++)
+            {
+                UInt32 result = 0;
+
+                for (UInt32 bit = 0; bit < 8; bit++)
+                {
+                    if (value & (0x80 >> bit)) result ^= windows[bit];
+                }
+                _table[position][value] = result;
+            }
+        }
+
+#if defined(__x86_64__)
+        // The 64 key bits from each input byte position, bit reversed so the
+        // carry-less product lines up the way pclmulqdq computes it.
+        for (UInt32 position = 0; position < kIONetworkRSSMaxInput; position++)
+        {
+            UInt64 bits = 0;
+
+            for (UInt32 byte = position; byte < position + 8; byte++)
+            {
+                bits = (bits << 8) | ((byte < kIONetworkRSSKeyLength) ? key[byte] : 0);
+            }
+            _windows[position] = reverse64(bits);
+        }
+        _pclmul = (cpuid_features() & CPUID_FEATURE_PCLMULQDQ) != 0;
+#endif
+
+        return kIOReturnSuccess;
+    }
+
+/*! @function free
+    @abstract Frees the tables.
+*/
+
+    void free()
+    {
+        if (_table)
+        {
+            IOFree(_table, kIONetworkRSSMaxInput * sizeof(*_table));
+            _table = 0;
+        }
+    }
+
+/*! @function hash
+    @abstract Hashes input bytes placed at an offset of the hash input.
+    @discussion The hash of a whole input is the XOR of the hashes of its
+    pieces, so addresses and ports can be hashed where they lie in the
+    packet without being gathered.
+    @param input The bytes.
+    @param length Number of bytes; offset plus length is at most
+    kIONetworkRSSMaxInput.
+    @param offset Position of the bytes in the hash input.
+*/
+
+    UInt32 hash(const void * input, UInt32 length, UInt32 offset = 0) const
+    {
+        const UInt8 * bytes  = (const UInt8 *) input;
+        UInt32        result = 0;
+
+        for (UInt32 index = 0; index < length; index++)
+        {
+            result ^= _table[offset + index][bytes[index]];
+        }
+        return result;
+    }
+
+/*! @function hashBatch
+    @abstract Hashes several whole inputs.
+    @discussion Uses carry-less multiplication where available, between one
+    save and restore of the SSE state for the whole batch, and the tables
+    otherwise.  The hashes are the same either way.
+    @param inputs The inputs, each hashed from offset 0.
+    @param lengths Length of each input, at most kIONetworkRSSMaxInput.
+    @param hashes Receives the hash of each input.
+    @param count Number of inputs.
+*/
+
+    void hashBatch(const void * const * inputs, const UInt32 * lengths,
+                   UInt32 * hashes, UInt32 count) const
+    {
+#if defined(__x86_64__)
+        if (_pclmul)
+        {
+            simd_state_decl(SIMD_STATE_SIZE_SSE, state);
+            uint64_t saved = simd_state_save(&state, SIMD_STATE_SSE);
+
+            if (saved == SIMD_STATE_SSE)
+            {
+                hashPCLMUL(_windows, inputs, lengths, hashes, count);
+            }
+            simd_state_restore(&state, saved);
+            if (saved == SIMD_STATE_SSE) return;
+        }
+#endif
+        for (UInt32 index = 0; index < count; index++)
+        {
+            hashes[index] = hash(inputs[index], lengths[index]);
+        }
+    }
+
+/*! @function hashIPv4
+    @abstract Hashes IPv4 addresses, and ports if given.
+    @param addresses Source then destination address, as in the IPv4 header.
+    @param ports Source then destination port, as in the TCP or UDP header,
+    or 0 for a 2-tuple hash.
+*/
+
+    UInt32 hashIPv4(const void * addresses, const void * ports = 0) const
+    {
+        UInt32 result = hash(addresses, 8);
+
+        if (ports) result ^= hash(ports, 4, 8);
+        return result;
+    }
+
+/*! @function hashIPv6
+    @abstract Hashes IPv6 addresses, and ports if given.
+    @param addresses Source then destination address, as in the IPv6 header.
+    @param ports Source then destination port, or 0 for a 2-tuple hash.
+*/
+
+    UInt32 hashIPv6(const void * addresses, const void * ports = 0) const
+    {
+        UInt32 result = hash(addresses, 32);
+
+        if (ports) result ^= hash(ports, 4, 32);
+        return result;
+    }
+
+/*! @function hashPacket
+    @abstract Hashes an Ethernet frame the way RSS hardware does.
+    @discussion TCP and UDP packets that are not fragments are hashed on
+    their 4-tuple, other IP packets on their addresses.  IPv6 extension
+    headers are not followed, so such packets get a 2-tuple hash.  An IPv4
+    header length below 20 bytes makes the frame count as not IP.
+    @param packet The frame, starting at its Ethernet header.
+    @param type Receives what was hashed, if not 0.
+    @result Returns the hash, or 0 for a frame that is not IP.
+*/
+
+    UInt32 hashPacket(mbuf_t packet, HashType * type = 0) const
+    {
+        UInt8    header[18 + 60 + 4];
+        size_t   length = mbuf_pkthdr_len(packet);
+        UInt32   offset = 14;
+        UInt32   ethertype;
+        UInt8 *  ip;
+        HashType hashType = kHashTypeNone;
+        UInt32   result   = 0;
+
+        if (length > sizeof(header)) length = sizeof(header);
+        if (length >= 14 + 20 && mbuf_copydata(packet, 0, length, header) == 0)
+        {
+            ethertype = (header[12] << 8) | header[13];
+            if (ethertype == 0x8100)
+            {
+                offset    = 18;
+                ethertype = (header[16] << 8) | header[17];
+            }
+            ip = header + offset;
+
+            if (ethertype == 0x0800 && offset + 20 <= length && (ip[0] >> 4) == 4 &&
+                (ip[0] & 0x0F) >= 5)
+            {
+                UInt32 ipHeaderLength = (ip[0] & 0x0F) * 4;
+                bool   fragment       = (((ip[6] << 8) | ip[7]) & 0x3FFF) != 0;
+
+                hashType = kHashTypeIPv4;
+                if ((ip[9] == 6 || ip[9] == 17) && fragment == false &&
+                    offset + ipHeaderLength + 4 <= length)
+                {
+                    hashType = (ip[9] == 6) ? kHashTypeTCPIPv4 : kHashTypeUDPIPv4;
+                    result   = hashIPv4(ip + 12, ip + ipHeaderLength);
+                }
+                else
+                {
+                    result = hashIPv4(ip + 12);
+                }
+            }
+            else if (ethertype == 0x86DD && offset + 40 <= length && (ip[0] >> 4) == 6)
+            {
+                hashType = kHashTypeIPv6;
+                if ((ip[6] == 6 || ip[6] == 17) && offset + 40 + 4 <= length)
+                {
+                    hashType = (ip[6] == 6) ? kHashTypeTCPIPv6 : kHashTypeUDPIPv6;
+                    result   = hashIPv6(ip + 8, ip + 40);
+                }
+                else
+                {
+                    result = hashIPv6(ip + 8);
+                }
+            }
+        }
+
+        if (type) *type = hashType;
+        return result;
+    }
+
+/*! @function hashReference
+    @abstract Computes the hash bit by bit, as the Toeplitz definition
+    states, for checking tables or hardware.
+*/
+
+    static UInt32 hashReference(const UInt8 * key, const void * input, UInt32 length)
+    {
+        const UInt8 * bytes  = (const UInt8 *) input;
+        UInt32        result = 0;
+
+        for (UInt32 bit = 0; bit < length * 8; bit++)
+        {
+            if (bytes[bit / 8] & (0x80 >> (bit % 8))) result ^= window(key, bit);
+        }
+        return result;
+    }
+
+protected:
+
+    // The 32 key bits starting at bit, most significant first.
+    static UInt32 window(const UInt8 * key, UInt32 bit)
+    {
+        UInt32 byte   = bit / 8;
+        UInt32 shift  = bit % 8;
+        UInt64 value  = ((UInt64) key[byte] << 32) | ((UInt64) key[byte + 1] << 24) |
+                        ((UInt64) key[byte + 2] << 16) | ((UInt64) key[byte + 3] << 8);
+
+        if (byte + 4 < kIONetworkRSSKeyLength) value |= key[byte + 4];
+        return (UInt32) (value >> (8 - shift));
+    }
+
+    static UInt32 reverse32(UInt32 value)
+    {
+        value = ((value >> 1) & 0x55555555) | ((value & 0x55555555) << 1);
+        value = ((value >> 2) & 0x33333333) | ((value & 0x33333333) << 2);
+        value = ((value >> 4) & 0x0F0F0F0F) | ((value & 0x0F0F0F0F) << 4);
+        return OSSwapInt32(value);
+    }
+
+    static UInt64 reverse64(UInt64 value)
+    {
+        return ((UInt64) reverse32((UInt32) value) << 32) | reverse32((UInt32) (value >> 32));
+    }
+
+#if defined(__x86_64__)
+    typedef long long PCLMULVector __attribute__((vector_size(16)));
+
+    // With the input bits x and the reversed key bits k of a 4-byte chunk,
+    // the product x * k holds the chunk's share of the hash, bit reversed,
+    // in bits 31 to 62; shares add up by XOR, so only the sum is reversed.
+    // Must run with the SSE state saved.
+    static __attribute__((noinline, target("pclmul"))) void
+    hashPCLMUL(const UInt64 * windows, const void * const * inputs, const UInt32 * lengths,
+               UInt32 * hashes, UInt32 count)
+    {
+        for (UInt32 index = 0; index < count; index++)
+        {
+            const UInt8 * bytes  = (const UInt8 *) inputs[index];
+            UInt32        length = lengths[index];
+            PCLMULVector  sum    = { 0, 0 };
+
+            for (UInt32 offset = 0; offset < length; offset += 4)
+            {
+                UInt32 chunk = 0;
+
+                if (offset + 4 <= length)
+                {
+                    chunk = OSReadBigInt32(bytes, offset);
+                }
+                else
+                {
+                    for (UInt32 byte = offset; byte < length; byte++)
+                    {
+                        chunk |= (UInt32) bytes[byte] << (24 - 8 * (byte - offset));
+                    }
+                }
+
+                PCLMULVector x = { (long long) chunk, 0 };
+                PCLMULVector k = { (long long) windows[offset], 0 };
+
+                sum ^= __builtin_ia32_pclmulqdq128(x, k, 0x00);
+            }
+            hashes[index] = reverse32((UInt32) ((UInt64) sum[0] >> 31));
+        }
+    }
+
+    UInt64 _windows[kIONetworkRSSMaxInput];
+    bool   _pclmul;
+#endif
+
+    UInt32 (*_table)[256];
+};
+
+/*! @class IONetworkRSSTable
+    @abstract Maps hashes to receive queues through an indirection table,
+    and rebalances it as load shifts.
+    @discussion The low bits of a hash select an entry, and the entry
+    names a queue, as in the indirection table of an RSS NIC.  getQueue()
+    counts the packets that use each entry; rebalance() then moves the
+    entries carrying the most load off the busiest queues.  A driver with
+    hardware RSS copies the result to the NIC with getEntries().  Entries
+    are moved as a whole, so packets of a flow still reach one queue, but
+    a moved flow may see one reordering as it changes queue.
+*/
+
+class IONetworkRSSTable
+{
+public:
+
+    IONetworkRSSTable()
+    {
+        bzero(this, sizeof(*this));
+    }
+
+/*! @function init
+    @abstract Allocates the table and spreads entries over the queues.
+    @discussion Calling init() again replaces the table; it must not race
+    with lookups.
+    @param queueCount Number of receive queues, up to 256.
+    @param entryCount Number of entries, a power of 2 up to 4096; 128 is
+    common in hardware.
+    @result Returns kIOReturnSuccess, kIOReturnBadArgument or
+    kIOReturnNoMemory.
+*/
+
+    IOReturn init(UInt32 queueCount, UInt32 entryCount = 128)
+    {
+        if (queueCount == 0 || queueCount > 256 || entryCount == 0 ||
+            entryCount > 4096 || (entryCount & (entryCount - 1)))
+            return kIOReturnBadArgument;
+
+        free();
+
+        _entryCount = entryCount;
+        _entries    = (UInt8 *) IOMalloc(entryCount);
+        _load       = (UInt32 *) IOMalloc(entryCount * sizeof(UInt32));
+        if (_entries == 0 || _load == 0)
+        {
+            free();
+            return kIOReturnNoMemory;
+        }
+        setQueueCount(queueCount);
+
+        return kIOReturnSuccess;
+    }
+
+/*! @function free
+    @abstract Frees the table.
+*/
+
+    void free()
+    {
+        if (_entries) IOFree(_entries, _entryCount);
+        if (_load) IOFree(_load, _entryCount * sizeof(UInt32));
+        _entries = 0;
+        _load    = 0;
+    }
+
+/*! @function setQueueCount
+    @abstract Spreads entries evenly over a new number of queues and
+    forgets the load counted so far.
+*/
+
+    void setQueueCount(UInt32 queueCount)
+    {
+        if (queueCount == 0 || queueCount > 256) return;
+
+        _queueCount = queueCount;
+        for (UInt32 index = 0; index < _entryCount; index++)
+        {
+            _entries[index] = (UInt8) (index % queueCount);
+        }
+        bzero(_load, _entryCount * sizeof(UInt32));
+    }
+
+/*! @function getQueue
+    @abstract Returns the queue of a hash and counts the packet against
+    its entry.  Calls must be serialized.
+*/
+
+    UInt32 getQueue(UInt32 hash)
+    {
+        UInt32 index = hash & (_entryCount - 1);
+
+        _load[index]++;
+        return _entries[index];
+    }
+
+/*! @function rebalance
+    @abstract Moves entries from the busiest to the idlest queues.
+    @discussion Each step moves the entry of the busiest queue whose load
+    best evens it with the idlest queue, and stops when no move lowers the
+    busiest queue's load.  The counts are then halved so recent load
+    weighs most.  Must be serialized with getQueue().
+    @result Returns the number of entries moved.
+*/
+
+    UInt32 rebalance()
+    {
+        UInt64 queueLoad[256];
+        UInt32 moved = 0;
+
+        bzero(queueLoad, sizeof(queueLoad));
+        for (UInt32 index = 0; index < _entryCount; index++)
+        {
+            queueLoad[_entries[index]] += _load[index];
+        }
+
+        for (UInt32 step = 0; step < _entryCount; step++)
+        {
+            UInt32 busiest = 0;
+            UInt32 idlest  = 0;
+            UInt32 best    = _entryCount;
+            UInt64 gap;
+
+            for (UInt32 queue = 1; queue < _queueCount; queue++)
+            {
+                if (queueLoad[queue] > queueLoad[busiest]) busiest = queue;
+                if (queueLoad[queue] < queueLoad[idlest]) idlest = queue;
+            }
+            gap = queueLoad[busiest] - queueLoad[idlest];
+
+            // Moving load l leaves the pair at most max(busiest - l,
+            // idlest + l), an improvement only while l < gap; closest to
+            // gap / 2 evens them best.
+            for (UInt32 index = 0; index < _entryCount; index++)
+            {
+                UInt64 load = _load[index];
+
+                if (_entries[index] != busiest || load == 0 || load >= gap) continue;
+                if (best == _entryCount ||
+                    distance(load, gap / 2) < distance(_load[best], gap / 2))
+                    best = index;
+            }
+            if (best == _entryCount) break;
+
+            queueLoad[busiest] -= _load[best];
+            queueLoad[idlest]  += _load[best];
+            _entries[best]      = (UInt8) idlest;
+            moved++;
+        }
+
+        for (UInt32 index = 0; index < _entryCount; index++)
+        {
+            _load[index] /= 2;
+        }
+
+        return moved;
+    }
+
+/*! @function getEntries
+    @abstract Copies the queue of every entry, for programming a NIC.
+    @result Returns the number of entries.
+*/
+
+    UInt32 getEntries(UInt8 * entries, UInt32 maxCount) const
+    {
+        UInt32 count = (maxCount < _entryCount) ? maxCount : _entryCount;
+
+        if (entries) bcopy(_entries, entries, count);
+        return _entryCount;
+    }
+
+    UInt32 getQueueCount() const
+    {
+        return _queueCount;
+    }
+
+protected:
+
+    static UInt64 distance(UInt64 a, UInt64 b)
+    {
+        return (a > b) ? a - b : b - a;
+    }
+
+    UInt8 *  _entries;
+    UInt32 * _load;
+    UInt32   _entryCount;
+    UInt32   _queueCount;
+};
+
+/*! @typedef IONetworkRPSAction
+    @abstract Delivers packets steered to one queue.
+    @discussion Called on the queue's own thread, concurrently with the
+    actions of other queues, with a list linked through mbuf_nextpkt().
+    It may pass the list to ifnet_input(), which accepts calls from many
+    threads; IONetworkInterface::inputPacket() does not.
+    @param target The target given to IONetworkRPS::init().
+    @param queue Index of the queue.
+    @param packets First packet of the list.
+    @param count Number of packets.
+*/
+
+typedef void (*IONetworkRPSAction)(OSObject * target, UInt32 queue,
+                                   mbuf_t packets, UInt32 count);
+
+/*! @class IONetworkRPS
+    @abstract Spreads received packets over threads in software, for
+    controllers with a single receive queue.
+    @discussion steer() hashes each packet with an IONetworkRSSHash, picks
+    a queue through an IONetworkRSSTable and batches the packet for that
+    queue.  flush(), at the end of the driver's receive pass, hands each
+    batch to its queue and wakes the queue's thread call, which runs the
+    action.  Thread calls of the same priority run in parallel, so the
+    scheduler spreads the queues' stack processing over the CPUs; packets
+    of one flow stay on one queue, in order.
+    <br>
+    steer() and flush() must be serialized, as for the interface's input
+    queue.  A queue holding maxBacklog packets drops further packets.
+*/
+
+class IONetworkRPS
+{
+public:
+
+/*! @enum Statistics
+    @abstract Indices of the statistics reported by getStatistics().
+    @constant kStatisticsPackets Packets passed to steer().
+    @constant kStatisticsDelivered Packets passed to the action.
+    @constant kStatisticsDropped Packets dropped on a full queue.
+    @constant kStatisticsWakeups Thread calls entered.
+*/
+
+    enum Statistics
+    {
+        kStatisticsPackets,
+        kStatisticsDelivered,
+        kStatisticsDropped,
+        kStatisticsWakeups
+    };
+
+    static const UInt32 kStatisticsCount = kStatisticsWakeups + 1;
+
+    IONetworkRPS()
+    {
+        bzero(this, sizeof(*this));
+    }
+
+/*! @function init
+    @abstract Allocates a queue and thread call for each queue of table.
+    @param hash Hash the packets are steered by; it must outlive the RPS.
+    @param table Indirection table, whose queue count sets the number of
+    queues; it must outlive the RPS and keep its queue count.
+    @param target Passed to action.
+    @param action Called with each queue's packets.
+    @param maxBacklog Most packets held by one queue.
+    @result Returns kIOReturnSuccess, kIOReturnBadArgument,
+    kIOReturnNoMemory, or kIOReturnBusy if the RPS is already initialized.
+*/
+
+    IOReturn init(const IONetworkRSSHash * hash, IONetworkRSSTable * table,
+                  OSObject * target, IONetworkRPSAction action,
+                  UInt32 maxBacklog = 1024)
+    {
+        UInt32 queueCount;
+
+        if (hash == 0 || table == 0 || action == 0 || maxBacklog == 0)
+            return kIOReturnBadArgument;
+        if (_queues) return kIOReturnBusy;
+
+        queueCount = table->getQueueCount();
+        _queues = (Queue *) IOMalloc(queueCount * sizeof(Queue));
+        if (_queues == 0) return kIOReturnNoMemory;
+        bzero(_queues, queueCount * sizeof(Queue));
+        _queueCount = queueCount;
+
+        for (UInt32 index = 0; index < queueCount; index++)
+        {
+            Queue * queue = &_queues[index];
+
+            queue->owner = this;
+            queue->index = index;
+            queue->lock  = IOSimpleLockAlloc();
+            queue->call  = thread_call_allocate_with_priority(&IONetworkRPS::drain, queue,
+                                                              THREAD_CALL_PRIORITY_KERNEL_HIGH);
+            if (queue->lock == 0 || queue->call == 0)
+            {
+                free();
+                return kIOReturnNoMemory;
+            }
+        }
+
+        _hash       = hash;
+        _table      = table;
+        _target     = target;
+        _action     = action;
+        _maxBacklog = maxBacklog;
+
+        return kIOReturnSuccess;
+    }
+
+/*! @function free
+    @abstract Waits for running actions and frees queued packets.
+*/
+
+    void free()
+    {
+        if (_queues == 0) return;
+
+        for (UInt32 index = 0; index < _queueCount; index++)
+        {
+            Queue * queue = &_queues[index];
+
+            if (queue->call)
+            {
+                thread_call_cancel_wait(queue->call);
+                thread_call_free(queue->call);
+            }
+            if (queue->lock) IOSimpleLockFree(queue->lock);
+            if (queue->head) mbuf_freem_list(queue->head);
+            if (queue->batchHead) mbuf_freem_list(queue->batchHead);
+        }
+        _statistics[kStatisticsDelivered] += delivered();
+        IOFree(_queues, _queueCount * sizeof(Queue));
+        _queues     = 0;
+        _queueCount = 0;
+    }
+
+/*! @function steer
+    @abstract Batches a received frame for the queue its hash selects.
+*/
+
+    void steer(mbuf_t packet)
+    {
+        Queue * queue = &_queues[_table->getQueue(_hash->hashPacket(packet))];
+
+        _statistics[kStatisticsPackets]++;
+
+        mbuf_setnextpkt(packet, 0);
+        if (queue->batchTail) mbuf_setnextpkt(queue->batchTail, packet);
+        else queue->batchHead = packet;
+        queue->batchTail = packet;
+        queue->batchCount++;
+    }
+
+/*! @function flush
+    @abstract Hands every batch to its queue and wakes the queues that
+    have work.
+*/
+
+    void flush()
+    {
+        for (UInt32 index = 0; index < _queueCount; index++)
+        {
+            Queue *          queue = &_queues[index];
+            mbuf_t           drop  = 0;
+            bool             wake  = false;
+            IOInterruptState state;
+
+            if (queue->batchHead == 0) continue;
+
+            state = IOSimpleLockLockDisableInterrupt(queue->lock);
+            if (queue->count + queue->batchCount > _maxBacklog)
+            {
+                drop = queue->batchHead;
+            }
+            else
+            {
+                if (queue->tail) mbuf_setnextpkt(queue->tail, queue->batchHead);
+                else queue->head = queue->batchHead;
+                queue->tail   = queue->batchTail;
+                queue->count += queue->batchCount;
+                wake = (queue->scheduled == false);
+                queue->scheduled = true;
+            }
+            IOSimpleLockUnlockEnableInterrupt(queue->lock, state);
+
+            if (drop)
+            {
+                _statistics[kStatisticsDropped] += queue->batchCount;
+                mbuf_freem_list(drop);
+            }
+            if (wake)
+            {
+                _statistics[kStatisticsWakeups]++;
+                thread_call_enter(queue->call);
+            }
+
+            queue->batchHead  = 0;
+            queue->batchTail  = 0;
+            queue->batchCount = 0;
+        }
+    }
+
+/*! @function getStatistics
+    @abstract Reports the RPS statistics, indexed by Statistics.
+    @param statistics Buffer that will receive the UInt64 statistic values.
+    @param statisticsMaxCount Maximum number of values the buffer can hold.
+    @result Returns the number of values copied, or if no buffer is given,
+    the number of values available.
+*/
+
+    UInt32 getStatistics(UInt64 * statistics, UInt32 statisticsMaxCount) const
+    {
+        UInt32 count = (statisticsMaxCount < kStatisticsCount) ? statisticsMaxCount : kStatisticsCount;
+
+        if (statistics == 0 || statisticsMaxCount == 0) return kStatisticsCount;
+
+        for (UInt32 index = 0; index < count; index++)
+        {
+            statistics[index] = _statistics[index];
+            if (index == kStatisticsDelivered) statistics[index] += delivered();
+        }
+
+        return count;
+    }
+
+protected:
+
+    struct Queue
+    {
+        IONetworkRPS *   owner;
+        UInt32           index;
+        IOSimpleLock *   lock;
+        thread_call_t    call;
+        mbuf_t           head;          // handed over, under lock
+        mbuf_t           tail;
+        UInt32           count;
+        bool             scheduled;
+        mbuf_t           batchHead;     // being built by steer()
+        mbuf_t           batchTail;
+        UInt32           batchCount;
+        volatile UInt64  delivered;
+    };
+
+    UInt64 delivered() const
+    {
+        UInt64 total = 0;
+
+        for (UInt32 index = 0; index < _queueCount; index++)
+        {
+            total += _queues[index].delivered;
+        }
+        return total;
+    }
+
+    // Runs on the queue's thread call until the queue is empty.
+    static void drain(thread_call_param_t param0, thread_call_param_t param1)
+    {
+        Queue *          queue = (Queue *) param0;
+        IONetworkRPS *   self  = queue->owner;
+        IOInterruptState state;
+
+        (void) param1;
+
+        for (;;)
+        {
+            mbuf_t packets;
+            UInt32 count;
+
+            state   = IOSimpleLockLockDisableInterrupt(queue->lock);
+            packets = queue->head;
+            count   = queue->count;
+            queue->head  = 0;
+            queue->tail  = 0;
+            queue->count = 0;
+            if (packets == 0) queue->scheduled = false;
+            IOSimpleLockUnlockEnableInterrupt(queue->lock, state);
+
+            if (packets == 0) break;
+
+            self->_action(self->_target, queue->index, packets, count);
+            queue->delivered += count;
+        }
+    }
+
+    const IONetworkRSSHash * _hash;
+    IONetworkRSSTable *      _table;
+    OSObject *               _target;
+    IONetworkRPSAction       _action;
+    Queue *                  _queues;
+    UInt32                   _queueCount;
+    UInt32                   _maxBacklog;
+    UInt64                   _statistics[kStatisticsCount];
+};
+
+#endif /* !_IONETWORKRSS_H */
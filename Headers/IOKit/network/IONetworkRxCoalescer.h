@@ -0,0 +1,604 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IONETWORKRXCOALESCER_H
+#define _IONETWORKRXCOALESCER_H
+
+#include <IOKit/IOLib.h>
+#include <IOKit/network/IONetworkInterface.h>
+#include <libkern/OSByteOrder.h>
+extern "C" {
+#include <sys/kpi_mbuf.h>
+}
+
+/*! @defined kIONetworkRxCoalescerDefaultFlows
+    @abstract Default number of TCP flows held at once. */
+
+#define kIONetworkRxCoalescerDefaultFlows       8
+
+/*! @defined kIONetworkRxCoalescerMaxSegments
+    @abstract Most segments merged into one packet. */
+
+#define kIONetworkRxCoalescerMaxSegments        64
+
+/*! @class IONetworkRxCoalescer
+    @abstract Merges received TCP segments of the same flow into large
+    packets before they reach the network stack.
+    @discussion A driver normally queues every received frame with
+    IONetworkInterface::inputPacket() and kInputOptionQueuePacket, then
+    calls flushInputQueue(), so the stack runs once per TCP segment.  A
+    driver using an IONetworkRxCoalescer calls its inputPacket() and
+    flushInputQueue() instead.  In-order data segments of a TCP/IPv4 or
+    TCP/IPv6 flow whose checksums the hardware verified are held and
+    chained, headers stripped, behind the flow's first segment; the result
+    is one Ethernet frame of up to 64KB carrying the first segment's
+    headers, with the lengths of the merged packet and the PSH flag of the
+    last segment.  Every other frame is queued to the interface unchanged.
+    <br>
+    A flow is delivered when it reaches the size or segment limit, when a
+    segment cannot extend it (out of order, short, different ACK, window or
+    options, or a flag other than ACK and PSH), when a segment has PSH set,
+    when it has been held longer than the timeout, and at the latest on
+    flushInputQueue().  Segments of a flow are never reordered.
+    <br>
+    Only frames of Ethernet, IPv4 without options or fragments, and IPv6
+    without extension headers are merged.  The merged packet's TCP checksum
+    field is left as received; the packet is marked as verified, which is
+    what the stack relies on.
+    <br>
+    Calls must be serialized, as for the interface's input queue.
+*/
+
+class IONetworkRxCoalescer
+{
+public:
+
+/*! @enum Statistics
+    @abstract Indices of the statistics reported by getStatistics().
+    @constant kStatisticsPackets Frames passed to inputPacket().
+    @constant kStatisticsBypassed Frames queued without being held.
+    @constant kStatisticsMerged Segments merged into a held packet.
+    @constant kStatisticsDelivered Packets queued to the interface.
+    @constant kStatisticsTimeouts Flows delivered for being held too long.
+    @constant kStatisticsEvictions Flows delivered to make room for another.
+*/
+
+    enum Statistics
+    {
+        kStatisticsPackets,
+        kStatisticsBypassed,
+        kStatisticsMerged,
+        kStatisticsDelivered,
+        kStatisticsTimeouts,
+        kStatisticsEvictions
+    };
+
+    static const UInt32 kStatisticsCount = kStatisticsEvictions + 1;
+
+    IONetworkRxCoalescer()
+    {
+        bzero(this, sizeof(*this));
+    }
+
+/*! @function init
+    @abstract Prepares the coalescer for an interface.
+    @param interface Interface the packets are queued to.  It is not
+    retained.
+    @param flowCount Most flows held at once, up to 64.
+    @param timeoutUS Longest time a flow is held, in microseconds.  Zero
+    holds flows only until flushInputQueue().
+    @result Returns kIOReturnSuccess, kIOReturnBadArgument or
+    kIOReturnNoMemory.
+*/
+
+    IOReturn init(IONetworkInterface * interface,
+                  UInt32 flowCount = kIONetworkRxCoalescerDefaultFlows,
+                  UInt32 timeoutUS = 0)
+    {
+        if (interface == 0 || flowCount == 0 || flowCount > 64)
+            return kIOReturnBadArgument;
+
+        _flows = (Flow *) IOMalloc(flowCount * sizeof(Flow));
+        if (_flows == 0) return kIOReturnNoMemory;
+        bzero(_flows, flowCount * sizeof(Flow));
+
+        _interface = interface;
+        _flowCount = flowCount;
+        if (timeoutUS)
+            clock_interval_to_absolutetime_interval(timeoutUS, kMicrosecondScale, &_timeout);
+
+        return kIOReturnSuccess;
+    }
+
+/*! @function free
+    @abstract Frees held packets and the flow table.
+*/
+
+    void free()
+    {
+        if (_flows)
+        {
+            for (UInt32 index = 0; index < _flowCount; index++)
+            {
+                if (_flows[index].head) mbuf_freem(_flows[index].head);
+            }
+            IOFree(_flows, _flowCount * sizeof(Flow));
+            _flows = 0;
+        }
+    }
+
+/*! @function inputPacket
+    @abstract Holds a received frame for merging, or queues it to the
+    interface.
+    @param packet The mbuf containing the received Ethernet frame.
+    @param length Size of the frame; if zero the mbuf length fields are
+    already set.
+    @param checksumFlags Checksum operations the hardware performed, as
+    given to mbuf_set_csum_performed().  Only segments with
+    MBUF_CSUM_DID_DATA and MBUF_CSUM_PSEUDO_HDR, and for IPv4 also
+    MBUF_CSUM_DID_IP and MBUF_CSUM_IP_GOOD, are merged.
+    @param checksumValue Checksum value reported with MBUF_CSUM_DID_DATA,
+    0xFFFF for a verified segment.
+*/
+
+    void inputPacket(mbuf_t packet, UInt32 length = 0,
+                     UInt32 checksumFlags = 0, UInt32 checksumValue = 0)
+    {
+        Segment segment;
+        Flow *  flow;
+
+        _statistics[kStatisticsPackets]++;
+
+        if (length)
+        {
+            mbuf_setlen(packet, length);
+            mbuf_pkthdr_setlen(packet, length);
+        }
+        if (checksumFlags)
+            mbuf_set_csum_performed(packet, checksumFlags, checksumValue);
+
+        if (parse(packet, checksumFlags, checksumValue, &segment) == false)
+        {
+            // A segment that cannot be merged still follows what is held
+            // of its flow.
+            if (segment.tcp && (flow = lookup(&segment))) deliver(flow);
+            bypass(packet);
+            return;
+        }
+
+        flow = lookup(&segment);
+        if (flow && append(flow, packet, &segment) == false)
+        {
+            deliver(flow);
+            flow = 0;
+        }
+
+        if (flow == 0)
+        {
+            flow = allocate();
+            start(flow, packet, &segment);
+        }
+
+        if (flow->segments >= kIONetworkRxCoalescerMaxSegments ||
+            flow->ipLength + flow->segmentSize > 0xFFFF ||
+            (flow->flags & kTCPFlagPush) || segment.payload < flow->segmentSize)
+        {
+            deliver(flow);
+        }
+        else if (_timeout && flow->segments > 1 && expired(flow, now()))
+        {
+            _statistics[kStatisticsTimeouts]++;
+            deliver(flow);
+        }
+    }
+
+/*! @function flushInputQueue
+    @abstract Queues held flows to the interface and flushes its input
+    queue to the stack.
+    @param expiredOnly Pass true to keep holding flows younger than the
+    timeout; the driver must then call again, for instance from a timer,
+    for them to be delivered.  Ignored without a timeout.
+    @result Returns the number of packets submitted to the stack.
+*/
+
+    UInt32 flushInputQueue(bool expiredOnly = false)
+    {
+        UInt64 current = (_timeout && expiredOnly) ? now() : 0;
+
+        for (UInt32 index = 0; index < _flowCount; index++)
+        {
+            Flow * flow = &_flows[index];
+
+            if (flow->head == 0) continue;
+            if (current)
+            {
+                if (expired(flow, current) == false) continue;
+                _statistics[kStatisticsTimeouts]++;
+            }
+            deliver(flow);
+        }
+
+        return _interface->flushInputQueue();
+    }
+
+/*! @function getHeldCount
+    @abstract Returns the number of flows being held.
+*/
+
+    UInt32 getHeldCount() const
+    {
+        UInt32 count = 0;
+
+        for (UInt32 index = 0; index < _flowCount; index++)
+        {
+            if (_flows[index].head) count++;
+        }
+        return count;
+    }
+
+/*! @function getStatistics
+    @abstract Reports the coalescer statistics, indexed by Statistics.
+    @param statistics Buffer that will receive the UInt64 statistic values.
+    @param statisticsMaxCount Maximum number of values the buffer can hold.
+    @result Returns the number of values copied, or if no buffer is given,
+    the number of values available.
+*/
+
+    UInt32 getStatistics(UInt64 * statistics, UInt32 statisticsMaxCount) const
+    {
+        UInt32 count = (statisticsMaxCount < kStatisticsCount) ? statisticsMaxCount : kStatisticsCount;
+
+        if (statistics == 0 || statisticsMaxCount == 0) return kStatisticsCount;
+
+        for (UInt32 index = 0; index < count; index++)
+        {
+            statistics[index] = _statistics[index];
+        }
+
+        return count;
+    }
+
+protected:
+
+    enum
+    {
+        kEthernetHeaderLength = 14,
+        kIPv6HeaderLength     = 40,
+        kTCPFlagPush          = 0x08,
+        kTCPFlagAck           = 0x10
+    };
+
+    // Where the headers of a received frame sit, all in its first mbuf.
+    struct Segment
+    {
+        UInt8 * frame;
+        UInt8 * tcp;        // 0 if the frame is not TCP
+        UInt32  hash;
+        UInt32  seq;
+        UInt32  payload;
+        UInt16  headerLength;
+        UInt16  vlan;
+        bool    ipv6;
+        bool    tagged;
+    };
+
+    struct Flow
+    {
+        mbuf_t  head;       // first segment, carrying the headers
+        mbuf_t  last;       // last mbuf of the chain
+        UInt64  started;
+        UInt64  sequence;   // order of start(), for eviction without a timeout
+        UInt32  hash;
+        UInt32  nextSeq;
+        UInt32  ipLength;   // IPv4 total length, or IPv6 header plus payload
+        UInt32  segmentSize;
+        UInt16  segments;
+        UInt16  headerLength;
+        UInt16  vlan;
+        UInt8   flags;
+        bool    ipv6;
+        bool    tagged;
+    };
+
+    static UInt64 now()
+    {
+        UInt64 time;
+
+        clock_get_uptime(&time);
+        return time;
+    }
+
+    bool expired(const Flow * flow, UInt64 current) const
+    {
+        return (current - flow->started) >= _timeout;
+    }
+
+    static UInt16 read16(const UInt8 * bytes)
+    {
+        return (UInt16) ((bytes[0] << 8) | bytes[1]);
+    }
+
+    static UInt32 read32(const UInt8 * bytes)
+    {
+        return OSReadBigInt32(bytes, 0);
+    }
+
+    static void write16(UInt8 * bytes, UInt32 value)
+    {
+        bytes[0] = (UInt8) (value >> 8);
+        bytes[1] = (UInt8) value;
+    }
+
+    // Fills in segment and returns whether the frame may be merged; for a
+    // TCP frame that may not, segment->tcp is still set.
+    static bool parse(mbuf_t packet, UInt32 checksumFlags, UInt32 checksumValue,
+                      Segment * segment)
+    {
+        UInt8 * frame  = (UInt8 *) mbuf_data(packet);
+        size_t  length = mbuf_len(packet);
+        UInt8 * ip     = frame + kEthernetHeaderLength;
+        UInt32  ipHeaderLength;
+        UInt32  ipLength;
+        UInt32  tcpHeaderLength;
+        UInt32  verified = MBUF_CSUM_DID_DATA | MBUF_CSUM_PSEUDO_HDR;
+        UInt8 * tcp;
+
+        bzero(segment, sizeof(*segment));
+
+        if (length < kEthernetHeaderLength + 20) return false;
+
+        switch (read16(frame + 12))
+        {
+            case 0x0800:
+                if (ip[0] != 0x45 || ip[9] != 6 || (read16(ip + 6) & 0x3FFF))
+                    return false;
+                ipHeaderLength = 20;
+                ipLength       = read16(ip + 2);
+                verified      |= MBUF_CSUM_DID_IP | MBUF_CSUM_IP_GOOD;
+                segment->hash  = read32(ip + 12) ^ read32(ip + 16);
+                break;
+
+            case 0x86DD:
+                if (length < kEthernetHeaderLength + kIPv6HeaderLength ||
+                    (ip[0] >> 4) != 6 || ip[6] != 6)
+                    return false;
+                ipHeaderLength = kIPv6HeaderLength;
+                ipLength       = kIPv6HeaderLength + read16(ip + 4);
+                segment->ipv6  = true;
+                segment->hash  = read32(ip + 20) ^ read32(ip + 36);
+                break;
+
+            default:
+                return false;
+        }
+
+        tcp = ip + ipHeaderLength;
+        if (length < kEthernetHeaderLength + ipHeaderLength + 20) return false;
+        tcpHeaderLength = (tcp[12] >> 4) * 4;
+        if (tcpHeaderLength < 20 ||
+            length < kEthernetHeaderLength + ipHeaderLength + tcpHeaderLength)
+            return false;
+
+        segment->frame        = frame;
+        segment->tcp          = tcp;
+        segment->hash        ^= read32(tcp);
+        segment->headerLength = (UInt16) (kEthernetHeaderLength + ipHeaderLength + tcpHeaderLength);
+        segment->seq          = read32(tcp + 4);
+        segment->tagged       = (mbuf_get_vlan_tag(packet, &segment->vlan) == 0);
+
+        // Padded or truncated frames, and frames with nothing to merge.
+        if (mbuf_pkthdr_len(packet) != kEthernetHeaderLength + ipLength ||
+            ipLength <= ipHeaderLength + tcpHeaderLength)
+            return false;
+        segment->payload = ipLength - ipHeaderLength - tcpHeaderLength;
+
+        if ((tcp[13] & ~kTCPFlagPush) != kTCPFlagAck) return false;
+        if ((checksumFlags & verified) != verified || checksumValue != 0xFFFF)
+            return false;
+
+        return true;
+    }
+
+    Flow * lookup(const Segment * segment) const
+    {
+        for (UInt32 index = 0; index < _flowCount; index++)
+        {
+            Flow *        flow = &_flows[index];
+            const UInt8 * frame;
+            const UInt8 * ip;
+
+            if (flow->head == 0 || flow->hash != segment->hash || flow->ipv6 != segment->ipv6)
+                continue;
+
+            frame = (const UInt8 *) mbuf_data(flow->head);
+            ip    = frame + kEthernetHeaderLength;
+
+            // Addresses, then ports.
+            if (flow->ipv6 ? bcmp(ip + 8, segment->frame + kEthernetHeaderLength + 8, 32) :
+                             bcmp(ip + 12, segment->frame + kEthernetHeaderLength + 12, 8))
+                continue;
+            if (bcmp(frame + flow->headerLength - headerTCPLength(flow), segment->tcp, 4))
+                continue;
+
+            return flow;
+        }
+        return 0;
+    }
+
+    static UInt32 headerTCPLength(const Flow * flow)
+    {
+        return flow->headerLength - kEthernetHeaderLength -
+               (flow->ipv6 ? kIPv6HeaderLength : 20);
+    }
+
+    // Oldest flow is delivered when the table is full.
+    Flow * allocate()
+    {
+        Flow * oldest = 0;
+
+        for (UInt32 index = 0; index < _flowCount; index++)
+        {
+            Flow * flow = &_flows[index];
+
+            if (flow->head == 0) return flow;
+            if (oldest == 0 || flow->sequence < oldest->sequence) oldest = flow;
+        }
+
+        _statistics[kStatisticsEvictions]++;
+        deliver(oldest);
+        return oldest;
+    }
+
+    void start(Flow * flow, mbuf_t packet, const Segment * segment)
+    {
+        mbuf_t last = packet;
+
+        while (mbuf_next(last)) last = mbuf_next(last);
+
+        flow->head         = packet;
+        flow->last         = last;
+        flow->started      = _timeout ? now() : 0;
+        flow->sequence     = ++_sequence;
+        flow->hash         = segment->hash;
+        flow->nextSeq      = segment->seq + segment->payload;
+        flow->ipLength     = mbuf_pkthdr_len(packet) - kEthernetHeaderLength;
+        flow->segmentSize  = segment->payload;
+        flow->segments     = 1;
+        flow->headerLength = segment->headerLength;
+        flow->vlan         = segment->vlan;
+        flow->flags        = segment->tcp[13];
+        flow->ipv6         = segment->ipv6;
+        flow->tagged       = segment->tagged;
+    }
+
+    // Chains the segment's payload behind the flow, or returns false if it
+    // does not continue the flow.
+    bool append(Flow * flow, mbuf_t packet, const Segment * segment)
+    {
+        const UInt8 * frame = (const UInt8 *) mbuf_data(flow->head);
+        const UInt8 * ip    = frame + kEthernetHeaderLength;
+        const UInt8 * tcp   = frame + flow->headerLength - headerTCPLength(flow);
+        const UInt8 * sip   = segment->frame + kEthernetHeaderLength;
+        UInt32        tcpHeaderLength = headerTCPLength(flow);
+        mbuf_t        last;
+
+        if (segment->seq != flow->nextSeq ||
+            segment->headerLength != flow->headerLength ||
+            segment->payload > flow->segmentSize ||
+            flow->ipLength + segment->payload > 0xFFFF ||
+            segment->tagged != flow->tagged || segment->vlan != flow->vlan)
+            return false;
+
+        // Link header, then IPv4 TOS and TTL or IPv6 class, label and hop
+        // limit, then ACK, flags but PSH, window and options.
+        if (bcmp(frame, segment->frame, kEthernetHeaderLength)) return false;
+        if (flow->ipv6 ? (bcmp(ip, sip, 4) || ip[7] != sip[7]) :
+                         (ip[1] != sip[1] || ip[8] != sip[8]))
+            return false;
+        if (bcmp(tcp + 8, segment->tcp + 8, 4) ||
+            ((tcp[13] ^ segment->tcp[13]) & ~kTCPFlagPush) ||
+            bcmp(tcp + 14, segment->tcp + 14, 2) ||
+            bcmp(tcp + 20, segment->tcp + 20, tcpHeaderLength - 20))
+            return false;
+
+        // The payload loses its headers and packet header and joins the
+        // chain; the stack only sees the first segment's packet header.  A
+        // packet header that cannot be dropped leaves the segment to start
+        // a flow of its own.
+        if (mbuf_setflags_mask(packet, 0, MBUF_PKTHDR) != 0) return false;
+        mbuf_adj(packet, segment->headerLength);
+        mbuf_setnext(flow->last, packet);
+        for (last = packet; mbuf_next(last); last = mbuf_next(last)) {}
+
+        mbuf_pkthdr_adjustlen(flow->head, (int) segment->payload);
+        flow->last      = last;
+        flow->nextSeq  += segment->payload;
+        flow->ipLength += segment->payload;
+        flow->flags    |= segment->tcp[13] & kTCPFlagPush;
+        flow->segments++;
+
+        _statistics[kStatisticsMerged]++;
+        return true;
+    }
+
+    // Writes the merged lengths into the first segment's headers and queues
+    // the packet to the interface.
+    void deliver(Flow * flow)
+    {
+        mbuf_t  packet = flow->head;
+        UInt8 * frame  = (UInt8 *) mbuf_data(packet);
+        UInt8 * ip     = frame + kEthernetHeaderLength;
+
+        if (flow->segments > 1)
+        {
+            UInt8 * tcp = frame + flow->headerLength - headerTCPLength(flow);
+
+            tcp[13] |= flow->flags & kTCPFlagPush;
+
+            if (flow->ipv6)
+            {
+                write16(ip + 4, flow->ipLength - kIPv6HeaderLength);
+                mbuf_set_csum_performed(packet, MBUF_CSUM_DID_DATA | MBUF_CSUM_PSEUDO_HDR, 0xFFFF);
+            }
+            else
+            {
+                UInt32 sum = 0;
+
+                write16(ip + 2, flow->ipLength);
+                write16(ip + 10, 0);
+                for (UInt32 offset = 0; offset < 20; offset += 2) sum += read16(ip + offset);
+                sum = (sum >> 16) + (sum & 0xFFFF);
+                sum += sum >> 16;
+                write16(ip + 10, ~sum & 0xFFFF);
+
+                mbuf_set_csum_performed(packet, MBUF_CSUM_DID_IP | MBUF_CSUM_IP_GOOD |
+                                        MBUF_CSUM_DID_DATA | MBUF_CSUM_PSEUDO_HDR, 0xFFFF);
+            }
+        }
+
+        flow->head = 0;
+        flow->last = 0;
+
+        _statistics[kStatisticsDelivered]++;
+        _interface->inputPacket(packet, 0, IONetworkInterface::kInputOptionQueuePacket);
+    }
+
+    void bypass(mbuf_t packet)
+    {
+        _statistics[kStatisticsBypassed]++;
+        _statistics[kStatisticsDelivered]++;
+        _interface->inputPacket(packet, 0, IONetworkInterface::kInputOptionQueuePacket);
+    }
+
+    IONetworkInterface * _interface;
+    Flow *               _flows;
+    UInt32               _flowCount;
+    UInt64               _timeout;
+    UInt64               _sequence;
+    UInt64               _statistics[kStatisticsCount];
+};
+
+#endif /* !_IONETWORKRXCOALESCER_H */
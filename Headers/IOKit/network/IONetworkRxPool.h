@@ -0,0 +1,398 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IONETWORKRXPOOL_H
+#define _IONETWORKRXPOOL_H
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <libkern/OSAtomic.h>
+extern "C" {
+#include <sys/kpi_mbuf.h>
+}
+
+/*! @defined kIONetworkRxPoolDefaultCopyBreak
+    @abstract Default length up to which received frames are copied
+    rather than loaned to the stack. */
+
+#define kIONetworkRxPoolDefaultCopyBreak    256
+
+/*! @class IONetworkRxPool
+    @abstract Recycles a controller's receive buffers instead of allocating
+    a cluster for every received frame.
+    @discussion IONetworkController::replaceOrCopyPacket() gives the stack
+    the cluster a frame was received into and allocates a new one for the
+    receive ring, or copies the frame.  An IONetworkRxPool instead owns a
+    fixed set of wired, DMA-addressable pages split into half-page buffers.
+    The driver posts buffers from the pool to its receive ring, and hands
+    each completed buffer to receive(), which either copies a short frame
+    into a small mbuf and lets the driver post the same buffer again, or
+    attaches the buffer to an mbuf as an external cluster.  When the stack
+    frees that mbuf the buffer returns to the pool, so in steady state no
+    cluster is allocated or mapped on the receive path.
+    <br>
+    The stack returns loaned buffers through a callback in the driver's
+    kext, so free() fails with kIOReturnBusy, leaving the pool intact,
+    until every loaned buffer has returned.  A driver stops its receive
+    ring and retries free() from stop() until it succeeds before letting
+    its kext unload.
+*/
+
+class IONetworkRxPool
+{
+public:
+
+/*! @enum Statistics
+    @abstract Indices of the statistics reported by getStatistics().
+    @constant kStatisticsPackets Frames passed to receive().
+    @constant kStatisticsCopied Frames copied into a new mbuf.
+    @constant kStatisticsCopiedBytes Bytes copied into new mbufs.
+    @constant kStatisticsLoaned Buffers loaned to the stack.
+    @constant kStatisticsRecycled Loaned buffers returned by the stack.
+    @constant kStatisticsStarved Calls to getBuffer() that found the pool empty.
+    @constant kStatisticsAllocationFailures Frames dropped for lack of an mbuf.
+*/
+
+    enum Statistics
+    {
+        kStatisticsPackets,
+        kStatisticsCopied,
+        kStatisticsCopiedBytes,
+        kStatisticsLoaned,
+        kStatisticsRecycled,
+        kStatisticsStarved,
+        kStatisticsAllocationFailures
+    };
+
+    static const UInt32 kStatisticsCount = kStatisticsAllocationFailures + 1;
+
+    IONetworkRxPool()
+    {
+        bzero(this, sizeof(*this));
+    }
+
+/*! @function init
+    @abstract Allocates and wires the pool's pages.
+    @param pageCount Number of pages; the pool holds twice as many buffers.
+    It should cover the receive ring plus the frames the stack is expected
+    to hold at once.
+    @param copyBreak Frames up to this length are copied instead of loaned.
+    @param physicalMask Physical address mask the controller can reach.
+    @result Returns kIOReturnSuccess, kIOReturnBadArgument or
+    kIOReturnNoMemory.
+*/
+
+    IOReturn init(UInt32 pageCount,
+                  UInt32 copyBreak = kIONetworkRxPoolDefaultCopyBreak,
+                  mach_vm_address_t physicalMask = 0xFFFFFFFFFFFFF000ULL)
+    {
+        Shared * shared;
+        UInt32   bufferCount = pageCount * 2;
+
+        if (pageCount == 0 || pageCount > 65536) return kIOReturnBadArgument;
+
+        shared = (Shared *) IOMalloc(sizeof(Shared) + bufferCount * sizeof(UInt32));
+        if (shared == 0) return kIOReturnNoMemory;
+        bzero(shared, sizeof(Shared));
+
+        shared->refs        = 1;
+        shared->bufferSize  = (UInt32) page_size / 2;
+        shared->bufferCount = bufferCount;
+        shared->lock        = IOSimpleLockAlloc();
+        shared->memory      = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(
+                                kernel_task, kIODirectionInOut,
+                                (mach_vm_size_t) pageCount * page_size, physicalMask);
+        _shared = shared;
+
+        if (shared->lock == 0 || shared->memory == 0 ||
+            shared->memory->prepare() != kIOReturnSuccess)
+        {
+            if (shared->memory) shared->memory->release();
+            shared->memory = 0;
+            _shared = 0;
+            destroy(shared);
+            return kIOReturnNoMemory;
+        }
+        shared->prepared = true;
+        shared->base     = (UInt8 *) shared->memory->getBytesNoCopy();
+
+        // Hand out the lowest buffers first.
+        for (UInt32 index = 0; index < bufferCount; index++)
+        {
+            shared->freeList[index] = bufferCount - 1 - index;
+        }
+        shared->freeCount = bufferCount;
+
+        _copyBreak = copyBreak;
+
+        return kIOReturnSuccess;
+    }
+
+/*! @function free
+    @abstract Releases the pool once no buffer is loaned to the stack.
+    @discussion Buffers still posted to the receive ring must be returned
+    with putBuffer(), or the ring stopped, before calling free().
+    @result Returns kIOReturnSuccess, or kIOReturnBusy if the stack still
+    holds loaned buffers, in which case the pool is left as it was and
+    free() must be called again later.
+*/
+
+    IOReturn free()
+    {
+        Shared * shared = _shared;
+
+        if (shared == 0) return kIOReturnSuccess;
+        if (OSCompareAndSwap(1, 0, (volatile UInt32 *) &shared->refs) == false)
+        {
+            return kIOReturnBusy;
+        }
+
+        _shared = 0;
+        destroy(shared);
+
+        return kIOReturnSuccess;
+    }
+
+/*! @function getBuffer
+    @abstract Takes a buffer from the pool to post to the receive ring.
+    @param index Receives the buffer's index, passed back to receive().
+    @param address Receives the buffer's physical address for the
+    controller.
+    @result Returns false if every buffer is posted or loaned.
+*/
+
+    bool getBuffer(UInt32 * index, IOPhysicalAddress64 * address)
+    {
+        Shared *         shared = _shared;
+        IOInterruptState state;
+        bool             taken  = false;
+
+        state = IOSimpleLockLockDisableInterrupt(shared->lock);
+        if (shared->freeCount)
+        {
+            *index = shared->freeList[--shared->freeCount];
+            taken  = true;
+        }
+        IOSimpleLockUnlockEnableInterrupt(shared->lock, state);
+
+        if (taken == false)
+        {
+            _statistics[kStatisticsStarved]++;
+            return false;
+        }
+
+        if (address)
+        {
+            *address = shared->memory->getPhysicalSegment(
+                            (IOByteCount) *index * shared->bufferSize, 0, 0);
+        }
+
+        return true;
+    }
+
+/*! @function putBuffer
+    @abstract Returns a buffer the driver took but will not hand to
+    receive(), such as one still posted when the ring is torn down.
+*/
+
+    void putBuffer(UInt32 index)
+    {
+        recycle(_shared, index);
+    }
+
+/*! @function getBufferAddress
+    @abstract Returns the kernel virtual address of a buffer.
+*/
+
+    void * getBufferAddress(UInt32 index) const
+    {
+        return _shared->base + (size_t) index * _shared->bufferSize;
+    }
+
+/*! @function getBufferSize
+    @abstract Returns the size of every buffer, half a page.
+*/
+
+    UInt32 getBufferSize() const
+    {
+        return _shared->bufferSize;
+    }
+
+/*! @function receive
+    @abstract Wraps a received frame in an mbuf packet.
+    @discussion Frames up to the copy break are copied into a new mbuf and
+    the buffer stays with the driver; longer frames are loaned to the stack
+    in the buffer itself.  If no mbuf can be attached to the buffer the
+    frame is copied instead.
+    @param index Buffer the frame was received into.
+    @param length Length of the frame.
+    @param keep Set to true if the driver still owns the buffer and should
+    post it again, false if it was loaned and a new one is needed from
+    getBuffer().
+    @result Returns the packet, or 0 if no mbuf could be allocated, in
+    which case the driver keeps the buffer and drops the frame.
+*/
+
+    mbuf_t receive(UInt32 index, UInt32 length, bool * keep)
+    {
+        Shared * shared = _shared;
+        UInt8 *  buffer = shared->base + (size_t) index * shared->bufferSize;
+        mbuf_t   m      = 0;
+
+        _statistics[kStatisticsPackets]++;
+        *keep = true;
+
+        if (length > shared->bufferSize) length = shared->bufferSize;
+
+        if (length > _copyBreak)
+        {
+            OSIncrementAtomic(&shared->refs);
+
+            if (mbuf_attachcluster(MBUF_DONTWAIT, MBUF_TYPE_DATA, &m,
+                                   (caddr_t) buffer, &IONetworkRxPool::loanReturned,
+                                   shared->bufferSize, (caddr_t) shared) == 0)
+            {
+                mbuf_setlen(m, length);
+                mbuf_pkthdr_setlen(m, length);
+                _statistics[kStatisticsLoaned]++;
+                *keep = false;
+                return m;
+            }
+
+            OSDecrementAtomic(&shared->refs);
+            m = 0;
+        }
+
+        if (mbuf_allocpacket(MBUF_DONTWAIT, length, 0, &m) != 0)
+        {
+            _statistics[kStatisticsAllocationFailures]++;
+            return 0;
+        }
+
+        if (mbuf_copyback(m, 0, length, buffer, MBUF_DONTWAIT) != 0)
+        {
+            mbuf_freem(m);
+            _statistics[kStatisticsAllocationFailures]++;
+            return 0;
+        }
+        mbuf_pkthdr_setlen(m, length);
+
+        _statistics[kStatisticsCopied]++;
+        _statistics[kStatisticsCopiedBytes] += length;
+
+        return m;
+    }
+
+/*! @function getLoanedCount
+    @abstract Returns the number of buffers the stack still holds, 0 once
+    the pool is freed.
+*/
+
+    UInt32 getLoanedCount() const
+    {
+        return _shared ? (UInt32) (_shared->refs - 1) : 0;
+    }
+
+/*! @function getStatistics
+    @abstract Reports the pool statistics, indexed by Statistics.
+    @param statistics Buffer that will receive the UInt64 statistic values.
+    @param statisticsMaxCount Maximum number of values the buffer can hold.
+    @result Returns the number of values copied, or if no buffer is given,
+    the number of values available.
+*/
+
+    UInt32 getStatistics(UInt64 * statistics, UInt32 statisticsMaxCount) const
+    {
+        UInt32 count = (statisticsMaxCount < kStatisticsCount) ? statisticsMaxCount : kStatisticsCount;
+
+        if (statistics == 0 || statisticsMaxCount == 0) return kStatisticsCount;
+
+        for (UInt32 index = 0; index < count; index++)
+        {
+            statistics[index] = (index == kStatisticsRecycled) ? _shared->recycled : _statistics[index];
+        }
+
+        return count;
+    }
+
+protected:
+
+    // refs counts the pool itself plus every loaned buffer; free() only
+    // destroys it from 1, when no loan can still return.
+    struct Shared
+    {
+        IOSimpleLock *             lock;
+        IOBufferMemoryDescriptor * memory;
+        UInt8 *                    base;
+        UInt32                     bufferSize;
+        UInt32                     bufferCount;
+        volatile SInt32            refs;
+        bool                       prepared;
+        UInt32                     freeCount;
+        UInt64                     recycled;
+        UInt32                     freeList[0];
+    };
+
+    static void recycle(Shared * shared, UInt32 index)
+    {
+        IOInterruptState state;
+
+        state = IOSimpleLockLockDisableInterrupt(shared->lock);
+        shared->freeList[shared->freeCount++] = index;
+        IOSimpleLockUnlockEnableInterrupt(shared->lock, state);
+    }
+
+    static void destroy(Shared * shared)
+    {
+        if (shared->memory)
+        {
+            if (shared->prepared) shared->memory->complete();
+            shared->memory->release();
+        }
+        if (shared->lock) IOSimpleLockFree(shared->lock);
+
+        IOFree(shared, sizeof(Shared) + shared->bufferCount * sizeof(UInt32));
+    }
+
+    // Called by the stack when it frees an mbuf holding a loaned buffer.
+    static void loanReturned(caddr_t buffer, u_int size, caddr_t argument)
+    {
+        Shared * shared = (Shared *) argument;
+
+        (void) size;
+
+        OSIncrementAtomic64((volatile SInt64 *) &shared->recycled);
+        recycle(shared, (UInt32) (((UInt8 *) buffer - shared->base) / shared->bufferSize));
+        OSDecrementAtomic(&shared->refs);
+    }
+
+    Shared * _shared;
+    UInt32   _copyBreak;
+    UInt64   _statistics[kStatisticsCount];
+};
+
+#endif /* !_IONETWORKRXPOOL_H */
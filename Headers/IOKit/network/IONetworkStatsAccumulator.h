@@ -0,0 +1,415 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IONETWORKSTATSACCUMULATOR_H
+#define _IONETWORKSTATSACCUMULATOR_H
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/network/IONetworkData.h>
+#include <IOKit/network/IONetworkStats.h>
+#include <machine/machine_routines.h>
+extern "C" {
+#include <net/kpi_interface.h>
+#include <kern/clock.h>
+#include <kern/thread_call.h>
+
+/* Exported by the kernel, but not declared by its public headers */
+extern int cpu_number(void);
+}
+
+/*! @struct IONetworkStatsCounts
+    @abstract Interface counters, as in struct ifnet_stat_increment_param
+    but 64 bits wide.
+*/
+
+struct IONetworkStatsCounts
+{
+    UInt64  packetsIn;
+    UInt64  bytesIn;
+    UInt64  errorsIn;
+    UInt64  packetsOut;
+    UInt64  bytesOut;
+    UInt64  errorsOut;
+    UInt64  collisions;
+    UInt64  dropped;
+};
+
+/*! @class IONetworkStatsAccumulator
+    @abstract Counts interface statistics in per-queue or per-CPU slots
+    and folds them into the ifnet and IONetworkStats on demand.
+    @discussion ifnet_stat_increment_in() and ifnet_stat_increment_out()
+    take a lock on every call, and counters in an IONetworkStats buffer
+    are one cache line shared by every queue that updates them.  An
+    IONetworkStatsAccumulator gives each receive or transmit queue, or
+    each CPU, a slot of its own, one cache line long, so counting costs a
+    few uncontended stores.  Totals are summed from the slots when read.
+    <br>
+    A slot is either a queue index, when each queue is serviced by one
+    thread at a time, or kSlotCurrentCPU, in which case the update runs
+    with interrupts disabled on the current CPU's slot.  An accumulator
+    must use one scheme or the other, since a queue's slot would
+    otherwise also be some CPU's.  Updates that find no slot of their
+    own, such as from a CPU numbered beyond the slot count, go to a
+    shared slot with atomic adds.
+    <br>
+    flush() passes what was counted since the previous flush to
+    ifnet_stat_increment(), either from the driver's own timer or from
+    startFlushTimer().  updateNetworkStats() copies the totals into an
+    IONetworkStats buffer; registering networkDataAction() as the
+    notification handler of the interface's statistics IONetworkData
+    does so whenever the buffer is read.  A driver counts each packet
+    through one of these paths only, or it would count it twice.
+*/
+
+class IONetworkStatsAccumulator
+{
+public:
+
+    // Selects the slot of the CPU making the update.
+    static const UInt32 kSlotCurrentCPU = 0xFFFFFFFF;
+
+    IONetworkStatsAccumulator()
+    {
+        bzero(this, sizeof(*this));
+    }
+
+/*! @function init
+    @abstract Allocates the slots.
+    @param slotCount Number of queues counted, or of CPUs, which must
+    cover every CPU number the system can report; up to 1024.
+    @result Returns kIOReturnSuccess, kIOReturnBadArgument or
+    kIOReturnNoMemory.
+*/
+
+    IOReturn init(UInt32 slotCount)
+    {
+        if (slotCount == 0 || slotCount > 1024) return kIOReturnBadArgument;
+
+        // One more slot, shared, for updates that have none of their own.
+        _slots = (Slot *) IOMallocAligned((slotCount + 1) * sizeof(Slot), sizeof(Slot));
+        _lock  = IOLockAlloc();
+        if (_slots == 0 || _lock == 0)
+        {
+            if (_slots) IOFreeAligned(_slots, (slotCount + 1) * sizeof(Slot));
+            if (_lock) IOLockFree(_lock);
+            _slots = 0;
+            _lock  = 0;
+            return kIOReturnNoMemory;
+        }
+        bzero(_slots, (slotCount + 1) * sizeof(Slot));
+        _slotCount = slotCount;
+
+        return kIOReturnSuccess;
+    }
+
+/*! @function free
+    @abstract Stops the flush timer and frees the slots.
+*/
+
+    void free()
+    {
+        stopFlushTimer();
+        if (_slots) IOFreeAligned(_slots, (_slotCount + 1) * sizeof(Slot));
+        if (_lock) IOLockFree(_lock);
+        _slots     = 0;
+        _lock      = 0;
+        _slotCount = 0;
+    }
+
+/*! @function addInput
+    @abstract Counts received packets, typically a whole batch at once.
+    @param slot A queue index, or kSlotCurrentCPU.
+*/
+
+    void addInput(UInt32 slot, UInt32 packets, UInt32 bytes, UInt32 errors = 0)
+    {
+        boolean_t state;
+        Slot *    counts = enter(&slot, &state);
+
+        add(slot, &counts->counts.packetsIn, packets);
+        add(slot, &counts->counts.bytesIn, bytes);
+        if (errors) add(slot, &counts->counts.errorsIn, errors);
+        leave(state);
+    }
+
+/*! @function addOutput
+    @abstract Counts transmitted packets, typically a whole batch at once.
+    @param slot A queue index, or kSlotCurrentCPU.
+*/
+
+    void addOutput(UInt32 slot, UInt32 packets, UInt32 bytes, UInt32 errors = 0)
+    {
+        boolean_t state;
+        Slot *    counts = enter(&slot, &state);
+
+        add(slot, &counts->counts.packetsOut, packets);
+        add(slot, &counts->counts.bytesOut, bytes);
+        if (errors) add(slot, &counts->counts.errorsOut, errors);
+        leave(state);
+    }
+
+/*! @function addCounts
+    @abstract Counts any of the counters.
+    @param slot A queue index, or kSlotCurrentCPU.
+    @param increments Amounts to add.
+*/
+
+    void addCounts(UInt32 slot, const IONetworkStatsCounts * increments)
+    {
+        const UInt64 * values = (const UInt64 *) increments;
+        boolean_t      state;
+        Slot *         counts = enter(&slot, &state);
+        UInt64 *       fields = (UInt64 *) &counts->counts;
+
+        for (UInt32 index = 0; index < kCountsFields; index++)
+        {
+            if (values[index]) add(slot, &fields[index], values[index]);
+        }
+        leave(state);
+    }
+
+/*! @function getCounts
+    @abstract Sums the slots.  Each counter is read whole, but counters
+    updated meanwhile may be seen in either state.
+*/
+
+    void getCounts(IONetworkStatsCounts * total) const
+    {
+        UInt64 * totals = (UInt64 *) total;
+
+        bzero(total, sizeof(*total));
+        if (_slots == 0) return;
+        for (UInt32 slot = 0; slot <= _slotCount; slot++)
+        {
+            const UInt64 * fields = (const UInt64 *) &_slots[slot].counts;
+
+            for (UInt32 index = 0; index < kCountsFields; index++)
+            {
+                totals[index] += __atomic_load_n(&fields[index], __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+/*! @function flush
+    @abstract Passes the counts added since the last flush to
+    ifnet_stat_increment().
+    @result Returns kIOReturnSuccess, or kIOReturnError if the ifnet
+    refused the counts, which are then retried by the next flush.
+*/
+
+    IOReturn flush(ifnet_t interface)
+    {
+        IONetworkStatsCounts total;
+        UInt64 *             totals  = (UInt64 *) &total;
+        UInt64 *             flushed = (UInt64 *) &_flushed;
+        IOReturn             result  = kIOReturnSuccess;
+
+        if (_slots == 0 || interface == 0) return kIOReturnNotReady;
+
+        IOLockLock(_lock);
+        getCounts(&total);
+        for (;;)
+        {
+            struct ifnet_stat_increment_param param;
+            u_int32_t *                       params = (u_int32_t *) &param;
+            bool                              pending = false;
+
+            // The ifnet takes 32-bit increments.
+            for (UInt32 index = 0; index < kCountsFields; index++)
+            {
+                UInt64 delta = totals[index] - flushed[index];
+
+                params[index] = (delta > 0xFFFFFFFFULL) ? 0xFFFFFFFF : (u_int32_t) delta;
+                pending |= (delta != 0);
+            }
+            if (!pending) break;
+            if (ifnet_stat_increment(interface, &param) != 0)
+            {
+                result = kIOReturnError;
+                break;
+            }
+            for (UInt32 index = 0; index < kCountsFields; index++)
+            {
+                flushed[index] += params[index];
+            }
+        }
+        IOLockUnlock(_lock);
+
+        return result;
+    }
+
+/*! @function updateNetworkStats
+    @abstract Copies the totals into an IONetworkStats buffer.
+    @discussion The buffer's counters are 32 bits wide and wrap, as they
+    do when a driver increments them directly.
+*/
+
+    void updateNetworkStats(IONetworkStats * stats) const
+    {
+        IONetworkStatsCounts total;
+
+        getCounts(&total);
+        stats->inputPackets  = (UInt32) total.packetsIn;
+        stats->inputErrors   = (UInt32) total.errorsIn;
+        stats->outputPackets = (UInt32) total.packetsOut;
+        stats->outputErrors  = (UInt32) total.errorsOut;
+        stats->collisions    = (UInt32) total.collisions;
+    }
+
+/*! @function networkDataAction
+    @abstract IONetworkData notification handler that updates an
+    IONetworkStats buffer before it is read.
+    @discussion Register it on the kIONetworkStatsKey data object with
+    the accumulator as the target:
+    <code>data->setNotificationTarget(accumulator,
+    &IONetworkStatsAccumulator::networkDataAction)</code>.
+*/
+
+    static IOReturn networkDataAction(void * target, void * param, IONetworkData * data,
+                                      UInt32 accessType, void * buffer, UInt32 * bufferSize,
+                                      UInt32 offset)
+    {
+        IONetworkStatsAccumulator * accumulator = (IONetworkStatsAccumulator *) target;
+
+        if ((accessType & (kIONetworkDataAccessTypeRead | kIONetworkDataAccessTypeSerialize)) &&
+            data->getSize() >= sizeof(IONetworkStats) && data->getBuffer())
+        {
+            accumulator->updateNetworkStats((IONetworkStats *) data->getBuffer());
+        }
+        return kIOReturnSuccess;
+    }
+
+/*! @function startFlushTimer
+    @abstract Flushes to an ifnet periodically from a thread call.
+    @param interface The ifnet; stopFlushTimer() must be called before it
+    is detached.
+    @param intervalMS Milliseconds between flushes.
+*/
+
+    IOReturn startFlushTimer(ifnet_t interface, UInt32 intervalMS = 1000)
+    {
+        UInt64 deadline;
+
+        if (_slots == 0 || interface == 0 || intervalMS == 0) return kIOReturnBadArgument;
+        if (_call) return kIOReturnBusy;
+
+        _call = thread_call_allocate(&IONetworkStatsAccumulator::timerFired, this);
+        if (_call == 0) return kIOReturnNoMemory;
+
+        _interface  = interface;
+        _intervalMS = intervalMS;
+        clock_interval_to_deadline(intervalMS, kMillisecondScale, &deadline);
+        thread_call_enter_delayed(_call, deadline);
+
+        return kIOReturnSuccess;
+    }
+
+/*! @function stopFlushTimer
+    @abstract Stops the periodic flush, waits for a running one, then
+    flushes once more.
+*/
+
+    void stopFlushTimer()
+    {
+        if (_call == 0) return;
+
+        // A flush already running may rearm the call once before it ends.
+        __atomic_store_n(&_intervalMS, 0, __ATOMIC_RELAXED);
+        thread_call_cancel_wait(_call);
+        thread_call_cancel(_call);
+        thread_call_free(_call);
+        _call = 0;
+
+        flush(_interface);
+        _interface = 0;
+    }
+
+protected:
+
+    // Counters are in the order of struct ifnet_stat_increment_param.
+    static const UInt32 kCountsFields = sizeof(IONetworkStatsCounts) / sizeof(UInt64);
+
+    // One cache line, so slots updated from different CPUs never share one.
+    struct Slot
+    {
+        IONetworkStatsCounts counts;
+    } __attribute__((aligned(64)));
+
+    Slot * enter(UInt32 * slot, boolean_t * state)
+    {
+        *state = FALSE;
+        if (*slot == kSlotCurrentCPU)
+        {
+            // Neither migration nor an interrupt on this CPU can interleave.
+            *state = ml_set_interrupts_enabled(FALSE);
+            *slot  = (UInt32) cpu_number();
+        }
+        if (*slot >= _slotCount) *slot = _slotCount;
+        return &_slots[*slot];
+    }
+
+    void leave(boolean_t state)
+    {
+        if (state) ml_set_interrupts_enabled(state);
+    }
+
+    void add(UInt32 slot, UInt64 * counter, UInt64 value)
+    {
+        // Only the shared slot has concurrent writers.
+        if (slot == _slotCount)
+            __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+        else
+            __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+                             __ATOMIC_RELAXED);
+    }
+
+    static void timerFired(thread_call_param_t param0, thread_call_param_t param1)
+    {
+        IONetworkStatsAccumulator * accumulator = (IONetworkStatsAccumulator *) param0;
+        UInt32                      intervalMS;
+        UInt64                      deadline;
+
+        accumulator->flush(accumulator->_interface);
+
+        intervalMS = __atomic_load_n(&accumulator->_intervalMS, __ATOMIC_RELAXED);
+        if (intervalMS)
+        {
+            clock_interval_to_deadline(intervalMS, kMillisecondScale, &deadline);
+            thread_call_enter_delayed(accumulator->_call, deadline);
+        }
+    }
+
+    Slot *                  _slots;
+    UInt32                  _slotCount;
+    UInt32                  _intervalMS;
+    IOLock *                _lock;
+    IONetworkStatsCounts    _flushed;
+    thread_call_t           _call;
+    ifnet_t                 _interface;
+};
+
+#endif /* !_IONETWORKSTATSACCUMULATOR_H */
@@ -0,0 +1,527 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IONETWORKTXSEGMENTER_H
+#define _IONETWORKTXSEGMENTER_H
+
+#include <IOKit/IOLib.h>
+#include <libkern/OSByteOrder.h>
+extern "C" {
+#include <sys/kpi_mbuf.h>
+#include <netinet/in_cksum.h>
+}
+
+/*! @class IONetworkTxSegmenter
+    @abstract Splits TCP segmentation offload packets into MSS-sized frames
+    in software.
+    @discussion A controller that advertises kIONetworkFeatureTSOIPv4 or
+    kIONetworkFeatureTSOIPv6 receives TCP packets larger than the MTU,
+    flagged by mbuf_get_tso_requested() with the MSS to cut them at.  A
+    driver whose hardware cannot segment passes such packets to segment(),
+    which returns a list of frames that each fit the MTU.
+    <br>
+    Each frame is a new mbuf holding a copy of the Ethernet, IP and TCP
+    headers, followed by references to the original packet's clusters for
+    its payload, so no payload is copied.  Only when a frame would need more
+    buffers than the controller's descriptor limit is its payload copied
+    into fresh buffers.  The headers are fixed up for every frame: IP total
+    or payload length, IPv4 identification and header checksum, TCP
+    sequence number, and FIN, PSH and CWR, which only the last or the first
+    frame keeps.  TCP checksums are derived from checksums of the original
+    headers by adding in the fields that change, RFC 1624 style, and either
+    completed over the payload in software or left as the pseudo-header sum
+    for checksum offload hardware to finish.
+    <br>
+    Frames carry a copy of the original packet header, so the checksum and
+    TSO requests read from them are those of the original packet.
+*/
+
+class IONetworkTxSegmenter
+{
+public:
+
+/*! @enum Statistics
+    @abstract Indices of the statistics reported by getStatistics().
+    @constant kStatisticsPackets Packets segmented.
+    @constant kStatisticsSegments Frames produced.
+    @constant kStatisticsCopied Frames whose payload had to be copied.
+    @constant kStatisticsCopiedBytes Payload bytes copied.
+    @constant kStatisticsUnsupported Packets refused for their headers.
+    @constant kStatisticsAllocationFailures Packets refused for lack of an mbuf.
+*/
+
+    enum Statistics
+    {
+        kStatisticsPackets,
+        kStatisticsSegments,
+        kStatisticsCopied,
+        kStatisticsCopiedBytes,
+        kStatisticsUnsupported,
+        kStatisticsAllocationFailures
+    };
+
+    static const UInt32 kStatisticsCount = kStatisticsAllocationFailures + 1;
+
+/*! @enum SegmentOptions
+    @constant kOptionChecksumHardware Leave each frame's TCP checksum field
+    holding the pseudo-header checksum, for hardware that completes TCP
+    checksums the way it does for kChecksumTCP.  Without this option the
+    TCP checksum is computed in software.
+*/
+
+    enum
+    {
+        kOptionChecksumHardware = 0x1
+    };
+
+    IONetworkTxSegmenter()
+    {
+        bzero(this, sizeof(*this));
+    }
+
+/*! @function init
+    @abstract Configures the segmenter.
+    @param maxFragments Most buffers the controller can transmit one frame
+    from, or 0 if it has no limit.  At least 2 if not 0.
+    @param options Pass kOptionChecksumHardware to leave TCP checksums to
+    the hardware.
+    @result Returns kIOReturnSuccess or kIOReturnBadArgument.
+*/
+
+    IOReturn init(UInt32 maxFragments = 0, IOOptionBits options = 0)
+    {
+        if (maxFragments == 1) return kIOReturnBadArgument;
+
+        _maxFragments = maxFragments;
+        _options      = options;
+
+        return kIOReturnSuccess;
+    }
+
+/*! @function segment
+    @abstract Splits a packet into frames no longer than its MSS allows.
+    @param packet An outbound Ethernet frame.
+    @param segments Receives the first frame; the others follow through
+    mbuf_nextpkt().  A packet with no TSO request, or whose payload fits in
+    one segment, is returned as is.
+    @param count Receives the number of frames, if not 0.
+    @result Returns kIOReturnSuccess once packet has been freed or returned
+    as the only frame.  Returns kIOReturnUnsupported for headers other than
+    Ethernet, IPv4 and IPv6 without extension headers, followed by TCP, and
+    kIOReturnNoMemory if an mbuf could not be allocated.  On failure packet
+    still belongs to the caller.
+*/
+
+    IOReturn segment(mbuf_t packet, mbuf_t * segments, UInt32 * count = 0)
+    {
+        mbuf_tso_request_flags_t request = 0;
+        UInt32                   mss     = 0;
+        UInt8                    header[kMaxHeaderLength];
+        Layout                   layout;
+        Cursor                   cursor;
+        mbuf_t                   first   = 0;
+        mbuf_t                   last    = 0;
+        size_t                   total   = mbuf_pkthdr_len(packet);
+        UInt32                   number  = 0;
+        UInt16                   ipID;
+        UInt32                   seq;
+        UInt8                    flags;
+
+        *segments = packet;
+        if (count) *count = 1;
+
+        mbuf_get_tso_requested(packet, &request, &mss);
+        if ((request & (MBUF_TSO_IPV4 | MBUF_TSO_IPV6)) == 0) return kIOReturnSuccess;
+
+        if (mss == 0 || parse(packet, header, &layout) == false)
+        {
+            _statistics[kStatisticsUnsupported]++;
+            return kIOReturnUnsupported;
+        }
+        if (total <= layout.headerLength + mss) return kIOReturnSuccess;
+
+        UInt8 * ip  = header + layout.ipOffset;
+        UInt8 * tcp = header + layout.tcpOffset;
+
+        ipID  = read16(ip + 4);
+        seq   = read32(tcp + 4);
+        flags = tcp[13];
+
+        cursor.m      = packet;
+        cursor.offset = 0;
+        advance(&cursor, layout.headerLength);
+
+        for (size_t offset = layout.headerLength; offset < total; offset += mss, number++)
+        {
+            UInt32 length   = (UInt32) ((total - offset < mss) ? total - offset : mss);
+            UInt32 tcpBytes = layout.tcpHeaderLength + length;
+            UInt8  segmentFlags;
+            UInt64 sum;
+            mbuf_t frame;
+
+            // CWR belongs to the first frame only, FIN and PSH to the last.
+            segmentFlags = flags & ~(kTCPFlagCWR | kTCPFlagFin | kTCPFlagPush);
+            if (number == 0) segmentFlags |= flags & kTCPFlagCWR;
+            if (offset + length == total) segmentFlags |= flags & (kTCPFlagFin | kTCPFlagPush);
+
+            tcp[13] = segmentFlags;
+            write32(tcp + 4, seq + (UInt32) (offset - layout.headerLength));
+
+            if (layout.ipv6)
+            {
+                write16(ip + 4, tcpBytes);
+                sum = layout.pseudoSum + (tcpBytes >> 16) + (tcpBytes & 0xFFFF);
+            }
+            else
+            {
+                UInt16 id = (UInt16) (ipID + number);
+
+                write16(ip + 2, layout.ipHeaderLength + tcpBytes);
+                write16(ip + 4, id);
+                write16(ip + 10, ~fold(layout.ipSum + layout.ipHeaderLength + tcpBytes + id) & 0xFFFF);
+                sum = layout.pseudoSum + tcpBytes;
+            }
+
+            if (_options & kOptionChecksumHardware)
+            {
+                write16(tcp + 16, fold(sum));
+                advance(&cursor, length);
+            }
+            else
+            {
+                sum += layout.tcpSum + (read32(tcp + 4) >> 16) + (read32(tcp + 4) & 0xFFFF) +
+                       read16(tcp + 12);
+                sum += checksum(&cursor, length);
+                write16(tcp + 16, ~fold(sum) & 0xFFFF);
+            }
+
+            frame = build(packet, header, layout.headerLength, offset, length);
+            if (frame == 0)
+            {
+                if (first) mbuf_freem_list(first);
+                _statistics[kStatisticsAllocationFailures]++;
+                return kIOReturnNoMemory;
+            }
+
+            if (last) mbuf_setnextpkt(last, frame);
+            else first = frame;
+            last = frame;
+        }
+
+        mbuf_freem(packet);
+
+        _statistics[kStatisticsPackets]++;
+        _statistics[kStatisticsSegments] += number;
+
+        *segments = first;
+        if (count) *count = number;
+
+        return kIOReturnSuccess;
+    }
+
+/*! @function getStatistics
+    @abstract Reports the segmenter statistics, indexed by Statistics.
+    @param statistics Buffer that will receive the UInt64 statistic values.
+    @param statisticsMaxCount Maximum number of values the buffer can hold.
+    @result Returns the number of values copied, or if no buffer is given,
+    the number of values available.
+*/
+
+    UInt32 getStatistics(UInt64 * statistics, UInt32 statisticsMaxCount) const
+    {
+        UInt32 count = (statisticsMaxCount < kStatisticsCount) ? statisticsMaxCount : kStatisticsCount;
+
+        if (statistics == 0 || statisticsMaxCount == 0) return kStatisticsCount;
+
+        for (UInt32 index = 0; index < count; index++)
+        {
+            statistics[index] = _statistics[index];
+        }
+
+        return count;
+    }
+
+protected:
+
+    enum
+    {
+        kMaxHeaderLength = 18 + 60 + 60,
+        kTCPFlagFin      = 0x01,
+        kTCPFlagPush     = 0x08,
+        kTCPFlagCWR      = 0x80
+    };
+
+    // Header offsets, and ones' complement sums of the header fields that
+    // stay the same in every frame.
+    struct Layout
+    {
+        UInt32 ipOffset;
+        UInt32 ipHeaderLength;
+        UInt32 tcpOffset;
+        UInt32 tcpHeaderLength;
+        UInt32 headerLength;
+        UInt64 ipSum;       // IPv4 header without length, ID and checksum
+        UInt64 pseudoSum;   // addresses and protocol
+        UInt64 tcpSum;      // TCP header without sequence, flags and checksum
+        bool   ipv6;
+    };
+
+    // A position in an mbuf chain.
+    struct Cursor
+    {
+        mbuf_t m;
+        size_t offset;
+    };
+
+    static UInt16 read16(const UInt8 * bytes)
+    {
+        return (UInt16) ((bytes[0] << 8) | bytes[1]);
+    }
+
+    static UInt32 read32(const UInt8 * bytes)
+    {
+        return OSReadBigInt32(bytes, 0);
+    }
+
+    static void write16(UInt8 * bytes, UInt32 value)
+    {
+        bytes[0] = (UInt8) (value >> 8);
+        bytes[1] = (UInt8) value;
+    }
+
+    static void write32(UInt8 * bytes, UInt32 value)
+    {
+        OSWriteBigInt32(bytes, 0, value);
+    }
+
+    static UInt16 fold(UInt64 sum)
+    {
+        while (sum >> 16) sum = (sum >> 16) + (sum & 0xFFFF);
+        return (UInt16) sum;
+    }
+
+    static UInt64 sumWords(const UInt8 * bytes, UInt32 length)
+    {
+        UInt64 sum = 0;
+
+        for (UInt32 offset = 0; offset + 1 < length; offset += 2) sum += read16(bytes + offset);
+        return sum;
+    }
+
+    static bool parse(mbuf_t packet, UInt8 * header, Layout * layout)
+    {
+        size_t  length = mbuf_pkthdr_len(packet);
+        UInt32  type;
+        UInt8 * ip;
+        UInt8 * tcp;
+
+        bzero(layout, sizeof(*layout));
+
+        if (length > kMaxHeaderLength) length = kMaxHeaderLength;
+        if (length < 14 + 20 + 20 || mbuf_copydata(packet, 0, length, header) != 0)
+            return false;
+
+        layout->ipOffset = 14;
+        type = read16(header + 12);
+        if (type == 0x8100)
+        {
+            layout->ipOffset = 18;
+            type = read16(header + 16);
+        }
+        ip = header + layout->ipOffset;
+
+        if (type == 0x0800)
+        {
+            layout->ipHeaderLength = (ip[0] & 0x0F) * 4;
+            if ((ip[0] >> 4) != 4 || layout->ipHeaderLength < 20 || ip[9] != 6 ||
+                (read16(ip + 6) & 0x3FFF))
+                return false;
+        }
+        else if (type == 0x86DD)
+        {
+            layout->ipHeaderLength = 40;
+            layout->ipv6           = true;
+            if ((ip[0] >> 4) != 6 || ip[6] != 6) return false;
+        }
+        else
+        {
+            return false;
+        }
+
+        layout->tcpOffset = layout->ipOffset + layout->ipHeaderLength;
+        if (layout->tcpOffset + 20 > length) return false;
+        tcp = header + layout->tcpOffset;
+        layout->tcpHeaderLength = (tcp[12] >> 4) * 4;
+        layout->headerLength    = layout->tcpOffset + layout->tcpHeaderLength;
+        if (layout->tcpHeaderLength < 20 || layout->headerLength > length) return false;
+
+        if (layout->ipv6)
+        {
+            layout->pseudoSum = sumWords(ip + 8, 32) + 6;
+        }
+        else
+        {
+            layout->pseudoSum = sumWords(ip + 12, 8) + 6;
+            layout->ipSum     = sumWords(ip, layout->ipHeaderLength) -
+                                read16(ip + 2) - read16(ip + 4) - read16(ip + 10);
+        }
+        layout->tcpSum = sumWords(tcp, layout->tcpHeaderLength) - read16(tcp + 4) -
+                         read16(tcp + 6) - read16(tcp + 12) - read16(tcp + 16);
+
+        return true;
+    }
+
+    static void advance(Cursor * cursor, size_t length)
+    {
+        while (cursor->m && cursor->offset + length >= mbuf_len(cursor->m))
+        {
+            length        -= mbuf_len(cursor->m) - cursor->offset;
+            cursor->m      = mbuf_next(cursor->m);
+            cursor->offset = 0;
+            if (length == 0) break;
+        }
+        cursor->offset += length;
+    }
+
+    // Ones' complement sum of length bytes from the cursor, which moves
+    // past them, as a big-endian value like the header sums.
+    static UInt64 checksum(Cursor * cursor, size_t length)
+    {
+        UInt32 sum  = 0;
+        size_t done = 0;
+
+        while (length && cursor->m)
+        {
+            const UInt8 * bytes = (const UInt8 *) mbuf_data(cursor->m) + cursor->offset;
+            size_t        chunk = mbuf_len(cursor->m) - cursor->offset;
+
+            if (chunk > length) chunk = length;
+            advance(cursor, chunk);
+
+            sum     = in_cksum_combine(sum, in_cksum_partial(bytes, chunk, 0), done);
+            done   += chunk;
+            length -= chunk;
+        }
+        return OSSwapBigToHostInt16(in_cksum_fold(sum));
+    }
+
+    // A frame from the header copy and length bytes of payload at offset,
+    // referenced from the original clusters unless that takes too many
+    // buffers, in which case the whole frame is copied into as few as
+    // possible.
+    mbuf_t build(mbuf_t packet, const UInt8 * header, UInt32 headerLength,
+                 size_t offset, UInt32 length)
+    {
+        unsigned int chunks    = 1;
+        UInt32       fragments = 1;
+        mbuf_t       frame;
+        mbuf_t       payload;
+
+        if (mbuf_copym(packet, offset, length, MBUF_DONTWAIT, &payload) != 0)
+            return 0;
+        for (mbuf_t m = payload; m; m = mbuf_next(m)) fragments++;
+
+        if (_maxFragments == 0 || fragments <= _maxFragments)
+        {
+            if (mbuf_allocpacket(MBUF_DONTWAIT, headerLength, &chunks, &frame) != 0)
+            {
+                mbuf_freem(payload);
+                return 0;
+            }
+            __builtin_memcpy(mbuf_data(frame), header, headerLength);
+            mbuf_setlen(frame, headerLength);
+            mbuf_setnext(frame, payload);
+        }
+        else
+        {
+            Cursor cursor    = { packet, 0 };
+            size_t position  = headerLength;
+            size_t remaining = length;
+            mbuf_t tail;
+            mbuf_t unused;
+
+            mbuf_freem(payload);
+            chunks = _maxFragments;
+            if (mbuf_allocpacket(MBUF_DONTWAIT, headerLength + length, &chunks, &frame) != 0)
+                return 0;
+
+            // mbuf_copyback() fills the chain from an empty length, growing
+            // each mbuf's length and the packet header's as it goes.
+            for (mbuf_t m = frame; m; m = mbuf_next(m)) mbuf_setlen(m, 0);
+            mbuf_pkthdr_setlen(frame, 0);
+
+            if (mbuf_copyback(frame, 0, headerLength, header, MBUF_DONTWAIT) != 0)
+            {
+                mbuf_freem(frame);
+                return 0;
+            }
+
+            advance(&cursor, offset);
+            while (remaining && cursor.m)
+            {
+                const UInt8 * data  = (const UInt8 *) mbuf_data(cursor.m) + cursor.offset;
+                size_t        chunk = mbuf_len(cursor.m) - cursor.offset;
+
+                if (chunk > remaining) chunk = remaining;
+                if (mbuf_copyback(frame, position, chunk, data, MBUF_DONTWAIT) != 0)
+                {
+                    mbuf_freem(frame);
+                    return 0;
+                }
+                advance(&cursor, chunk);
+                position  += chunk;
+                remaining -= chunk;
+            }
+            if (remaining)
+            {
+                mbuf_freem(frame);
+                return 0;
+            }
+
+            // Drop the mbufs the copy did not need.
+            for (tail = frame; mbuf_next(tail) && mbuf_len(mbuf_next(tail)); tail = mbuf_next(tail)) {}
+            if ((unused = mbuf_next(tail)) != 0)
+            {
+                mbuf_setnext(tail, 0);
+                mbuf_freem(unused);
+            }
+
+            _statistics[kStatisticsCopied]++;
+            _statistics[kStatisticsCopiedBytes] += length;
+        }
+
+        mbuf_copy_pkthdr(frame, packet);
+        mbuf_pkthdr_setlen(frame, headerLength + length);
+
+        return frame;
+    }
+
+    UInt32       _maxFragments;
+    IOOptionBits _options;
+    UInt64       _statistics[kStatisticsCount];
+};
+
+#endif /* !_IONETWORKTXSEGMENTER_H */
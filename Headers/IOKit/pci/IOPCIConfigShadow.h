@@ -0,0 +1,496 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _IOKIT_IOPCICONFIGSHADOW_H
+#define _IOKIT_IOPCICONFIGSHADOW_H
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/pci/IOPCIDevice.h>
+
+/*! @class IOPCIConfigShadow
+    @abstract Shadow of the stable part of a PCI device's configuration space.
+    @discussion IOPCIDevice performs a configuration cycle for every register access, and its
+    capability searches walk the capability lists each time.  An IOPCIConfigShadow, embedded in
+    the driver of the device, keeps a copy of the registers that do not change while the device
+    is configured and an index of its capabilities and PCI Express extended capabilities, built
+    once by init().
+
+    Only dwords marked cacheable are shadowed: the identification, class, subsystem and
+    capability pointer registers, the header of every capability, and whatever ranges the driver
+    adds with setCacheable(), such as read-only capability registers.  The first dword of an MSI,
+    MSI-X, PCI-X, HyperTransport or CompactPCI hot swap capability also holds control bits that
+    the device or the system changes, so it is never shadowed.  Other accesses are passed
+    through to the device.  Writes through the shadow invalidate the dwords they touch; the
+    driver calls invalidate() or rebuild() after any change made behind its back, typically a
+    reset or a power transition that loses configuration state.
+
+    Accesses may come from any context, including a primary interrupt filter: the shadow is
+    protected by a spin lock that is never held across a configuration cycle. */
+
+class IOPCIConfigShadow
+{
+public:
+
+/*! @enum Statistics
+    @discussion Indices for the different statistics that getStatistics() can report.
+    @constant kStatisticsHits Number of reads served from the shadow, i.e. configuration cycles saved.
+    @constant kStatisticsMisses Number of cacheable reads that had to fill the shadow.
+    @constant kStatisticsPassThrough Number of reads of uncacheable registers.
+    @constant kStatisticsWrites Number of writes.
+    @constant kStatisticsCapabilityLookups Number of capability searches served from the index. */
+
+    enum Statistics
+    {
+        kStatisticsHits,
+        kStatisticsMisses,
+        kStatisticsPassThrough,
+        kStatisticsWrites,
+        kStatisticsCapabilityLookups
+    };
+
+    static const UInt32 kStatisticsCount = kStatisticsCapabilityLookups + 1;
+
+    static const UInt32 kConfigSize       = 4096;
+    static const UInt32 kLegacyConfigSize = 256;
+    static const UInt32 kCapabilitiesMax  = 64;
+
+    IOPCIConfigShadow()
+    {
+        bzero(this, sizeof(*this));
+    }
+
+/*! @function init
+    @abstract Prepares the shadow and indexes the device's capabilities.
+    @param device The PCI device, which must outlive the shadow.
+    @result kIOReturnSuccess, kIOReturnBadArgument or kIOReturnNoMemory. */
+
+    IOReturn init(IOPCIDevice * device)
+    {
+        if (device == 0) return kIOReturnBadArgument;
+
+        _lock = IOSimpleLockAlloc();
+        if (_lock == 0) return kIOReturnNoMemory;
+
+        _device = device;
+
+        rebuild();
+
+        return kIOReturnSuccess;
+    }
+
+/*! @function free
+    @abstract Releases the resources of the shadow. */
+
+    void free()
+    {
+        if (_lock) IOSimpleLockFree(_lock);
+
+        _lock   = 0;
+        _device = 0;
+    }
+
+/*! @function rebuild
+    @abstract Drops the shadow and indexes the capabilities again.
+    @discussion Ranges added with setCacheable() stay cacheable. */
+
+    void rebuild()
+    {
+        IOInterruptState state;
+        UInt8            offset;
+        UInt32           guard;
+
+        state = IOSimpleLockLockDisableInterrupt(_lock);
+        bzero(_valid, sizeof(_valid));
+        _capabilityCount = 0;
+        _size = kLegacyConfigSize;
+        _generation++;
+        IOSimpleLockUnlockEnableInterrupt(_lock, state);
+
+        setCacheable(kIOPCIConfigVendorID, 4);
+        setCacheable(kIOPCIConfigRevisionID, 4);
+        setCacheable(kIOPCIConfigCapabilitiesPtr, 4);
+
+        // Offset 0x2C holds the subsystem IDs only for type 0 headers.
+        if ((read8(kIOPCIConfigHeaderType) & 0x7F) == 0) setCacheable(kIOPCIConfigSubSystemVendorID, 4);
+
+        if ((_device->extendedConfigRead16(kIOPCIConfigStatus) & kIOPCIStatusCapabilities) == 0) return;
+
+        offset = read8(kIOPCIConfigCapabilitiesPtr) & 0xFC;
+
+        for (guard = 0; offset >= 0x40 && guard < 48; guard++)
+        {
+            UInt32 header;
+
+            header = read32(offset);
+            if (stableHeader(header & 0xFF)) setCacheable(offset, 4);
+
+            addCapability(header & 0xFF, false, offset);
+
+            if ((header & 0xFF) == kIOPCICapabilityIDPCIExpress) _size = kConfigSize;
+
+            offset = (header >> 8) & 0xFC;
+        }
+
+        if (_size != kConfigSize) return;
+
+        // Extended capabilities are chained from 0x100; an absent or
+        // inaccessible list reads as 0 or all ones.
+
+        for (IOByteCount extended = 0x100, count = 0; extended >= 0x100 && count < 960; count++)
+        {
+            UInt32 header;
+
+            setCacheable(extended, 4);
+            header = read32(extended);
+
+            if (header == 0 || header == 0xFFFFFFFF) break;
+
+            addCapability(header & 0xFFFF, true, extended);
+
+            extended = (header >> 20) & 0xFFC;
+        }
+    }
+
+/*! @function setCacheable
+    @abstract Marks a range of configuration space as stable.
+    @param offset Byte offset of the range; it is widened to whole dwords.
+    @param length Length of the range in bytes. */
+
+    void setCacheable(IOByteCount offset, IOByteCount length)
+    {
+        IOInterruptState state;
+
+        state = IOSimpleLockLockDisableInterrupt(_lock);
+        for (IOByteCount dword = offset / 4; dword < (offset + length + 3) / 4 && dword < kConfigSize / 4; dword++)
+        {
+            _cacheable[dword / 32] |= 1U << (dword % 32);
+        }
+        IOSimpleLockUnlockEnableInterrupt(_lock, state);
+    }
+
+/*! @function invalidate
+    @abstract Drops the shadow of a range of configuration space.
+    @param offset Byte offset of the range.
+    @param length Length of the range in bytes. */
+
+    void invalidate(IOByteCount offset, IOByteCount length)
+    {
+        IOInterruptState state;
+
+        state = IOSimpleLockLockDisableInterrupt(_lock);
+        for (IOByteCount dword = offset / 4; dword < (offset + length + 3) / 4 && dword < kConfigSize / 4; dword++)
+        {
+            _valid[dword / 32] &= ~(1U << (dword % 32));
+        }
+        _generation++;
+        IOSimpleLockUnlockEnableInterrupt(_lock, state);
+    }
+
+/*! @function invalidateAll
+    @abstract Drops the whole shadow, keeping the capability index. */
+
+    void invalidateAll()
+    {
+        invalidate(0, kConfigSize);
+    }
+
+/*! @function read32
+    @abstract Reads a 32-bit configuration register, from the shadow if it is cacheable.
+    @param offset A byte offset into configuration space, of which bits 0-1 are ignored.
+    @result The 32-bit value of the register. */
+
+    UInt32 read32(IOByteCount offset)
+    {
+        return readDword(offset & ~3UL);
+    }
+
+/*! @function read16
+    @abstract Reads a 16-bit configuration register, from the shadow if it is cacheable.
+    @param offset A byte offset into configuration space, of which bit 0 is ignored.
+    @result The 16-bit value of the register. */
+
+    UInt16 read16(IOByteCount offset)
+    {
+        offset &= ~1UL;
+
+        if (cacheable(offset) == false)
+        {
+            _statistics[kStatisticsPassThrough]++;
+            return _device->extendedConfigRead16(offset);
+        }
+
+        return (UInt16) (readDword(offset & ~3UL) >> ((offset & 2) * 8));
+    }
+
+/*! @function read8
+    @abstract Reads an 8-bit configuration register, from the shadow if it is cacheable.
+    @param offset A byte offset into configuration space.
+    @result The 8-bit value of the register. */
+
+    UInt8 read8(IOByteCount offset)
+    {
+        if (cacheable(offset) == false)
+        {
+            _statistics[kStatisticsPassThrough]++;
+            return _device->extendedConfigRead8(offset);
+        }
+
+        return (UInt8) (readDword(offset & ~3UL) >> ((offset & 3) * 8));
+    }
+
+/*! @function write32
+    @abstract Writes a 32-bit configuration register and drops its shadow.
+    @param offset A byte offset into configuration space, of which bits 0-1 are ignored.
+    @param data The 32-bit value to be written. */
+
+    void write32(IOByteCount offset, UInt32 data)
+    {
+        _device->extendedConfigWrite32(offset, data);
+        written(offset);
+    }
+
+/*! @function write16
+    @abstract Writes a 16-bit configuration register and drops its shadow.
+    @param offset A byte offset into configuration space, of which bit 0 is ignored.
+    @param data The 16-bit value to be written. */
+
+    void write16(IOByteCount offset, UInt16 data)
+    {
+        _device->extendedConfigWrite16(offset, data);
+        written(offset);
+    }
+
+/*! @function write8
+    @abstract Writes an 8-bit configuration register and drops its shadow.
+    @param offset A byte offset into configuration space.
+    @param data The 8-bit value to be written. */
+
+    void write8(IOByteCount offset, UInt8 data)
+    {
+        _device->extendedConfigWrite8(offset, data);
+        written(offset);
+    }
+
+/*! @function findCapability
+    @abstract Looks up a PCI capability in the index.
+    @discussion Equivalent to IOPCIDevice::findPCICapability().
+    @param capabilityID An 8-bit PCI capability ID.
+    @param offset An optional pointer to return the offset into config space where the capability was found.
+    @result The 32-bit value of the capability register if one was found, zero otherwise. */
+
+    UInt32 findCapability(UInt8 capabilityID, UInt8 * offset = 0)
+    {
+        IOByteCount found = 0;
+        UInt32      value;
+
+        value = extendedFindCapability(capabilityID, &found);
+        if (offset) *offset = (UInt8) found;
+
+        return value;
+    }
+
+/*! @function extendedFindCapability
+    @abstract Looks up a PCI capability or PCI Express extended capability in the index.
+    @discussion Equivalent to IOPCIDevice::extendedFindPCICapability().
+    @param capabilityID A PCI capability ID, or the negated ID of an extended capability.
+    @param offset An optional in/out parameter to return the offset into config space where the
+    capability was found, and to set the start point of the next search; initialize it to zero
+    before the first call.  A start point that is not in the index is searched on the device.
+    @result The 32-bit value of the capability register if one was found, zero otherwise. */
+
+    UInt32 extendedFindCapability(UInt32 capabilityID, IOByteCount * offset = 0)
+    {
+        IOByteCount start = offset ? *offset : 0;
+        bool        extended = (capabilityID & 0x80000000) != 0;
+        UInt32      id;
+        UInt32      first = 0;
+
+        // Extended capability IDs are passed negated.
+        id = extended ? ((0 - capabilityID) & 0xFFFF) : (capabilityID & 0xFF);
+
+        // The index is in list order, which need not be offset order:
+        // resume after the entry the previous search returned.
+        if (start)
+        {
+            while (first < _capabilityCount && _capabilities[first].offset != start) first++;
+            if (first == _capabilityCount) return _device->extendedFindPCICapability(capabilityID, offset);
+            first++;
+        }
+
+        _statistics[kStatisticsCapabilityLookups]++;
+
+        for (UInt32 index = first; index < _capabilityCount; index++)
+        {
+            if (_capabilities[index].id == id && _capabilities[index].extended == extended)
+            {
+                if (offset) *offset = _capabilities[index].offset;
+                return read32(_capabilities[index].offset);
+            }
+        }
+
+        if (offset) *offset = 0;
+
+        return 0;
+    }
+
+/*! @function getStatistics
+    @abstract Reports the shadow statistics, indexed by Statistics.
+    @param statistics Buffer that will receive the UInt64 statistic values.
+    @param statisticsMaxCount Maximum number of statistic values that can be held in the buffer.
+    @result Actual number of statistic values copied to the buffer, or if no buffer is given, the
+    total number of statistic values available. */
+
+    UInt32 getStatistics(UInt64 * statistics, UInt32 statisticsMaxCount) const
+    {
+        UInt32 count = (statisticsMaxCount < kStatisticsCount) ? statisticsMaxCount : kStatisticsCount;
+
+        if (statistics == 0 || statisticsMaxCount == 0) return kStatisticsCount;
+
+        for (UInt32 index = 0; index < count; index++)
+        {
+            statistics[index] = _statistics[index];
+        }
+
+        return count;
+    }
+
+/*! @function getStatistic
+    @abstract Reports one of the shadow statistics. */
+
+    UInt64 getStatistic(Statistics statistic) const
+    {
+        return (statistic < kStatisticsCount) ? _statistics[statistic] : 0;
+    }
+
+protected:
+
+    struct Capability
+    {
+        UInt16 id;              // capability ID, or extended capability ID
+        UInt16 offset;
+        bool   extended;
+    };
+
+    void addCapability(UInt32 id, bool extended, IOByteCount offset)
+    {
+        if (_capabilityCount == kCapabilitiesMax) return;
+
+        _capabilities[_capabilityCount].id       = (UInt16) id;
+        _capabilities[_capabilityCount].offset   = (UInt16) offset;
+        _capabilities[_capabilityCount].extended = extended;
+        _capabilityCount++;
+    }
+
+    // Whether the first dword of a capability holds only read-only fields
+    // besides its ID and next pointer.
+    static bool stableHeader(UInt32 id)
+    {
+        switch (id)
+        {
+            case kIOPCICapabilityIDMSI:
+            case kIOPCICapabilityIDMSIX:
+            case kIOPCICapabilityIDPCIX:
+            case kIOPCICapabilityIDLDT:
+            case kIOPCICapabilityIDCPCIHotswap:
+                return false;
+            default:
+                return true;
+        }
+    }
+
+    bool cacheable(IOByteCount offset) const
+    {
+        UInt32 dword = (UInt32) (offset / 4);
+
+        return offset < _size && (_cacheable[dword / 32] & (1U << (dword % 32)));
+    }
+
+    UInt32 readDword(IOByteCount offset)
+    {
+        UInt32           dword = (UInt32) (offset / 4);
+        UInt32           bit = 1U << (dword % 32);
+        IOInterruptState state;
+        UInt32           generation;
+        UInt32           value;
+
+        if (cacheable(offset) == false)
+        {
+            _statistics[kStatisticsPassThrough]++;
+            return _device->extendedConfigRead32(offset);
+        }
+
+        state = IOSimpleLockLockDisableInterrupt(_lock);
+        if (_valid[dword / 32] & bit)
+        {
+            value = _shadow[dword];
+            _statistics[kStatisticsHits]++;
+            IOSimpleLockUnlockEnableInterrupt(_lock, state);
+            return value;
+        }
+        generation = _generation;
+        _statistics[kStatisticsMisses]++;
+        IOSimpleLockUnlockEnableInterrupt(_lock, state);
+
+        value = _device->extendedConfigRead32(offset);
+
+        // A write or invalidation during the cycle may have made the value
+        // stale; return it, but do not keep it.
+
+        state = IOSimpleLockLockDisableInterrupt(_lock);
+        if (generation == _generation)
+        {
+            _shadow[dword] = value;
+            _valid[dword / 32] |= bit;
+        }
+        IOSimpleLockUnlockEnableInterrupt(_lock, state);
+
+        return value;
+    }
+
+    void written(IOByteCount offset)
+    {
+        _statistics[kStatisticsWrites]++;
+
+        if (cacheable(offset)) invalidate(offset, 1);
+    }
+
+    IOPCIDevice *  _device;
+    IOSimpleLock * _lock;
+    IOByteCount    _size;               // kConfigSize for PCI Express devices
+    UInt32         _generation;         // bumped by every invalidation
+
+    UInt32         _shadow[kConfigSize / 4];
+    UInt32         _valid[kConfigSize / 4 / 32];
+    UInt32         _cacheable[kConfigSize / 4 / 32];
+
+    Capability     _capabilities[kCapabilitiesMax];
+    UInt32         _capabilityCount;
+
+    UInt64         _statistics[kStatisticsCount];
+};
+
+#endif /* ! _IOKIT_IOPCICONFIGSHADOW_H */
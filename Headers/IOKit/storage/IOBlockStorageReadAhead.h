@@ -0,0 +1,795 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*!
+ * @header IOBlockStorageReadAhead
+ * @abstract
+ * This header contains the IOBlockStorageReadAhead class definition.
+ */
+
+#ifndef _IOBLOCKSTORAGEREADAHEAD_H
+#define _IOBLOCKSTORAGEREADAHEAD_H
+
+#include <IOKit/IOTypes.h>
+
+/*!
+ * @defined kIOBlockStorageDriverStatisticsReadAheadHitsKey
+ * @abstract
+ * Describes the number of reads served from the read-ahead cache.
+ * @discussion
+ * This property describes the number of reads served from the read-ahead
+ * cache without a device transfer.  It is one of the statistic entries that a
+ * driver using IOBlockStorageReadAhead may list under the top-level
+ * kIOBlockStorageDriverStatisticsKey property table.  It has an OSNumber value.
+ */
+
+#define kIOBlockStorageDriverStatisticsReadAheadHitsKey "Read-Ahead Hits"
+
+/*!
+ * @defined kIOBlockStorageDriverStatisticsReadAheadMissesKey
+ * @abstract
+ * Describes the number of cacheable reads not found in the read-ahead cache.
+ * @discussion
+ * This property describes the number of reads small enough to be cached that
+ * were not found in the read-ahead cache.  It has an OSNumber value.
+ */
+
+#define kIOBlockStorageDriverStatisticsReadAheadMissesKey "Read-Ahead Misses"
+
+/*!
+ * @defined kIOBlockStorageDriverStatisticsReadAheadBytesKey
+ * @abstract
+ * Describes the number of bytes transferred into the read-ahead cache.
+ * @discussion
+ * This property describes the number of bytes read from the device into the
+ * read-ahead cache, whether or not they were later used.  It has an OSNumber
+ * value.
+ */
+
+#define kIOBlockStorageDriverStatisticsReadAheadBytesKey "Read-Ahead Bytes"
+
+/*!
+ * @defined kIOBlockStorageDriverStatisticsReadAheadFillsKey
+ * @abstract
+ * Describes the number of window transfers into the read-ahead cache.
+ * @discussion
+ * This property describes the number of device transfers that filled a
+ * read-ahead window.  It has an OSNumber value.
+ */
+
+#define kIOBlockStorageDriverStatisticsReadAheadFillsKey "Read-Ahead Fills"
+
+/*!
+ * @defined kIOBlockStorageDriverStatisticsReadAheadInvalidationsKey
+ * @abstract
+ * Describes the number of read-ahead windows discarded by writes.
+ * @discussion
+ * This property describes the number of read-ahead windows discarded because
+ * a write or an unmap overlapped them.  It has an OSNumber value.
+ */
+
+#define kIOBlockStorageDriverStatisticsReadAheadInvalidationsKey "Read-Ahead Invalidations"
+
+#ifdef KERNEL
+#ifdef __cplusplus
+
+/*
+ * Kernel
+ */
+
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/storage/IOBlockStorageDriver.h>
+
+/*!
+ * @class IOBlockStorageReadAhead
+ * @abstract
+ * Sequential-stream read-ahead cache for IOBlockStorageDriver subclasses.
+ * @discussion
+ * IOBlockStorageDriver passes every client read() to the device once it has
+ * been prepared, deblocked and broken up, so a client walking the media in
+ * small sequential reads (such as a file system scanning its metadata) turns
+ * each read into a device transfer.  IOBlockStorageReadAhead recognizes such
+ * streams and, once a stream has made kSequentialThreshold consecutive reads,
+ * replaces the next miss with a single transfer of a whole window into a
+ * private buffer, serving the following reads from memory.
+ *
+ * The window of each stream starts at the minimum size, doubles (up to the
+ * maximum) every time most of the previous window was consumed and halves
+ * when most of it was not.  Each stream owns one buffer of the maximum
+ * window size; the least recently used stream is recycled for new streams.
+ *
+ * The cache is opt-in.  A driver embeds an instance, calls init() from
+ * start() and free() from free(), and routes its requests through it:
+ *
+ * void MyDriver::read(IOService * client, UInt64 byteStart,
+ *                     IOMemoryDescriptor * buffer,
+ *                     IOStorageAttributes * attributes,
+ *                     IOStorageCompletion * completion)
+ * {
+ *     if (_readAhead.read(client, byteStart, buffer, attributes, completion) == false)
+ *     {
+ *         IOBlockStorageDriver::read(client, byteStart, buffer, attributes, completion);
+ *     }
+ * }
+ *
+ * void MyDriver::write(IOService * client, UInt64 byteStart,
+ *                      IOMemoryDescriptor * buffer,
+ *                      IOStorageAttributes * attributes,
+ *                      IOStorageCompletion * completion)
+ * {
+ *     if (_readAhead.write(client, byteStart, buffer, attributes, completion) == false)
+ *     {
+ *         IOBlockStorageDriver::write(client, byteStart, buffer, attributes, completion);
+ *     }
+ * }
+ *
+ * Media changes must call invalidateAll(), and unmap() should invalidate the
+ * extents it is given.  The counters are reported by getStatistics(), which
+ * a driver may append to those of IOBlockStorageDriver::getStatistics().
+ */
+
+class IOBlockStorageReadAhead
+{
+public:
+
+    /*!
+     * @enum Statistics
+     * @discussion
+     * Indices for the different statistics that getStatistics() can report.
+     * @constant kStatisticsHits Number of reads served from the cache.
+     * @constant kStatisticsMisses Number of cacheable reads not in the cache.
+     * @constant kStatisticsFills Number of window transfers into the cache.
+     * @constant kStatisticsBytesFilled Number of bytes transferred into the cache.
+     * @constant kStatisticsInvalidations Number of windows discarded by writes.
+     */
+
+    enum Statistics
+    {
+        kStatisticsHits,
+        kStatisticsMisses,
+        kStatisticsFills,
+        kStatisticsBytesFilled,
+        kStatisticsInvalidations
+    };
+
+    static const UInt32 kStatisticsCount = kStatisticsInvalidations + 1;
+
+    static const UInt32 kStreamsMax = 8;
+
+    static const UInt32 kSequentialThreshold = 2;
+
+    IOBlockStorageReadAhead()
+    {
+        bzero(this, sizeof(*this));
+    }
+
+    /*!
+     * @function init
+     * @discussion
+     * Allocates the stream buffers.  The cache starts enabled.
+     * @param driver
+     * Driver whose IOBlockStorageDriver::read() performs the window transfers.
+     * @param streams
+     * Number of concurrent sequential streams tracked, up to kStreamsMax.
+     * @param windowMin
+     * Initial window size in bytes.
+     * @param windowMax
+     * Maximum window size in bytes, which is also the buffer size of a stream.
+     * @param readMax
+     * Reads larger than this many bytes bypass the cache.
+     * @result
+     * Returns true on success, false otherwise.
+     */
+
+    bool init(IOBlockStorageDriver * driver,
+              UInt32                 streams   = 4,
+              UInt64                 windowMin = 64 * 1024,
+              UInt64                 windowMax = 512 * 1024,
+              UInt64                 readMax   = 64 * 1024)
+    {
+        if (driver == 0 || streams == 0 || streams > kStreamsMax) return false;
+        if (windowMin == 0 || windowMin > windowMax || readMax > windowMax) return false;
+
+        _lock = IOLockAlloc();
+        if (_lock == 0) return false;
+
+        for (UInt32 index = 0; index < streams; index++)
+        {
+            _streams[index].buffer = IOBufferMemoryDescriptor::withCapacity(windowMax, kIODirectionIn);
+            if (_streams[index].buffer == 0)
+            {
+                free();
+                return false;
+            }
+            _streams[index].nextByte   = ((UInt64) -1);
+            _streams[index].windowSize = windowMin;
+        }
+
+        _driver      = driver;
+        _streamCount = streams;
+        _windowMin   = windowMin;
+        _windowMax   = windowMax;
+        _readMax     = readMax;
+        _enabled     = true;
+
+        return true;
+    }
+
+    /*!
+     * @function free
+     * @discussion
+     * Releases the stream buffers.  No window transfer may be outstanding,
+     * which holds once the driver has been stopped.
+     */
+
+    void free()
+    {
+        for (UInt32 index = 0; index < kStreamsMax; index++)
+        {
+            if (_streams[index].buffer) _streams[index].buffer->release();
+            _streams[index].buffer = 0;
+        }
+
+        if (_lock) IOLockFree(_lock);
+        _lock = 0;
+
+        _streamCount = 0;
+        _enabled     = false;
+    }
+
+    /*!
+     * @function setEnabled
+     * @discussion
+     * Enables or disables the cache.  Disabling it discards every window.
+     */
+
+    void setEnabled(bool enabled)
+    {
+        if (_lock == 0) return;
+
+        IOLockLock(_lock);
+
+        if (enabled == false) discardAll();
+        _enabled = enabled;
+
+        IOLockUnlock(_lock);
+    }
+
+    /*!
+     * @function read
+     * @discussion
+     * Serves a read from the cache, or replaces it with a window transfer
+     * when it continues a sequential stream.  The completion is called in
+     * both cases, possibly before this method returns.
+     * @param client
+     * Client requesting the read.
+     * @param byteStart
+     * Starting byte offset for the data transfer.
+     * @param buffer
+     * Buffer for the data transfer.  The size of the buffer implies the size
+     * of the data transfer.
+     * @param attributes
+     * Attributes of the data transfer.  See IOStorageAttributes.
+     * @param completion
+     * Completion routine to call once the data transfer is complete.
+     * @result
+     * Returns true if the request was taken over, false if the caller must
+     * pass it to IOBlockStorageDriver::read() itself.
+     */
+
+    bool read(IOService *           client,
+              UInt64                byteStart,
+              IOMemoryDescriptor *  buffer,
+              IOStorageAttributes * attributes,
+              IOStorageCompletion * completion)
+    {
+        UInt64   byteCount = buffer->getLength();
+        UInt64   byteEnd   = byteStart + byteCount;
+        Stream * stream    = 0;
+        UInt64   windowStart;
+        UInt64   windowLength;
+        UInt64   blockSize;
+        UInt64   mediaSize;
+        IOMedia * media;
+
+        if (_lock == 0 || byteCount == 0 || byteCount > _readMax) return false;
+        if (buffer->getDirection() != kIODirectionIn) return false;
+        if (attributes && (attributes->options & ~kIOStorageOptionIsStatic)) return false;
+
+        IOLockLock(_lock);
+
+        if (_enabled == false)
+        {
+            IOLockUnlock(_lock);
+            return false;
+        }
+
+        _tick++;
+
+        // Serve the read from a window that holds all of it.
+
+        for (UInt32 index = 0; index < _streamCount; index++)
+        {
+            Stream * candidate = &_streams[index];
+
+            if (candidate->filling == false &&
+                byteStart >= candidate->windowStart &&
+                byteEnd <= candidate->windowStart + candidate->windowLength)
+            {
+                stream = candidate;
+                break;
+            }
+        }
+
+        if (stream)
+        {
+            IOReturn status;
+
+            stream->readers++;
+            stream->consumed += byteCount;
+            stream->nextByte  = byteEnd;
+            stream->lastUse   = _tick;
+
+            IOLockUnlock(_lock);
+
+            status = copyOut(stream, byteStart, buffer);
+
+            IOLockLock(_lock);
+            stream->readers--;
+            if (status == kIOReturnSuccess) _statistics[kStatisticsHits]++;
+            IOLockUnlock(_lock);
+
+            if (status != kIOReturnSuccess) return false;
+
+            IOStorage::complete(completion, kIOReturnSuccess, byteCount);
+            return true;
+        }
+
+        _statistics[kStatisticsMisses]++;
+
+        // Find the stream this read continues, or recycle the least recently used one.
+
+        for (UInt32 index = 0; index < _streamCount; index++)
+        {
+            if (_streams[index].nextByte == byteStart && _streams[index].filling == false)
+            {
+                stream = &_streams[index];
+                break;
+            }
+        }
+
+        if (stream == 0)
+        {
+            for (UInt32 index = 0; index < _streamCount; index++)
+            {
+                Stream * candidate = &_streams[index];
+
+                if (candidate->filling || candidate->readers) continue;
+                if (stream == 0 || candidate->lastUse < stream->lastUse) stream = candidate;
+            }
+
+            if (stream)
+            {
+                stream->windowLength = 0;
+                stream->windowSize   = _windowMin;
+                stream->consumed     = 0;
+                stream->sequential   = 1;
+                stream->nextByte     = byteEnd;
+                stream->lastUse      = _tick;
+            }
+
+            IOLockUnlock(_lock);
+            return false;
+        }
+
+        stream->sequential++;
+        stream->nextByte = byteEnd;
+        stream->lastUse  = _tick;
+
+        if (stream->sequential < kSequentialThreshold || stream->readers)
+        {
+            IOLockUnlock(_lock);
+            return false;
+        }
+
+        // Size the next window after how much of the previous one was used.
+
+        if (stream->windowLength)
+        {
+            if (stream->consumed >= stream->windowLength - stream->windowLength / 4)
+            {
+                stream->windowSize = (stream->windowSize * 2 < _windowMax) ? stream->windowSize * 2 : _windowMax;
+            }
+            else if (stream->consumed < stream->windowLength / 4)
+            {
+                stream->windowSize = (stream->windowSize / 2 > _windowMin) ? stream->windowSize / 2 : _windowMin;
+            }
+        }
+
+        media     = OSDynamicCast(IOMedia, _driver->getClient());
+        blockSize = media ? media->getPreferredBlockSize() : 0;
+        mediaSize = media ? media->getSize() : 0;
+
+        if (blockSize == 0 || byteEnd > mediaSize)
+        {
+            IOLockUnlock(_lock);
+            return false;
+        }
+
+        windowStart  = byteStart - (byteStart % blockSize);
+        windowLength = stream->windowSize;
+        if (windowLength < byteEnd - windowStart) windowLength = byteEnd - windowStart;
+        if (windowLength > _windowMax)            windowLength = _windowMax;
+        if (windowLength > mediaSize - windowStart) windowLength = mediaSize - windowStart;
+        windowLength -= windowLength % blockSize;
+
+        if (windowLength < byteEnd - windowStart)
+        {
+            IOLockUnlock(_lock);
+            return false;
+        }
+
+        stream->filling           = true;
+        stream->windowStart       = windowStart;
+        stream->windowLength      = 0;
+        stream->fillLength        = windowLength;
+        stream->fillGeneration    = stream->generation;
+        stream->consumed          = byteCount;
+        stream->client            = client;
+        stream->requestStart      = byteStart;
+        stream->requestBuffer     = buffer;
+        stream->requestCompletion = *completion;
+
+        if (attributes) stream->requestAttributes = *attributes;
+        else bzero(&stream->requestAttributes, sizeof(stream->requestAttributes));
+
+        _statistics[kStatisticsFills]++;
+        _statistics[kStatisticsBytesFilled] += windowLength;
+
+        IOLockUnlock(_lock);
+
+        IOStorageCompletion fill;
+
+        fill.target    = this;
+        fill.action    = fillCompletion;
+        fill.parameter = stream;
+
+        stream->buffer->setLength(windowLength);
+
+        _driver->IOBlockStorageDriver::read(client, windowStart, stream->buffer, &stream->requestAttributes, &fill);
+
+        return true;
+    }
+
+    /*!
+     * @function write
+     * @discussion
+     * Passes a write to IOBlockStorageDriver::write(), discarding the windows
+     * it overlaps both before it is issued and once it completes, so that a
+     * window transfer issued while the write is in flight cannot keep the
+     * data it replaces.
+     * @param client
+     * Client requesting the write.
+     * @param byteStart
+     * Starting byte offset for the data transfer.
+     * @param buffer
+     * Buffer for the data transfer.  The size of the buffer implies the size
+     * of the data transfer.
+     * @param attributes
+     * Attributes of the data transfer.  See IOStorageAttributes.
+     * @param completion
+     * Completion routine to call once the data transfer is complete.
+     * @result
+     * Returns true if the request was taken over, false if the caller must
+     * pass it to IOBlockStorageDriver::write() itself.
+     */
+
+    bool write(IOService *           client,
+               UInt64                byteStart,
+               IOMemoryDescriptor *  buffer,
+               IOStorageAttributes * attributes,
+               IOStorageCompletion * completion)
+    {
+        UInt64              byteCount = buffer->getLength();
+        WriteContext *      context;
+        IOStorageCompletion done;
+
+        if (_lock == 0) return false;
+
+        context = (WriteContext *) IOMalloc(sizeof(WriteContext));
+        if (context == 0)
+        {
+            IOStorage::complete(completion, kIOReturnNoMemory, 0);
+            return true;
+        }
+
+        context->byteStart  = byteStart;
+        context->byteCount  = byteCount;
+        context->completion = *completion;
+
+        invalidate(byteStart, byteCount);
+
+        done.target    = this;
+        done.action    = writeCompletion;
+        done.parameter = context;
+
+        _driver->IOBlockStorageDriver::write(client, byteStart, buffer, attributes, &done);
+
+        return true;
+    }
+
+    /*!
+     * @function invalidate
+     * @discussion
+     * Discards every window that overlaps the given range.  Must be called
+     * before the range is unmapped; writes go through write(), which also
+     * calls it when they complete.
+     * @param byteStart
+     * Starting byte offset of the range.
+     * @param byteCount
+     * Size of the range.
+     */
+
+    void invalidate(UInt64 byteStart, UInt64 byteCount)
+    {
+        if (_lock == 0 || byteCount == 0) return;
+
+        IOLockLock(_lock);
+
+        for (UInt32 index = 0; index < _streamCount; index++)
+        {
+            Stream * stream = &_streams[index];
+            UInt64   length = stream->filling ? stream->fillLength : stream->windowLength;
+
+            if (length && byteStart < stream->windowStart + length && stream->windowStart < byteStart + byteCount)
+            {
+                stream->windowLength = 0;
+                stream->generation++;
+                _statistics[kStatisticsInvalidations]++;
+            }
+        }
+
+        IOLockUnlock(_lock);
+    }
+
+    /*!
+     * @function invalidateAll
+     * @discussion
+     * Discards every window and forgets every stream, for instance on a media
+     * change.
+     */
+
+    void invalidateAll()
+    {
+        if (_lock == 0) return;
+
+        IOLockLock(_lock);
+        discardAll();
+        IOLockUnlock(_lock);
+    }
+
+    /*!
+     * @function getStatistics
+     * @discussion
+     * Reports the cache statistics, indexed by Statistics, in the manner of
+     * IOBlockStorageDriver::getStatistics().
+     * @param statistics
+     * Buffer that will receive the UInt64 statistic values.
+     * @param statisticsMaxCount
+     * Maximum number of statistic values that can be held in the buffer.
+     * @result
+     * Actual number of statistic values copied to the buffer, or if no buffer
+     * is given, the total number of statistic values available.
+     */
+
+    UInt32 getStatistics(UInt64 * statistics, UInt32 statisticsMaxCount) const
+    {
+        UInt32 count = (statisticsMaxCount < kStatisticsCount) ? statisticsMaxCount : kStatisticsCount;
+
+        if (statistics == 0 || statisticsMaxCount == 0) return kStatisticsCount;
+
+        for (UInt32 index = 0; index < count; index++)
+        {
+            statistics[index] = _statistics[index];
+        }
+
+        return count;
+    }
+
+    /*!
+     * @function getStatistic
+     * @param statistic
+     * Statistic index (an IOBlockStorageReadAhead::Statistics index).
+     * @result
+     * Statistic value.
+     */
+
+    UInt64 getStatistic(Statistics statistic) const
+    {
+        return (statistic < kStatisticsCount) ? _statistics[statistic] : 0;
+    }
+
+protected:
+
+    // Called with the lock held.
+
+    void discardAll()
+    {
+        for (UInt32 index = 0; index < _streamCount; index++)
+        {
+            Stream * stream = &_streams[index];
+
+            stream->windowLength = 0;
+            stream->windowSize   = _windowMin;
+            stream->consumed     = 0;
+            stream->sequential   = 0;
+            stream->nextByte     = ((UInt64) -1);
+            stream->generation++;
+        }
+    }
+
+    struct Stream
+    {
+        IOBufferMemoryDescriptor * buffer;
+
+        UInt64                     windowStart;
+        UInt64                     windowLength;      /* valid bytes, 0 if none */
+        UInt64                     windowSize;        /* length of the next fill */
+        UInt64                     fillLength;
+        UInt64                     consumed;          /* bytes of the window read */
+        UInt64                     nextByte;          /* where a sequential read starts */
+        UInt64                     lastUse;
+        UInt32                     sequential;
+        UInt32                     readers;
+        UInt32                     generation;
+        UInt32                     fillGeneration;
+        bool                       filling;
+
+        /* Request waiting for the fill */
+        IOService *                client;
+        UInt64                     requestStart;
+        IOMemoryDescriptor *       requestBuffer;
+        IOStorageAttributes        requestAttributes;
+        IOStorageCompletion        requestCompletion;
+    };
+
+    struct WriteContext
+    {
+        UInt64              byteStart;
+        UInt64              byteCount;
+        IOStorageCompletion completion;
+    };
+
+    static void writeCompletion(void *   target,
+                                void *   parameter,
+                                IOReturn status,
+                                UInt64   actualByteCount)
+    {
+        IOBlockStorageReadAhead * self    = (IOBlockStorageReadAhead *) target;
+        WriteContext *            context = (WriteContext *) parameter;
+        IOStorageCompletion       completion;
+
+        // A window filled while the write was in flight may hold the old data;
+        // a fill still outstanding sees the generation change and is dropped.
+
+        self->invalidate(context->byteStart, context->byteCount);
+
+        completion = context->completion;
+        IOFree(context, sizeof(WriteContext));
+
+        IOStorage::complete(&completion, status, actualByteCount);
+    }
+
+    IOReturn copyOut(Stream * stream, UInt64 byteStart, IOMemoryDescriptor * buffer)
+    {
+        UInt64   byteCount = buffer->getLength();
+        UInt8 *  bytes     = (UInt8 *) stream->buffer->getBytesNoCopy();
+        IOReturn status;
+
+        status = buffer->prepare();
+        if (status != kIOReturnSuccess) return status;
+
+        if (buffer->writeBytes(0, bytes + (byteStart - stream->windowStart), byteCount) != byteCount)
+        {
+            status = kIOReturnUnderrun;
+        }
+
+        buffer->complete();
+
+        return status;
+    }
+
+    static void fillCompletion(void *   target,
+                               void *   parameter,
+                               IOReturn status,
+                               UInt64   actualByteCount)
+    {
+        IOBlockStorageReadAhead * self   = (IOBlockStorageReadAhead *) target;
+        Stream *                  stream = (Stream *) parameter;
+        IOService *               client;
+        UInt64                    byteStart;
+        IOMemoryDescriptor *      buffer;
+        IOStorageAttributes       attributes;
+        IOStorageCompletion       completion;
+        bool                      valid;
+
+        IOLockLock(self->_lock);
+
+        client     = stream->client;
+        byteStart  = stream->requestStart;
+        buffer     = stream->requestBuffer;
+        attributes = stream->requestAttributes;
+        completion = stream->requestCompletion;
+
+        // A write that overlapped the window while it was read leaves it stale.
+
+        valid = (status == kIOReturnSuccess &&
+                 stream->generation == stream->fillGeneration &&
+                 stream->windowStart + actualByteCount >= byteStart + buffer->getLength());
+
+        stream->windowLength = valid ? actualByteCount : 0;
+        stream->filling      = false;
+        if (valid) stream->readers++;
+
+        IOLockUnlock(self->_lock);
+
+        if (valid)
+        {
+            status = self->copyOut(stream, byteStart, buffer);
+
+            IOLockLock(self->_lock);
+            stream->readers--;
+            IOLockUnlock(self->_lock);
+
+            if (status == kIOReturnSuccess)
+            {
+                IOStorage::complete(&completion, kIOReturnSuccess, buffer->getLength());
+                return;
+            }
+        }
+
+        // Let the device report the error, or retry a read that raced a write.
+
+        self->_driver->IOBlockStorageDriver::read(client, byteStart, buffer, &attributes, &completion);
+    }
+
+    IOBlockStorageDriver * _driver;
+    IOLock *               _lock;
+    Stream                 _streams[kStreamsMax];
+    UInt32                 _streamCount;
+    UInt64                 _windowMin;
+    UInt64                 _windowMax;
+    UInt64                 _readMax;
+    UInt64                 _tick;
+    UInt64                 _statistics[kStatisticsCount];
+    bool                   _enabled;
+};
+
+#endif /* __cplusplus */
+#endif /* KERNEL */
+#endif /* !_IOBLOCKSTORAGEREADAHEAD_H */
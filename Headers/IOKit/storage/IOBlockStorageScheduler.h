@@ -0,0 +1,902 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*!
+ * @header IOBlockStorageScheduler
+ * @abstract
+ * This header contains the IOBlockStorageScheduler class definition.
+ */
+
+#ifndef _IOBLOCKSTORAGESCHEDULER_H
+#define _IOBLOCKSTORAGESCHEDULER_H
+
+#include <IOKit/IOTypes.h>
+
+#ifdef KERNEL
+#ifdef __cplusplus
+
+/*
+ * Kernel
+ */
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOMultiMemoryDescriptor.h>
+#include <IOKit/storage/IOBlockStorageDriver.h>
+#include <kern/clock.h>
+
+/*!
+ * @class IOBlockStorageScheduler
+ * @abstract
+ * Request merging and scheduling stage for IOBlockStorageDriver subclasses.
+ * @discussion
+ * IOBlockStorageDriver hands each block-aligned request to executeRequest()
+ * in arrival order.  IOBlockStorageScheduler sits in front of it: requests
+ * are queued, at most a given number are outstanding at the device, and the
+ * next one is picked by the configured policy.  Queued requests that are
+ * adjacent to the picked one, in the same direction and with the same
+ * options, are merged into a single transfer described by an
+ * IOMultiMemoryDescriptor; the device's completion is split back across the
+ * original requests.
+ *
+ * Policies:
+ *
+ * kPolicyFIFO issues requests in arrival order, merging only.
+ *
+ * kPolicyDeadline issues requests in ascending byte order from the current
+ * head position, wrapping around (C-LOOK), unless a request has waited past
+ * its deadline (the read or write expiry), in which case the oldest expired
+ * request goes first.
+ *
+ * kPolicyBudgetFair queues requests per priority band (see IOStoragePriority)
+ * and serves the bands by deficit round robin, each round granting a band a
+ * byte budget proportional to its weight, in C-LOOK order within a band.
+ *
+ * Under every policy a request is never issued, alone or merged into another
+ * transfer, ahead of an earlier queued request that overlaps it when either
+ * of the two is a write.  A priority of 0, as in zeroed attributes, counts as
+ * kIOStoragePriorityDefault.
+ *
+ * A driver embeds an instance, calls init() from start() and free() from
+ * free(), and routes executeRequest() through it.  Since executeRequest()
+ * and IOBlockStorageDriver::Context are protected, the driver supplies the
+ * function that performs the transfer, and one that stamps the start time of
+ * each request of a transfer, since executeRequest() only sees the context of
+ * the first:
+ *
+ * static void executeRequestDispatch(IOBlockStorageDriver * driver,
+ *                                    UInt64 byteStart,
+ *                                    IOMemoryDescriptor * buffer,
+ *                                    IOStorageAttributes * attributes,
+ *                                    IOStorageCompletion * completion,
+ *                                    void * context)
+ * {
+ *     ((MyDriver *) driver)->IOBlockStorageDriver::executeRequest(
+ *         byteStart, buffer, attributes, completion, (Context *) context);
+ * }
+ *
+ * static void executeRequestStarted(void * context, AbsoluteTime time)
+ * {
+ *     ((Context *) context)->timeStart = time;
+ * }
+ *
+ * void MyDriver::executeRequest(UInt64 byteStart, IOMemoryDescriptor * buffer,
+ *                               IOStorageAttributes * attributes,
+ *                               IOStorageCompletion * completion,
+ *                               Context * context)
+ * {
+ *     _scheduler.submit(byteStart, buffer, attributes, completion, context,
+ *                       context->block.type);
+ * }
+ *
+ * A merged transfer reuses the context of its first request, so requests
+ * only merge when their merge keys match; the block type is a suitable key.
+ * Since breakUpRequest() has already run on each request, merged transfers
+ * are also kept within the maximum byte and segment counts the device
+ * publishes (kIOMaximumByteCountReadKey and the like).  Segments are counted
+ * as the pages a buffer may span.
+ */
+
+class IOBlockStorageScheduler
+{
+public:
+
+    /*!
+     * @enum Policy
+     * @constant kPolicyFIFO Arrival order.
+     * @constant kPolicyDeadline Ascending byte order with read and write expiry.
+     * @constant kPolicyBudgetFair Deficit round robin over priority bands.
+     */
+
+    enum Policy
+    {
+        kPolicyFIFO,
+        kPolicyDeadline,
+        kPolicyBudgetFair
+    };
+
+    /*!
+     * @enum Statistics
+     * @discussion
+     * Indices for the different statistics that getStatistics() can report.
+     * @constant kStatisticsQueued Number of requests queued.
+     * @constant kStatisticsDispatched Number of transfers issued to the device.
+     * @constant kStatisticsMerged Number of requests merged into another transfer.
+     * @constant kStatisticsAllocated Number of requests queued in allocated entries, for lack of pool entries.
+     * @constant kStatisticsExpired Number of requests issued because their deadline passed.
+     */
+
+    enum Statistics
+    {
+        kStatisticsQueued,
+        kStatisticsDispatched,
+        kStatisticsMerged,
+        kStatisticsAllocated,
+        kStatisticsExpired
+    };
+
+    static const UInt32 kStatisticsCount = kStatisticsExpired + 1;
+
+    static const UInt32 kQueueMax = 128;
+
+    static const UInt32 kMergeCountMax = 32;
+
+    static const UInt32 kBandCount = 4;
+
+    /*!
+     * @typedef Dispatch
+     * @discussion
+     * Performs a transfer, normally with IOBlockStorageDriver::executeRequest().
+     * The context is an IOBlockStorageDriver::Context.
+     */
+
+    typedef void (*Dispatch)(IOBlockStorageDriver * driver,
+                             UInt64                 byteStart,
+                             IOMemoryDescriptor *   buffer,
+                             IOStorageAttributes *  attributes,
+                             IOStorageCompletion *  completion,
+                             void *                 context);
+
+    /*!
+     * @typedef Started
+     * @discussion
+     * Records the time a request is issued, normally in
+     * IOBlockStorageDriver::Context::timeStart.
+     */
+
+    typedef void (*Started)(void * context, AbsoluteTime time);
+
+    IOBlockStorageScheduler()
+    {
+        bzero(this, sizeof(*this));
+    }
+
+    /*!
+     * @function init
+     * @param driver
+     * Driver passed to dispatch.
+     * @param dispatch
+     * Function performing a transfer.
+     * @param started
+     * Function stamping the start time of each request of a transfer.
+     * @param policy
+     * Scheduling policy.  See Policy.
+     * @param depth
+     * Maximum number of transfers outstanding at the device.  A smaller depth
+     * gives the policy more requests to choose from.
+     * @param mergeByteCountMax
+     * Maximum size of a merged transfer, 0 to disable merging.  The device's
+     * own maximum applies as well.
+     * @param mergeCountMax
+     * Maximum number of requests in a merged transfer, up to kMergeCountMax.
+     * @result
+     * Returns true on success, false otherwise.
+     */
+
+    bool init(IOBlockStorageDriver * driver,
+              Dispatch               dispatch,
+              Started                started,
+              Policy                 policy            = kPolicyDeadline,
+              UInt32                 depth             = 4,
+              UInt64                 mergeByteCountMax = 1024 * 1024,
+              UInt32                 mergeCountMax     = 16)
+    {
+        if (driver == 0 || dispatch == 0 || started == 0 || depth == 0) return false;
+        if (mergeCountMax == 0 || mergeCountMax > kMergeCountMax) return false;
+
+        _lock = IOLockAlloc();
+        if (_lock == 0) return false;
+
+        _free = 0;
+
+        for (UInt32 index = 0; index < kQueueMax; index++)
+        {
+            _pool[index].next = _free;
+            _free = &_pool[index];
+        }
+
+        _driver            = driver;
+        _dispatch          = dispatch;
+        _started           = started;
+        _policy            = policy;
+        _depth             = depth;
+        _mergeByteCountMax = mergeByteCountMax;
+        _mergeCountMax     = mergeCountMax;
+
+        _byteCountMax[0]    = deviceLimit(kIOMaximumByteCountReadKey);
+        _byteCountMax[1]    = deviceLimit(kIOMaximumByteCountWriteKey);
+        _segmentCountMax[0] = deviceLimit(kIOMaximumSegmentCountReadKey);
+        _segmentCountMax[1] = deviceLimit(kIOMaximumSegmentCountWriteKey);
+
+        setExpiry(50 * 1000 * 1000, 500 * 1000 * 1000);
+
+        for (UInt32 band = 0; band < kBandCount; band++)
+        {
+            _weight[band] = 1 << (kBandCount - 1 - band);
+        }
+        _quantum = 128 * 1024;
+
+        return true;
+    }
+
+    /*!
+     * @function free
+     * @discussion
+     * Releases the scheduler's resources.  No request may be queued or
+     * outstanding, which holds once the driver has been stopped.
+     */
+
+    void free()
+    {
+        if (_lock) IOLockFree(_lock);
+        _lock = 0;
+    }
+
+    /*!
+     * @function setExpiry
+     * @discussion
+     * Sets the deadlines of kPolicyDeadline, relative to the time a request is
+     * queued.
+     * @param readNanoseconds
+     * Read expiry.
+     * @param writeNanoseconds
+     * Write expiry.
+     */
+
+    void setExpiry(UInt64 readNanoseconds, UInt64 writeNanoseconds)
+    {
+        nanoseconds_to_absolutetime(readNanoseconds,  &_expiry[0]);
+        nanoseconds_to_absolutetime(writeNanoseconds, &_expiry[1]);
+    }
+
+    /*!
+     * @function setBudget
+     * @discussion
+     * Sets the byte budget of kPolicyBudgetFair.  Each round a band is granted
+     * quantum times its weight; the defaults are 128 KiB and weights of 8, 4,
+     * 2 and 1 for the high, default, low and background bands.
+     * @param quantum
+     * Bytes per unit of weight.
+     * @param weights
+     * kBandCount weights, in IOStoragePriority order, or zero to keep them.
+     */
+
+    void setBudget(UInt64 quantum, const UInt32 * weights = 0)
+    {
+        IOLockLock(_lock);
+
+        if (quantum) _quantum = quantum;
+
+        for (UInt32 band = 0; weights && band < kBandCount; band++)
+        {
+            _weight[band] = weights[band] ? weights[band] : 1;
+        }
+
+        IOLockUnlock(_lock);
+    }
+
+    /*!
+     * @function submit
+     * @discussion
+     * Queues a block-aligned request, as passed to executeRequest(), and
+     * issues as many queued requests as the depth allows.
+     * @param byteStart
+     * Starting byte offset for the data transfer.
+     * @param buffer
+     * Buffer for the data transfer.  The size of the buffer implies the size
+     * of the data transfer.
+     * @param attributes
+     * Attributes of the data transfer.  See IOStorageAttributes.
+     * @param completion
+     * Completion routine to call once the data transfer is complete.
+     * @param context
+     * Context passed to dispatch.
+     * @param mergeKey
+     * Requests only merge with requests of the same key.
+     */
+
+    void submit(UInt64                byteStart,
+                IOMemoryDescriptor *  buffer,
+                IOStorageAttributes * attributes,
+                IOStorageCompletion * completion,
+                void *                context,
+                UInt32                mergeKey = 0)
+    {
+        Request * request;
+        Request ** link;
+        bool       allocated = false;
+
+        IOLockLock(_lock);
+
+        request = _free;
+
+        // Past the pool, requests are still queued, so that they keep their
+        // order against overlapping writes and count against the depth.
+
+        if (request == 0)
+        {
+            IOLockUnlock(_lock);
+
+            request = (Request *) IOMalloc(sizeof(Request));
+            if (request == 0)
+            {
+                IOStorage::complete(completion, kIOReturnNoMemory, 0);
+                return;
+            }
+            allocated = true;
+
+            IOLockLock(_lock);
+            _statistics[kStatisticsAllocated]++;
+        }
+        else
+        {
+            _free = request->next;
+        }
+
+        request->byteStart    = byteStart;
+        request->byteCount    = buffer->getLength();
+        request->segmentCount = (request->byteCount + PAGE_SIZE - 1) / PAGE_SIZE + 1;
+        request->buffer       = buffer;
+        request->completion   = *completion;
+        request->context      = context;
+        request->mergeKey     = mergeKey;
+        request->write        = (buffer->getDirection() == kIODirectionOut);
+        request->band         = (attributes && attributes->priority) ? (attributes->priority >> 6) : 1;
+        request->arrival      = ++_arrival;
+        request->merged       = 0;
+        request->mergeCount   = 1;
+        request->multi        = 0;
+        request->allocated    = allocated;
+
+        if (attributes) request->attributes = *attributes;
+        else bzero(&request->attributes, sizeof(request->attributes));
+
+        clock_get_uptime(&request->deadline);
+        request->deadline += _expiry[request->write];
+
+        // Keep each band sorted by byte offset.
+
+        for (link = &_queue[request->band]; *link && (*link)->byteStart <= byteStart; link = &(*link)->next) { }
+
+        request->next = *link;
+        *link = request;
+
+        _queued++;
+        _statistics[kStatisticsQueued]++;
+
+        IOLockUnlock(_lock);
+
+        run();
+    }
+
+    /*!
+     * @function getStatistics
+     * @discussion
+     * Reports the scheduler statistics, indexed by Statistics, in the manner of
+     * IOBlockStorageDriver::getStatistics().
+     * @param statistics
+     * Buffer that will receive the UInt64 statistic values.
+     * @param statisticsMaxCount
+     * Maximum number of statistic values that can be held in the buffer.
+     * @result
+     * Actual number of statistic values copied to the buffer, or if no buffer
+     * is given, the total number of statistic values available.
+     */
+
+    UInt32 getStatistics(UInt64 * statistics, UInt32 statisticsMaxCount) const
+    {
+        UInt32 count = (statisticsMaxCount < kStatisticsCount) ? statisticsMaxCount : kStatisticsCount;
+
+        if (statistics == 0 || statisticsMaxCount == 0) return kStatisticsCount;
+
+        for (UInt32 index = 0; index < count; index++)
+        {
+            statistics[index] = _statistics[index];
+        }
+
+        return count;
+    }
+
+    /*!
+     * @function getStatistic
+     * @param statistic
+     * Statistic index (an IOBlockStorageScheduler::Statistics index).
+     * @result
+     * Statistic value.
+     */
+
+    UInt64 getStatistic(Statistics statistic) const
+    {
+        return (statistic < kStatisticsCount) ? _statistics[statistic] : 0;
+    }
+
+protected:
+
+    struct Request
+    {
+        UInt64                    byteStart;
+        UInt64                    byteCount;
+        UInt64                    segmentCount; /* most segments the buffer can take */
+        IOMemoryDescriptor *      buffer;
+        IOStorageAttributes       attributes;
+        IOStorageCompletion       completion;
+        void *                    context;
+        UInt64                    deadline;
+        UInt64                    arrival;
+        UInt32                    mergeKey;
+        UInt32                    band;
+        bool                      write;
+        bool                      allocated;   /* by IOMalloc, not from the pool */
+
+        Request *                 next;        /* band queue, or free list */
+        Request *                 merged;      /* following requests of a merged transfer */
+        UInt32                    mergeCount;
+        IOMultiMemoryDescriptor * multi;
+    };
+
+    void unlink(Request * request)
+    {
+        Request ** link;
+
+        for (link = &_queue[request->band]; *link != request; link = &(*link)->next) { }
+
+        *link = request->next;
+        _queued--;
+    }
+
+    // Returns the first request at or after the head position in the given
+    // bands, wrapping around to the lowest byte offset.
+
+    Request * selectLook(UInt32 bandFirst, UInt32 bandLast)
+    {
+        Request * ahead = 0;
+        Request * lowest = 0;
+
+        for (UInt32 band = bandFirst; band <= bandLast; band++)
+        {
+            for (Request * request = _queue[band]; request; request = request->next)
+            {
+                if (lowest == 0 || request->byteStart < lowest->byteStart) lowest = request;
+
+                if (request->byteStart >= _head)
+                {
+                    if (ahead == 0 || request->byteStart < ahead->byteStart) ahead = request;
+                    break;
+                }
+            }
+        }
+
+        return ahead ? ahead : lowest;
+    }
+
+    // Returns a queued request that arrived before the given one and overlaps
+    // it, when either of the two is a write, or 0 if it may be issued.
+
+    Request * blocker(const Request * choice) const
+    {
+        for (UInt32 band = 0; band < kBandCount; band++)
+        {
+            for (Request * request = _queue[band]; request; request = request->next)
+            {
+                if (request->arrival < choice->arrival &&
+                    (request->write || choice->write) &&
+                    request->byteStart < choice->byteStart + choice->byteCount &&
+                    choice->byteStart < request->byteStart + request->byteCount)
+                {
+                    return request;
+                }
+            }
+        }
+
+        return 0;
+    }
+
+    Request * select()
+    {
+        Request * choice = 0;
+
+        if (_queued == 0) return 0;
+
+        if (_policy == kPolicyFIFO)
+        {
+            for (UInt32 band = 0; band < kBandCount; band++)
+            {
+                for (Request * request = _queue[band]; request; request = request->next)
+                {
+                    if (choice == 0 || request->arrival < choice->arrival) choice = request;
+                }
+            }
+        }
+        else if (_policy == kPolicyDeadline)
+        {
+            UInt64 now;
+
+            clock_get_uptime(&now);
+
+            for (UInt32 band = 0; band < kBandCount; band++)
+            {
+                for (Request * request = _queue[band]; request; request = request->next)
+                {
+                    if (request->deadline <= now && (choice == 0 || request->deadline < choice->deadline)) choice = request;
+                }
+            }
+
+            if (choice) _statistics[kStatisticsExpired]++;
+            else choice = selectLook(0, kBandCount - 1);
+        }
+        else
+        {
+            // Deficit round robin; a band keeps the turn while it has budget left.
+
+            while (choice == 0)
+            {
+                UInt32 band = _band;
+
+                if (_queue[band] == 0)
+                {
+                    _deficit[band] = 0;
+                    _band = (band + 1) % kBandCount;
+                }
+                else if (_deficit[band] <= 0)
+                {
+                    _deficit[band] += (SInt64) (_quantum * _weight[band]);
+                    if (_deficit[band] <= 0) _band = (band + 1) % kBandCount;
+                }
+                else
+                {
+                    choice = selectLook(band, band);
+                }
+            }
+        }
+
+        // Never pass an earlier overlapping request when either one writes.
+
+        for (Request * earlier = blocker(choice); earlier; earlier = blocker(choice))
+        {
+            choice = earlier;
+        }
+
+        unlink(choice);
+
+        return choice;
+    }
+
+    // Device limits, 0 when the device publishes none.
+
+    UInt64 deviceLimit(const char * key) const
+    {
+        IOService * provider = _driver->getProvider();
+        OSNumber *  number = provider ? OSDynamicCast(OSNumber, provider->getProperty(key)) : 0;
+
+        return number ? number->unsigned64BitValue() : 0;
+    }
+
+    bool mergeable(const Request * first, const Request * request, UInt64 byteCount, UInt64 segmentCount) const
+    {
+        UInt64 byteCountMax = _byteCountMax[first->write];
+        UInt64 segmentCountMax = _segmentCountMax[first->write];
+
+        return (request->write == first->write &&
+                request->mergeKey == first->mergeKey &&
+                request->attributes.options == first->attributes.options &&
+                (_policy != kPolicyBudgetFair || request->band == first->band) &&
+                byteCount + request->byteCount <= _mergeByteCountMax &&
+                (byteCountMax == 0 || byteCount + request->byteCount <= byteCountMax) &&
+                (segmentCountMax == 0 || segmentCount + request->segmentCount <= segmentCountMax));
+    }
+
+    // Collects queued requests adjacent to first, in byte order, into its
+    // merged list.  Returns the total byte count.
+
+    UInt64 merge(Request * first)
+    {
+        UInt64    byteStart = first->byteStart;
+        UInt64    byteCount = first->byteCount;
+        UInt64    segmentCount = first->segmentCount;
+        Request * head = first;
+        Request * tail = first;
+        bool      found = true;
+
+        while (found && first->mergeCount < _mergeCountMax)
+        {
+            found = false;
+
+            for (UInt32 band = 0; band < kBandCount && found == false; band++)
+            {
+                for (Request * request = _queue[band]; request; request = request->next)
+                {
+                    if (mergeable(first, request, byteCount, segmentCount) == false) continue;
+
+                    if (request->byteStart != byteStart + byteCount &&
+                        request->byteStart + request->byteCount != byteStart) continue;
+
+                    // Merging issues the request now, so it obeys the same
+                    // ordering as select().
+
+                    if (blocker(request)) continue;
+
+                    if (request->byteStart == byteStart + byteCount)
+                    {
+                        unlink(request);
+                        tail->merged = request;
+                        request->merged = 0;
+                        tail = request;
+                    }
+                    else
+                    {
+                        unlink(request);
+                        request->merged = head;
+                        head = request;
+                        byteStart = request->byteStart;
+                    }
+
+                    byteCount += request->byteCount;
+                    segmentCount += request->segmentCount;
+                    first->mergeCount++;
+                    found = true;
+                    break;
+                }
+            }
+        }
+
+        // The transfer is tracked through its lowest request.
+
+        if (head != first)
+        {
+            head->mergeCount = first->mergeCount;
+            first->mergeCount = 1;
+        }
+
+        _statistics[kStatisticsMerged] += head->mergeCount - 1;
+        _mergeHead = head;
+
+        return byteCount;
+    }
+
+    void run()
+    {
+        IOLockLock(_lock);
+
+        // Only one thread issues at a time; completions arriving meanwhile are
+        // picked up by the running thread, which rechecks the depth.
+
+        if (_running)
+        {
+            IOLockUnlock(_lock);
+            return;
+        }
+
+        _running = true;
+
+        while (_inflight < _depth && _queued)
+        {
+            Request * request = select();
+            UInt64    byteCount = request->byteCount;
+
+            if (_mergeByteCountMax)
+            {
+                byteCount = merge(request);
+                request = _mergeHead;
+            }
+
+            if (_policy == kPolicyBudgetFair) _deficit[request->band] -= (SInt64) byteCount;
+
+            _head = request->byteStart + byteCount;
+            _inflight++;
+            _statistics[kStatisticsDispatched]++;
+
+            IOLockUnlock(_lock);
+
+            issue(request);
+
+            IOLockLock(_lock);
+        }
+
+        _running = false;
+
+        IOLockUnlock(_lock);
+    }
+
+    void issue(Request * request)
+    {
+        IOStorageCompletion  completion;
+        IOMemoryDescriptor * buffer = request->buffer;
+        AbsoluteTime         now;
+
+        if (request->mergeCount > 1)
+        {
+            IOMemoryDescriptor * buffers[kMergeCountMax];
+            UInt32               count = 0;
+
+            for (Request * member = request; member; member = member->merged)
+            {
+                buffers[count++] = member->buffer;
+            }
+
+            request->multi = IOMultiMemoryDescriptor::withDescriptors(buffers,
+                                                                       count,
+                                                                       buffer->getDirection(),
+                                                                       false);
+
+            if (request->multi && request->multi->prepare() != kIOReturnSuccess)
+            {
+                request->multi->release();
+                request->multi = 0;
+            }
+
+            // Without a multi-descriptor, issue the members one by one.
+
+            if (request->multi == 0)
+            {
+                Request * member = request->merged;
+
+                request->merged = 0;
+                request->mergeCount = 1;
+
+                while (member)
+                {
+                    Request * next = member->merged;
+
+                    member->merged = 0;
+                    member->mergeCount = 1;
+
+                    IOLockLock(_lock);
+                    _inflight++;
+                    _statistics[kStatisticsDispatched]++;
+                    IOLockUnlock(_lock);
+
+                    issue(member);
+
+                    member = next;
+                }
+            }
+            else
+            {
+                buffer = request->multi;
+            }
+        }
+
+        // Every request of the transfer starts now, not just the one whose
+        // context the transfer carries.
+
+        clock_get_uptime(&now);
+
+        for (Request * member = request; member; member = member->merged)
+        {
+            _started(member->context, now);
+        }
+
+        completion.target    = this;
+        completion.action    = issueCompletion;
+        completion.parameter = request;
+
+        _dispatch(_driver, request->byteStart, buffer, &request->attributes, &completion, request->context);
+    }
+
+    static void issueCompletion(void *   target,
+                                void *   parameter,
+                                IOReturn status,
+                                UInt64   actualByteCount)
+    {
+        IOBlockStorageScheduler * self    = (IOBlockStorageScheduler *) target;
+        Request *                 request = (Request *) parameter;
+
+        if (request->multi)
+        {
+            request->multi->complete();
+            request->multi->release();
+            request->multi = 0;
+        }
+
+        // Hand each member its share of the transferred bytes, in byte order.
+
+        while (request)
+        {
+            Request *           next = request->merged;
+            IOStorageCompletion completion = request->completion;
+            UInt64              byteCount = (actualByteCount < request->byteCount) ? actualByteCount : request->byteCount;
+            IOReturn            memberStatus = status;
+
+            if (memberStatus == kIOReturnSuccess && byteCount < request->byteCount) memberStatus = kIOReturnUnderrun;
+
+            actualByteCount -= byteCount;
+
+            if (request->allocated)
+            {
+                IOFree(request, sizeof(Request));
+            }
+            else
+            {
+                IOLockLock(self->_lock);
+                request->next = self->_free;
+                self->_free = request;
+                IOLockUnlock(self->_lock);
+            }
+
+            IOStorage::complete(&completion, memberStatus, byteCount);
+
+            request = next;
+        }
+
+        IOLockLock(self->_lock);
+        self->_inflight--;
+        IOLockUnlock(self->_lock);
+
+        self->run();
+    }
+
+    IOBlockStorageDriver * _driver;
+    Dispatch               _dispatch;
+    Started                _started;
+    IOLock *               _lock;
+    Policy                 _policy;
+    UInt32                 _depth;
+    UInt64                 _mergeByteCountMax;
+    UInt32                 _mergeCountMax;
+    UInt64                 _byteCountMax[2];          /* read, write; 0 for no limit */
+    UInt64                 _segmentCountMax[2];       /* read, write; 0 for no limit */
+    UInt64                 _expiry[2];                /* read, write */
+    UInt64                 _quantum;
+    UInt32                 _weight[kBandCount];
+
+    Request                _pool[kQueueMax];
+    Request *              _free;
+    Request *              _queue[kBandCount];        /* per band, by byte offset */
+    Request *              _mergeHead;
+    UInt32                 _queued;
+    UInt32                 _inflight;
+    UInt64                 _arrival;
+    UInt64                 _head;                     /* byte after the last transfer */
+    UInt32                 _band;
+    SInt64                 _deficit[kBandCount];
+    bool                   _running;
+
+    UInt64                 _statistics[kStatisticsCount];
+};
+
+#endif /* __cplusplus */
+#endif /* KERNEL */
+#endif /* !_IOBLOCKSTORAGESCHEDULER_H */
@@ -0,0 +1,574 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*!
+ @header     IOUSBHostIsochronousScheduler.h
+ @brief      IOUSBHostIsochronousScheduler keeps an isochronous pipe supplied with frame lists.
+ */
+
+#ifndef IOUSBHostFamily_IOUSBHostIsochronousScheduler_h
+#define IOUSBHostFamily_IOUSBHostIsochronousScheduler_h
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/usb/IOUSBHostPipe.h>
+#include <IOKit/usb/IOUSBHostInterface.h>
+#include <kern/clock.h>
+#include <kern/thread_call.h>
+
+/*!
+ * @class       IOUSBHostIsochronousScheduler
+ * @brief       Rolling window of isochronous transfers for an IOUSBHostPipe
+ * @discussion  IOUSBHostIsochronousScheduler keeps a fixed number of isochronous transfers queued
+ *              back to back on a pipe.  Each transfer covers framesPerTransfer entries of its frame
+ *              list and is scheduled right after the previous one; the first transfer, and any
+ *              transfer that would start less than one frame ahead of the bus, is placed
+ *              <code>margin</code> frames after the current frame number instead.  Such a resync is
+ *              counted as an underrun along with the number of frames skipped.
+ *
+ *              Request counts are either a fixed packet size or, for endpoints paced by a feedback
+ *              endpoint, derived from a rate in samples per service interval in 16.16 fixed point:
+ *              the fractional part accumulates across packets, so a rate of 44.1 samples per frame
+ *              yields nine packets of 44 samples followed by one of 45.
+ *
+ *              For OUT pipes the fill handler is called with the request counts set and packs the
+ *              data of every packet back to back in the buffer.  For IN pipes each request count is
+ *              the max packet size.  In both directions the completion handler then sees the frame
+ *              list with its status and complete counts, after which the transfer is scheduled
+ *              again.  The frame list entries are service intervals: for a high speed endpoint
+ *              serviced every microframe, intervalsPerFrame is 8 and framesPerTransfer a multiple of it.
+ *
+ *              A transfer the pipe refuses to schedule again is reported to the completion handler
+ *              with the error, a NULL frame list and a frame list count of 0, counted, and retried
+ *              from the next frame until the pipe takes it or the scheduler is stopped.
+ */
+class IOUSBHostIsochronousScheduler
+{
+public:
+
+    /*!
+     * @enum        Statistics
+     * @brief       Indices for the different statistics that getStatistics() can report.
+     * @constant    kStatisticsTransfers Number of transfers completed.
+     * @constant    kStatisticsBytes Number of bytes transferred.
+     * @constant    kStatisticsUnderruns Number of times the schedule fell behind the bus and was resynchronized.
+     * @constant    kStatisticsFramesSkipped Number of bus frames left unscheduled by resynchronizations.
+     * @constant    kStatisticsOverruns Number of packets that overran, or transfers scheduled too far ahead.
+     * @constant    kStatisticsPacketErrors Number of packets that completed with another error.
+     * @constant    kStatisticsSubmitErrors Number of times a transfer could not be scheduled and was retried.
+     */
+    enum Statistics
+    {
+        kStatisticsTransfers,
+        kStatisticsBytes,
+        kStatisticsUnderruns,
+        kStatisticsFramesSkipped,
+        kStatisticsOverruns,
+        kStatisticsPacketErrors,
+        kStatisticsSubmitErrors
+    };
+
+    static const UInt32 kStatisticsCount = kStatisticsSubmitErrors + 1;
+
+    static const uint32_t kTransfersMax = 16;
+    static const uint32_t kFramesMax    = 64;
+
+    /*!
+     * @typedef     FillHandler
+     * @brief       Fills the buffer of an OUT transfer about to be scheduled.
+     */
+    typedef void (*FillHandler)(void* owner, IOBufferMemoryDescriptor* buffer, IOUSBHostIsochronousFrame* frameList,
+                                uint32_t frameListCount, uint64_t firstFrameNumber);
+
+    /*!
+     * @typedef     CompleteHandler
+     * @brief       Reports a completed transfer before it is scheduled again, or a transfer that could
+     *              not be scheduled, with a NULL frame list.
+     */
+    typedef void (*CompleteHandler)(void* owner, IOReturn status, IOBufferMemoryDescriptor* buffer,
+                                    IOUSBHostIsochronousFrame* frameList, uint32_t frameListCount, uint64_t firstFrameNumber);
+
+    IOUSBHostIsochronousScheduler()
+    {
+        bzero(this, sizeof(*this));
+    }
+
+    /*!
+     * @brief       Prepares the scheduler and allocates its transfers
+     * @param       interface Interface used to read the current frame number, retained by the scheduler.
+     * @param       pipe Isochronous pipe, retained by the scheduler.
+     * @param       fill Fill handler; required for OUT pipes, ignored for IN pipes.
+     * @param       complete Completion handler, or NULL.
+     * @param       owner Context passed to the handlers.
+     * @param       maxPacketSize Largest request count of one frame list entry.
+     * @param       framesPerTransfer Number of frame list entries of each transfer, at most kFramesMax.
+     * @param       transferCount Number of transfers kept queued, at most kTransfersMax.
+     * @param       margin Number of frames between the current frame and a (re)started schedule.
+     * @param       intervalsPerFrame Number of frame list entries per bus frame.
+     * @return      kIOReturnSuccess, kIOReturnBadArgument or kIOReturnNoMemory
+     */
+    IOReturn init(IOUSBHostInterface* interface, IOUSBHostPipe* pipe, FillHandler fill, CompleteHandler complete, void* owner,
+                  uint32_t maxPacketSize, uint32_t framesPerTransfer = 8, uint32_t transferCount = 4, uint32_t margin = 2,
+                  uint32_t intervalsPerFrame = 1)
+    {
+        const StandardUSB::EndpointDescriptor* descriptor;
+
+        if (interface == NULL || pipe == NULL || maxPacketSize == 0 || transferCount == 0 || transferCount > kTransfersMax ||
+            framesPerTransfer == 0 || framesPerTransfer > kFramesMax || intervalsPerFrame == 0 ||
+            framesPerTransfer % intervalsPerFrame || margin == 0)
+        {
+            return kIOReturnBadArgument;
+        }
+
+        descriptor = pipe->getEndpointDescriptor();
+        if (descriptor == NULL) return kIOReturnBadArgument;
+
+        _in = StandardUSB::getEndpointDirection(descriptor) == kEndpointDirectionIn;
+        if (_in == false && fill == NULL) return kIOReturnBadArgument;
+
+        _lock = IOLockAlloc();
+        if (_lock == NULL) return kIOReturnNoMemory;
+
+        _retryCall = thread_call_allocate(&IOUSBHostIsochronousScheduler::retry, this);
+        if (_retryCall == NULL)
+        {
+            free();
+            return kIOReturnNoMemory;
+        }
+
+        for (uint32_t index = 0; index < transferCount; index++)
+        {
+            IOBufferMemoryDescriptor* buffer;
+
+            buffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, _in ? kIODirectionIn : kIODirectionOut,
+                                                                 maxPacketSize * framesPerTransfer);
+            if (buffer && buffer->prepare() != kIOReturnSuccess)
+            {
+                buffer->release();
+                buffer = NULL;
+            }
+
+            if (buffer == NULL)
+            {
+                free();
+                return kIOReturnNoMemory;
+            }
+
+            _transfers[index].buffer = buffer;
+        }
+
+        interface->retain();
+        pipe->retain();
+
+        _interface         = interface;
+        _pipe              = pipe;
+        _fill              = fill;
+        _complete          = complete;
+        _owner             = owner;
+        _maxPacketSize     = maxPacketSize;
+        _packetSize        = maxPacketSize;
+        _framesPerTransfer = framesPerTransfer;
+        _transferCount     = transferCount;
+        _margin            = margin;
+        _intervalsPerFrame = intervalsPerFrame;
+
+        return kIOReturnSuccess;
+    }
+
+    /*!
+     * @brief       Releases the transfers, the pipe and the interface
+     * @discussion  The scheduler must be stopped first.
+     */
+    void free()
+    {
+        for (uint32_t index = 0; index < kTransfersMax; index++)
+        {
+            if (_transfers[index].buffer)
+            {
+                _transfers[index].buffer->complete();
+                _transfers[index].buffer->release();
+                _transfers[index].buffer = NULL;
+            }
+        }
+
+        if (_pipe) _pipe->release();
+        if (_interface) _interface->release();
+        if (_retryCall)
+        {
+            thread_call_cancel_wait(_retryCall);
+            thread_call_free(_retryCall);
+        }
+        if (_lock) IOLockFree(_lock);
+
+        _pipe      = NULL;
+        _interface = NULL;
+        _retryCall = NULL;
+        _lock      = NULL;
+    }
+
+    /*!
+     * @brief       Sets a fixed request count for OUT packets, the default being the max packet size
+     * @return      kIOReturnSuccess, or kIOReturnBadArgument if packetSize exceeds the max packet size
+     */
+    IOReturn setPacketSize(uint32_t packetSize)
+    {
+        if (packetSize > _maxPacketSize) return kIOReturnBadArgument;
+
+        IOLockLock(_lock);
+        _packetSize = packetSize;
+        _rate       = 0;
+        IOLockUnlock(_lock);
+
+        return kIOReturnSuccess;
+    }
+
+    /*!
+     * @brief       Paces OUT packets by a rate, typically read from a feedback endpoint
+     * @param       rate Samples per frame list entry in 16.16 fixed point.
+     * @param       bytesPerSample Size of one sample frame, all channels included.
+     * @return      kIOReturnSuccess, or kIOReturnBadArgument if a packet at this rate, rounded up to
+     *              whole samples, would exceed the max packet size
+     */
+    IOReturn setRate(uint32_t rate, uint32_t bytesPerSample)
+    {
+        if (rate == 0 || maxPacketBytes(rate, bytesPerSample) > _maxPacketSize) return kIOReturnBadArgument;
+
+        IOLockLock(_lock);
+        _rate           = rate;
+        _bytesPerSample = bytesPerSample;
+        IOLockUnlock(_lock);
+
+        return kIOReturnSuccess;
+    }
+
+    /*!
+     * @brief       Schedules every transfer, starting margin frames from now
+     * @return      kIOReturnSuccess, or the error of the first transfer that could not be scheduled
+     */
+    IOReturn start()
+    {
+        IOReturn status = kIOReturnSuccess;
+
+        IOLockLock(_lock);
+        _running   = true;
+        _scheduled = false;
+        IOLockUnlock(_lock);
+
+        for (uint32_t index = 0; index < _transferCount && status == kIOReturnSuccess; index++)
+        {
+            status = submit(&_transfers[index]);
+        }
+
+        return status;
+    }
+
+    /*!
+     * @brief       Stops rescheduling and aborts the queued transfers
+     * @discussion  Waits for the aborted transfers to complete, so it must not be called from a
+     *              handler or with the pipe's work loop held.
+     */
+    void stop()
+    {
+        IOLockLock(_lock);
+        _running = false;
+        IOLockUnlock(_lock);
+
+        // A retry already running finds the scheduler stopped.
+        thread_call_cancel_wait(_retryCall);
+
+        _pipe->abort(IOUSBHostIOSource::kAbortSynchronous, kIOReturnAborted);
+
+        for (uint32_t index = 0; index < _transferCount; index++)
+        {
+            _transfers[index].retry = false;
+        }
+    }
+
+    /*!
+     * @brief       Returns the frame number the next transfer will start on
+     */
+    uint64_t getNextFrameNumber() const
+    {
+        return _nextFrame;
+    }
+
+    /*!
+     * @brief       Reports the scheduler statistics, indexed by Statistics
+     * @param       statistics Buffer that will receive the UInt64 statistic values.
+     * @param       statisticsMaxCount Maximum number of statistic values that can be held in the buffer.
+     * @return      Actual number of statistic values copied to the buffer, or if no buffer is given,
+     *              the total number of statistic values available
+     */
+    UInt32 getStatistics(UInt64* statistics, UInt32 statisticsMaxCount) const
+    {
+        UInt32 count = (statisticsMaxCount < kStatisticsCount) ? statisticsMaxCount : kStatisticsCount;
+
+        if (statistics == NULL || statisticsMaxCount == 0) return kStatisticsCount;
+
+        for (UInt32 index = 0; index < count; index++)
+        {
+            statistics[index] = _statistics[index];
+        }
+
+        return count;
+    }
+
+    /*!
+     * @brief       Reports one of the scheduler statistics
+     */
+    UInt64 getStatistic(Statistics statistic) const
+    {
+        return (statistic < kStatisticsCount) ? _statistics[statistic] : 0;
+    }
+
+protected:
+
+    struct Transfer
+    {
+        IOBufferMemoryDescriptor* buffer;
+        IOUSBHostIsochronousFrame frames[kFramesMax];
+        uint64_t                  firstFrame;
+        bool                      retry;        // waiting for retry() to schedule it again
+    };
+
+    // Largest packet a rate produces: the fraction carried between packets
+    // adds at most one sample to the integer part.
+    static uint64_t maxPacketBytes(uint32_t rate, uint32_t bytesPerSample)
+    {
+        return (((uint64_t) rate + 0xffff) >> 16) * bytesPerSample;
+    }
+
+    // Reserves the next frames and sets the request counts; called with the lock held.
+    IOReturn reserve(Transfer* transfer)
+    {
+        // Clamping a packet would drop samples; refuse the rate instead.
+        if (_in == false && _rate && maxPacketBytes(_rate, _bytesPerSample) > _maxPacketSize)
+        {
+            return kIOReturnBadArgument;
+        }
+
+        uint64_t current = _interface->getFrameNumber();
+
+        if (_scheduled == false || _nextFrame <= current)
+        {
+            if (_scheduled)
+            {
+                _statistics[kStatisticsUnderruns]++;
+                _statistics[kStatisticsFramesSkipped] += current + _margin - _nextFrame;
+            }
+
+            _nextFrame = current + _margin;
+            _scheduled = true;
+        }
+
+        transfer->firstFrame = _nextFrame;
+        _nextFrame += _framesPerTransfer / _intervalsPerFrame;
+
+        for (uint32_t index = 0; index < _framesPerTransfer; index++)
+        {
+            IOUSBHostIsochronousFrame* frame = &transfer->frames[index];
+            uint32_t                   count = _packetSize;
+
+            if (_in)
+            {
+                count = _maxPacketSize;
+            }
+            else if (_rate)
+            {
+                _accumulator += _rate;
+                count = (_accumulator >> 16) * _bytesPerSample;
+                _accumulator &= 0xffff;
+            }
+
+            frame->status        = kIOReturnInvalid;
+            frame->requestCount  = count;
+            frame->completeCount = 0;
+            frame->reserved      = 0;
+        }
+
+        return kIOReturnSuccess;
+    }
+
+    IOReturn submit(Transfer* transfer)
+    {
+        IOUSBHostIsochronousCompletion completion;
+        IOReturn                       status = kIOReturnNotReady;
+
+        completion.owner     = this;
+        completion.action    = complete;
+        completion.parameter = transfer;
+
+        // A transfer refused as too old means the bus moved on while it was
+        // being filled; resynchronize once and try again.
+
+        for (uint32_t attempt = 0; attempt < 2; attempt++)
+        {
+            IOLockLock(_lock);
+            if (_running == false)
+            {
+                IOLockUnlock(_lock);
+                return kIOReturnNotReady;
+            }
+            if (attempt) _scheduled = false;
+            status = reserve(transfer);
+            IOLockUnlock(_lock);
+
+            if (status != kIOReturnSuccess) return status;
+
+            if (_in == false)
+            {
+                _fill(_owner, transfer->buffer, transfer->frames, _framesPerTransfer, transfer->firstFrame);
+            }
+
+            status = _pipe->io(transfer->buffer, transfer->frames, _framesPerTransfer, transfer->firstFrame, &completion);
+
+            IOLockLock(_lock);
+            if (status == kIOReturnIsoTooOld)
+            {
+                _statistics[kStatisticsUnderruns]++;
+                _statistics[kStatisticsFramesSkipped] += _framesPerTransfer / _intervalsPerFrame;
+            }
+            else if (status == kIOReturnIsoTooNew)
+            {
+                _statistics[kStatisticsOverruns]++;
+            }
+            IOLockUnlock(_lock);
+
+            if (status != kIOReturnIsoTooOld && status != kIOReturnIsoTooNew) break;
+        }
+
+        return status;
+    }
+
+    static void complete(void* owner, void* parameter, IOReturn status, IOUSBHostIsochronousFrame* frameList)
+    {
+        IOUSBHostIsochronousScheduler* scheduler = (IOUSBHostIsochronousScheduler*) owner;
+        Transfer*                      transfer = (Transfer*) parameter;
+        uint64_t                       bytes = 0;
+        uint32_t                       overruns = 0;
+        uint32_t                       errors = 0;
+        bool                           running;
+
+        for (uint32_t index = 0; index < scheduler->_framesPerTransfer; index++)
+        {
+            IOReturn frameStatus = frameList[index].status;
+
+            bytes += frameList[index].completeCount;
+
+            // Short IN packets are routine.
+            if (frameStatus == kIOReturnOverrun) overruns++;
+            else if (frameStatus != kIOReturnSuccess && frameStatus != kIOReturnUnderrun && status != kIOReturnAborted) errors++;
+        }
+
+        IOLockLock(scheduler->_lock);
+        scheduler->_statistics[kStatisticsTransfers]++;
+        scheduler->_statistics[kStatisticsBytes]        += bytes;
+        scheduler->_statistics[kStatisticsOverruns]     += overruns;
+        scheduler->_statistics[kStatisticsPacketErrors] += errors;
+        running = scheduler->_running;
+        IOLockUnlock(scheduler->_lock);
+
+        if (scheduler->_complete)
+        {
+            scheduler->_complete(scheduler->_owner, status, transfer->buffer, frameList, scheduler->_framesPerTransfer, transfer->firstFrame);
+        }
+
+        if (running && status != kIOReturnAborted) scheduler->resubmit(transfer);
+    }
+
+    // Schedules a transfer again, or leaves it to retry() from the next frame.
+    void resubmit(Transfer* transfer)
+    {
+        IOReturn status = submit(transfer);
+        uint64_t deadline;
+
+        // kIOReturnNotReady means the scheduler was stopped meanwhile.
+        if (status == kIOReturnSuccess || status == kIOReturnNotReady) return;
+
+        IOLockLock(_lock);
+        _statistics[kStatisticsSubmitErrors]++;
+        transfer->retry = true;
+        _scheduled      = false;
+        IOLockUnlock(_lock);
+
+        if (_complete)
+        {
+            _complete(_owner, status, transfer->buffer, NULL, 0, transfer->firstFrame);
+        }
+
+        // One frame is a millisecond at every bus speed.
+        clock_interval_to_deadline(1, kMillisecondScale, &deadline);
+        thread_call_enter_delayed(_retryCall, deadline);
+    }
+
+    static void retry(thread_call_param_t param0, thread_call_param_t param1)
+    {
+        IOUSBHostIsochronousScheduler* scheduler = (IOUSBHostIsochronousScheduler*) param0;
+
+        for (uint32_t index = 0; index < scheduler->_transferCount; index++)
+        {
+            Transfer* transfer = &scheduler->_transfers[index];
+            bool      pending;
+
+            IOLockLock(scheduler->_lock);
+            pending         = transfer->retry && scheduler->_running;
+            transfer->retry = false;
+            IOLockUnlock(scheduler->_lock);
+
+            if (pending) scheduler->resubmit(transfer);
+        }
+    }
+
+    IOUSBHostInterface* _interface;
+    IOUSBHostPipe*      _pipe;
+    FillHandler         _fill;
+    CompleteHandler     _complete;
+    void*               _owner;
+    IOLock*             _lock;
+    thread_call_t       _retryCall;
+
+    bool                _in;
+    bool                _running;
+    bool                _scheduled;
+
+    uint32_t            _maxPacketSize;
+    uint32_t            _packetSize;
+    uint32_t            _rate;              // samples per entry, 16.16
+    uint32_t            _bytesPerSample;
+    uint32_t            _accumulator;       // fractional samples carried between packets
+    uint32_t            _framesPerTransfer;
+    uint32_t            _transferCount;
+    uint32_t            _margin;
+    uint32_t            _intervalsPerFrame;
+    uint64_t            _nextFrame;
+
+    Transfer            _transfers[kTransfersMax];
+
+    UInt64              _statistics[kStatisticsCount];
+};
+
+#endif // IOUSBHostFamily_IOUSBHostIsochronousScheduler_h
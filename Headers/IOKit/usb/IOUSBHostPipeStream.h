@@ -0,0 +1,543 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*!
+ @header     IOUSBHostPipeStream.h
+ @brief      IOUSBHostPipeStream keeps a bulk or interrupt pipe busy with a ring of preallocated buffers.
+ */
+
+#ifndef IOUSBHostFamily_IOUSBHostPipeStream_h
+#define IOUSBHostFamily_IOUSBHostPipeStream_h
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/usb/IOUSBHostPipe.h>
+#include <kern/clock.h>
+
+/*!
+ * @class       IOUSBHostPipeStream
+ * @brief       Pipelined transfer engine for an IOUSBHostPipe
+ * @discussion  IOUSBHostPipeStream owns a ring of IOBufferMemoryDescriptors and keeps up to a
+ *              queue depth of them in flight on a bulk or interrupt pipe, using the bundled
+ *              completion variant of IOUSBHostPipe::io so that transfers finishing together are
+ *              reported with a single callback.
+ *
+ *              On an IN pipe the stream reissues every buffer as soon as the handler has consumed
+ *              it, so the handler must copy out whatever it keeps.  On an OUT pipe the client takes
+ *              a buffer with getBuffer(), fills it and passes it to write(); the buffer returns to
+ *              the ring once the transfer completes.
+ *
+ *              The queue depth moves between a minimum and a maximum: after every window of
+ *              completions it shrinks by one if the average completion latency exceeds the target,
+ *              and grows by one if it is under half the target.
+ *
+ *              A failed transfer halts the stream; the handler sees the error, and the client may
+ *              call resume() once the endpoint is usable again, for instance after
+ *              IOUSBHostPipe::clearStall().  The stream is a plain object meant to be embedded in
+ *              the function driver that owns the pipe.
+ */
+class IOUSBHostPipeStream
+{
+public:
+
+    /*!
+     * @enum        Statistics
+     * @brief       Indices for the different statistics that getStatistics() can report.
+     * @constant    kStatisticsTransfers Number of transfers completed.
+     * @constant    kStatisticsBytes Number of bytes transferred.
+     * @constant    kStatisticsErrors Number of transfers that failed or could not be issued.
+     * @constant    kStatisticsBundles Number of completion callbacks received.
+     * @constant    kStatisticsDepthChanges Number of queue depth adjustments.
+     */
+    enum Statistics
+    {
+        kStatisticsTransfers,
+        kStatisticsBytes,
+        kStatisticsErrors,
+        kStatisticsBundles,
+        kStatisticsDepthChanges
+    };
+
+    static const UInt32 kStatisticsCount = kStatisticsDepthChanges + 1;
+
+    static const UInt32 kBuffersMax = 64;
+
+    /*!
+     * @typedef     Handler
+     * @brief       Completion handler for a bundle of transfers, in submission order.
+     * @param       owner Owner given to init().
+     * @param       count Number of transfers in the bundle.
+     * @param       buffers Buffers of the transfers.
+     * @param       status Status of each transfer.
+     * @param       bytesTransferred Number of bytes transferred by each transfer.
+     */
+    typedef void (*Handler)(void* owner, uint32_t count, IOBufferMemoryDescriptor** buffers, IOReturn* status, uint32_t* bytesTransferred);
+
+    IOUSBHostPipeStream()
+    {
+        bzero(this, sizeof(*this));
+    }
+
+    /*!
+     * @brief       Prepares the stream and allocates its buffers
+     * @param       pipe Bulk or interrupt pipe, retained by the stream.
+     * @param       handler Completion handler.
+     * @param       owner Context passed to the handler.
+     * @param       bufferSize Size of each buffer, a multiple of the endpoint's max packet size.
+     * @param       bufferCount Number of buffers in the ring, at most kBuffersMax.
+     * @param       depthMin Minimum number of transfers in flight.
+     * @param       depthMax Maximum number of transfers in flight, at most bufferCount.
+     * @param       latencyTarget Completion latency, in microseconds, the depth adapts to; 0 keeps the depth at depthMax.
+     * @param       completionTimeoutMs Timeout of each transfer, 0 for none; must be 0 for interrupt pipes.
+     * @return      kIOReturnSuccess, kIOReturnBadArgument or kIOReturnNoMemory
+     */
+    IOReturn init(IOUSBHostPipe* pipe, Handler handler, void* owner, uint32_t bufferSize, uint32_t bufferCount = 8,
+                  uint32_t depthMin = 2, uint32_t depthMax = 8, uint32_t latencyTarget = 4000, uint32_t completionTimeoutMs = 0)
+    {
+        const StandardUSB::EndpointDescriptor* descriptor;
+
+        if (pipe == NULL || handler == NULL || bufferSize == 0 || bufferCount == 0 || bufferCount > kBuffersMax ||
+            depthMin == 0 || depthMin > depthMax || depthMax > bufferCount)
+        {
+            return kIOReturnBadArgument;
+        }
+
+        descriptor = pipe->getEndpointDescriptor();
+        if (descriptor == NULL) return kIOReturnBadArgument;
+
+        _in = StandardUSB::getEndpointDirection(descriptor) == kEndpointDirectionIn;
+
+        _lock = IOLockAlloc();
+        if (_lock == NULL) return kIOReturnNoMemory;
+
+        for (uint32_t index = 0; index < bufferCount; index++)
+        {
+            _slots[index].buffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, _in ? kIODirectionIn : kIODirectionOut, bufferSize);
+            if (_slots[index].buffer && _slots[index].buffer->prepare() != kIOReturnSuccess)
+            {
+                _slots[index].buffer->release();
+                _slots[index].buffer = NULL;
+            }
+
+            if (_slots[index].buffer == NULL)
+            {
+                free();
+                return kIOReturnNoMemory;
+            }
+
+            _free[index] = index;
+        }
+
+        pipe->retain();
+
+        _pipe          = pipe;
+        _handler       = handler;
+        _owner         = owner;
+        _bufferSize    = bufferSize;
+        _bufferCount   = bufferCount;
+        _freeCount     = bufferCount;
+        _depthMin      = depthMin;
+        _depthMax      = depthMax;
+        _depth         = latencyTarget ? depthMin : depthMax;
+        _latencyTarget = (uint64_t) latencyTarget * 1000;
+        _timeout       = completionTimeoutMs;
+        _stopped       = true;
+
+        return kIOReturnSuccess;
+    }
+
+    /*!
+     * @brief       Releases the buffers and the pipe
+     * @discussion  The stream must be stopped first.
+     */
+    void free()
+    {
+        for (uint32_t index = 0; index < kBuffersMax; index++)
+        {
+            if (_slots[index].buffer)
+            {
+                _slots[index].buffer->complete();
+                _slots[index].buffer->release();
+                _slots[index].buffer = NULL;
+            }
+        }
+
+        if (_pipe) _pipe->release();
+        if (_lock) IOLockFree(_lock);
+
+        _pipe = NULL;
+        _lock = NULL;
+    }
+
+    /*!
+     * @brief       Starts streaming
+     * @discussion  On an IN pipe this issues the first transfers; on an OUT pipe it allows write() to issue.
+     */
+    void start()
+    {
+        IOLockLock(_lock);
+        _stopped = false;
+        _halted  = false;
+        IOLockUnlock(_lock);
+
+        run();
+    }
+
+    /*!
+     * @brief       Resumes a stream halted by a failed transfer
+     */
+    void resume()
+    {
+        start();
+    }
+
+    /*!
+     * @brief       Stops streaming and aborts the transfers in flight
+     * @discussion  Waits for the aborted transfers to complete, so it must not be called from the
+     *              handler or with the pipe's work loop held.  Buffers queued by write() and not yet
+     *              issued are returned to the ring without being reported.
+     */
+    void stop()
+    {
+        IOLockLock(_lock);
+        _stopped = true;
+        while (_pendingCount)
+        {
+            _free[_freeCount++] = _pending[_pendingHead];
+            _pendingHead = (_pendingHead + 1) % kBuffersMax;
+            _pendingCount--;
+        }
+        IOLockUnlock(_lock);
+
+        _pipe->abort(IOUSBHostIOSource::kAbortSynchronous, kIOReturnAborted);
+    }
+
+    /*!
+     * @brief       Takes a free buffer of an OUT stream
+     * @return      Buffer to fill and pass to write(), or NULL if every buffer is in use
+     */
+    IOBufferMemoryDescriptor* getBuffer()
+    {
+        IOBufferMemoryDescriptor* buffer = NULL;
+
+        IOLockLock(_lock);
+        if (_in == false && _freeCount)
+        {
+            buffer = _slots[_free[--_freeCount]].buffer;
+        }
+        IOLockUnlock(_lock);
+
+        return buffer;
+    }
+
+    /*!
+     * @brief       Queues a buffer taken with getBuffer() for transfer on an OUT stream
+     * @param       buffer Buffer to transfer.
+     * @param       length Number of bytes to transfer, at most the buffer size.
+     * @return      kIOReturnSuccess if the handler will see the buffer, otherwise kIOReturnBadArgument
+     *              or kIOReturnNotReady if the stream is stopped; the buffer is then back in the ring
+     */
+    IOReturn write(IOBufferMemoryDescriptor* buffer, uint32_t length)
+    {
+        int index = find(buffer);
+
+        if (index < 0 || _in) return kIOReturnBadArgument;
+
+        IOLockLock(_lock);
+
+        if (length > _bufferSize || _stopped)
+        {
+            _free[_freeCount++] = (uint32_t) index;
+            IOLockUnlock(_lock);
+            return length > _bufferSize ? kIOReturnBadArgument : kIOReturnNotReady;
+        }
+
+        _slots[index].length = length;
+        _pending[(_pendingHead + _pendingCount) % kBuffersMax] = (uint32_t) index;
+        _pendingCount++;
+
+        IOLockUnlock(_lock);
+
+        run();
+
+        return kIOReturnSuccess;
+    }
+
+    /*!
+     * @brief       Returns the current queue depth
+     */
+    uint32_t getDepth() const
+    {
+        return _depth;
+    }
+
+    /*!
+     * @brief       Returns the average completion latency of the last window, in nanoseconds
+     */
+    uint64_t getLatency() const
+    {
+        return _latency;
+    }
+
+    /*!
+     * @brief       Reports the stream statistics, indexed by Statistics
+     * @param       statistics Buffer that will receive the UInt64 statistic values.
+     * @param       statisticsMaxCount Maximum number of statistic values that can be held in the buffer.
+     * @return      Actual number of statistic values copied to the buffer, or if no buffer is given,
+     *              the total number of statistic values available
+     */
+    UInt32 getStatistics(UInt64* statistics, UInt32 statisticsMaxCount) const
+    {
+        UInt32 count = (statisticsMaxCount < kStatisticsCount) ? statisticsMaxCount : kStatisticsCount;
+
+        if (statistics == NULL || statisticsMaxCount == 0) return kStatisticsCount;
+
+        for (UInt32 index = 0; index < count; index++)
+        {
+            statistics[index] = _statistics[index];
+        }
+
+        return count;
+    }
+
+    /*!
+     * @brief       Reports one of the stream statistics
+     */
+    UInt64 getStatistic(Statistics statistic) const
+    {
+        return (statistic < kStatisticsCount) ? _statistics[statistic] : 0;
+    }
+
+protected:
+
+    struct Slot
+    {
+        IOBufferMemoryDescriptor* buffer;
+        uint64_t                  issued;
+        uint32_t                  length;
+    };
+
+    static uint64_t now()
+    {
+        uint64_t time;
+        uint64_t nanoseconds;
+
+        clock_get_uptime(&time);
+        absolutetime_to_nanoseconds(time, &nanoseconds);
+
+        return nanoseconds;
+    }
+
+    int find(IOBufferMemoryDescriptor* buffer) const
+    {
+        for (uint32_t index = 0; index < _bufferCount; index++)
+        {
+            if (_slots[index].buffer == buffer) return (int) index;
+        }
+
+        return -1;
+    }
+
+    void run()
+    {
+        IOLockLock(_lock);
+
+        // Only one thread issues at a time, which keeps OUT transfers in write()
+        // order; completions arriving meanwhile are picked up by the running thread.
+
+        if (_running)
+        {
+            IOLockUnlock(_lock);
+            return;
+        }
+
+        _running = true;
+
+        while (_stopped == false && _halted == false && _inflight < _depth)
+        {
+            IOUSBHostBundledCompletion completion;
+            uint32_t                   index;
+            IOReturn                   status;
+
+            if (_in)
+            {
+                if (_freeCount == 0) break;
+                index = _free[--_freeCount];
+                _slots[index].length = _bufferSize;
+            }
+            else
+            {
+                if (_pendingCount == 0) break;
+                index = _pending[_pendingHead];
+                _pendingHead = (_pendingHead + 1) % kBuffersMax;
+                _pendingCount--;
+            }
+
+            _slots[index].issued = now();
+            _inflight++;
+
+            IOLockUnlock(_lock);
+
+            completion.owner     = this;
+            completion.action    = complete;
+            completion.parameter = &_slots[index];
+
+            status = _pipe->io(_slots[index].buffer, _slots[index].length, &completion, _timeout);
+
+            IOLockLock(_lock);
+
+            if (status != kIOReturnSuccess)
+            {
+                // Put the buffer back where it came from and halt until resume().
+                if (_in)
+                {
+                    _free[_freeCount++] = index;
+                }
+                else
+                {
+                    _pendingHead = (_pendingHead + kBuffersMax - 1) % kBuffersMax;
+                    _pending[_pendingHead] = index;
+                    _pendingCount++;
+                }
+
+                _inflight--;
+                _halted = true;
+                _statistics[kStatisticsErrors]++;
+            }
+        }
+
+        _running = false;
+
+        IOLockUnlock(_lock);
+    }
+
+    void adapt(uint64_t latency, uint32_t count)
+    {
+        _windowLatency += latency;
+        _windowCount   += count;
+
+        if (_windowCount < _depth) return;
+
+        _latency       = _windowLatency / _windowCount;
+        _windowLatency = 0;
+        _windowCount   = 0;
+
+        if (_latencyTarget == 0) return;
+
+        if (_latency > _latencyTarget && _depth > _depthMin)
+        {
+            _depth--;
+            _statistics[kStatisticsDepthChanges]++;
+        }
+        else if (_latency < _latencyTarget / 2 && _depth < _depthMax)
+        {
+            _depth++;
+            _statistics[kStatisticsDepthChanges]++;
+        }
+    }
+
+    static void complete(void* owner, uint32_t count, IOMemoryDescriptor** dataBufferArray, void** parameter,
+                         IOReturn* statusArray, uint32_t* actualByteCountArray)
+    {
+        IOUSBHostPipeStream*      stream = (IOUSBHostPipeStream*) owner;
+        IOBufferMemoryDescriptor* buffers[kBuffersMax];
+        uint64_t                  time = now();
+        uint64_t                  latency = 0;
+        uint64_t                  bytes = 0;
+        uint32_t                  errors = 0;
+
+        (void) dataBufferArray;
+
+        if (count > kBuffersMax) count = kBuffersMax;
+
+        for (uint32_t index = 0; index < count; index++)
+        {
+            Slot* slot = (Slot*) parameter[index];
+
+            buffers[index] = slot->buffer;
+            latency += time - slot->issued;
+            bytes   += actualByteCountArray[index];
+
+            if (statusArray[index] != kIOReturnSuccess && statusArray[index] != kIOReturnAborted) errors++;
+        }
+
+        IOLockLock(stream->_lock);
+        stream->_inflight -= count;
+        stream->_statistics[kStatisticsTransfers] += count;
+        stream->_statistics[kStatisticsBytes]     += bytes;
+        stream->_statistics[kStatisticsErrors]    += errors;
+        stream->_statistics[kStatisticsBundles]++;
+        if (errors == 0) stream->adapt(latency, count);
+        IOLockUnlock(stream->_lock);
+
+        stream->_handler(stream->_owner, count, buffers, statusArray, actualByteCountArray);
+
+        IOLockLock(stream->_lock);
+        for (uint32_t index = 0; index < count; index++)
+        {
+            stream->_free[stream->_freeCount++] = (uint32_t) ((Slot*) parameter[index] - stream->_slots);
+        }
+        if (errors) stream->_halted = true;
+        IOLockUnlock(stream->_lock);
+
+        stream->run();
+    }
+
+    IOUSBHostPipe* _pipe;
+    Handler        _handler;
+    void*          _owner;
+    IOLock*        _lock;
+
+    bool           _in;
+    bool           _stopped;
+    bool           _halted;
+    bool           _running;
+
+    uint32_t       _bufferSize;
+    uint32_t       _bufferCount;
+    uint32_t       _timeout;
+
+    Slot           _slots[kBuffersMax];
+    uint32_t       _free[kBuffersMax];          // stack of idle buffers
+    uint32_t       _freeCount;
+    uint32_t       _pending[kBuffersMax];       // ring of OUT buffers awaiting issue
+    uint32_t       _pendingHead;
+    uint32_t       _pendingCount;
+
+    uint32_t       _inflight;
+    uint32_t       _depth;
+    uint32_t       _depthMin;
+    uint32_t       _depthMax;
+    uint64_t       _latencyTarget;              // nanoseconds
+    uint64_t       _latency;
+    uint64_t       _windowLatency;
+    uint32_t       _windowCount;
+
+    UInt64         _statistics[kStatisticsCount];
+};
+
+#endif // IOUSBHostFamily_IOUSBHostPipeStream_h
@@ -0,0 +1,163 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ *
+ * Vector register state preservation for kernel code
+ */
+
+#ifndef _I386_SIMD_STATE_H_
+#define _I386_SIMD_STATE_H_
+
+/*
+ * The kernel does not save the user vector register file on entry, so kext
+ * code that uses SSE/AVX/AVX-512 (for example through target("...") function
+ * attributes) must preserve every register it may clobber. The helpers below
+ * wrap XSAVE/XRSTOR (or FXSAVE/FXRSTOR on processors without XSAVE) for the
+ * requested state components only.
+ *
+ * Usage:
+ *
+ *	simd_state_decl(SIMD_STATE_SIZE_AVX, state);
+ *	uint64_t saved = simd_state_save(&state, SIMD_STATE_AVX);
+ *	if (saved == SIMD_STATE_AVX) {
+ *		vector_worker(...);  // noinline, target("avx2")
+ *	}
+ *	simd_state_restore(&state, saved);
+ *
+ * The worker must not be inlined into the caller, which is compiled without
+ * vector support and must not carry vector values across the save/restore.
+ *
+ * A context switch does not preserve kernel vector registers either, so a
+ * successful simd_state_save() disables preemption and the matching
+ * simd_state_restore() enables it again. The worker runs non-preemptible:
+ * it must not block, and callers should bound the work done per save.
+ *
+ * Components enabled lazily by the kernel (AVX-512 is only enabled in XCR0
+ * for threads that used it) are reported as unavailable by
+ * simd_state_available() and are never saved.
+ */
+
+#if defined(__x86_64__)
+
+#include <sys/cdefs.h>
+#include <stdint.h>
+#include <string.h>
+#include <i386/cpuid.h>
+#include <i386/proc_reg.h>
+
+__BEGIN_DECLS
+
+#if defined(KERNEL)
+/* Exported by the kernel, but not declared by its public headers */
+extern void _disable_preemption(void);
+extern void _enable_preemption(void);
+#endif
+
+#define SIMD_STATE_SSE          (XFEM_SSE)
+#define SIMD_STATE_AVX          (XFEM_SSE | XFEM_YMM)
+#define SIMD_STATE_AVX512       (XFEM_SSE | XFEM_YMM | XFEM_ZMM)
+
+/* Standard (non-compacted) XSAVE area sizes, including the 64-byte header */
+#define SIMD_STATE_SIZE_SSE     576
+#define SIMD_STATE_SIZE_AVX     832
+#define SIMD_STATE_SIZE_AVX512  2688
+
+#define SIMD_STATE_HEADER_OFFSET 512
+#define SIMD_STATE_HEADER_SIZE   64
+
+#define simd_state_decl(_size_, _name_) \
+	struct { uint8_t area[_size_]; } __attribute__((aligned(64))) _name_
+
+/* Returns the subset of SIMD_STATE_AVX512 the current thread may use */
+static inline uint64_t
+simd_state_available(void)
+{
+	uint64_t features = cpuid_features();
+	uint32_t lo, hi;
+
+	if ((features & CPUID_FEATURE_XSAVE) == 0) {
+		return (features & CPUID_FEATURE_SSE2) ? SIMD_STATE_SSE : 0;
+	}
+
+	__asm__ volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (XCR0));
+	return (((uint64_t)hi << 32) | lo) & SIMD_STATE_AVX512;
+}
+
+/*
+ * Saves the requested components into a 64-byte aligned area of at least
+ * SIMD_STATE_SIZE_* bytes. Returns the components actually saved, which is
+ * the intersection of the request and simd_state_available(); callers must
+ * pass the same value to simd_state_restore(). Preemption stays disabled
+ * from a non-zero return until that restore.
+ */
+static inline uint64_t
+simd_state_save(void *area, uint64_t components)
+{
+	uint64_t features = cpuid_features();
+
+	components &= simd_state_available();
+	if (components == 0) {
+		return 0;
+	}
+
+#if defined(KERNEL)
+	_disable_preemption();
+#endif
+	if ((features & CPUID_FEATURE_XSAVE) == 0) {
+		__asm__ volatile ("fxsave (%0)" : : "r" (area) : "memory");
+		return components;
+	}
+
+	/* XRSTOR faults on a header with reserved bits set, XSAVE only writes XSTATE_BV */
+	memset((uint8_t *)area + SIMD_STATE_HEADER_OFFSET, 0, SIMD_STATE_HEADER_SIZE);
+	__asm__ volatile ("xsave (%0)"
+	    : : "r" (area), "a" ((uint32_t)components), "d" ((uint32_t)(components >> 32))
+	    : "memory");
+	return components;
+}
+
+static inline void
+simd_state_restore(const void *area, uint64_t components)
+{
+	if (components == 0) {
+		return;
+	}
+
+	if ((cpuid_features() & CPUID_FEATURE_XSAVE) == 0) {
+		__asm__ volatile ("fxrstor (%0)" : : "r" (area) : "memory");
+	} else {
+		__asm__ volatile ("xrstor (%0)"
+		    : : "r" (area), "a" ((uint32_t)components), "d" ((uint32_t)(components >> 32))
+		    : "memory");
+	}
+#if defined(KERNEL)
+	_enable_preemption();
+#endif
+}
+
+__END_DECLS
+
+#endif /* defined(__x86_64__) */
+
+#endif /* _I386_SIMD_STATE_H_ */
@@ -0,0 +1,376 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef KERN_BACKTRACE_AGGREGATOR_H
+#define KERN_BACKTRACE_AGGREGATOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/cdefs.h>
+#include <kern/backtrace.h>
+
+__BEGIN_DECLS
+
+/*
+ * A backtrace aggregator counts how often each distinct stack was sampled,
+ * in a fixed amount of memory supplied by the client, instead of storing
+ * every sample.  Samples are inserted without locks or allocation, so a
+ * profiler can feed it from timer or PMI context on any CPU.
+ *
+ * Stacks are kept in an open-addressed hash table of frame arrays.  A sample
+ * whose stack is not in the table claims an empty slot; when a slot is being
+ * claimed by another CPU, or the probe limit is reached, the sample is either
+ * stored in a later slot or counted as dropped, never waited for.  The same
+ * stack can therefore occupy more than one slot, which export merges naturally:
+ * flame graph tools sum identical collapsed stacks.
+ */
+
+#define BACKTRACE_AGGREGATOR_DEPTH_MAX  64
+#define BACKTRACE_AGGREGATOR_PROBES     32
+
+/* longest exported line: "0x<address>;" per frame, the count and a newline */
+#define BACKTRACE_AGGREGATOR_LINE_MAX(depth) \
+	((size_t)(depth) * (3 + 2 * sizeof(uintptr_t)) + 2 + 20 + 1)
+
+#define BACKTRACE_AGGREGATOR_SLOT_EMPTY 0ULL
+#define BACKTRACE_AGGREGATOR_SLOT_BUSY  1ULL
+
+struct backtrace_aggregator_slot {
+	uint64_t bas_hash;      /* stack hash, or SLOT_EMPTY / SLOT_BUSY */
+	uint64_t bas_count;
+	uint32_t bas_nframes;
+	uint32_t bas_truncated;
+};
+
+struct backtrace_aggregator {
+	struct backtrace_aggregator_slot *ba_slots;
+	uintptr_t *ba_frames;           /* ba_depth frames per slot */
+	uint32_t ba_nslots;             /* a power of 2 */
+	uint32_t ba_depth;
+	uint64_t ba_dropped;
+	uint64_t ba_stacks;
+};
+
+/*!
+ * @function backtrace_aggregator_size
+ *
+ * @abstract memory needed to hold a number of distinct stacks
+ *
+ * @param nstacks The number of distinct stacks, rounded up to a power of 2.
+ *
+ * @param depth The maximum number of frames kept per stack.
+ */
+static inline size_t
+backtrace_aggregator_size(uint32_t nstacks, uint32_t depth)
+{
+	size_t nslots = 1;
+
+	while (nslots < nstacks) {
+		nslots <<= 1;
+	}
+	return nslots * (sizeof(struct backtrace_aggregator_slot) + depth * sizeof(uintptr_t));
+}
+
+/*!
+ * @function backtrace_aggregator_init
+ *
+ * @abstract prepare an aggregator in client memory
+ *
+ * @discussion The memory is zeroed and must stay valid, and be accessible
+ * from the context samples are taken in, until the aggregator is no longer
+ * used.  Its size need not come from backtrace_aggregator_size(); the largest
+ * power of 2 number of stacks that fits is used.
+ *
+ * @param depth The maximum number of frames kept per stack, at most
+ * BACKTRACE_AGGREGATOR_DEPTH_MAX.  Deeper stacks are truncated to their
+ * innermost frames.
+ *
+ * @return false if depth is out of range or the memory cannot hold a stack.
+ */
+static inline bool
+backtrace_aggregator_init(struct backtrace_aggregator *ba, void *memory,
+    size_t size, uint32_t depth)
+{
+	size_t per_stack = sizeof(struct backtrace_aggregator_slot) + depth * sizeof(uintptr_t);
+	size_t nslots = 1;
+
+	if (depth == 0 || depth > BACKTRACE_AGGREGATOR_DEPTH_MAX || size < per_stack) {
+		return false;
+	}
+	while ((nslots << 1) * per_stack <= size && (nslots << 1) <= UINT32_MAX) {
+		nslots <<= 1;
+	}
+
+	__builtin_memset(memory, 0, nslots * per_stack);
+
+	ba->ba_slots = (struct backtrace_aggregator_slot *)memory;
+	ba->ba_frames = (uintptr_t *)(ba->ba_slots + nslots);
+	ba->ba_nslots = (uint32_t)nslots;
+	ba->ba_depth = depth;
+	ba->ba_dropped = 0;
+	ba->ba_stacks = 0;
+	return true;
+}
+
+static inline uint64_t
+backtrace_aggregator_hash(const uintptr_t *bt, unsigned int btlen)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL ^ btlen;
+
+	for (unsigned int i = 0; i < btlen; i++) {
+		hash = (hash ^ (uint64_t)bt[i]) * 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+	/* reserve the empty and busy markers */
+	return hash > BACKTRACE_AGGREGATOR_SLOT_BUSY ? hash : hash + 2;
+}
+
+/*!
+ * @function backtrace_aggregator_insert
+ *
+ * @abstract count one sample of a stack
+ *
+ * @discussion Safe to call concurrently from any context, including
+ * interrupt and PMI handlers; it neither blocks nor allocates.
+ *
+ * @param bt Return addresses as stored by backtrace(), innermost first.
+ *
+ * @param btlen The number of return addresses in bt.
+ *
+ * @param was_truncated Whether the backtrace itself was truncated.
+ *
+ * @return false if the sample had to be dropped.
+ */
+static inline bool
+backtrace_aggregator_insert(struct backtrace_aggregator *ba,
+    const uintptr_t *bt, unsigned int btlen, bool was_truncated)
+{
+	uint32_t mask = ba->ba_nslots - 1;
+	uint64_t hash;
+	uint32_t index;
+
+	if (btlen > ba->ba_depth) {
+		btlen = ba->ba_depth;
+		was_truncated = true;
+	}
+	hash = backtrace_aggregator_hash(bt, btlen);
+	index = (uint32_t)hash & mask;
+
+	for (unsigned int probe = 0; probe < BACKTRACE_AGGREGATOR_PROBES && probe <= mask;
+	    probe++, index = (index + 1) & mask) {
+		struct backtrace_aggregator_slot *slot = &ba->ba_slots[index];
+		uintptr_t *frames = &ba->ba_frames[(size_t)index * ba->ba_depth];
+		uint64_t state = __atomic_load_n(&slot->bas_hash, __ATOMIC_ACQUIRE);
+
+		if (state == BACKTRACE_AGGREGATOR_SLOT_EMPTY) {
+			if (!__atomic_compare_exchange_n(&slot->bas_hash, &state,
+			    BACKTRACE_AGGREGATOR_SLOT_BUSY, false, __ATOMIC_ACQUIRE,
+			    __ATOMIC_ACQUIRE)) {
+				/* lost the race; state now holds the winner's value */
+				if (state != hash) {
+					continue;
+				}
+			} else {
+				for (unsigned int i = 0; i < btlen; i++) {
+					frames[i] = bt[i];
+				}
+				slot->bas_nframes = btlen;
+				slot->bas_truncated = was_truncated;
+				slot->bas_count = 1;
+				__atomic_store_n(&slot->bas_hash, hash, __ATOMIC_RELEASE);
+				__atomic_fetch_add(&ba->ba_stacks, 1, __ATOMIC_RELAXED);
+				return true;
+			}
+		}
+
+		if (state != hash || slot->bas_nframes != btlen) {
+			continue;
+		}
+		unsigned int i = 0;
+		while (i < btlen && frames[i] == bt[i]) {
+			i++;
+		}
+		if (i == btlen) {
+			__atomic_fetch_add(&slot->bas_count, 1, __ATOMIC_RELAXED);
+			return true;
+		}
+	}
+
+	__atomic_fetch_add(&ba->ba_dropped, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+/*!
+ * @function backtrace_aggregator_sample_interrupted
+ *
+ * @abstract backtrace the interrupted context and count it
+ *
+ * @discussion Must be called from interrupt context, as backtrace_interrupted().
+ */
+static inline bool
+backtrace_aggregator_sample_interrupted(struct backtrace_aggregator *ba)
+{
+	uintptr_t bt[BACKTRACE_AGGREGATOR_DEPTH_MAX];
+	bool was_truncated = false;
+	unsigned int btlen;
+
+	btlen = backtrace_interrupted(bt, ba->ba_depth, &was_truncated);
+	return backtrace_aggregator_insert(ba, bt, btlen, was_truncated);
+}
+
+/*!
+ * @function backtrace_aggregator_samples
+ *
+ * @abstract count the samples inserted so far, including dropped samples
+ *
+ * @discussion Walks the table rather than keeping a shared counter that every
+ * CPU would write on every sample.
+ */
+static inline uint64_t
+backtrace_aggregator_samples(struct backtrace_aggregator *ba)
+{
+	uint64_t samples = __atomic_load_n(&ba->ba_dropped, __ATOMIC_RELAXED);
+
+	for (uint32_t index = 0; index < ba->ba_nslots; index++) {
+		struct backtrace_aggregator_slot *slot = &ba->ba_slots[index];
+
+		if (__atomic_load_n(&slot->bas_hash, __ATOMIC_ACQUIRE) > BACKTRACE_AGGREGATOR_SLOT_BUSY) {
+			samples += __atomic_load_n(&slot->bas_count, __ATOMIC_RELAXED);
+		}
+	}
+	return samples;
+}
+
+static inline size_t
+backtrace_aggregator_format_hex(char *buf, uintptr_t value)
+{
+	char digits[2 * sizeof(uintptr_t)];
+	size_t n = 0, len = 0;
+
+	do {
+		digits[n++] = "0123456789abcdef"[value & 0xf];
+		value >>= 4;
+	} while (value);
+
+	buf[len++] = '0';
+	buf[len++] = 'x';
+	while (n) {
+		buf[len++] = digits[--n];
+	}
+	return len;
+}
+
+/*!
+ * @function backtrace_aggregator_export
+ *
+ * @abstract write the aggregated stacks in collapsed-stack format
+ *
+ * @discussion Writes one line per stored stack, outermost frame first, with
+ * frames separated by semicolons and followed by a space and the sample
+ * count, as consumed by flamegraph.pl and similar tools.  Frames are written
+ * as hexadecimal addresses less slide, for symbolication against an unslid
+ * kernel or kext.  Only whole lines are written; call again with the
+ * returned cursor until it returns 0 to export everything.  Stacks inserted
+ * during an export may or may not be included.
+ *
+ * @param buf The buffer receiving the text, which is not NUL-terminated.
+ *
+ * @param len The size of buf, at least BACKTRACE_AGGREGATOR_LINE_MAX(depth).
+ *
+ * @param slide Subtracted from every frame address.
+ *
+ * @param cursor Slot to resume from, 0 initially; advanced past the exported
+ * stacks.
+ *
+ * @return The number of bytes written to buf.
+ */
+static inline size_t
+backtrace_aggregator_export(struct backtrace_aggregator *ba, char *buf,
+    size_t len, uintptr_t slide, uint32_t *cursor)
+{
+	size_t line_max = BACKTRACE_AGGREGATOR_LINE_MAX(ba->ba_depth);
+	size_t used = 0;
+	uint32_t index;
+
+	for (index = *cursor; index < ba->ba_nslots; index++) {
+		struct backtrace_aggregator_slot *slot = &ba->ba_slots[index];
+		uintptr_t *frames = &ba->ba_frames[(size_t)index * ba->ba_depth];
+		uint64_t state = __atomic_load_n(&slot->bas_hash, __ATOMIC_ACQUIRE);
+		uint64_t count;
+		char digits[20];
+		size_t n = 0;
+
+		if (state <= BACKTRACE_AGGREGATOR_SLOT_BUSY) {
+			continue;
+		}
+		if (len - used < line_max) {
+			break;
+		}
+
+		for (unsigned int i = slot->bas_nframes; i > 0; i--) {
+			used += backtrace_aggregator_format_hex(&buf[used], frames[i - 1] - slide);
+			buf[used++] = (i > 1) ? ';' : ' ';
+		}
+		if (slot->bas_nframes == 0) {
+			buf[used++] = '?';
+			buf[used++] = ' ';
+		}
+
+		count = __atomic_load_n(&slot->bas_count, __ATOMIC_RELAXED);
+		do {
+			digits[n++] = (char)('0' + count % 10);
+			count /= 10;
+		} while (count);
+		while (n) {
+			buf[used++] = digits[--n];
+		}
+		buf[used++] = '\n';
+	}
+
+	*cursor = index;
+	return used;
+}
+
+/*!
+ * @function backtrace_aggregator_reset
+ *
+ * @abstract forget every stack
+ *
+ * @discussion Must not race with insertions; stop sampling first.
+ */
+static inline void
+backtrace_aggregator_reset(struct backtrace_aggregator *ba)
+{
+	__builtin_memset(ba->ba_slots, 0, (size_t)ba->ba_nslots *
+	    (sizeof(struct backtrace_aggregator_slot) + ba->ba_depth * sizeof(uintptr_t)));
+	ba->ba_dropped = 0;
+	ba->ba_stacks = 0;
+}
+
+__END_DECLS
+
+#endif /* !defined(KERN_BACKTRACE_AGGREGATOR_H) */
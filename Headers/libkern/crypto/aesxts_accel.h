@@ -0,0 +1,574 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _CRYPTO_AESXTS_ACCEL_H
+#define _CRYPTO_AESXTS_ACCEL_H
+
+/*
+ * XTS-AES with AES-NI and VAES.
+ *
+ * xts_accel_* mirror the xts_* interfaces from aesxts.h and produce identical
+ * output (IEEE 1619-2007, 128-bit and 256-bit keys). Data is processed eight
+ * blocks at a time with AES-NI, or sixteen blocks at a time with VAES on
+ * 512-bit registers when the current thread has AVX-512 state enabled. The
+ * per-block tweaks of a batch are advanced together with carry-less multiply
+ * instead of sequential doubling.
+ *
+ * Processors without AES-NI and PCLMULQDQ, 192-bit keys and 32-bit builds use
+ * the corecrypto implementation behind xts_start(). Accelerated contexts set
+ * it up as well, for calls that cannot save the vector state they need.
+ *
+ * The AVX-512 save area (2.7 KB) lives in the context rather than on the
+ * kernel stack. Only one call at a time can hold it; a concurrent call on the
+ * same context uses AES-NI instead.
+ *
+ * Unlike xts_encrypt(), which panics, a length that is not a multiple of the
+ * block size is rejected with -1.
+ */
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#include <libkern/crypto/aesxts.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <i386/simd_state.h>
+#endif
+
+#define AES_XTS_ACCEL_BLOCK_SIZE        16
+#define AES_XTS_ACCEL_MAX_ROUNDS        14
+
+typedef struct {
+	uint8_t         ek[AES_XTS_ACCEL_MAX_ROUNDS + 1][AES_XTS_ACCEL_BLOCK_SIZE];   /* data key, encryption */
+	uint8_t         dk[AES_XTS_ACCEL_MAX_ROUNDS + 1][AES_XTS_ACCEL_BLOCK_SIZE];   /* data key, decryption */
+	uint8_t         tk[AES_XTS_ACCEL_MAX_ROUNDS + 1][AES_XTS_ACCEL_BLOCK_SIZE];   /* tweak key, encryption */
+	uint32_t        rounds;                                                        /* 0 when using fallback */
+	symmetric_xts   fallback;
+#if defined(__x86_64__)
+	uint32_t        vaes_busy;                                                     /* vaes_area is in use */
+	uint8_t         vaes_area[SIMD_STATE_SIZE_AVX512 + 63];                        /* aligned to 64 within */
+#endif
+} __attribute__((aligned(16))) symmetric_xts_accel;
+
+#if defined(__x86_64__)
+
+typedef long long xts_accel_v2di __attribute__((vector_size(16)));
+typedef unsigned long long xts_accel_v2du __attribute__((vector_size(16)));
+typedef int xts_accel_v4si __attribute__((vector_size(16)));
+typedef long long xts_accel_v2di_u __attribute__((vector_size(16), aligned(1), __may_alias__));
+typedef long long xts_accel_v8di __attribute__((vector_size(64)));
+typedef unsigned long long xts_accel_v8du __attribute__((vector_size(64)));
+typedef long long xts_accel_v8di_u __attribute__((vector_size(64), aligned(1), __may_alias__));
+
+#define XTS_ACCEL_TARGET_AESNI  __attribute__((target("sse2,aes,pclmul")))
+#define XTS_ACCEL_TARGET_VAES   __attribute__((target("avx512f,vaes,vpclmulqdq,aes,pclmul")))
+
+#define XTS_ACCEL_LOAD(p)       (*(const xts_accel_v2di_u *)(const void *)(p))
+#define XTS_ACCEL_STORE(p, v)   (*(xts_accel_v2di_u *)(void *)(p) = (v))
+
+static inline bool
+xts_accel_aesni_available(void)
+{
+	return (cpuid_features() & (CPUID_FEATURE_AES | CPUID_FEATURE_PCLMULQDQ)) ==
+	       (CPUID_FEATURE_AES | CPUID_FEATURE_PCLMULQDQ);
+}
+
+static inline bool
+xts_accel_vaes_available(void)
+{
+	return (cpuid_leaf7_features() & (CPUID_LEAF7_FEATURE_AVX512F | CPUID_LEAF7_FEATURE_VAES |
+	       CPUID_LEAF7_FEATURE_VPCLMULQDQ)) == (CPUID_LEAF7_FEATURE_AVX512F |
+	       CPUID_LEAF7_FEATURE_VAES | CPUID_LEAF7_FEATURE_VPCLMULQDQ);
+}
+
+/*
+ * Key schedule. aeskeygenassist needs an immediate round constant, hence the
+ * macros. XTS_ACCEL_SPREAD computes k ^ (k << 32) ^ (k << 64) ^ (k << 96).
+ */
+#define XTS_ACCEL_SPREAD(k) ({                                                  \
+	xts_accel_v4si _z = { 0, 0, 0, 0 };                                     \
+	xts_accel_v4si _k = (xts_accel_v4si)(k);                                \
+	xts_accel_v4si _s = __builtin_shufflevector(_k, _z, 4, 0, 1, 2);        \
+	_k ^= _s;                                                               \
+	_s = __builtin_shufflevector(_s, _z, 4, 0, 1, 2);                       \
+	_k ^= _s;                                                               \
+	_s = __builtin_shufflevector(_s, _z, 4, 0, 1, 2);                       \
+	(xts_accel_v2di)(_k ^ _s);                                              \
+})
+
+#define XTS_ACCEL_ASSIST(prev, src, rcon, word) ({                              \
+	xts_accel_v4si _a = (xts_accel_v4si)                                    \
+	    __builtin_ia32_aeskeygenassist128((src), (rcon));                   \
+	_a = __builtin_shufflevector(_a, _a, word, word, word, word);           \
+	XTS_ACCEL_SPREAD(prev) ^ (xts_accel_v2di)_a;                            \
+})
+
+#define XTS_ACCEL_EXPAND128(rk, i, rcon)                                        \
+	(rk)[i] = XTS_ACCEL_ASSIST((rk)[(i) - 1], (rk)[(i) - 1], rcon, 3)
+
+#define XTS_ACCEL_EXPAND256(rk, i, rcon)                                        \
+	(rk)[i] = XTS_ACCEL_ASSIST((rk)[(i) - 2], (rk)[(i) - 1], rcon, 3)
+
+#define XTS_ACCEL_EXPAND256_ODD(rk, i)                                          \
+	(rk)[i] = XTS_ACCEL_ASSIST((rk)[(i) - 2], (rk)[(i) - 1], 0, 2)
+
+static inline __attribute__((always_inline)) XTS_ACCEL_TARGET_AESNI void
+xts_accel_expand_key(const uint8_t *key, uint32_t rounds, xts_accel_v2di *rk)
+{
+	rk[0] = XTS_ACCEL_LOAD(key);
+	if (rounds == 10) {
+		XTS_ACCEL_EXPAND128(rk, 1, 0x01);
+		XTS_ACCEL_EXPAND128(rk, 2, 0x02);
+		XTS_ACCEL_EXPAND128(rk, 3, 0x04);
+		XTS_ACCEL_EXPAND128(rk, 4, 0x08);
+		XTS_ACCEL_EXPAND128(rk, 5, 0x10);
+		XTS_ACCEL_EXPAND128(rk, 6, 0x20);
+		XTS_ACCEL_EXPAND128(rk, 7, 0x40);
+		XTS_ACCEL_EXPAND128(rk, 8, 0x80);
+		XTS_ACCEL_EXPAND128(rk, 9, 0x1b);
+		XTS_ACCEL_EXPAND128(rk, 10, 0x36);
+	} else {
+		rk[1] = XTS_ACCEL_LOAD(key + AES_XTS_ACCEL_BLOCK_SIZE);
+		XTS_ACCEL_EXPAND256(rk, 2, 0x01);
+		XTS_ACCEL_EXPAND256_ODD(rk, 3);
+		XTS_ACCEL_EXPAND256(rk, 4, 0x02);
+		XTS_ACCEL_EXPAND256_ODD(rk, 5);
+		XTS_ACCEL_EXPAND256(rk, 6, 0x04);
+		XTS_ACCEL_EXPAND256_ODD(rk, 7);
+		XTS_ACCEL_EXPAND256(rk, 8, 0x08);
+		XTS_ACCEL_EXPAND256_ODD(rk, 9);
+		XTS_ACCEL_EXPAND256(rk, 10, 0x10);
+		XTS_ACCEL_EXPAND256_ODD(rk, 11);
+		XTS_ACCEL_EXPAND256(rk, 12, 0x20);
+		XTS_ACCEL_EXPAND256_ODD(rk, 13);
+		XTS_ACCEL_EXPAND256(rk, 14, 0x40);
+	}
+}
+
+static __attribute__((noinline, unused)) XTS_ACCEL_TARGET_AESNI void
+xts_accel_aesni_schedule(const uint8_t *key1, const uint8_t *key2, symmetric_xts_accel *xts)
+{
+	xts_accel_v2di ek[AES_XTS_ACCEL_MAX_ROUNDS + 1];
+	xts_accel_v2di tk[AES_XTS_ACCEL_MAX_ROUNDS + 1];
+	uint32_t rounds = xts->rounds;
+	uint32_t i;
+
+	xts_accel_expand_key(key1, rounds, ek);
+	xts_accel_expand_key(key2, rounds, tk);
+
+	for (i = 0; i <= rounds; i++) {
+		XTS_ACCEL_STORE(xts->ek[i], ek[i]);
+		XTS_ACCEL_STORE(xts->tk[i], tk[i]);
+	}
+
+	/* Equivalent inverse cipher schedule for aesdec */
+	XTS_ACCEL_STORE(xts->dk[0], ek[rounds]);
+	for (i = 1; i < rounds; i++) {
+		XTS_ACCEL_STORE(xts->dk[i], __builtin_ia32_aesimc128(ek[rounds - i]));
+	}
+	XTS_ACCEL_STORE(xts->dk[rounds], ek[0]);
+
+	memset(ek, 0, sizeof(ek));
+	memset(tk, 0, sizeof(tk));
+}
+
+/*
+ * Multiplies both 128-bit tweaks of t by alpha^n in GF(2^128) modulo
+ * x^128 + x^7 + x^2 + x + 1 (n <= 56): shift left by n and fold the bits
+ * shifted out of the top back in with a carry-less multiply by 0x87.
+ */
+#define XTS_ACCEL_MUL_ALPHA(t, n) ({                                            \
+	xts_accel_v2du _z = { 0, 0 };                                           \
+	xts_accel_v2di _p = { 0x87, 0 };                                        \
+	xts_accel_v2du _c = (xts_accel_v2du)(t) >> (64 - (n));                  \
+	xts_accel_v2du _s = (xts_accel_v2du)(t) << (n);                         \
+	_s ^= __builtin_shufflevector(_c, _z, 2, 0);                            \
+	(xts_accel_v2di)_s ^ __builtin_ia32_pclmulqdq128((xts_accel_v2di)_c, _p, 0x01); \
+})
+
+#define XTS_ACCEL_ROUND(x, k, dec)                                              \
+	((dec) ? __builtin_ia32_aesdec128((x), (k)) : __builtin_ia32_aesenc128((x), (k)))
+#define XTS_ACCEL_LAST(x, k, dec)                                               \
+	((dec) ? __builtin_ia32_aesdeclast128((x), (k)) : __builtin_ia32_aesenclast128((x), (k)))
+
+#define XTS_ACCEL_LANES 8
+
+/* Explicitly unrolled so that the lanes stay in registers at -Os */
+#define XTS_ACCEL_UNROLL4(m)    m(0) m(1) m(2) m(3)
+#define XTS_ACCEL_UNROLL8(m)    XTS_ACCEL_UNROLL4(m) m(4) m(5) m(6) m(7)
+
+/*
+ * Processes blocks starting at the encrypted tweak *tweak and stores the
+ * tweak of the following block back.
+ */
+static inline __attribute__((always_inline)) XTS_ACCEL_TARGET_AESNI void
+xts_accel_aesni_blocks(const symmetric_xts_accel *xts, const uint8_t *in, uint8_t *out,
+    size_t blocks, uint8_t *tweak, const bool dec)
+{
+	const uint8_t (*keys)[AES_XTS_ACCEL_BLOCK_SIZE] = dec ? xts->dk : xts->ek;
+	xts_accel_v2di rk[AES_XTS_ACCEL_MAX_ROUNDS + 1];
+	xts_accel_v2di t[XTS_ACCEL_LANES];
+	xts_accel_v2di x[XTS_ACCEL_LANES];
+	xts_accel_v2di k;
+	uint32_t rounds = xts->rounds;
+	uint32_t r, i;
+
+	for (r = 0; r <= rounds; r++) {
+		rk[r] = XTS_ACCEL_LOAD(keys[r]);
+	}
+
+	t[0] = XTS_ACCEL_LOAD(tweak);
+	for (i = 1; i < XTS_ACCEL_LANES; i++) {
+		t[i] = XTS_ACCEL_MUL_ALPHA(t[i - 1], 1);
+	}
+
+#define XTS_ACCEL_WHITEN(i)                                                     \
+	x[i] = XTS_ACCEL_LOAD(in + (i) * AES_XTS_ACCEL_BLOCK_SIZE) ^ t[i] ^ k;
+#define XTS_ACCEL_MIDDLE(i)                                                     \
+	x[i] = XTS_ACCEL_ROUND(x[i], k, dec);
+#define XTS_ACCEL_FINAL(i)                                                      \
+	x[i] = XTS_ACCEL_LAST(x[i], k, dec);                                    \
+	XTS_ACCEL_STORE(out + (i) * AES_XTS_ACCEL_BLOCK_SIZE, x[i] ^ t[i]);     \
+	t[i] = XTS_ACCEL_MUL_ALPHA(t[i], XTS_ACCEL_LANES);
+
+	for (; blocks >= XTS_ACCEL_LANES; blocks -= XTS_ACCEL_LANES) {
+		k = rk[0];
+		XTS_ACCEL_UNROLL8(XTS_ACCEL_WHITEN)
+		for (r = 1; r < rounds; r++) {
+			k = rk[r];
+			XTS_ACCEL_UNROLL8(XTS_ACCEL_MIDDLE)
+		}
+		k = rk[rounds];
+		XTS_ACCEL_UNROLL8(XTS_ACCEL_FINAL)
+		in += XTS_ACCEL_LANES * AES_XTS_ACCEL_BLOCK_SIZE;
+		out += XTS_ACCEL_LANES * AES_XTS_ACCEL_BLOCK_SIZE;
+	}
+
+#undef XTS_ACCEL_WHITEN
+#undef XTS_ACCEL_MIDDLE
+#undef XTS_ACCEL_FINAL
+
+	/* t[0..blocks) already hold the tweaks of the tail */
+	for (i = 0; i < blocks; i++) {
+		x[0] = XTS_ACCEL_LOAD(in) ^ t[i] ^ rk[0];
+		for (r = 1; r < rounds; r++) {
+			x[0] = XTS_ACCEL_ROUND(x[0], rk[r], dec);
+		}
+		x[0] = XTS_ACCEL_LAST(x[0], rk[rounds], dec);
+		XTS_ACCEL_STORE(out, x[0] ^ t[i]);
+		in += AES_XTS_ACCEL_BLOCK_SIZE;
+		out += AES_XTS_ACCEL_BLOCK_SIZE;
+	}
+
+	XTS_ACCEL_STORE(tweak, t[blocks]);
+	memset(rk, 0, sizeof(rk));
+}
+
+static __attribute__((noinline, unused)) XTS_ACCEL_TARGET_AESNI void
+xts_accel_aesni_tweak(const symmetric_xts_accel *xts, const uint8_t *iv, uint8_t *tweak)
+{
+	xts_accel_v2di t = XTS_ACCEL_LOAD(iv) ^ XTS_ACCEL_LOAD(xts->tk[0]);
+	uint32_t r;
+
+	for (r = 1; r < xts->rounds; r++) {
+		t = __builtin_ia32_aesenc128(t, XTS_ACCEL_LOAD(xts->tk[r]));
+	}
+	XTS_ACCEL_STORE(tweak, __builtin_ia32_aesenclast128(t, XTS_ACCEL_LOAD(xts->tk[r])));
+}
+
+static __attribute__((noinline, unused)) XTS_ACCEL_TARGET_AESNI void
+xts_accel_aesni_encrypt(const symmetric_xts_accel *xts, const uint8_t *in, uint8_t *out,
+    size_t blocks, uint8_t *tweak)
+{
+	xts_accel_aesni_blocks(xts, in, out, blocks, tweak, false);
+}
+
+static __attribute__((noinline, unused)) XTS_ACCEL_TARGET_AESNI void
+xts_accel_aesni_decrypt(const symmetric_xts_accel *xts, const uint8_t *in, uint8_t *out,
+    size_t blocks, uint8_t *tweak)
+{
+	xts_accel_aesni_blocks(xts, in, out, blocks, tweak, true);
+}
+
+#define XTS_ACCEL_VAES_REGS     4
+#define XTS_ACCEL_VAES_BLOCKS   (XTS_ACCEL_VAES_REGS * 4)
+
+#define XTS_ACCEL_VAES_OP(op, x, k)                                             \
+	__asm__ (op " %1, %0, %0" : "+v" (x) : "v" (k))
+
+/* Same as XTS_ACCEL_MUL_ALPHA for the four tweaks of a 512-bit register */
+#define XTS_ACCEL_MUL_ALPHA512(t, n) ({                                         \
+	xts_accel_v8du _z = { 0, 0, 0, 0, 0, 0, 0, 0 };                         \
+	xts_accel_v8di _p = { 0x87, 0, 0x87, 0, 0x87, 0, 0x87, 0 };             \
+	xts_accel_v8du _c = (xts_accel_v8du)(t) >> (64 - (n));                  \
+	xts_accel_v8du _s = (xts_accel_v8du)(t) << (n);                         \
+	xts_accel_v8di _m;                                                      \
+	_s ^= __builtin_shufflevector(_c, _z, 8, 0, 8, 2, 8, 4, 8, 6);          \
+	__asm__ ("vpclmulqdq $0x01, %2, %1, %0" : "=v" (_m) : "v" (_c), "v" (_p)); \
+	(xts_accel_v8di)_s ^ _m;                                                \
+})
+
+/* Processes a multiple of XTS_ACCEL_VAES_BLOCKS blocks, see xts_accel_aesni_blocks */
+static inline __attribute__((always_inline)) XTS_ACCEL_TARGET_VAES void
+xts_accel_vaes_blocks(const symmetric_xts_accel *xts, const uint8_t *in, uint8_t *out,
+    size_t blocks, uint8_t *tweak, const bool dec)
+{
+	const uint8_t (*keys)[AES_XTS_ACCEL_BLOCK_SIZE] = dec ? xts->dk : xts->ek;
+	xts_accel_v8di rk[AES_XTS_ACCEL_MAX_ROUNDS + 1];
+	xts_accel_v8di t[XTS_ACCEL_VAES_REGS];
+	xts_accel_v8di x[XTS_ACCEL_VAES_REGS];
+	xts_accel_v2di t1[XTS_ACCEL_VAES_BLOCKS];
+	xts_accel_v8di k;
+	uint32_t rounds = xts->rounds;
+	uint32_t r, i;
+
+	for (r = 0; r <= rounds; r++) {
+		xts_accel_v2di k1 = XTS_ACCEL_LOAD(keys[r]);
+		rk[r] = (xts_accel_v8di) {
+			k1[0], k1[1], k1[0], k1[1], k1[0], k1[1], k1[0], k1[1]
+		};
+	}
+
+	t1[0] = XTS_ACCEL_LOAD(tweak);
+	for (i = 1; i < XTS_ACCEL_VAES_BLOCKS; i++) {
+		t1[i] = XTS_ACCEL_MUL_ALPHA(t1[i - 1], 1);
+	}
+	for (i = 0; i < XTS_ACCEL_VAES_REGS; i++) {
+		t[i] = *(const xts_accel_v8di_u *)(const void *)&t1[i * 4];
+	}
+
+#define XTS_ACCEL_WHITEN(i)                                                     \
+	x[i] = *(const xts_accel_v8di_u *)(const void *)(in + (i) * 64) ^ t[i] ^ k;
+#define XTS_ACCEL_MIDDLE(i)                                                     \
+	if (dec) {                                                              \
+		XTS_ACCEL_VAES_OP("vaesdec", x[i], k);                          \
+	} else {                                                                \
+		XTS_ACCEL_VAES_OP("vaesenc", x[i], k);                          \
+	}
+#define XTS_ACCEL_FINAL(i)                                                      \
+	if (dec) {                                                              \
+		XTS_ACCEL_VAES_OP("vaesdeclast", x[i], k);                      \
+	} else {                                                                \
+		XTS_ACCEL_VAES_OP("vaesenclast", x[i], k);                      \
+	}                                                                       \
+	*(xts_accel_v8di_u *)(void *)(out + (i) * 64) = x[i] ^ t[i];            \
+	t[i] = XTS_ACCEL_MUL_ALPHA512(t[i], XTS_ACCEL_VAES_BLOCKS);
+
+	for (; blocks >= XTS_ACCEL_VAES_BLOCKS; blocks -= XTS_ACCEL_VAES_BLOCKS) {
+		k = rk[0];
+		XTS_ACCEL_UNROLL4(XTS_ACCEL_WHITEN)
+		for (r = 1; r < rounds; r++) {
+			k = rk[r];
+			XTS_ACCEL_UNROLL4(XTS_ACCEL_MIDDLE)
+		}
+		k = rk[rounds];
+		XTS_ACCEL_UNROLL4(XTS_ACCEL_FINAL)
+		in += XTS_ACCEL_VAES_BLOCKS * AES_XTS_ACCEL_BLOCK_SIZE;
+		out += XTS_ACCEL_VAES_BLOCKS * AES_XTS_ACCEL_BLOCK_SIZE;
+	}
+
+#undef XTS_ACCEL_WHITEN
+#undef XTS_ACCEL_MIDDLE
+#undef XTS_ACCEL_FINAL
+
+	XTS_ACCEL_STORE(tweak, ((xts_accel_v2di) { t[0][0], t[0][1] }));
+	memset(rk, 0, sizeof(rk));
+}
+
+static __attribute__((noinline, unused)) XTS_ACCEL_TARGET_VAES void
+xts_accel_vaes_encrypt(const symmetric_xts_accel *xts, const uint8_t *in, uint8_t *out,
+    size_t blocks, uint8_t *tweak)
+{
+	xts_accel_vaes_blocks(xts, in, out, blocks, tweak, false);
+	__asm__ volatile ("vzeroupper");
+}
+
+static __attribute__((noinline, unused)) XTS_ACCEL_TARGET_VAES void
+xts_accel_vaes_decrypt(const symmetric_xts_accel *xts, const uint8_t *in, uint8_t *out,
+    size_t blocks, uint8_t *tweak)
+{
+	xts_accel_vaes_blocks(xts, in, out, blocks, tweak, true);
+	__asm__ volatile ("vzeroupper");
+}
+
+static inline bool
+xts_accel_crypt_vaes(const uint8_t *in, size_t blocks, uint8_t *out, const uint8_t *iv,
+    symmetric_xts_accel *xts, bool dec)
+{
+	void *state = (void *)(((uintptr_t)xts->vaes_area + 63) & ~(uintptr_t)63);
+	uint8_t tweak[AES_XTS_ACCEL_BLOCK_SIZE];
+	size_t bulk = blocks - blocks % XTS_ACCEL_VAES_BLOCKS;
+	uint64_t saved;
+
+	if (__atomic_exchange_n(&xts->vaes_busy, 1, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+	saved = simd_state_save(state, SIMD_STATE_AVX512);
+	if (saved != SIMD_STATE_AVX512) {
+		simd_state_restore(state, saved);
+		__atomic_store_n(&xts->vaes_busy, 0, __ATOMIC_RELEASE);
+		return false;
+	}
+
+	xts_accel_aesni_tweak(xts, iv, tweak);
+	if (dec) {
+		xts_accel_vaes_decrypt(xts, in, out, bulk, tweak);
+		xts_accel_aesni_decrypt(xts, in + bulk * AES_XTS_ACCEL_BLOCK_SIZE,
+		    out + bulk * AES_XTS_ACCEL_BLOCK_SIZE, blocks - bulk, tweak);
+	} else {
+		xts_accel_vaes_encrypt(xts, in, out, bulk, tweak);
+		xts_accel_aesni_encrypt(xts, in + bulk * AES_XTS_ACCEL_BLOCK_SIZE,
+		    out + bulk * AES_XTS_ACCEL_BLOCK_SIZE, blocks - bulk, tweak);
+	}
+
+	simd_state_restore(state, saved);
+	__atomic_store_n(&xts->vaes_busy, 0, __ATOMIC_RELEASE);
+	memset(tweak, 0, sizeof(tweak));
+	return true;
+}
+
+static inline int
+xts_accel_crypt(const uint8_t *in, unsigned long len, uint8_t *out, const uint8_t *iv,
+    symmetric_xts_accel *xts, bool dec)
+{
+	simd_state_decl(SIMD_STATE_SIZE_SSE, state);
+	uint8_t tweak[AES_XTS_ACCEL_BLOCK_SIZE];
+	size_t blocks = len / AES_XTS_ACCEL_BLOCK_SIZE;
+	uint64_t saved;
+
+	if (blocks >= XTS_ACCEL_VAES_BLOCKS && xts_accel_vaes_available() &&
+	    xts_accel_crypt_vaes(in, blocks, out, iv, xts, dec)) {
+		return 0;
+	}
+
+	saved = simd_state_save(&state, SIMD_STATE_SSE);
+	if (saved != SIMD_STATE_SSE) {
+		simd_state_restore(&state, saved);
+		return dec ? xts_decrypt(in, len, out, iv, &xts->fallback) :
+		       xts_encrypt(in, len, out, iv, &xts->fallback);
+	}
+	xts_accel_aesni_tweak(xts, iv, tweak);
+	if (dec) {
+		xts_accel_aesni_decrypt(xts, in, out, blocks, tweak);
+	} else {
+		xts_accel_aesni_encrypt(xts, in, out, blocks, tweak);
+	}
+	simd_state_restore(&state, saved);
+
+	memset(tweak, 0, sizeof(tweak));
+	return 0;
+}
+
+#endif /* defined(__x86_64__) */
+
+/*
+ * These mirror xts_start(), xts_encrypt(), xts_decrypt() and xts_done()
+ */
+
+static inline uint32_t
+xts_accel_start(uint32_t cipher, // ignored - we're doing this for xts-aes only
+    const uint8_t *IV,               // ignored
+    const uint8_t *key1, int keylen,
+    const uint8_t *key2, int tweaklen,               // both keys are the same size for xts
+    uint32_t num_rounds,               // ignored
+    uint32_t options,                  // ignored
+    symmetric_xts_accel *xts)
+{
+	uint32_t rc;
+
+	xts->rounds = 0;
+	rc = xts_start(cipher, IV, key1, keylen, key2, tweaklen, num_rounds, options, &xts->fallback);
+	if (rc != 0) {
+		return rc;
+	}
+
+#if defined(__x86_64__)
+	xts->vaes_busy = 0;
+	if ((keylen == 16 || keylen == 32) && xts_accel_aesni_available()) {
+		simd_state_decl(SIMD_STATE_SIZE_SSE, state);
+		uint64_t saved = simd_state_save(&state, SIMD_STATE_SSE);
+
+		if (saved == SIMD_STATE_SSE) {
+			xts->rounds = keylen == 16 ? 10 : 14;
+			xts_accel_aesni_schedule(key1, key2, xts);
+		}
+		simd_state_restore(&state, saved);
+	}
+#endif
+
+	return 0;
+}
+
+static inline int
+xts_accel_encrypt(const uint8_t *pt, unsigned long ptlen,
+    uint8_t *ct,
+    const uint8_t *tweak,                             // this can be considered the sector IV for this use
+    symmetric_xts_accel *xts)
+{
+	if (ptlen % AES_XTS_ACCEL_BLOCK_SIZE) {
+		return -1;
+	}
+#if defined(__x86_64__)
+	if (xts->rounds != 0) {
+		return xts_accel_crypt(pt, ptlen, ct, tweak, xts, false);
+	}
+#endif
+	return xts_encrypt(pt, ptlen, ct, tweak, &xts->fallback);
+}
+
+static inline int
+xts_accel_decrypt(const uint8_t *ct, unsigned long ptlen,
+    uint8_t *pt,
+    const uint8_t *tweak,                             // this can be considered the sector IV for this use
+    symmetric_xts_accel *xts)
+{
+	if (ptlen % AES_XTS_ACCEL_BLOCK_SIZE) {
+		return -1;
+	}
+#if defined(__x86_64__)
+	if (xts->rounds != 0) {
+		return xts_accel_crypt(ct, ptlen, pt, tweak, xts, true);
+	}
+#endif
+	return xts_decrypt(ct, ptlen, pt, tweak, &xts->fallback);
+}
+
+static inline void
+xts_accel_done(symmetric_xts_accel *xts)
+{
+	xts_done(&xts->fallback);
+	memset_s(xts, sizeof(*xts), 0, sizeof(*xts));
+}
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -0,0 +1,975 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _CRYPTO_CHACHA20POLY1305_SG_H
+#define _CRYPTO_CHACHA20POLY1305_SG_H
+
+/*
+ * ChaCha20-Poly1305 (RFC 8439) over scattered buffers.
+ *
+ * The call sequence and return values are those of chacha20poly1305.h:
+ * init, setnonce, aad*, encrypt* or decrypt*, then finalize or verify, and
+ * reset before the next message. In addition, chacha20poly1305_sg_encryptv()
+ * and chacha20poly1305_sg_decryptv() seal or open a message in place across
+ * an iovec array, and the mbuf variants do the same over an mbuf chain in
+ * the kernel. Segments may have any length; the keystream and the Poly1305
+ * block carry over from one segment to the next.
+ *
+ * On x86_64 the keystream is generated 8 blocks at a time with AVX2 (4 with
+ * SSE2) and long runs of Poly1305 blocks are evaluated 4 at a time with
+ * AVX2 using r^1..r^4. Vector state is saved once per call rather than per
+ * segment, so callers should pass a whole packet in one call.
+ */
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#include <corecrypto/cc_error.h>
+#include <corecrypto/ccchacha20poly1305.h>
+#include <sys/uio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if KERNEL
+#include <sys/kpi_mbuf.h>
+#endif
+
+#if defined(__x86_64__)
+#include <i386/simd_state.h>
+#endif
+
+#define CHACHA20POLY1305_SG_ENGINE_SCALAR       0
+#define CHACHA20POLY1305_SG_ENGINE_SSE2         1       /* 4 keystream blocks */
+#define CHACHA20POLY1305_SG_ENGINE_AVX2         2       /* 8 keystream blocks, 4-way Poly1305 */
+
+/* Shorter calls are not worth saving the vector registers for */
+#define CHACHA20POLY1305_SG_SIMD_MIN_NBYTES     256
+
+/* Keystream and MAC passes are interleaved in chunks of this size */
+#define CHACHA20POLY1305_SG_CHUNK_NBYTES        2048
+
+typedef struct chacha20poly1305_sg_ctx {
+	uint32_t        key[8];
+	uint32_t        nonce[3];
+	uint32_t        counter;
+	uint8_t         stream[CCCHACHA20_BLOCK_NBYTES];
+	size_t          leftover;       /* unused keystream bytes at the end of stream */
+	uint32_t        r[4][5];        /* r^1..r^4, radix 2^26 */
+	uint32_t        h[5];
+	uint32_t        pad[4];
+	uint8_t         buf[16];
+	size_t          buf_used;
+	uint64_t        aad_nbytes;
+	uint64_t        text_nbytes;
+	uint8_t         state;          /* CCCHACHA20POLY1305_STATE_* */
+	uint8_t         engine;         /* CHACHA20POLY1305_SG_ENGINE_* */
+} chacha20poly1305_sg_ctx;
+
+static inline uint32_t
+chacha20poly1305_sg_load32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void
+chacha20poly1305_sg_store32(uint8_t *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+#define CHACHA20_SG_ROTL(v, n)  (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define CHACHA20_SG_QUARTER(x, a, b, c, d, rotl) do {                           \
+	x[a] += x[b]; x[d] ^= x[a]; x[d] = rotl(x[d], 16);                      \
+	x[c] += x[d]; x[b] ^= x[c]; x[b] = rotl(x[b], 12);                      \
+	x[a] += x[b]; x[d] ^= x[a]; x[d] = rotl(x[d], 8);                       \
+	x[c] += x[d]; x[b] ^= x[c]; x[b] = rotl(x[b], 7);                       \
+} while (0)
+
+#define CHACHA20_SG_DOUBLEROUND(x, rotl) do {                                   \
+	CHACHA20_SG_QUARTER(x, 0, 4, 8, 12, rotl);                              \
+	CHACHA20_SG_QUARTER(x, 1, 5, 9, 13, rotl);                              \
+	CHACHA20_SG_QUARTER(x, 2, 6, 10, 14, rotl);                             \
+	CHACHA20_SG_QUARTER(x, 3, 7, 11, 15, rotl);                             \
+	CHACHA20_SG_QUARTER(x, 0, 5, 10, 15, rotl);                             \
+	CHACHA20_SG_QUARTER(x, 1, 6, 11, 12, rotl);                             \
+	CHACHA20_SG_QUARTER(x, 2, 7, 8, 13, rotl);                              \
+	CHACHA20_SG_QUARTER(x, 3, 4, 9, 14, rotl);                              \
+} while (0)
+
+/* Initial state for the block at ctx->counter */
+static inline void
+chacha20_sg_state(const chacha20poly1305_sg_ctx *ctx, uint32_t st[16])
+{
+	st[0] = 0x61707865;
+	st[1] = 0x3320646e;
+	st[2] = 0x79622d32;
+	st[3] = 0x6b206574;
+	memcpy(&st[4], ctx->key, sizeof(ctx->key));
+	st[12] = ctx->counter;
+	memcpy(&st[13], ctx->nonce, sizeof(ctx->nonce));
+}
+
+static inline void
+chacha20_sg_block(const uint32_t st[16], uint8_t out[CCCHACHA20_BLOCK_NBYTES])
+{
+	uint32_t x[16];
+	int i;
+
+	memcpy(x, st, sizeof(x));
+	for (i = 0; i < 10; i++) {
+		CHACHA20_SG_DOUBLEROUND(x, CHACHA20_SG_ROTL);
+	}
+	for (i = 0; i < 16; i++) {
+		chacha20poly1305_sg_store32(out + 4 * i, x[i] + st[i]);
+	}
+}
+
+static inline void
+chacha20_sg_xor(uint8_t *out, const uint8_t *in, const uint8_t *ks, size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		uint64_t a, b;
+
+		memcpy(&a, in + i, 8);
+		memcpy(&b, ks + i, 8);
+		a ^= b;
+		memcpy(out + i, &a, 8);
+	}
+	for (; i < n; i++) {
+		out[i] = in[i] ^ ks[i];
+	}
+}
+
+/*
+ * Poly1305 in radix 2^26 (after poly1305-donna). h = h * r mod 2^130 - 5,
+ * partially reduced.
+ */
+static inline void
+poly1305_sg_mul(uint32_t h[5], const uint32_t r[5])
+{
+	uint32_t s1 = r[1] * 5, s2 = r[2] * 5, s3 = r[3] * 5, s4 = r[4] * 5;
+	uint64_t d0, d1, d2, d3, d4;
+	uint32_t c;
+
+	d0 = (uint64_t)h[0] * r[0] + (uint64_t)h[1] * s4 + (uint64_t)h[2] * s3 +
+	    (uint64_t)h[3] * s2 + (uint64_t)h[4] * s1;
+	d1 = (uint64_t)h[0] * r[1] + (uint64_t)h[1] * r[0] + (uint64_t)h[2] * s4 +
+	    (uint64_t)h[3] * s3 + (uint64_t)h[4] * s2;
+	d2 = (uint64_t)h[0] * r[2] + (uint64_t)h[1] * r[1] + (uint64_t)h[2] * r[0] +
+	    (uint64_t)h[3] * s4 + (uint64_t)h[4] * s3;
+	d3 = (uint64_t)h[0] * r[3] + (uint64_t)h[1] * r[2] + (uint64_t)h[2] * r[1] +
+	    (uint64_t)h[3] * r[0] + (uint64_t)h[4] * s4;
+	d4 = (uint64_t)h[0] * r[4] + (uint64_t)h[1] * r[3] + (uint64_t)h[2] * r[2] +
+	    (uint64_t)h[3] * r[1] + (uint64_t)h[4] * r[0];
+
+	c = (uint32_t)(d0 >> 26); h[0] = (uint32_t)d0 & 0x3ffffff;
+	d1 += c; c = (uint32_t)(d1 >> 26); h[1] = (uint32_t)d1 & 0x3ffffff;
+	d2 += c; c = (uint32_t)(d2 >> 26); h[2] = (uint32_t)d2 & 0x3ffffff;
+	d3 += c; c = (uint32_t)(d3 >> 26); h[3] = (uint32_t)d3 & 0x3ffffff;
+	d4 += c; c = (uint32_t)(d4 >> 26); h[4] = (uint32_t)d4 & 0x3ffffff;
+	h[0] += c * 5; c = h[0] >> 26; h[0] &= 0x3ffffff;
+	h[1] += c;
+}
+
+/* Absorbs whole 16-byte blocks; AEAD input is always padded to full blocks */
+static inline void
+poly1305_sg_blocks(chacha20poly1305_sg_ctx *ctx, const uint8_t *m, size_t blocks)
+{
+	for (; blocks > 0; blocks--, m += 16) {
+		ctx->h[0] += chacha20poly1305_sg_load32(m) & 0x3ffffff;
+		ctx->h[1] += (chacha20poly1305_sg_load32(m + 3) >> 2) & 0x3ffffff;
+		ctx->h[2] += (chacha20poly1305_sg_load32(m + 6) >> 4) & 0x3ffffff;
+		ctx->h[3] += (chacha20poly1305_sg_load32(m + 9) >> 6) & 0x3ffffff;
+		ctx->h[4] += (chacha20poly1305_sg_load32(m + 12) >> 8) | (1 << 24);
+		poly1305_sg_mul(ctx->h, ctx->r[0]);
+	}
+}
+
+#if defined(__x86_64__)
+
+typedef uint32_t chacha20_sg_v4su __attribute__((vector_size(16)));
+typedef uint32_t chacha20_sg_v8su __attribute__((vector_size(32)));
+typedef uint32_t chacha20_sg_v4su_u __attribute__((vector_size(16), aligned(1), __may_alias__));
+typedef uint32_t chacha20_sg_v8su_u __attribute__((vector_size(32), aligned(1), __may_alias__));
+typedef uint64_t chacha20_sg_v4du __attribute__((vector_size(32)));
+typedef uint64_t chacha20_sg_v4du_u __attribute__((vector_size(32), aligned(1), __may_alias__));
+typedef int chacha20_sg_v8si __attribute__((vector_size(32)));
+typedef char chacha20_sg_v32qi __attribute__((vector_size(32)));
+
+/* Rotations by 16 and 8 are byte shuffles with AVX2 */
+#define CHACHA20_SG_ROTL_AVX2(v, n)                                             \
+	((n) == 16 ? (chacha20_sg_v8su)__builtin_shufflevector((chacha20_sg_v32qi)(v), (chacha20_sg_v32qi)(v), \
+	    2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,               \
+	    18, 19, 16, 17, 22, 23, 20, 21, 26, 27, 24, 25, 30, 31, 28, 29) :   \
+	(n) == 8 ? (chacha20_sg_v8su)__builtin_shufflevector((chacha20_sg_v32qi)(v), (chacha20_sg_v32qi)(v), \
+	    3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,               \
+	    19, 16, 17, 18, 23, 20, 21, 22, 27, 24, 25, 26, 31, 28, 29, 30) :   \
+	CHACHA20_SG_ROTL(v, n))
+
+/* Words a..d of 4 blocks to 16 consecutive bytes of each block */
+#define CHACHA20_SG_STORE4(out, off, a, b, c, d) do {                           \
+	chacha20_sg_v4su t0_ = __builtin_shufflevector(a, b, 0, 4, 1, 5);       \
+	chacha20_sg_v4su t1_ = __builtin_shufflevector(a, b, 2, 6, 3, 7);       \
+	chacha20_sg_v4su t2_ = __builtin_shufflevector(c, d, 0, 4, 1, 5);       \
+	chacha20_sg_v4su t3_ = __builtin_shufflevector(c, d, 2, 6, 3, 7);       \
+	*(chacha20_sg_v4su_u *)((out) + (off)) =                                \
+	    __builtin_shufflevector(t0_, t2_, 0, 1, 4, 5);                      \
+	*(chacha20_sg_v4su_u *)((out) + 64 + (off)) =                           \
+	    __builtin_shufflevector(t0_, t2_, 2, 3, 6, 7);                      \
+	*(chacha20_sg_v4su_u *)((out) + 128 + (off)) =                          \
+	    __builtin_shufflevector(t1_, t3_, 0, 1, 4, 5);                      \
+	*(chacha20_sg_v4su_u *)((out) + 192 + (off)) =                          \
+	    __builtin_shufflevector(t1_, t3_, 2, 3, 6, 7);                      \
+} while (0)
+
+#define CHACHA20_SG_LO32_8      0, 8, 1, 9, 4, 12, 5, 13
+#define CHACHA20_SG_HI32_8      2, 10, 3, 11, 6, 14, 7, 15
+#define CHACHA20_SG_LO64_8      0, 1, 8, 9, 4, 5, 12, 13
+#define CHACHA20_SG_HI64_8      2, 3, 10, 11, 6, 7, 14, 15
+#define CHACHA20_SG_LO128_8     0, 1, 2, 3, 8, 9, 10, 11
+#define CHACHA20_SG_HI128_8     4, 5, 6, 7, 12, 13, 14, 15
+
+/* Words x[w..w + 7] of 8 blocks to 32 consecutive bytes of each block */
+#define CHACHA20_SG_STORE8(out, off, x, w) do {                                 \
+	chacha20_sg_v8su t0_ = __builtin_shufflevector(x[(w) + 0], x[(w) + 1], CHACHA20_SG_LO32_8); \
+	chacha20_sg_v8su t1_ = __builtin_shufflevector(x[(w) + 0], x[(w) + 1], CHACHA20_SG_HI32_8); \
+	chacha20_sg_v8su t2_ = __builtin_shufflevector(x[(w) + 2], x[(w) + 3], CHACHA20_SG_LO32_8); \
+	chacha20_sg_v8su t3_ = __builtin_shufflevector(x[(w) + 2], x[(w) + 3], CHACHA20_SG_HI32_8); \
+	chacha20_sg_v8su t4_ = __builtin_shufflevector(x[(w) + 4], x[(w) + 5], CHACHA20_SG_LO32_8); \
+	chacha20_sg_v8su t5_ = __builtin_shufflevector(x[(w) + 4], x[(w) + 5], CHACHA20_SG_HI32_8); \
+	chacha20_sg_v8su t6_ = __builtin_shufflevector(x[(w) + 6], x[(w) + 7], CHACHA20_SG_LO32_8); \
+	chacha20_sg_v8su t7_ = __builtin_shufflevector(x[(w) + 6], x[(w) + 7], CHACHA20_SG_HI32_8); \
+	/* u0_..u3_: first 4 words of blocks 0..3 | 4..7, u4_..u7_: last 4 */  \
+	chacha20_sg_v8su u0_ = __builtin_shufflevector(t0_, t2_, CHACHA20_SG_LO64_8); \
+	chacha20_sg_v8su u1_ = __builtin_shufflevector(t0_, t2_, CHACHA20_SG_HI64_8); \
+	chacha20_sg_v8su u2_ = __builtin_shufflevector(t1_, t3_, CHACHA20_SG_LO64_8); \
+	chacha20_sg_v8su u3_ = __builtin_shufflevector(t1_, t3_, CHACHA20_SG_HI64_8); \
+	chacha20_sg_v8su u4_ = __builtin_shufflevector(t4_, t6_, CHACHA20_SG_LO64_8); \
+	chacha20_sg_v8su u5_ = __builtin_shufflevector(t4_, t6_, CHACHA20_SG_HI64_8); \
+	chacha20_sg_v8su u6_ = __builtin_shufflevector(t5_, t7_, CHACHA20_SG_LO64_8); \
+	chacha20_sg_v8su u7_ = __builtin_shufflevector(t5_, t7_, CHACHA20_SG_HI64_8); \
+	*(chacha20_sg_v8su_u *)((out) + 0 * 64 + (off)) = __builtin_shufflevector(u0_, u4_, CHACHA20_SG_LO128_8); \
+	*(chacha20_sg_v8su_u *)((out) + 1 * 64 + (off)) = __builtin_shufflevector(u1_, u5_, CHACHA20_SG_LO128_8); \
+	*(chacha20_sg_v8su_u *)((out) + 2 * 64 + (off)) = __builtin_shufflevector(u2_, u6_, CHACHA20_SG_LO128_8); \
+	*(chacha20_sg_v8su_u *)((out) + 3 * 64 + (off)) = __builtin_shufflevector(u3_, u7_, CHACHA20_SG_LO128_8); \
+	*(chacha20_sg_v8su_u *)((out) + 4 * 64 + (off)) = __builtin_shufflevector(u0_, u4_, CHACHA20_SG_HI128_8); \
+	*(chacha20_sg_v8su_u *)((out) + 5 * 64 + (off)) = __builtin_shufflevector(u1_, u5_, CHACHA20_SG_HI128_8); \
+	*(chacha20_sg_v8su_u *)((out) + 6 * 64 + (off)) = __builtin_shufflevector(u2_, u6_, CHACHA20_SG_HI128_8); \
+	*(chacha20_sg_v8su_u *)((out) + 7 * 64 + (off)) = __builtin_shufflevector(u3_, u7_, CHACHA20_SG_HI128_8); \
+} while (0)
+
+/*
+ * XORs nbytes with the keystream starting at block st[12], 8 blocks per
+ * iteration, one block per vector lane. The keystream of a partially used
+ * last block is copied to last.
+ */
+static __attribute__((noinline, unused, target("avx2"))) void
+chacha20_sg_xor_avx2(const uint32_t st[16], const uint8_t *in, uint8_t *out, size_t nbytes,
+    uint8_t last[CCCHACHA20_BLOCK_NBYTES])
+{
+	const chacha20_sg_v8su lane = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	chacha20_sg_v8su s[16], x[16];
+	uint8_t ks[8 * CCCHACHA20_BLOCK_NBYTES] __attribute__((aligned(32)));
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		s[i] = (chacha20_sg_v8su){ st[i], st[i], st[i], st[i], st[i], st[i], st[i], st[i] };
+	}
+	s[12] += lane;
+
+	while (nbytes > 0) {
+		for (i = 0; i < 16; i++) {
+			x[i] = s[i];
+		}
+		for (i = 0; i < 10; i++) {
+			CHACHA20_SG_DOUBLEROUND(x, CHACHA20_SG_ROTL_AVX2);
+		}
+		for (i = 0; i < 16; i++) {
+			x[i] += s[i];
+		}
+		CHACHA20_SG_STORE8(ks, 0, x, 0);
+		CHACHA20_SG_STORE8(ks, 32, x, 8);
+		if (nbytes < sizeof(ks)) {
+			break;
+		}
+		for (i = 0; i < (int)sizeof(ks); i += 32) {
+			*(chacha20_sg_v8su_u *)(out + i) =
+			    *(const chacha20_sg_v8su_u *)(in + i) ^ *(const chacha20_sg_v8su *)(ks + i);
+		}
+		s[12] += 8;
+		in += sizeof(ks);
+		out += sizeof(ks);
+		nbytes -= sizeof(ks);
+	}
+	if (nbytes > 0) {
+		chacha20_sg_xor(out, in, ks, nbytes);
+		memcpy(last, ks + (nbytes & ~(size_t)(CCCHACHA20_BLOCK_NBYTES - 1)), CCCHACHA20_BLOCK_NBYTES);
+	}
+	memset(ks, 0, sizeof(ks));
+}
+
+/* As above, 4 blocks per iteration with SSE2 */
+static __attribute__((noinline, unused, target("sse2"))) void
+chacha20_sg_xor_sse2(const uint32_t st[16], const uint8_t *in, uint8_t *out, size_t nbytes,
+    uint8_t last[CCCHACHA20_BLOCK_NBYTES])
+{
+	const chacha20_sg_v4su lane = { 0, 1, 2, 3 };
+	chacha20_sg_v4su s[16], x[16];
+	uint8_t ks[4 * CCCHACHA20_BLOCK_NBYTES] __attribute__((aligned(16)));
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		s[i] = (chacha20_sg_v4su){ st[i], st[i], st[i], st[i] };
+	}
+	s[12] += lane;
+
+	while (nbytes > 0) {
+		for (i = 0; i < 16; i++) {
+			x[i] = s[i];
+		}
+		for (i = 0; i < 10; i++) {
+			CHACHA20_SG_DOUBLEROUND(x, CHACHA20_SG_ROTL);
+		}
+		for (i = 0; i < 16; i++) {
+			x[i] += s[i];
+		}
+		CHACHA20_SG_STORE4(ks, 0, x[0], x[1], x[2], x[3]);
+		CHACHA20_SG_STORE4(ks, 16, x[4], x[5], x[6], x[7]);
+		CHACHA20_SG_STORE4(ks, 32, x[8], x[9], x[10], x[11]);
+		CHACHA20_SG_STORE4(ks, 48, x[12], x[13], x[14], x[15]);
+		if (nbytes < sizeof(ks)) {
+			break;
+		}
+		for (i = 0; i < (int)sizeof(ks); i += 16) {
+			*(chacha20_sg_v4su_u *)(out + i) =
+			    *(const chacha20_sg_v4su_u *)(in + i) ^ *(const chacha20_sg_v4su *)(ks + i);
+		}
+		s[12] += 4;
+		in += sizeof(ks);
+		out += sizeof(ks);
+		nbytes -= sizeof(ks);
+	}
+	if (nbytes > 0) {
+		chacha20_sg_xor(out, in, ks, nbytes);
+		memcpy(last, ks + (nbytes & ~(size_t)(CCCHACHA20_BLOCK_NBYTES - 1)), CCCHACHA20_BLOCK_NBYTES);
+	}
+	memset(ks, 0, sizeof(ks));
+}
+
+#define POLY1305_SG_MUL32(a, b) \
+	((chacha20_sg_v4du)__builtin_ia32_pmuludq256((chacha20_sg_v8si)(a), (chacha20_sg_v8si)(b)))
+
+/*
+ * Absorbs blocks (a multiple of 4) blocks, one block per 64-bit lane: every
+ * lane accumulates h = (h + m) * r^4 and the last group is multiplied by
+ * r^4, r^3, r^2, r^1 instead so that the lane sums equal the serial result.
+ */
+static __attribute__((noinline, unused, target("avx2"))) void
+poly1305_sg_blocks_avx2(chacha20poly1305_sg_ctx *ctx, const uint8_t *m, size_t blocks)
+{
+	const chacha20_sg_v4du mask = { 0x3ffffff, 0x3ffffff, 0x3ffffff, 0x3ffffff };
+	const chacha20_sg_v4du hibit = { 1 << 24, 1 << 24, 1 << 24, 1 << 24 };
+	chacha20_sg_v4du h[5], r4[5], s4[5], rn[5], sn[5], r[5], s[5];
+	chacha20_sg_v4du d0, d1, d2, d3, d4, c;
+	uint64_t sum[5];
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		uint64_t p = ctx->r[3][i];
+
+		r4[i] = (chacha20_sg_v4du){ p, p, p, p };
+		rn[i] = (chacha20_sg_v4du){ p, ctx->r[2][i], ctx->r[1][i], ctx->r[0][i] };
+		s4[i] = r4[i] * 5;
+		sn[i] = rn[i] * 5;
+		h[i] = (chacha20_sg_v4du){ ctx->h[i], 0, 0, 0 };
+	}
+
+	for (; blocks > 0; blocks -= 4, m += 64) {
+		chacha20_sg_v4du a = *(const chacha20_sg_v4du_u *)m;
+		chacha20_sg_v4du b = *(const chacha20_sg_v4du_u *)(m + 32);
+		chacha20_sg_v4du lo = __builtin_shufflevector(a, b, 0, 2, 4, 6);
+		chacha20_sg_v4du hi = __builtin_shufflevector(a, b, 1, 3, 5, 7);
+
+		h[0] += lo & mask;
+		h[1] += (lo >> 26) & mask;
+		h[2] += ((lo >> 52) | (hi << 12)) & mask;
+		h[3] += (hi >> 14) & mask;
+		h[4] += (hi >> 40) | hibit;
+
+		for (i = 0; i < 5; i++) {
+			r[i] = blocks == 4 ? rn[i] : r4[i];
+			s[i] = blocks == 4 ? sn[i] : s4[i];
+		}
+
+		d0 = POLY1305_SG_MUL32(h[0], r[0]) + POLY1305_SG_MUL32(h[1], s[4]) +
+		    POLY1305_SG_MUL32(h[2], s[3]) + POLY1305_SG_MUL32(h[3], s[2]) +
+		    POLY1305_SG_MUL32(h[4], s[1]);
+		d1 = POLY1305_SG_MUL32(h[0], r[1]) + POLY1305_SG_MUL32(h[1], r[0]) +
+		    POLY1305_SG_MUL32(h[2], s[4]) + POLY1305_SG_MUL32(h[3], s[3]) +
+		    POLY1305_SG_MUL32(h[4], s[2]);
+		d2 = POLY1305_SG_MUL32(h[0], r[2]) + POLY1305_SG_MUL32(h[1], r[1]) +
+		    POLY1305_SG_MUL32(h[2], r[0]) + POLY1305_SG_MUL32(h[3], s[4]) +
+		    POLY1305_SG_MUL32(h[4], s[3]);
+		d3 = POLY1305_SG_MUL32(h[0], r[3]) + POLY1305_SG_MUL32(h[1], r[2]) +
+		    POLY1305_SG_MUL32(h[2], r[1]) + POLY1305_SG_MUL32(h[3], r[0]) +
+		    POLY1305_SG_MUL32(h[4], s[4]);
+		d4 = POLY1305_SG_MUL32(h[0], r[4]) + POLY1305_SG_MUL32(h[1], r[3]) +
+		    POLY1305_SG_MUL32(h[2], r[2]) + POLY1305_SG_MUL32(h[3], r[1]) +
+		    POLY1305_SG_MUL32(h[4], r[0]);
+
+		c = d0 >> 26; h[0] = d0 & mask;
+		d1 += c; c = d1 >> 26; h[1] = d1 & mask;
+		d2 += c; c = d2 >> 26; h[2] = d2 & mask;
+		d3 += c; c = d3 >> 26; h[3] = d3 & mask;
+		d4 += c; c = d4 >> 26; h[4] = d4 & mask;
+		h[0] += c + (c << 2); c = h[0] >> 26; h[0] &= mask;
+		h[1] += c;
+	}
+
+	for (i = 0; i < 5; i++) {
+		sum[i] = h[i][0] + h[i][1] + h[i][2] + h[i][3];
+	}
+	sum[1] += sum[0] >> 26; sum[0] &= 0x3ffffff;
+	sum[2] += sum[1] >> 26; sum[1] &= 0x3ffffff;
+	sum[3] += sum[2] >> 26; sum[2] &= 0x3ffffff;
+	sum[4] += sum[3] >> 26; sum[3] &= 0x3ffffff;
+	sum[0] += (sum[4] >> 26) * 5; sum[4] &= 0x3ffffff;
+	sum[1] += sum[0] >> 26; sum[0] &= 0x3ffffff;
+	for (i = 0; i < 5; i++) {
+		ctx->h[i] = (uint32_t)sum[i];
+	}
+}
+
+#endif /* defined(__x86_64__) */
+
+/*
+ * Vector state saved for one call: components is what the workers may use,
+ * 0 when the call runs scalar.
+ */
+typedef struct chacha20poly1305_sg_simd {
+#if defined(__x86_64__)
+	simd_state_decl(SIMD_STATE_SIZE_AVX, area);
+#endif
+	uint64_t        components;
+} chacha20poly1305_sg_simd;
+
+static inline void
+chacha20poly1305_sg_simd_begin(const chacha20poly1305_sg_ctx *ctx,
+    chacha20poly1305_sg_simd *simd, size_t nbytes)
+{
+	simd->components = 0;
+#if defined(__x86_64__)
+	if (nbytes < CHACHA20POLY1305_SG_SIMD_MIN_NBYTES) {
+		return;
+	}
+	if (ctx->engine == CHACHA20POLY1305_SG_ENGINE_AVX2) {
+		simd->components = simd_state_save(&simd->area, SIMD_STATE_AVX);
+	} else if (ctx->engine == CHACHA20POLY1305_SG_ENGINE_SSE2) {
+		simd->components = simd_state_save(&simd->area, SIMD_STATE_SSE);
+	}
+#else
+	(void)ctx;
+	(void)nbytes;
+#endif
+}
+
+static inline void
+chacha20poly1305_sg_simd_end(chacha20poly1305_sg_simd *simd)
+{
+#if defined(__x86_64__)
+	if (simd->components & XFEM_YMM) {
+		__asm__ volatile ("vzeroupper");
+	}
+	simd_state_restore(&simd->area, simd->components);
+#else
+	(void)simd;
+#endif
+}
+
+/* XORs nbytes of in with the keystream into out, which may equal in */
+static inline void
+chacha20poly1305_sg_stream(chacha20poly1305_sg_ctx *ctx, size_t nbytes,
+    const uint8_t *in, uint8_t *out, uint64_t components)
+{
+	uint32_t st[16];
+	size_t n;
+
+	if (ctx->leftover > 0) {
+		n = nbytes < ctx->leftover ? nbytes : ctx->leftover;
+		chacha20_sg_xor(out, in, ctx->stream + sizeof(ctx->stream) - ctx->leftover, n);
+		ctx->leftover -= n;
+		in += n;
+		out += n;
+		nbytes -= n;
+	}
+
+#if defined(__x86_64__)
+	/* The vector workers also produce the tail and its partially used block */
+	if (nbytes > 2 * CCCHACHA20_BLOCK_NBYTES && (components & SIMD_STATE_SSE)) {
+		chacha20_sg_state(ctx, st);
+		if ((components & SIMD_STATE_AVX) == SIMD_STATE_AVX) {
+			chacha20_sg_xor_avx2(st, in, out, nbytes, ctx->stream);
+		} else {
+			chacha20_sg_xor_sse2(st, in, out, nbytes, ctx->stream);
+		}
+		n = (nbytes + CCCHACHA20_BLOCK_NBYTES - 1) / CCCHACHA20_BLOCK_NBYTES;
+		ctx->counter += (uint32_t)n;
+		ctx->leftover = n * CCCHACHA20_BLOCK_NBYTES - nbytes;
+		nbytes = 0;
+	}
+#else
+	(void)components;
+#endif
+
+	while (nbytes > 0) {
+		n = nbytes < CCCHACHA20_BLOCK_NBYTES ? nbytes : CCCHACHA20_BLOCK_NBYTES;
+		chacha20_sg_state(ctx, st);
+		chacha20_sg_block(st, ctx->stream);
+		ctx->counter++;
+		chacha20_sg_xor(out, in, ctx->stream, n);
+		ctx->leftover = CCCHACHA20_BLOCK_NBYTES - n;
+		in += n;
+		out += n;
+		nbytes -= n;
+	}
+	memset(st, 0, sizeof(st));
+}
+
+static inline void
+chacha20poly1305_sg_mac(chacha20poly1305_sg_ctx *ctx, size_t nbytes,
+    const uint8_t *m, uint64_t components)
+{
+	size_t n, blocks;
+
+	if (ctx->buf_used > 0) {
+		n = sizeof(ctx->buf) - ctx->buf_used;
+		n = nbytes < n ? nbytes : n;
+		memcpy(ctx->buf + ctx->buf_used, m, n);
+		ctx->buf_used += n;
+		m += n;
+		nbytes -= n;
+		if (ctx->buf_used < sizeof(ctx->buf)) {
+			return;
+		}
+		poly1305_sg_blocks(ctx, ctx->buf, 1);
+		ctx->buf_used = 0;
+	}
+
+	blocks = nbytes / 16;
+#if defined(__x86_64__)
+	if ((components & SIMD_STATE_AVX) == SIMD_STATE_AVX &&
+	    blocks >= CHACHA20POLY1305_SG_SIMD_MIN_NBYTES / 16) {
+		n = blocks & ~(size_t)3;
+		poly1305_sg_blocks_avx2(ctx, m, n);
+		m += 16 * n;
+		nbytes -= 16 * n;
+		blocks -= n;
+	}
+#else
+	(void)components;
+#endif
+	poly1305_sg_blocks(ctx, m, blocks);
+	m += 16 * blocks;
+	nbytes -= 16 * blocks;
+
+	memcpy(ctx->buf, m, nbytes);
+	ctx->buf_used = nbytes;
+}
+
+/* Zero-pads the AAD or the text to a whole Poly1305 block */
+static inline void
+chacha20poly1305_sg_mac_pad(chacha20poly1305_sg_ctx *ctx)
+{
+	if (ctx->buf_used > 0) {
+		memset(ctx->buf + ctx->buf_used, 0, sizeof(ctx->buf) - ctx->buf_used);
+		poly1305_sg_blocks(ctx, ctx->buf, 1);
+		ctx->buf_used = 0;
+	}
+}
+
+/* Moves to the encrypt or decrypt state, padding the AAD on the first call */
+static inline int
+chacha20poly1305_sg_begin_text(chacha20poly1305_sg_ctx *ctx, uint8_t state, size_t nbytes)
+{
+	if (ctx->state == CCCHACHA20POLY1305_STATE_AAD) {
+		chacha20poly1305_sg_mac_pad(ctx);
+		ctx->state = state;
+	}
+	if (ctx->state != state) {
+		return CCMODE_INVALID_CALL_SEQUENCE;
+	}
+	if (nbytes > CCCHACHA20POLY1305_TEXT_MAX_NBYTES - ctx->text_nbytes) {
+		return CCMODE_INVALID_CALL_SEQUENCE;
+	}
+	ctx->text_nbytes += nbytes;
+	return CCERR_OK;
+}
+
+static inline void
+chacha20poly1305_sg_crypt(chacha20poly1305_sg_ctx *ctx, size_t nbytes,
+    const uint8_t *in, uint8_t *out, bool encrypt, uint64_t components)
+{
+	while (nbytes > 0) {
+		size_t n = nbytes < CHACHA20POLY1305_SG_CHUNK_NBYTES ?
+		    nbytes : CHACHA20POLY1305_SG_CHUNK_NBYTES;
+
+		if (encrypt) {
+			chacha20poly1305_sg_stream(ctx, n, in, out, components);
+			chacha20poly1305_sg_mac(ctx, n, out, components);
+		} else {
+			chacha20poly1305_sg_mac(ctx, n, in, components);
+			chacha20poly1305_sg_stream(ctx, n, in, out, components);
+		}
+		in += n;
+		out += n;
+		nbytes -= n;
+	}
+}
+
+static inline void
+chacha20poly1305_sg_tag(chacha20poly1305_sg_ctx *ctx, uint8_t tag[CCCHACHA20POLY1305_TAG_NBYTES])
+{
+	uint32_t *h = ctx->h;
+	uint32_t g0, g1, g2, g3, g4, c, mask;
+	uint64_t f;
+	uint8_t lengths[16];
+	int i;
+
+	chacha20poly1305_sg_mac_pad(ctx);
+	for (i = 0; i < 8; i++) {
+		lengths[i] = (uint8_t)(ctx->aad_nbytes >> (8 * i));
+		lengths[8 + i] = (uint8_t)(ctx->text_nbytes >> (8 * i));
+	}
+	poly1305_sg_blocks(ctx, lengths, 1);
+
+	c = h[1] >> 26; h[1] &= 0x3ffffff;
+	h[2] += c; c = h[2] >> 26; h[2] &= 0x3ffffff;
+	h[3] += c; c = h[3] >> 26; h[3] &= 0x3ffffff;
+	h[4] += c; c = h[4] >> 26; h[4] &= 0x3ffffff;
+	h[0] += c * 5; c = h[0] >> 26; h[0] &= 0x3ffffff;
+	h[1] += c;
+
+	/* h - p, selected in constant time when h >= p */
+	g0 = h[0] + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+	g1 = h[1] + c; c = g1 >> 26; g1 &= 0x3ffffff;
+	g2 = h[2] + c; c = g2 >> 26; g2 &= 0x3ffffff;
+	g3 = h[3] + c; c = g3 >> 26; g3 &= 0x3ffffff;
+	g4 = h[4] + c - (1 << 26);
+	mask = (g4 >> 31) - 1;
+	h[0] = (h[0] & ~mask) | (g0 & mask);
+	h[1] = (h[1] & ~mask) | (g1 & mask);
+	h[2] = (h[2] & ~mask) | (g2 & mask);
+	h[3] = (h[3] & ~mask) | (g3 & mask);
+	h[4] = (h[4] & ~mask) | (g4 & mask);
+
+	f = (uint64_t)(h[0] | (h[1] << 26)) + ctx->pad[0];
+	chacha20poly1305_sg_store32(tag, (uint32_t)f);
+	f = (uint64_t)((h[1] >> 6) | (h[2] << 20)) + ctx->pad[1] + (f >> 32);
+	chacha20poly1305_sg_store32(tag + 4, (uint32_t)f);
+	f = (uint64_t)((h[2] >> 12) | (h[3] << 14)) + ctx->pad[2] + (f >> 32);
+	chacha20poly1305_sg_store32(tag + 8, (uint32_t)f);
+	f = (uint64_t)((h[3] >> 18) | (h[4] << 8)) + ctx->pad[3] + (f >> 32);
+	chacha20poly1305_sg_store32(tag + 12, (uint32_t)f);
+
+	ctx->state = CCCHACHA20POLY1305_STATE_FINAL;
+}
+
+/*
+ * Public interface, mirroring chacha20poly1305.h.
+ */
+
+static inline int
+chacha20poly1305_sg_reset(chacha20poly1305_sg_ctx *ctx)
+{
+	memset(ctx->nonce, 0, sizeof(ctx->nonce));
+	memset(ctx->stream, 0, sizeof(ctx->stream));
+	memset(ctx->r, 0, sizeof(ctx->r));
+	memset(ctx->h, 0, sizeof(ctx->h));
+	memset(ctx->pad, 0, sizeof(ctx->pad));
+	memset(ctx->buf, 0, sizeof(ctx->buf));
+	ctx->counter = 0;
+	ctx->leftover = 0;
+	ctx->buf_used = 0;
+	ctx->aad_nbytes = 0;
+	ctx->text_nbytes = 0;
+	ctx->state = CCCHACHA20POLY1305_STATE_SETNONCE;
+	return CCERR_OK;
+}
+
+static inline int
+chacha20poly1305_sg_init(chacha20poly1305_sg_ctx *ctx, const uint8_t *key)
+{
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		ctx->key[i] = chacha20poly1305_sg_load32(key + 4 * i);
+	}
+
+	ctx->engine = CHACHA20POLY1305_SG_ENGINE_SCALAR;
+#if defined(__x86_64__)
+	uint64_t xfem = simd_state_available();
+
+	if ((cpuid_leaf7_features() & CPUID_LEAF7_FEATURE_AVX2) &&
+	    (xfem & SIMD_STATE_AVX) == SIMD_STATE_AVX) {
+		ctx->engine = CHACHA20POLY1305_SG_ENGINE_AVX2;
+	} else if (xfem & SIMD_STATE_SSE) {
+		ctx->engine = CHACHA20POLY1305_SG_ENGINE_SSE2;
+	}
+#endif
+
+	return chacha20poly1305_sg_reset(ctx);
+}
+
+static inline int
+chacha20poly1305_sg_setnonce(chacha20poly1305_sg_ctx *ctx, const uint8_t *nonce)
+{
+	uint32_t st[16];
+	uint8_t block[CCCHACHA20_BLOCK_NBYTES];
+	int i;
+
+	if (ctx->state != CCCHACHA20POLY1305_STATE_SETNONCE) {
+		return CCMODE_INVALID_CALL_SEQUENCE;
+	}
+
+	for (i = 0; i < 3; i++) {
+		ctx->nonce[i] = chacha20poly1305_sg_load32(nonce + 4 * i);
+	}
+
+	/* The one-time Poly1305 key is the first 32 bytes of block 0 */
+	ctx->counter = 0;
+	chacha20_sg_state(ctx, st);
+	chacha20_sg_block(st, block);
+	ctx->counter = 1;
+
+	ctx->r[0][0] = chacha20poly1305_sg_load32(block) & 0x3ffffff;
+	ctx->r[0][1] = (chacha20poly1305_sg_load32(block + 3) >> 2) & 0x3ffff03;
+	ctx->r[0][2] = (chacha20poly1305_sg_load32(block + 6) >> 4) & 0x3ffc0ff;
+	ctx->r[0][3] = (chacha20poly1305_sg_load32(block + 9) >> 6) & 0x3f03fff;
+	ctx->r[0][4] = (chacha20poly1305_sg_load32(block + 12) >> 8) & 0x00fffff;
+	for (i = 1; i < 4; i++) {
+		memcpy(ctx->r[i], ctx->r[i - 1], sizeof(ctx->r[i]));
+		poly1305_sg_mul(ctx->r[i], ctx->r[0]);
+	}
+	for (i = 0; i < 4; i++) {
+		ctx->pad[i] = chacha20poly1305_sg_load32(block + 16 + 4 * i);
+	}
+
+	memset(st, 0, sizeof(st));
+	memset(block, 0, sizeof(block));
+	ctx->state = CCCHACHA20POLY1305_STATE_AAD;
+	return CCERR_OK;
+}
+
+static inline int
+chacha20poly1305_sg_aad(chacha20poly1305_sg_ctx *ctx, size_t nbytes, const void *aad)
+{
+	if (ctx->state != CCCHACHA20POLY1305_STATE_AAD) {
+		return CCMODE_INVALID_CALL_SEQUENCE;
+	}
+	ctx->aad_nbytes += nbytes;
+	chacha20poly1305_sg_mac(ctx, nbytes, (const uint8_t *)aad, 0);
+	return CCERR_OK;
+}
+
+static inline int
+chacha20poly1305_sg_encrypt(chacha20poly1305_sg_ctx *ctx, size_t nbytes, const void *ptext, void *ctext)
+{
+	chacha20poly1305_sg_simd simd;
+	int rc;
+
+	rc = chacha20poly1305_sg_begin_text(ctx, CCCHACHA20POLY1305_STATE_ENCRYPT, nbytes);
+	if (rc != CCERR_OK) {
+		return rc;
+	}
+	chacha20poly1305_sg_simd_begin(ctx, &simd, nbytes);
+	chacha20poly1305_sg_crypt(ctx, nbytes, (const uint8_t *)ptext, (uint8_t *)ctext, true, simd.components);
+	chacha20poly1305_sg_simd_end(&simd);
+	return CCERR_OK;
+}
+
+static inline int
+chacha20poly1305_sg_decrypt(chacha20poly1305_sg_ctx *ctx, size_t nbytes, const void *ctext, void *ptext)
+{
+	chacha20poly1305_sg_simd simd;
+	int rc;
+
+	rc = chacha20poly1305_sg_begin_text(ctx, CCCHACHA20POLY1305_STATE_DECRYPT, nbytes);
+	if (rc != CCERR_OK) {
+		return rc;
+	}
+	chacha20poly1305_sg_simd_begin(ctx, &simd, nbytes);
+	chacha20poly1305_sg_crypt(ctx, nbytes, (const uint8_t *)ctext, (uint8_t *)ptext, false, simd.components);
+	chacha20poly1305_sg_simd_end(&simd);
+	return CCERR_OK;
+}
+
+static inline int
+chacha20poly1305_sg_cryptv(chacha20poly1305_sg_ctx *ctx, const struct iovec *iov, int iovcnt, bool encrypt)
+{
+	chacha20poly1305_sg_simd simd;
+	size_t total = 0;
+	int i, rc;
+
+	if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) {
+		return CCERR_PARAMETER;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > CCCHACHA20POLY1305_TEXT_MAX_NBYTES - total) {
+			return CCMODE_INVALID_CALL_SEQUENCE;
+		}
+		total += iov[i].iov_len;
+	}
+
+	rc = chacha20poly1305_sg_begin_text(ctx, encrypt ?
+	    CCCHACHA20POLY1305_STATE_ENCRYPT : CCCHACHA20POLY1305_STATE_DECRYPT, total);
+	if (rc != CCERR_OK) {
+		return rc;
+	}
+	chacha20poly1305_sg_simd_begin(ctx, &simd, total);
+	for (i = 0; i < iovcnt; i++) {
+		chacha20poly1305_sg_crypt(ctx, iov[i].iov_len, (const uint8_t *)iov[i].iov_base,
+		    (uint8_t *)iov[i].iov_base, encrypt, simd.components);
+	}
+	chacha20poly1305_sg_simd_end(&simd);
+	return CCERR_OK;
+}
+
+/* Encrypts the segments of iov in place, as one chacha20poly1305_sg_encrypt() call */
+static inline int
+chacha20poly1305_sg_encryptv(chacha20poly1305_sg_ctx *ctx, const struct iovec *iov, int iovcnt)
+{
+	return chacha20poly1305_sg_cryptv(ctx, iov, iovcnt, true);
+}
+
+/* Decrypts the segments of iov in place, as one chacha20poly1305_sg_decrypt() call */
+static inline int
+chacha20poly1305_sg_decryptv(chacha20poly1305_sg_ctx *ctx, const struct iovec *iov, int iovcnt)
+{
+	return chacha20poly1305_sg_cryptv(ctx, iov, iovcnt, false);
+}
+
+#if KERNEL
+static inline int
+chacha20poly1305_sg_crypt_mbuf(chacha20poly1305_sg_ctx *ctx, mbuf_t m, size_t off, size_t len, bool encrypt)
+{
+	chacha20poly1305_sg_simd simd;
+	int rc;
+
+	rc = chacha20poly1305_sg_begin_text(ctx, encrypt ?
+	    CCCHACHA20POLY1305_STATE_ENCRYPT : CCCHACHA20POLY1305_STATE_DECRYPT, len);
+	if (rc != CCERR_OK) {
+		return rc;
+	}
+
+	chacha20poly1305_sg_simd_begin(ctx, &simd, len);
+	for (; m != NULL && len > 0; m = mbuf_next(m)) {
+		size_t mlen = mbuf_len(m);
+		size_t n;
+
+		if (off >= mlen) {
+			off -= mlen;
+			continue;
+		}
+		n = mlen - off < len ? mlen - off : len;
+		chacha20poly1305_sg_crypt(ctx, n, (uint8_t *)mbuf_data(m) + off,
+		    (uint8_t *)mbuf_data(m) + off, encrypt, simd.components);
+		off = 0;
+		len -= n;
+	}
+	chacha20poly1305_sg_simd_end(&simd);
+
+	/* The chain was shorter than off + len, the context can only be reset */
+	if (len > 0) {
+		ctx->state = CCCHACHA20POLY1305_STATE_FINAL;
+		return CCERR_PARAMETER;
+	}
+	return CCERR_OK;
+}
+
+/*
+ * Encrypts len bytes of the mbuf chain starting off bytes into m, in place.
+ * Segments must be writable (see mbuf_pullup/mbuf_dup for shared clusters).
+ */
+static inline int
+chacha20poly1305_sg_encrypt_mbuf(chacha20poly1305_sg_ctx *ctx, mbuf_t m, size_t off, size_t len)
+{
+	return chacha20poly1305_sg_crypt_mbuf(ctx, m, off, len, true);
+}
+
+static inline int
+chacha20poly1305_sg_decrypt_mbuf(chacha20poly1305_sg_ctx *ctx, mbuf_t m, size_t off, size_t len)
+{
+	return chacha20poly1305_sg_crypt_mbuf(ctx, m, off, len, false);
+}
+#endif /* KERNEL */
+
+static inline int
+chacha20poly1305_sg_finalize(chacha20poly1305_sg_ctx *ctx, uint8_t *tag)
+{
+	if (ctx->state == CCCHACHA20POLY1305_STATE_AAD) {
+		ctx->state = CCCHACHA20POLY1305_STATE_ENCRYPT;
+	}
+	if (ctx->state != CCCHACHA20POLY1305_STATE_ENCRYPT) {
+		return CCMODE_INVALID_CALL_SEQUENCE;
+	}
+	chacha20poly1305_sg_tag(ctx, tag);
+	return CCERR_OK;
+}
+
+static inline int
+chacha20poly1305_sg_verify(chacha20poly1305_sg_ctx *ctx, const uint8_t *tag)
+{
+	uint8_t computed[CCCHACHA20POLY1305_TAG_NBYTES];
+	uint8_t diff = 0;
+	int i;
+
+	if (ctx->state == CCCHACHA20POLY1305_STATE_AAD) {
+		ctx->state = CCCHACHA20POLY1305_STATE_DECRYPT;
+	}
+	if (ctx->state != CCCHACHA20POLY1305_STATE_DECRYPT) {
+		return CCMODE_INVALID_CALL_SEQUENCE;
+	}
+	chacha20poly1305_sg_tag(ctx, computed);
+	for (i = 0; i < CCCHACHA20POLY1305_TAG_NBYTES; i++) {
+		diff |= computed[i] ^ tag[i];
+	}
+	memset(computed, 0, sizeof(computed));
+	return diff == 0 ? CCERR_OK : CCMODE_INTEGRITY_FAILURE;
+}
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _CRYPTO_CHACHA20POLY1305_SG_H */
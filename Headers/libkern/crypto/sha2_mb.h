@@ -0,0 +1,485 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _CRYPTO_SHA2_MB_H__
+#define _CRYPTO_SHA2_MB_H__
+
+/*
+ * Multi-buffer SHA-256.
+ *
+ * SHA256_MB_Digest() hashes many independent messages at once, each lane of
+ * a vector register carrying one message: 16 lanes with AVX-512 (when the
+ * thread has AVX-512 state enabled), 8 with AVX2 and 4 with SSE2. On
+ * processors with the SHA extensions and without AVX-512 messages are hashed
+ * one at a time with SHA-NI instead, which is faster than 8 lanes; the same
+ * applies to groups that would leave most lanes empty. Without any of these,
+ * and on i386, every message goes through SHA256_Init/Update/Final.
+ *
+ * Lanes of one group run for as many blocks as the longest message of the
+ * group, so callers get the best throughput with messages of equal length
+ * (e.g. 4 KiB pages).
+ *
+ * The context only holds scratch space and may be reused for any number of
+ * calls. It is large (about 2.5 KiB) and should not be placed on the stack.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <libkern/crypto/sha2.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <i386/simd_state.h>
+#endif
+
+#define SHA256_MB_MAX_LANES     16
+
+#define SHA256_MB_ENGINE_SCALAR 0       /* SHA256_Init/Update/Final */
+#define SHA256_MB_ENGINE_SHANI  1       /* one stream at a time with SHA extensions */
+#define SHA256_MB_ENGINE_SSE2   4       /* 4 lanes */
+#define SHA256_MB_ENGINE_AVX2   8       /* 8 lanes */
+#define SHA256_MB_ENGINE_AVX512 16      /* 16 lanes */
+
+typedef struct SHA256_MB_CTX {
+	uint32_t        state[8][SHA256_MB_MAX_LANES];
+	uint32_t        words[16][SHA256_MB_MAX_LANES];
+	uint8_t         tail[SHA256_MB_MAX_LANES][2 * SHA256_BLOCK_LENGTH];
+	const uint8_t   *data[SHA256_MB_MAX_LANES];
+	size_t          blocks[SHA256_MB_MAX_LANES];
+	size_t          full[SHA256_MB_MAX_LANES];
+	uint32_t        lanes;          /* SHA256_MB_ENGINE_* of the widest lane engine */
+	bool            shani;
+} SHA256_MB_CTX;
+
+static const uint32_t sha256_mb_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha256_mb_k[64] __attribute__((aligned(16))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t
+sha256_mb_load_be32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return __builtin_bswap32(v);
+}
+
+static inline void
+sha256_mb_store_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)(v >> 24);
+	p[1] = (uint8_t)(v >> 16);
+	p[2] = (uint8_t)(v >> 8);
+	p[3] = (uint8_t)v;
+}
+
+/*
+ * Splits lane's message into whole blocks read in place and one or two padded
+ * blocks in ctx->tail. Returns the total number of blocks.
+ */
+static inline size_t
+sha256_mb_prepare(SHA256_MB_CTX *ctx, uint32_t lane, const void *data, size_t len)
+{
+	size_t full = len / SHA256_BLOCK_LENGTH;
+	size_t rest = len % SHA256_BLOCK_LENGTH;
+	size_t tail = rest + 9 > SHA256_BLOCK_LENGTH ? 2 : 1;
+	uint8_t *buf = ctx->tail[lane];
+	uint64_t bits = (uint64_t)len << 3;
+	uint32_t i;
+
+	memset(buf, 0, sizeof(ctx->tail[lane]));
+	memcpy(buf, (const uint8_t *)data + full * SHA256_BLOCK_LENGTH, rest);
+	buf[rest] = 0x80;
+	for (i = 0; i < 8; i++) {
+		buf[tail * SHA256_BLOCK_LENGTH - 1 - i] = (uint8_t)(bits >> (8 * i));
+	}
+
+	ctx->data[lane] = (const uint8_t *)data;
+	ctx->full[lane] = full;
+	ctx->blocks[lane] = full + tail;
+	return full + tail;
+}
+
+static inline const uint8_t *
+sha256_mb_block(const SHA256_MB_CTX *ctx, uint32_t lane, size_t block)
+{
+	if (block < ctx->full[lane]) {
+		return ctx->data[lane] + block * SHA256_BLOCK_LENGTH;
+	}
+	return ctx->tail[lane] + (block - ctx->full[lane]) * SHA256_BLOCK_LENGTH;
+}
+
+#if defined(__x86_64__)
+
+typedef uint32_t sha256_mb_v4su __attribute__((vector_size(16)));
+typedef uint32_t sha256_mb_v8su __attribute__((vector_size(32)));
+typedef uint32_t sha256_mb_v16su __attribute__((vector_size(64)));
+typedef uint32_t sha256_mb_v4su_u __attribute__((vector_size(16), aligned(1), __may_alias__));
+typedef uint32_t sha256_mb_v8su_u __attribute__((vector_size(32), aligned(1), __may_alias__));
+typedef uint32_t sha256_mb_v16su_u __attribute__((vector_size(64), aligned(1), __may_alias__));
+typedef int sha256_mb_v4si __attribute__((vector_size(16)));
+typedef char sha256_mb_v16qi __attribute__((vector_size(16)));
+typedef char sha256_mb_v16qi_u __attribute__((vector_size(16), aligned(1), __may_alias__));
+
+#define SHA256_MB_ROTR(x, n)    (((x) >> (n)) | ((x) << (32 - (n))))
+
+/*
+ * One round on lane vectors, the working variables rotate through the macro
+ * arguments instead of being moved. The message schedule is only expanded
+ * from round 16 on; t is a multiple of 16, so w indices are constants.
+ */
+#define SHA256_MB_ROUND(a, b, c, d, e, f, g, h, w, t, j) do {                   \
+	if ((t) != 0) {                                                         \
+	        w[j] += w[((j) + 9) & 15] +                                     \
+	            (SHA256_MB_ROTR(w[((j) + 1) & 15], 7) ^                     \
+	            SHA256_MB_ROTR(w[((j) + 1) & 15], 18) ^ (w[((j) + 1) & 15] >> 3)) + \
+	            (SHA256_MB_ROTR(w[((j) + 14) & 15], 17) ^                   \
+	            SHA256_MB_ROTR(w[((j) + 14) & 15], 19) ^ (w[((j) + 14) & 15] >> 10)); \
+	}                                                                       \
+	t1 = h + (SHA256_MB_ROTR(e, 6) ^ SHA256_MB_ROTR(e, 11) ^ SHA256_MB_ROTR(e, 25)) + \
+	    ((e & f) ^ (~e & g)) + sha256_mb_k[(t) + (j)] + w[j];               \
+	d += t1;                                                                \
+	h = t1 + (SHA256_MB_ROTR(a, 2) ^ SHA256_MB_ROTR(a, 13) ^ SHA256_MB_ROTR(a, 22)) + \
+	    ((a & b) ^ (a & c) ^ (b & c));                                      \
+} while (0)
+
+#define SHA256_MB_ROUNDS8(v, w, t, j) do {                                      \
+	SHA256_MB_ROUND(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], w, t, (j) + 0); \
+	SHA256_MB_ROUND(v[7], v[0], v[1], v[2], v[3], v[4], v[5], v[6], w, t, (j) + 1); \
+	SHA256_MB_ROUND(v[6], v[7], v[0], v[1], v[2], v[3], v[4], v[5], w, t, (j) + 2); \
+	SHA256_MB_ROUND(v[5], v[6], v[7], v[0], v[1], v[2], v[3], v[4], w, t, (j) + 3); \
+	SHA256_MB_ROUND(v[4], v[5], v[6], v[7], v[0], v[1], v[2], v[3], w, t, (j) + 4); \
+	SHA256_MB_ROUND(v[3], v[4], v[5], v[6], v[7], v[0], v[1], v[2], w, t, (j) + 5); \
+	SHA256_MB_ROUND(v[2], v[3], v[4], v[5], v[6], v[7], v[0], v[1], w, t, (j) + 6); \
+	SHA256_MB_ROUND(v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[0], w, t, (j) + 7); \
+} while (0)
+
+#define SHA256_MB_ROUNDS16(v, w, t) do {                                        \
+	SHA256_MB_ROUNDS8(v, w, t, 0);                                          \
+	SHA256_MB_ROUNDS8(v, w, t, 8);                                          \
+} while (0)
+
+/*
+ * Defines name(ctx, count) compressing every block of lanes [0, count) with
+ * vtype holding one state word of all lanes. Lanes with fewer blocks keep
+ * their state once their message is exhausted.
+ */
+#define SHA256_MB_DEFINE_LANES(name, vtype, vtype_u, nlanes, features)          \
+static __attribute__((noinline, unused, target(features))) void                 \
+name(SHA256_MB_CTX *ctx, uint32_t count)                                        \
+{                                                                               \
+	vtype s[8], w[16], v[8], t1, active;                                    \
+	size_t block, blocks = 0;                                               \
+	uint32_t lane, i, t;                                                    \
+                                                                                \
+	for (lane = 0; lane < count; lane++) {                                  \
+	        if (ctx->blocks[lane] > blocks) {                               \
+	                blocks = ctx->blocks[lane];                             \
+	        }                                                               \
+	}                                                                       \
+	for (i = 0; i < 8; i++) {                                               \
+	        s[i] = *(const vtype_u *)ctx->state[i];                         \
+	}                                                                       \
+                                                                                \
+	for (block = 0; block < blocks; block++) {                              \
+	        uint32_t mask[nlanes];                                          \
+                                                                                \
+	        for (lane = 0; lane < nlanes; lane++) {                         \
+	                const uint8_t *p;                                       \
+	                mask[lane] = 0;                                         \
+	                if (lane >= count || block >= ctx->blocks[lane]) {      \
+	                        continue;                                       \
+	                }                                                       \
+	                mask[lane] = ~0U;                                       \
+	                p = sha256_mb_block(ctx, lane, block);                  \
+	                for (t = 0; t < 16; t++) {                              \
+	                        ctx->words[t][lane] = sha256_mb_load_be32(p + 4 * t); \
+	                }                                                       \
+	        }                                                               \
+	        active = *(const vtype_u *)mask;                                \
+	        for (t = 0; t < 16; t++) {                                      \
+	                w[t] = *(const vtype_u *)ctx->words[t];                 \
+	        }                                                               \
+	        for (i = 0; i < 8; i++) {                                       \
+	                v[i] = s[i];                                            \
+	        }                                                               \
+	        for (t = 0; t < 64; t += 16) {                                  \
+	                SHA256_MB_ROUNDS16(v, w, t);                            \
+	        }                                                               \
+                                                                                \
+	        for (i = 0; i < 8; i++) {                                       \
+	                s[i] += v[i] & active;                                  \
+	        }                                                               \
+	}                                                                       \
+                                                                                \
+	for (i = 0; i < 8; i++) {                                               \
+	        *(vtype_u *)ctx->state[i] = s[i];                               \
+	}                                                                       \
+}
+
+SHA256_MB_DEFINE_LANES(sha256_mb_compress_sse2, sha256_mb_v4su, sha256_mb_v4su_u,
+    SHA256_MB_ENGINE_SSE2, "sse2")
+SHA256_MB_DEFINE_LANES(sha256_mb_compress_avx2, sha256_mb_v8su, sha256_mb_v8su_u,
+    SHA256_MB_ENGINE_AVX2, "avx2")
+SHA256_MB_DEFINE_LANES(sha256_mb_compress_avx512, sha256_mb_v16su, sha256_mb_v16su_u,
+    SHA256_MB_ENGINE_AVX512, "avx512f")
+
+#define SHA256_MB_TARGET_SHANI  __attribute__((target("sse4.1,sha")))
+
+/* Hashes lane's prepared blocks into digest with the SHA extensions */
+static __attribute__((noinline, unused)) SHA256_MB_TARGET_SHANI void
+sha256_mb_shani(const SHA256_MB_CTX *ctx, uint32_t lane, uint8_t *digest)
+{
+	const sha256_mb_v16qi bswap = { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 };
+	sha256_mb_v4si abcd = (sha256_mb_v4si)*(const sha256_mb_v4su_u *)&sha256_mb_iv[0];
+	sha256_mb_v4si efgh = (sha256_mb_v4si)*(const sha256_mb_v4su_u *)&sha256_mb_iv[4];
+	sha256_mb_v4si s0, s1, abef, cdgh, msg, w[16];
+	size_t block;
+	uint32_t i;
+
+	/* The rounds instruction works on {F, E, B, A} and {H, G, D, C} */
+	s0 = __builtin_shufflevector(abcd, efgh, 5, 4, 1, 0);
+	s1 = __builtin_shufflevector(abcd, efgh, 7, 6, 3, 2);
+
+	for (block = 0; block < ctx->blocks[lane]; block++) {
+		const uint8_t *p = sha256_mb_block(ctx, lane, block);
+
+		abef = s0;
+		cdgh = s1;
+		for (i = 0; i < 16; i++) {
+			if (i < 4) {
+				w[i] = (sha256_mb_v4si)__builtin_ia32_pshufb128(
+					*(const sha256_mb_v16qi_u *)(const void *)(p + 16 * i), bswap);
+			} else {
+				msg = __builtin_shufflevector(w[i - 2], w[i - 1], 1, 2, 3, 4);
+				w[i] = __builtin_ia32_sha256msg1(w[i - 4], w[i - 3]) + msg;
+				w[i] = __builtin_ia32_sha256msg2(w[i], w[i - 1]);
+			}
+			msg = w[i] + (sha256_mb_v4si)*(const sha256_mb_v4su *)(const void *)&sha256_mb_k[4 * i];
+			s1 = __builtin_ia32_sha256rnds2(s1, s0, msg);
+			msg = __builtin_shufflevector(msg, msg, 2, 3, 0, 0);
+			s0 = __builtin_ia32_sha256rnds2(s0, s1, msg);
+		}
+		s0 += abef;
+		s1 += cdgh;
+	}
+
+	abcd = __builtin_shufflevector(s0, s1, 3, 2, 7, 6);
+	efgh = __builtin_shufflevector(s0, s1, 1, 0, 5, 4);
+	for (i = 0; i < 4; i++) {
+		sha256_mb_store_be32(digest + 4 * i, (uint32_t)abcd[i]);
+		sha256_mb_store_be32(digest + 16 + 4 * i, (uint32_t)efgh[i]);
+	}
+}
+
+/* Out of line so that the large save area only occupies the stack when used */
+static __attribute__((noinline, unused)) bool
+sha256_mb_run_avx512(SHA256_MB_CTX *ctx, uint32_t count)
+{
+	simd_state_decl(SIMD_STATE_SIZE_AVX512, state);
+	uint64_t saved = simd_state_save(&state, SIMD_STATE_AVX512);
+
+	if (saved == SIMD_STATE_AVX512) {
+		sha256_mb_compress_avx512(ctx, count);
+	}
+	simd_state_restore(&state, saved);
+	return saved == SIMD_STATE_AVX512;
+}
+
+static inline bool
+sha256_mb_run(SHA256_MB_CTX *ctx, uint32_t count, uint32_t lanes)
+{
+	simd_state_decl(SIMD_STATE_SIZE_AVX, state);
+	uint64_t saved;
+
+	if (lanes == SHA256_MB_ENGINE_AVX512) {
+		return sha256_mb_run_avx512(ctx, count);
+	}
+
+	saved = simd_state_save(&state, lanes == SHA256_MB_ENGINE_AVX2 ? SIMD_STATE_AVX : SIMD_STATE_SSE);
+	if (lanes == SHA256_MB_ENGINE_AVX2 && saved == SIMD_STATE_AVX) {
+		sha256_mb_compress_avx2(ctx, count);
+		__asm__ volatile ("vzeroupper");
+	} else if (lanes == SHA256_MB_ENGINE_SSE2 && saved == SIMD_STATE_SSE) {
+		sha256_mb_compress_sse2(ctx, count);
+	} else {
+		lanes = 0;
+	}
+	simd_state_restore(&state, saved);
+	return lanes != 0;
+}
+
+static inline bool
+sha256_mb_run_shani(SHA256_MB_CTX *ctx, uint8_t *digest)
+{
+	simd_state_decl(SIMD_STATE_SIZE_SSE, state);
+	uint64_t saved = simd_state_save(&state, SIMD_STATE_SSE);
+
+	if (saved == SIMD_STATE_SSE) {
+		sha256_mb_shani(ctx, 0, digest);
+	}
+	simd_state_restore(&state, saved);
+	return saved == SIMD_STATE_SSE;
+}
+
+#endif /* defined(__x86_64__) */
+
+static inline void
+SHA256_MB_Init(SHA256_MB_CTX *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->lanes = SHA256_MB_ENGINE_SCALAR;
+
+#if defined(__x86_64__)
+	uint64_t leaf7 = cpuid_leaf7_features();
+	uint64_t xfem = simd_state_available();
+
+	if (leaf7 & CPUID_LEAF7_FEATURE_AVX512F) {
+		ctx->lanes = SHA256_MB_ENGINE_AVX512;
+	} else if ((leaf7 & CPUID_LEAF7_FEATURE_AVX2) && (xfem & SIMD_STATE_AVX) == SIMD_STATE_AVX) {
+		ctx->lanes = SHA256_MB_ENGINE_AVX2;
+	} else if (xfem & SIMD_STATE_SSE) {
+		ctx->lanes = SHA256_MB_ENGINE_SSE2;
+	}
+	ctx->shani = (leaf7 & CPUID_LEAF7_FEATURE_SHA) &&
+	    (cpuid_features() & CPUID_FEATURE_SSE4_1);
+
+	/* A single SHA extensions stream outruns up to 8 lanes */
+	if (ctx->shani && ctx->lanes < SHA256_MB_ENGINE_AVX512) {
+		ctx->lanes = SHA256_MB_ENGINE_SHANI;
+	}
+#endif
+}
+
+/* Returns the number of messages hashed in parallel, 1 when hashing one at a time */
+static inline uint32_t
+SHA256_MB_Lanes(const SHA256_MB_CTX *ctx)
+{
+	return ctx->lanes > 1 ? ctx->lanes : 1;
+}
+
+static inline void
+sha256_mb_single(SHA256_MB_CTX *ctx, const void *data, size_t len, uint8_t *digest)
+{
+	SHA256_CTX sha;
+
+#if defined(__x86_64__)
+	if (ctx->shani) {
+		sha256_mb_prepare(ctx, 0, data, len);
+		if (sha256_mb_run_shani(ctx, digest)) {
+			return;
+		}
+	}
+#else
+	(void)ctx;
+#endif
+
+	SHA256_Init(&sha);
+	SHA256_Update(&sha, data, len);
+	SHA256_Final(digest, &sha);
+}
+
+/*
+ * Computes digest[i] = SHA-256(data[i], len[i]) for i in [0, count).
+ */
+static inline void
+SHA256_MB_Digest(SHA256_MB_CTX *ctx, size_t count, const void * const *data,
+    const size_t *len, uint8_t (*digest)[SHA256_DIGEST_LENGTH])
+{
+	size_t base = 0;
+
+#if defined(__x86_64__)
+	uint32_t lanes = ctx->lanes;
+
+	/* AVX-512 state is enabled per thread, fall back to narrower engines without it */
+	if (lanes == SHA256_MB_ENGINE_AVX512 &&
+	    (simd_state_available() & SIMD_STATE_AVX512) != SIMD_STATE_AVX512) {
+		if (ctx->shani) {
+			lanes = SHA256_MB_ENGINE_SHANI;
+		} else if ((simd_state_available() & SIMD_STATE_AVX) == SIMD_STATE_AVX) {
+			lanes = SHA256_MB_ENGINE_AVX2;
+		} else {
+			lanes = SHA256_MB_ENGINE_SSE2;
+		}
+	}
+
+	while (lanes > 1 && base < count) {
+		uint32_t n = count - base < lanes ? (uint32_t)(count - base) : lanes;
+		uint32_t lane, i;
+
+		/* A single stream is faster with the SHA extensions than a mostly empty group */
+		if (ctx->shani && n < lanes / 2) {
+			break;
+		}
+
+		for (lane = 0; lane < lanes; lane++) {
+			for (i = 0; i < 8; i++) {
+				ctx->state[i][lane] = sha256_mb_iv[i];
+			}
+			ctx->blocks[lane] = 0;
+			if (lane < n) {
+				sha256_mb_prepare(ctx, lane, data[base + lane], len[base + lane]);
+			}
+		}
+
+		if (!sha256_mb_run(ctx, n, lanes)) {
+			break;
+		}
+
+		for (lane = 0; lane < n; lane++) {
+			for (i = 0; i < 8; i++) {
+				sha256_mb_store_be32(&digest[base + lane][4 * i], ctx->state[i][lane]);
+			}
+		}
+		base += n;
+	}
+#endif
+
+	for (; base < count; base++) {
+		sha256_mb_single(ctx, data[base], len[base], digest[base]);
+	}
+}
+
+#ifdef  __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _CRYPTO_SHA2_MB_H__ */
@@ -0,0 +1,908 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+/*!
+ *       @header lpm.h
+ *       Longest prefix match tables for IPv4 and IPv6 addresses, for kexts
+ *       that keep per-destination tables of their own alongside the routing
+ *       table.  Prefixes are added and removed as with a radix tree: the
+ *       host bits of a prefix are ignored, a prefix can be added once, and a
+ *       lookup yields the value of the longest prefix containing the address.
+ *
+ *       Lookups use a compressed table in the manner of Poptrie: the first
+ *       16 bits of the address index an array directly, and below that each
+ *       node covers the next 6 bits with two 64-bit vectors, one marking the
+ *       child nodes and one marking where runs of equal values begin, so a
+ *       child or a value is found by counting the bits below it.  An IPv4
+ *       lookup reads at most four nodes.
+ *
+ *       Changes are made to a binary trie and take effect together when
+ *       committed: the subtrees under the changed top-level entries are
+ *       rebuilt and published with a new top-level array, and the commit
+ *       waits for lookups still using the old ones before freeing them, so
+ *       lookups never take a lock.
+ */
+
+#ifndef __NET_LPM__
+#define __NET_LPM__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stddef.h>
+#include <stdint.h>
+#ifdef KERNEL
+#include <sys/errno.h>
+#include <libkern/OSMalloc.h>
+#include <kern/clock.h>
+#else
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#endif
+
+__BEGIN_DECLS
+
+#ifdef KERNEL
+/* Exported by the kernel, but not declared by its public headers */
+extern int cpu_number(void);
+#endif
+
+#define LPM_NO_MATCH            0xffffffffU
+#define LPM_VALUE_MAX           0xfffffffdU
+
+#define LPM_TOP_BITS            16
+#define LPM_TOP_SLOTS           (1U << LPM_TOP_BITS)
+#define LPM_ENTRY_CHILD         0xfffffffeU     /* node entry with a child */
+#define LPM_STRIDE              6
+#define LPM_READERS             64
+
+/* a node of a subtree, covering LPM_STRIDE bits of the address */
+struct lpm_node {
+	uint64_t        ln_vector;      /* entries that are child nodes */
+	uint64_t        ln_leafvec;     /* entries that begin a run of values */
+	uint32_t        ln_leaf;        /* index of the first value */
+	uint32_t        ln_child;       /* index of the first child node */
+};
+
+/* the subtree under a top-level entry, nodes then values */
+struct lpm_block {
+	uint32_t        lb_size;
+	uint32_t        lb_nnodes;
+	uint32_t        lb_nleaves;
+	uint32_t        lb_pad;
+	struct lpm_node lb_nodes[];
+};
+
+/*
+ * What lookups read, replaced by each commit.  A top-level entry is a
+ * subtree's address, or a value shifted left with the low bit set, so a
+ * lookup that ends there reads one word.
+ */
+struct lpm_fib {
+	uint64_t        lf_top[LPM_TOP_SLOTS];
+};
+
+#define LPM_TOP_VALUE(value)    ((uint64_t)(value) << 1 | 1)
+#define LPM_TOP_IS_VALUE(entry) (((entry) & 1) != 0)
+#define LPM_TOP_BLOCK(entry)    ((struct lpm_block *)(uintptr_t)(entry))
+
+/* a node of the binary trie changes are made to; 0 is the root and no child */
+struct lpm_rib_node {
+	uint32_t        lr_child[2];
+	uint32_t        lr_value;       /* LPM_NO_MATCH if no prefix ends here */
+};
+
+/* per-CPU counts of lookups begun and ended in each epoch parity */
+struct lpm_reader {
+	uint64_t        lrd_enter[2];
+	uint64_t        lrd_exit[2];
+	uint64_t        lrd_pad[4];
+} __attribute__((aligned(64)));
+
+/*!
+ *       @struct lpm_table
+ *       @discussion A table of prefixes of one address family.
+ */
+struct lpm_table {
+	struct lpm_reader       lt_readers[LPM_READERS];
+	struct lpm_fib          *lt_fib;
+	uint32_t                lt_epoch;
+	uint32_t                lt_bits;        /* 32 or 128 */
+	uint32_t                lt_count;
+	struct lpm_rib_node     *lt_rib;
+	uint32_t                lt_rib_count;
+	uint32_t                lt_rib_max;
+	uint32_t                lt_rib_free;    /* free list through lr_child[0] */
+	uint32_t                lt_ndirty;
+	uint64_t                lt_dirty[LPM_TOP_SLOTS / 64];
+#ifdef KERNEL
+	OSMallocTag             lt_tag;
+#endif
+};
+
+static inline void *
+lpm_alloc(struct lpm_table *table, uint64_t size)
+{
+	if (size == 0 || size > UINT32_MAX) {
+		return NULL;
+	}
+#ifdef KERNEL
+	return OSMalloc((uint32_t)size, table->lt_tag);
+#else
+	(void)table;
+	return malloc((size_t)size);
+#endif
+}
+
+static inline void
+lpm_release(struct lpm_table *table, void *data, uint64_t size)
+{
+	if (data == NULL) {
+		return;
+	}
+#ifdef KERNEL
+	OSFree(data, (uint32_t)size, table->lt_tag);
+#else
+	(void)table;
+	(void)size;
+	free(data);
+#endif
+}
+
+/*
+ * Addresses are handled as two 64-bit words, most significant bit first;
+ * bits past the end of the address read as 0.
+ */
+static inline void
+lpm_key(const struct lpm_table *table, const uint8_t *addr, uint64_t key[2])
+{
+	uint32_t bytes = table->lt_bits / 8;
+
+	key[0] = key[1] = 0;
+	for (uint32_t i = 0; i < bytes; i++) {
+		key[i / 8] |= (uint64_t)addr[i] << (56 - (i % 8) * 8);
+	}
+}
+
+static inline uint32_t
+lpm_key_bit(const uint64_t key[2], uint32_t bit)
+{
+	return (uint32_t)(key[bit / 64] >> (63 - bit % 64)) & 1;
+}
+
+static inline uint32_t
+lpm_key_stride(const uint64_t key[2], uint32_t bit)
+{
+	uint64_t window;
+
+	if (bit < 64) {
+		window = key[0] << bit | (bit ? key[1] >> (64 - bit) : 0);
+	} else {
+		window = key[1] << (bit - 64);
+	}
+	return (uint32_t)(window >> (64 - LPM_STRIDE));
+}
+
+static inline void
+lpm_mark(struct lpm_table *table, uint32_t slot)
+{
+	uint64_t bit = 1ULL << (slot % 64);
+
+	if ((table->lt_dirty[slot / 64] & bit) == 0) {
+		table->lt_dirty[slot / 64] |= bit;
+		table->lt_ndirty++;
+	}
+}
+
+static inline void
+lpm_block_free(struct lpm_table *table, struct lpm_block *block)
+{
+	if (block != NULL) {
+		lpm_release(table, block, block->lb_size);
+	}
+}
+
+/*
+ * Building a subtree.  Each node's entries are found by walking LPM_STRIDE
+ * levels of the binary trie; the child nodes of a node are queued together,
+ * so they are built next to each other in the order of their entries.
+ */
+struct lpm_build_item {
+	uint32_t        lbi_rib;
+	uint32_t        lbi_value;      /* the longest prefix above lbi_rib */
+};
+
+struct lpm_builder {
+	struct lpm_table        *lbd_table;
+	struct lpm_build_item   *lbd_queue;
+	uint32_t                lbd_queue_max;
+	struct lpm_node         *lbd_nodes;
+	uint32_t                lbd_nodes_max;
+	uint32_t                *lbd_leaves;
+	uint32_t                lbd_leaves_max;
+	uint32_t                lbd_nnodes;
+	uint32_t                lbd_nleaves;
+	uint32_t                lbd_entry[1U << LPM_STRIDE];
+	uint32_t                lbd_entry_rib[1U << LPM_STRIDE];
+};
+
+static inline errno_t
+lpm_reserve(struct lpm_table *table, void **data, uint32_t *max,
+    uint64_t needed, size_t size)
+{
+	uint64_t count = *max ? *max : 16;
+	void     *grown;
+
+	if (needed <= *max) {
+		return 0;
+	}
+	while (count < needed) {
+		count *= 2;
+	}
+	if (count > UINT32_MAX) {
+		return ENOMEM;
+	}
+	grown = lpm_alloc(table, count * size);
+	if (grown == NULL) {
+		return ENOMEM;
+	}
+	if (*max) {
+		__builtin_memcpy(grown, *data, (size_t)*max * size);
+	}
+	lpm_release(table, *data, (uint64_t)*max * size);
+	*data = grown;
+	*max = (uint32_t)count;
+	return 0;
+}
+
+static inline int
+lpm_rib_leaf(const struct lpm_table *table, uint32_t rib)
+{
+	return table->lt_rib[rib].lr_child[0] == 0 && table->lt_rib[rib].lr_child[1] == 0;
+}
+
+/*
+ * Fills the entries of a node from the trie below rib, which is depth
+ * levels into the node; an entry is a value, or LPM_ENTRY_CHILD with the trie
+ * node of its child in lbd_entry_rib.
+ */
+static inline void
+lpm_build_entries(struct lpm_builder *lbd, uint32_t rib, uint32_t value,
+    uint32_t depth, uint32_t index)
+{
+	const struct lpm_table *table = lbd->lbd_table;
+	uint32_t               span = 1U << (LPM_STRIDE - depth);
+
+	if (table->lt_rib[rib].lr_value != LPM_NO_MATCH) {
+		value = table->lt_rib[rib].lr_value;
+	}
+	if (lpm_rib_leaf(table, rib)) {
+		for (uint32_t i = 0; i < span; i++) {
+			lbd->lbd_entry[index * span + i] = value;
+		}
+		return;
+	}
+	if (depth == LPM_STRIDE) {
+		lbd->lbd_entry[index] = LPM_ENTRY_CHILD;
+		lbd->lbd_entry_rib[index] = rib;
+		return;
+	}
+	for (uint32_t b = 0; b < 2; b++) {
+		uint32_t child = table->lt_rib[rib].lr_child[b];
+
+		if (child != 0) {
+			lpm_build_entries(lbd, child, value, depth + 1, index * 2 + b);
+		} else {
+			uint32_t half = span / 2;
+
+			for (uint32_t i = 0; i < half; i++) {
+				lbd->lbd_entry[(index * 2 + b) * half + i] = value;
+			}
+		}
+	}
+}
+
+static inline errno_t
+lpm_build_block(struct lpm_builder *lbd, uint32_t rib, uint32_t value,
+    struct lpm_block **result)
+{
+	struct lpm_table *table = lbd->lbd_table;
+	struct lpm_block *block;
+	uint32_t         head = 0, tail = 0;
+	uint64_t         size;
+	errno_t          error;
+
+	lbd->lbd_nnodes = lbd->lbd_nleaves = 0;
+	error = lpm_reserve(table, (void **)&lbd->lbd_queue, &lbd->lbd_queue_max, 1, sizeof(lbd->lbd_queue[0]));
+	if (error) {
+		return error;
+	}
+	lbd->lbd_queue[tail++] = (struct lpm_build_item){ rib, value };
+
+	while (head < tail) {
+		struct lpm_build_item item = lbd->lbd_queue[head++];
+		struct lpm_node       *node;
+		uint32_t              last = LPM_NO_MATCH, have_last = 0;
+
+		error = lpm_reserve(table, (void **)&lbd->lbd_nodes, &lbd->lbd_nodes_max,
+		    (uint64_t)lbd->lbd_nnodes + 1, sizeof(lbd->lbd_nodes[0]));
+		if (error == 0) {
+			error = lpm_reserve(table, (void **)&lbd->lbd_queue, &lbd->lbd_queue_max,
+			    (uint64_t)tail + (1U << LPM_STRIDE), sizeof(lbd->lbd_queue[0]));
+		}
+		if (error == 0) {
+			error = lpm_reserve(table, (void **)&lbd->lbd_leaves, &lbd->lbd_leaves_max,
+			    (uint64_t)lbd->lbd_nleaves + (1U << LPM_STRIDE), sizeof(lbd->lbd_leaves[0]));
+		}
+		if (error) {
+			return error;
+		}
+
+		/* The trie node at a node's depth counts as the node's own prefix. */
+		lpm_build_entries(lbd, item.lbi_rib, item.lbi_value, 0, 0);
+		node = &lbd->lbd_nodes[lbd->lbd_nnodes++];
+		node->ln_vector = node->ln_leafvec = 0;
+		node->ln_leaf = lbd->lbd_nleaves;
+		node->ln_child = tail;
+		for (uint32_t v = 0; v < (1U << LPM_STRIDE); v++) {
+			uint32_t entry = lbd->lbd_entry[v];
+
+			if (entry == LPM_ENTRY_CHILD) {
+				uint32_t below = lbd->lbd_entry_rib[v];
+				uint32_t inherited = item.lbi_value;
+
+				/* The longest prefix down to the child's trie node. */
+				for (uint32_t r = item.lbi_rib, bit = 0;; bit++) {
+					if (table->lt_rib[r].lr_value != LPM_NO_MATCH) {
+						inherited = table->lt_rib[r].lr_value;
+					}
+					if (bit == LPM_STRIDE) {
+						break;
+					}
+					r = table->lt_rib[r].lr_child[(v >> (LPM_STRIDE - 1 - bit)) & 1];
+				}
+				node->ln_vector |= 1ULL << v;
+				lbd->lbd_queue[tail++] = (struct lpm_build_item){ below, inherited };
+				continue;
+			}
+			if (!have_last || entry != last) {
+				node->ln_leafvec |= 1ULL << v;
+				lbd->lbd_leaves[lbd->lbd_nleaves++] = entry;
+				last = entry;
+				have_last = 1;
+			}
+		}
+	}
+
+	size = sizeof(*block) + (uint64_t)lbd->lbd_nnodes * sizeof(struct lpm_node) +
+	    (uint64_t)lbd->lbd_nleaves * sizeof(uint32_t);
+	block = (struct lpm_block *)lpm_alloc(table, size);
+	if (block == NULL) {
+		return ENOMEM;
+	}
+	block->lb_size = (uint32_t)size;
+	block->lb_nnodes = lbd->lbd_nnodes;
+	block->lb_nleaves = lbd->lbd_nleaves;
+	block->lb_pad = 0;
+	__builtin_memcpy(block->lb_nodes, lbd->lbd_nodes, lbd->lbd_nnodes * sizeof(struct lpm_node));
+	__builtin_memcpy(&block->lb_nodes[lbd->lbd_nnodes], lbd->lbd_leaves, lbd->lbd_nleaves * sizeof(uint32_t));
+	*result = block;
+	return 0;
+}
+
+static inline void
+lpm_builder_free(struct lpm_builder *lbd)
+{
+	lpm_release(lbd->lbd_table, lbd->lbd_queue, (uint64_t)lbd->lbd_queue_max * sizeof(lbd->lbd_queue[0]));
+	lpm_release(lbd->lbd_table, lbd->lbd_nodes, (uint64_t)lbd->lbd_nodes_max * sizeof(lbd->lbd_nodes[0]));
+	lpm_release(lbd->lbd_table, lbd->lbd_leaves, (uint64_t)lbd->lbd_leaves_max * sizeof(lbd->lbd_leaves[0]));
+}
+
+/*
+ * Walks a run of top-level slots sharing a trie path, setting each slot's
+ * entry, and its subtree where the trie goes deeper than the slot.
+ */
+static inline errno_t
+lpm_build_slots(struct lpm_builder *lbd, struct lpm_fib *fib, uint32_t rib,
+    uint32_t value, uint32_t bit, uint32_t slot)
+{
+	struct lpm_table *table = lbd->lbd_table;
+	uint32_t         span = 1U << (LPM_TOP_BITS - bit);
+	errno_t          error;
+
+	if (rib != 0 || bit == 0) {
+		if (table->lt_rib[rib].lr_value != LPM_NO_MATCH) {
+			value = table->lt_rib[rib].lr_value;
+		}
+	}
+	if (bit == LPM_TOP_BITS && rib != 0 && !lpm_rib_leaf(table, rib)) {
+		if ((table->lt_dirty[slot / 64] & (1ULL << (slot % 64))) == 0) {
+			return 0;
+		}
+		struct lpm_block *block;
+
+		error = lpm_build_block(lbd, rib, value, &block);
+		if (error) {
+			return error;
+		}
+		fib->lf_top[slot] = (uint64_t)(uintptr_t)block;
+		return 0;
+	}
+	if ((rib == 0 && bit != 0) || bit == LPM_TOP_BITS || lpm_rib_leaf(table, rib)) {
+		for (uint32_t s = slot * span; s < (slot + 1) * span; s++) {
+			if (table->lt_dirty[s / 64] & (1ULL << (s % 64))) {
+				fib->lf_top[s] = LPM_TOP_VALUE(value);
+			}
+		}
+		return 0;
+	}
+	for (uint32_t b = 0; b < 2; b++) {
+		uint32_t first = (slot * 2 + b) * (span / 2), word;
+		int      dirty = 0;
+
+		/* Skip clean halves; span / 2 is a power of 2, so whole words. */
+		for (word = first / 64; word <= (first + span / 2 - 1) / 64; word++) {
+			if (table->lt_dirty[word]) {
+				dirty = 1;
+				break;
+			}
+		}
+		if (!dirty) {
+			continue;
+		}
+		error = lpm_build_slots(lbd, fib, table->lt_rib[rib].lr_child[b], value, bit + 1, slot * 2 + b);
+		if (error) {
+			return error;
+		}
+	}
+	return 0;
+}
+
+/*!
+ *       @function lpm_init
+ *       @discussion Initializes an empty table.
+ *       @param table The table.
+ *       @param family AF_INET or AF_INET6.
+ *       @result 0 upon success, EINVAL for another family, ENOMEM.
+ */
+static inline errno_t
+lpm_init(struct lpm_table *table, int family)
+{
+	__builtin_memset(table, 0, sizeof(*table));
+	if (family != AF_INET && family != AF_INET6) {
+		return EINVAL;
+	}
+	table->lt_bits = (family == AF_INET) ? 32 : 128;
+#ifdef KERNEL
+	table->lt_tag = OSMalloc_Tagalloc("com.apple.lpm", OSMT_DEFAULT);
+	if (table->lt_tag == NULL) {
+		return ENOMEM;
+	}
+#endif
+	if (lpm_reserve(table, (void **)&table->lt_rib, &table->lt_rib_max, 1, sizeof(table->lt_rib[0])) != 0) {
+#ifdef KERNEL
+		OSMalloc_Tagfree(table->lt_tag);
+		table->lt_tag = NULL;
+#endif
+		return ENOMEM;
+	}
+	table->lt_rib[0].lr_child[0] = table->lt_rib[0].lr_child[1] = 0;
+	table->lt_rib[0].lr_value = LPM_NO_MATCH;
+	table->lt_rib_count = 1;
+	return 0;
+}
+
+/*
+ * Finds the trie node of a prefix; with create, adds the nodes missing,
+ * for which the caller has reserved room.  path receives the nodes from the
+ * root down, len + 1 of them.
+ */
+static inline errno_t
+lpm_rib_walk(struct lpm_table *table, const uint64_t key[2], uint32_t len,
+    int create, uint32_t *path)
+{
+	uint32_t rib = 0;
+
+	path[0] = 0;
+	for (uint32_t bit = 0; bit < len; bit++) {
+		uint32_t b = lpm_key_bit(key, bit);
+		uint32_t next = table->lt_rib[rib].lr_child[b];
+
+		if (next == 0) {
+			if (!create) {
+				return ESRCH;
+			}
+			if (table->lt_rib_free != 0) {
+				next = table->lt_rib_free;
+				table->lt_rib_free = table->lt_rib[next].lr_child[0];
+			} else {
+				next = table->lt_rib_count++;
+			}
+			table->lt_rib[next].lr_child[0] = table->lt_rib[next].lr_child[1] = 0;
+			table->lt_rib[next].lr_value = LPM_NO_MATCH;
+			table->lt_rib[rib].lr_child[b] = next;
+		}
+		rib = next;
+		path[bit + 1] = rib;
+	}
+	return 0;
+}
+
+/* Frees the nodes at the end of a path that no longer lead to a prefix. */
+static inline void
+lpm_rib_prune(struct lpm_table *table, const uint64_t key[2], uint32_t len,
+    const uint32_t *path)
+{
+	for (uint32_t bit = len; bit > 0; bit--) {
+		uint32_t rib = path[bit];
+
+		if (table->lt_rib[rib].lr_value != LPM_NO_MATCH || !lpm_rib_leaf(table, rib)) {
+			return;
+		}
+		table->lt_rib[path[bit - 1]].lr_child[lpm_key_bit(key, bit - 1)] = 0;
+		table->lt_rib[rib].lr_child[0] = table->lt_rib_free;
+		table->lt_rib_free = rib;
+	}
+}
+
+static inline void
+lpm_mark_prefix(struct lpm_table *table, const uint64_t key[2], uint32_t len)
+{
+	uint32_t slot = (uint32_t)(key[0] >> (64 - LPM_TOP_BITS));
+
+	if (len >= LPM_TOP_BITS) {
+		lpm_mark(table, slot);
+		return;
+	}
+	slot &= ~((1U << (LPM_TOP_BITS - len)) - 1);
+	for (uint32_t s = 0; s < (1U << (LPM_TOP_BITS - len)); s++) {
+		lpm_mark(table, slot + s);
+	}
+}
+
+static inline void
+lpm_mask(uint64_t key[2], uint32_t len)
+{
+	for (uint32_t w = 0; w < 2; w++) {
+		uint32_t keep = len > w * 64 ? len - w * 64 : 0;
+
+		if (keep < 64) {
+			key[w] &= keep ? ~0ULL << (64 - keep) : 0;
+		}
+	}
+}
+
+/*!
+ *       @function lpm_insert
+ *       @discussion Adds a prefix, to take effect at the next lpm_commit().
+ *       @param table The table.
+ *       @param addr The prefix, in network byte order; bits past len are
+ *               ignored.
+ *       @param len The prefix length in bits.
+ *       @param value Returned by lookups of addresses for which this is the
+ *               longest prefix, at most LPM_VALUE_MAX.
+ *       @result 0 upon success, EEXIST if the prefix is in the table,
+ *               EINVAL, ENOMEM.
+ */
+static inline errno_t
+lpm_insert(struct lpm_table *table, const void *addr, uint32_t len, uint32_t value)
+{
+	uint32_t path[129];
+	uint64_t key[2];
+	uint32_t rib;
+	errno_t  error;
+
+	if (len > table->lt_bits || value > LPM_VALUE_MAX) {
+		return EINVAL;
+	}
+	lpm_key(table, (const uint8_t *)addr, key);
+	lpm_mask(key, len);
+
+	/* Room for the whole path first, so the walk cannot fail halfway. */
+	error = lpm_reserve(table, (void **)&table->lt_rib, &table->lt_rib_max,
+	    (uint64_t)table->lt_rib_count + len, sizeof(table->lt_rib[0]));
+	if (error) {
+		return error;
+	}
+	(void)lpm_rib_walk(table, key, len, 1, path);
+	rib = path[len];
+	if (table->lt_rib[rib].lr_value != LPM_NO_MATCH) {
+		return EEXIST;
+	}
+	table->lt_rib[rib].lr_value = value;
+	table->lt_count++;
+	lpm_mark_prefix(table, key, len);
+	return 0;
+}
+
+/*!
+ *       @function lpm_delete
+ *       @discussion Removes a prefix, to take effect at the next lpm_commit().
+ *       @param value If not NULL, receives the prefix's value.
+ *       @result 0 upon success, ESRCH if the prefix is not in the table,
+ *               EINVAL.
+ */
+static inline errno_t
+lpm_delete(struct lpm_table *table, const void *addr, uint32_t len, uint32_t *value)
+{
+	uint32_t path[129];
+	uint64_t key[2];
+	uint32_t rib;
+
+	if (len > table->lt_bits) {
+		return EINVAL;
+	}
+	lpm_key(table, (const uint8_t *)addr, key);
+	lpm_mask(key, len);
+	if (lpm_rib_walk(table, key, len, 0, path) != 0) {
+		return ESRCH;
+	}
+	rib = path[len];
+	if (table->lt_rib[rib].lr_value == LPM_NO_MATCH) {
+		return ESRCH;
+	}
+	if (value != NULL) {
+		*value = table->lt_rib[rib].lr_value;
+	}
+	table->lt_rib[rib].lr_value = LPM_NO_MATCH;
+	table->lt_count--;
+	lpm_rib_prune(table, key, len, path);
+	lpm_mark_prefix(table, key, len);
+	return 0;
+}
+
+/*!
+ *       @function lpm_lookup
+ *       @discussion Finds a prefix exactly, including changes not yet
+ *               committed.  Must be serialized with changes.
+ *       @result 0 and the value, or ESRCH.
+ */
+static inline errno_t
+lpm_lookup(struct lpm_table *table, const void *addr, uint32_t len, uint32_t *value)
+{
+	uint32_t path[129];
+	uint64_t key[2];
+
+	if (len > table->lt_bits) {
+		return EINVAL;
+	}
+	lpm_key(table, (const uint8_t *)addr, key);
+	lpm_mask(key, len);
+	if (lpm_rib_walk(table, key, len, 0, path) != 0 ||
+	    table->lt_rib[path[len]].lr_value == LPM_NO_MATCH) {
+		return ESRCH;
+	}
+	*value = table->lt_rib[path[len]].lr_value;
+	return 0;
+}
+
+static inline uint32_t
+lpm_fib_match(const struct lpm_fib *fib, const uint64_t key[2])
+{
+	uint32_t               slot = (uint32_t)(key[0] >> (64 - LPM_TOP_BITS));
+	uint64_t               entry = fib->lf_top[slot];
+	const struct lpm_block *block;
+	const struct lpm_node  *node;
+	uint32_t               bit = LPM_TOP_BITS;
+
+	if (LPM_TOP_IS_VALUE(entry)) {
+		return (uint32_t)(entry >> 1);
+	}
+	block = LPM_TOP_BLOCK(entry);
+	node = block->lb_nodes;
+	for (;;) {
+		uint32_t v = lpm_key_stride(key, bit);
+		uint64_t below = (2ULL << v) - 1;       /* wraps to all bits for 63 */
+
+		if (node->ln_vector & (1ULL << v)) {
+			node = &block->lb_nodes[node->ln_child + __builtin_popcountll(node->ln_vector & below) - 1];
+			bit += LPM_STRIDE;
+			continue;
+		}
+		return ((const uint32_t *)&block->lb_nodes[block->lb_nnodes])
+		       [node->ln_leaf + __builtin_popcountll(node->ln_leafvec & below) - 1];
+	}
+}
+
+static inline unsigned int
+lpm_reader_slot(void)
+{
+#ifdef KERNEL
+	return (unsigned int)cpu_number() % LPM_READERS;
+#else
+	static __thread char thread_slot;
+
+	return (unsigned int)((uintptr_t)&thread_slot >> 6) % LPM_READERS;
+#endif
+}
+
+/*!
+ *       @function lpm_match
+ *       @discussion Finds the longest committed prefix containing an
+ *               address.  Safe to call concurrently with each other and with
+ *               changes and commits; it neither blocks nor allocates.
+ *       @param table The table.
+ *       @param addr The address, in network byte order.
+ *       @result The prefix's value, or LPM_NO_MATCH.
+ */
+static inline uint32_t
+lpm_match(struct lpm_table *table, const void *addr)
+{
+	struct lpm_reader    *reader = &table->lt_readers[lpm_reader_slot()];
+	const struct lpm_fib *fib;
+	uint32_t             parity, value = LPM_NO_MATCH;
+	uint64_t             key[2];
+
+	lpm_key(table, (const uint8_t *)addr, key);
+	parity = __atomic_load_n(&table->lt_epoch, __ATOMIC_RELAXED) & 1;
+	__atomic_fetch_add(&reader->lrd_enter[parity], 1, __ATOMIC_SEQ_CST);
+	fib = __atomic_load_n(&table->lt_fib, __ATOMIC_SEQ_CST);
+	if (fib != NULL) {
+		value = lpm_fib_match(fib, key);
+	}
+	__atomic_fetch_add(&reader->lrd_exit[parity], 1, __ATOMIC_RELEASE);
+	return value;
+}
+
+/*
+ * Waits until every lookup begun in an epoch parity has ended.  Exits are
+ * summed before entries, so a lookup moving between slots is never counted
+ * as ended but not begun.
+ */
+static inline void
+lpm_wait(struct lpm_table *table, uint32_t parity)
+{
+	for (;;) {
+		uint64_t exits = 0, enters = 0;
+
+		for (int i = 0; i < LPM_READERS; i++) {
+			exits += __atomic_load_n(&table->lt_readers[i].lrd_exit[parity], __ATOMIC_ACQUIRE);
+		}
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		for (int i = 0; i < LPM_READERS; i++) {
+			enters += __atomic_load_n(&table->lt_readers[i].lrd_enter[parity], __ATOMIC_SEQ_CST);
+		}
+		if (enters == exits) {
+			return;
+		}
+#ifdef KERNEL
+		uint64_t deadline;
+
+		clock_interval_to_deadline(100, 1000 /* NSEC_PER_USEC */, &deadline);
+		clock_delay_until(deadline);
+#else
+		sched_yield();
+#endif
+	}
+}
+
+/*!
+ *       @function lpm_commit
+ *       @discussion Makes the changes since the last commit visible to
+ *               lookups, together.  Rebuilds the subtrees under the top-level
+ *               entries the changes touch, then returns once no lookup still
+ *               uses the old ones, and frees them.  May block; changes,
+ *               commits and lpm_destroy() must be serialized by the caller.
+ *       @result 0 upon success, ENOMEM, in which case lookups keep the
+ *               previous contents and the changes stay pending.
+ */
+static inline errno_t
+lpm_commit(struct lpm_table *table)
+{
+	struct lpm_builder lbd;
+	struct lpm_fib     *fib, *old = table->lt_fib;
+	uint32_t           epoch;
+	errno_t            error;
+
+	if (table->lt_ndirty == 0 && old != NULL) {
+		return 0;
+	}
+	fib = (struct lpm_fib *)lpm_alloc(table, sizeof(*fib));
+	if (fib == NULL) {
+		return ENOMEM;
+	}
+	if (old != NULL) {
+		__builtin_memcpy(fib, old, sizeof(*fib));
+	} else {
+		for (uint32_t slot = 0; slot < LPM_TOP_SLOTS; slot++) {
+			fib->lf_top[slot] = LPM_TOP_VALUE(LPM_NO_MATCH);
+		}
+		__builtin_memset(table->lt_dirty, 0xff, sizeof(table->lt_dirty));
+		table->lt_ndirty = LPM_TOP_SLOTS;
+	}
+	__builtin_memset(&lbd, 0, sizeof(lbd));
+	lbd.lbd_table = table;
+	error = lpm_build_slots(&lbd, fib, 0, LPM_NO_MATCH, 0, 0);
+	lpm_builder_free(&lbd);
+	if (error) {
+		for (uint32_t slot = 0; slot < LPM_TOP_SLOTS; slot++) {
+			if ((table->lt_dirty[slot / 64] & (1ULL << (slot % 64))) &&
+			    !LPM_TOP_IS_VALUE(fib->lf_top[slot]) &&
+			    (old == NULL || fib->lf_top[slot] != old->lf_top[slot])) {
+				lpm_block_free(table, LPM_TOP_BLOCK(fib->lf_top[slot]));
+			}
+		}
+		lpm_release(table, fib, sizeof(*fib));
+		return error;
+	}
+
+	__atomic_store_n(&table->lt_fib, fib, __ATOMIC_SEQ_CST);
+
+	/* As in ipf_rules_update(): wait for both parities across a flip. */
+	epoch = table->lt_epoch;
+	lpm_wait(table, (epoch + 1) & 1);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	__atomic_store_n(&table->lt_epoch, epoch + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	lpm_wait(table, epoch & 1);
+
+	if (old != NULL) {
+		for (uint32_t word = 0; word < LPM_TOP_SLOTS / 64; word++) {
+			for (uint64_t bits = table->lt_dirty[word]; bits != 0; bits &= bits - 1) {
+				uint32_t slot = word * 64 + (uint32_t)__builtin_ctzll(bits);
+
+				if (!LPM_TOP_IS_VALUE(old->lf_top[slot])) {
+					lpm_block_free(table, LPM_TOP_BLOCK(old->lf_top[slot]));
+				}
+			}
+		}
+		lpm_release(table, old, sizeof(*old));
+	}
+	__builtin_memset(table->lt_dirty, 0, sizeof(table->lt_dirty));
+	table->lt_ndirty = 0;
+	return 0;
+}
+
+/*!
+ *       @function lpm_destroy
+ *       @discussion Frees a table.  No lookup may be in progress.
+ */
+static inline void
+lpm_destroy(struct lpm_table *table)
+{
+	struct lpm_fib *fib = table->lt_fib;
+
+	if (fib != NULL) {
+		for (uint32_t slot = 0; slot < LPM_TOP_SLOTS; slot++) {
+			if (!LPM_TOP_IS_VALUE(fib->lf_top[slot])) {
+				lpm_block_free(table, LPM_TOP_BLOCK(fib->lf_top[slot]));
+			}
+		}
+		lpm_release(table, fib, sizeof(*fib));
+		table->lt_fib = NULL;
+	}
+	lpm_release(table, table->lt_rib, (uint64_t)table->lt_rib_max * sizeof(table->lt_rib[0]));
+	table->lt_rib = NULL;
+	table->lt_rib_max = table->lt_rib_count = 0;
+#ifdef KERNEL
+	if (table->lt_tag != NULL) {
+		OSMalloc_Tagfree(table->lt_tag);
+		table->lt_tag = NULL;
+	}
+#endif
+}
+
+__END_DECLS
+#endif /* __NET_LPM__ */
@@ -0,0 +1,440 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+/*!
+ *       @header in_cksum.h
+ *       Internet checksum (RFC 1071) over buffers and arbitrary ranges of
+ *       mbuf chains, and incremental checksum update (RFC 1624).
+ *
+ *       Sums are kept in the byte order of the data they cover: 16-bit words
+ *       are added as loaded from memory, so a complemented result from
+ *       in_cksum_finish() is stored into a header as is, and update values
+ *       are header fields as read from the packet.  A partial sum is a
+ *       32-bit value that may exceed 16 bits until it is folded.
+ *
+ *       Long spans are summed with AVX2 or SSE2: in the kernel on x86_64
+ *       by workers that run between simd_state_save() and
+ *       simd_state_restore(), since vector state is not preserved for kernel
+ *       code; elsewhere when the compiler targets them.  The rest is summed 8
+ *       bytes at a time in integer registers.
+ */
+
+#ifndef __NETINET_IN_CKSUM__
+#define __NETINET_IN_CKSUM__
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#ifdef KERNEL
+#include <sys/errno.h>
+#include <sys/kpi_mbuf.h>
+#if defined(__x86_64__)
+#include <i386/simd_state.h>
+#define IN_CKSUM_VECTOR_MIN     2048    /* shorter spans are not worth saving the vector registers for */
+#endif
+#elif defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#define IN_CKSUM_VECTOR_MIN     64
+#endif
+
+__BEGIN_DECLS
+
+/*!
+ *       @function in_cksum_fold
+ *       @discussion Folds a partial sum to 16 bits.
+ */
+static inline uint16_t
+in_cksum_fold(uint32_t sum)
+{
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += sum >> 16;
+	return (uint16_t)sum;
+}
+
+/*!
+ *       @function in_cksum_finish
+ *       @discussion Returns the checksum to store for a partial sum.
+ */
+static inline uint16_t
+in_cksum_finish(uint32_t sum)
+{
+	return (uint16_t)~in_cksum_fold(sum);
+}
+
+static inline uint32_t
+in_cksum_reduce(uint64_t sum)
+{
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum += sum >> 32;
+	return (uint32_t)sum;
+}
+
+#if defined(KERNEL) && defined(__x86_64__)
+typedef uint32_t in_cksum_v4su __attribute__((vector_size(16)));
+typedef uint32_t in_cksum_v8su __attribute__((vector_size(32)));
+typedef uint32_t in_cksum_v4su_u __attribute__((vector_size(16), aligned(1), __may_alias__));
+typedef uint32_t in_cksum_v8su_u __attribute__((vector_size(32), aligned(1), __may_alias__));
+
+/*
+ * Sum the 16-bit words of up to 32768 blocks of 32 bytes, the low and high
+ * word of each 32-bit lane apart so that no lane can overflow.
+ */
+static __attribute__((noinline, unused, target("avx2"))) uint64_t
+in_cksum_vector_avx2(const uint8_t *p, size_t blocks)
+{
+	in_cksum_v8su lo = { 0 };
+	in_cksum_v8su hi = { 0 };
+	uint64_t      sum = 0;
+
+	while (blocks--) {
+		in_cksum_v8su v = *(const in_cksum_v8su_u *)(const void *)p;
+
+		lo += v & 0xffff;
+		hi += v >> 16;
+		p += 32;
+	}
+	for (int i = 0; i < 8; i++) {
+		sum += (uint64_t)lo[i] + hi[i];
+	}
+	return sum;
+}
+
+static __attribute__((noinline, unused, target("sse2"))) uint64_t
+in_cksum_vector_sse2(const uint8_t *p, size_t blocks)
+{
+	in_cksum_v4su lo = { 0 };
+	in_cksum_v4su hi = { 0 };
+	uint64_t      sum = 0;
+
+	while (blocks--) {
+		in_cksum_v4su v0 = *(const in_cksum_v4su_u *)(const void *)p;
+		in_cksum_v4su v1 = *(const in_cksum_v4su_u *)(const void *)(p + 16);
+
+		lo += (v0 & 0xffff) + (v1 & 0xffff);
+		hi += (v0 >> 16) + (v1 >> 16);
+		p += 32;
+	}
+	for (int i = 0; i < 4; i++) {
+		sum += (uint64_t)lo[i] + hi[i];
+	}
+	return sum;
+}
+
+/*
+ * Sums whole 32-byte blocks with the widest vector unit whose state can be
+ * saved, leaving the tail, or everything if none can, to the caller.
+ */
+static inline uint64_t
+in_cksum_vector(const uint8_t **data, size_t *len)
+{
+	simd_state_decl(SIMD_STATE_SIZE_AVX, state);
+	const uint8_t *p = *data;
+	size_t         n = *len;
+	uint64_t       sum = 0;
+	uint64_t       saved;
+	int            avx2;
+
+	avx2  = (cpuid_leaf7_features() & CPUID_LEAF7_FEATURE_AVX2) != 0;
+	saved = simd_state_save(&state, avx2 ? SIMD_STATE_AVX : SIMD_STATE_SSE);
+	if ((saved & SIMD_STATE_AVX) != SIMD_STATE_AVX) {
+		avx2 = 0;
+	}
+
+	while ((saved & SIMD_STATE_SSE) && n >= 32) {
+		size_t blocks = n / 32;
+
+		if (blocks > 32768) {
+			blocks = 32768;
+		}
+		sum += avx2 ? in_cksum_vector_avx2(p, blocks) : in_cksum_vector_sse2(p, blocks);
+		p += blocks * 32;
+		n -= blocks * 32;
+	}
+
+	if (saved & XFEM_YMM) {
+		__asm__ volatile ("vzeroupper");
+	}
+	simd_state_restore(&state, saved);
+
+	*data = p;
+	*len  = n;
+	return sum;
+}
+#elif !defined(KERNEL) && (defined(__AVX2__) || defined(__SSE2__))
+/*
+ * Sums 16-bit words into 32-bit lanes, which cannot overflow in the 2^15
+ * blocks handled between reductions.
+ */
+static inline uint64_t
+in_cksum_vector(const uint8_t **data, size_t *len)
+{
+	const uint8_t *p = *data;
+	size_t         n = *len;
+	uint64_t       sum = 0;
+	uint32_t       lanes[8];
+
+#if defined(__AVX2__)
+	const __m256i zero = _mm256_setzero_si256();
+
+	while (n >= 32) {
+		__m256i acc = _mm256_setzero_si256();
+		size_t  blocks = n / 32;
+
+		if (blocks > 32768) {
+			blocks = 32768;
+		}
+		n -= blocks * 32;
+		while (blocks--) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(const void *)p);
+
+			acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+			acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+			p += 32;
+		}
+		_mm256_storeu_si256((__m256i *)(void *)lanes, acc);
+		for (int i = 0; i < 8; i++) {
+			sum += lanes[i];
+		}
+	}
+#else
+	const __m128i zero = _mm_setzero_si128();
+
+	while (n >= 32) {
+		__m128i acc0 = _mm_setzero_si128();
+		__m128i acc1 = _mm_setzero_si128();
+		size_t  blocks = n / 32;
+
+		if (blocks > 32768) {
+			blocks = 32768;
+		}
+		n -= blocks * 32;
+		while (blocks--) {
+			__m128i v0 = _mm_loadu_si128((const __m128i *)(const void *)p);
+			__m128i v1 = _mm_loadu_si128((const __m128i *)(const void *)(p + 16));
+
+			acc0 = _mm_add_epi32(acc0, _mm_unpacklo_epi16(v0, zero));
+			acc1 = _mm_add_epi32(acc1, _mm_unpackhi_epi16(v0, zero));
+			acc0 = _mm_add_epi32(acc0, _mm_unpacklo_epi16(v1, zero));
+			acc1 = _mm_add_epi32(acc1, _mm_unpackhi_epi16(v1, zero));
+			p += 32;
+		}
+		_mm_storeu_si128((__m128i *)(void *)lanes, acc0);
+		_mm_storeu_si128((__m128i *)(void *)(lanes + 4), acc1);
+		for (int i = 0; i < 8; i++) {
+			sum += lanes[i];
+		}
+	}
+#endif
+
+	*data = p;
+	*len  = n;
+	return sum;
+}
+#endif
+
+/*!
+ *       @function in_cksum_partial
+ *       @discussion Adds len bytes at data to a partial sum.  The bytes are
+ *               summed as if they start at an even offset of the checksummed
+ *               span; use in_cksum_combine() for a piece at an odd offset.
+ *       @param data The bytes, with any alignment.
+ *       @param len The number of bytes.
+ *       @param sum The partial sum so far, 0 to start.
+ *       @result The new partial sum.
+ */
+static inline uint32_t
+in_cksum_partial(const void *data, size_t len, uint32_t sum)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	uint64_t       acc = sum;
+	uint64_t       carry = 0;
+	uint64_t       w0, w1, w2, w3;
+
+#if defined(IN_CKSUM_VECTOR_MIN)
+	if (len >= IN_CKSUM_VECTOR_MIN) {
+		uint64_t v = in_cksum_vector(&p, &len);
+
+		acc += v;
+		carry += acc < v;
+	}
+#endif
+
+	/* 64-bit words with end-around carries counted separately. */
+	while (len >= 32) {
+		__builtin_memcpy(&w0, p, 8);
+		__builtin_memcpy(&w1, p + 8, 8);
+		__builtin_memcpy(&w2, p + 16, 8);
+		__builtin_memcpy(&w3, p + 24, 8);
+		acc += w0;
+		carry += acc < w0;
+		acc += w1;
+		carry += acc < w1;
+		acc += w2;
+		carry += acc < w2;
+		acc += w3;
+		carry += acc < w3;
+		p += 32;
+		len -= 32;
+	}
+	while (len >= 8) {
+		__builtin_memcpy(&w0, p, 8);
+		acc += w0;
+		carry += acc < w0;
+		p += 8;
+		len -= 8;
+	}
+	acc = (uint64_t)in_cksum_reduce(acc) + carry;
+	if (len >= 4) {
+		uint32_t w = 0;
+
+		__builtin_memcpy(&w, p, 4);
+		acc += w;
+		p += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		uint16_t w = 0;
+
+		__builtin_memcpy(&w, p, 2);
+		acc += w;
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+		/* The last byte is the first of a word padded with zero. */
+		uint16_t w = 0;
+
+		__builtin_memcpy(&w, p, 1);
+		acc += w;
+	}
+
+	return in_cksum_reduce(acc);
+}
+
+/*!
+ *       @function in_cksum_combine
+ *       @discussion Adds the partial sum of a piece of the span to the sum
+ *               of the rest.
+ *       @param sum The partial sum of the rest of the span.
+ *       @param part The partial sum of the piece, from in_cksum_partial().
+ *       @param offset Offset of the piece in the span; a piece at an odd
+ *               offset has its bytes swapped within each word.
+ *       @result The partial sum of both.
+ */
+static inline uint32_t
+in_cksum_combine(uint32_t sum, uint32_t part, size_t offset)
+{
+	if (offset & 1) {
+		uint16_t folded = in_cksum_fold(part);
+
+		part = (uint16_t)((folded << 8) | (folded >> 8));
+	}
+	return in_cksum_reduce((uint64_t)sum + part);
+}
+
+/*!
+ *       @function in_cksum_update16
+ *       @discussion Updates a checksum for one 16-bit field of the data it
+ *               covers changing from old to new, as in RFC 1624 eqn. 3.
+ *       @param cksum The checksum as stored in the header.
+ *       @result The checksum to store.
+ */
+static inline uint16_t
+in_cksum_update16(uint16_t cksum, uint16_t old, uint16_t new_value)
+{
+	uint32_t sum = (uint16_t)~cksum + (uint32_t)(uint16_t)~old + new_value;
+
+	return (uint16_t)~in_cksum_fold(sum);
+}
+
+/*!
+ *       @function in_cksum_update32
+ *       @discussion Updates a checksum for one 32-bit field, such as an IPv4
+ *               address or a TCP sequence number, changing from old to new.
+ *               The field must start at an even offset of the data.
+ *       @param cksum The checksum as stored in the header.
+ *       @result The checksum to store.
+ */
+static inline uint16_t
+in_cksum_update32(uint16_t cksum, uint32_t old, uint32_t new_value)
+{
+	uint32_t sum = (uint16_t)~cksum;
+
+	sum += (uint16_t)~(old >> 16) + (uint32_t)(uint16_t)~old;
+	sum += (new_value >> 16) + (new_value & 0xffff);
+	return (uint16_t)~in_cksum_fold(sum);
+}
+
+#ifdef KERNEL
+/*!
+ *       @function in_cksum_mbuf_partial
+ *       @discussion Adds a range of an mbuf chain to a partial sum.  The
+ *               range may start and end anywhere, including in the middle of
+ *               a word split across mbufs.  Unlike mbuf_inet_cksum(), no
+ *               header is parsed and the packet need not be IP.
+ *       @param mbuf The first mbuf of the chain.
+ *       @param offset The offset of the range from the start of mbuf.
+ *       @param length The number of bytes in the range.
+ *       @param sum On input the partial sum so far, 0 to start; on success
+ *               the partial sum including the range, which is taken to start
+ *               at an even offset of the checksummed span.
+ *       @result 0 upon success, EINVAL if the chain ends before the range.
+ */
+static inline errno_t
+in_cksum_mbuf_partial(mbuf_t mbuf, size_t offset, size_t length, uint32_t *sum)
+{
+	uint32_t total = 0;
+	size_t   done = 0;
+
+	while (mbuf != NULL && offset >= mbuf_len(mbuf)) {
+		offset -= mbuf_len(mbuf);
+		mbuf = mbuf_next(mbuf);
+	}
+
+	while (length != 0) {
+		size_t chunk;
+
+		if (mbuf == NULL) {
+			return EINVAL;
+		}
+		chunk = mbuf_len(mbuf) - offset;
+		if (chunk > length) {
+			chunk = length;
+		}
+		total = in_cksum_combine(total,
+		    in_cksum_partial((const uint8_t *)mbuf_data(mbuf) + offset, chunk, 0), done);
+		done += chunk;
+		length -= chunk;
+		offset = 0;
+		mbuf = mbuf_next(mbuf);
+	}
+
+	*sum = in_cksum_reduce((uint64_t)*sum + total);
+	return 0;
+}
+#endif /* KERNEL */
+
+__END_DECLS
+#endif /* __NETINET_IN_CKSUM__ */
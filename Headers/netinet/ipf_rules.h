@@ -0,0 +1,1543 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+/*!
+ *       @header ipf_rules.h
+ *       Compiled rule sets for IP filters attached with ipf_addv4() or
+ *       ipf_addv6().  An ordered list of rules on address prefixes, protocol
+ *       and port ranges is compiled once, and each packet is then classified
+ *       without walking the list: the first rule in list order that matches
+ *       is found with a few table lookups and a bitset intersection.
+ *
+ *       Each field of a rule is a dimension, and a lookup in a dimension
+ *       yields a few sets of rules, each kept as a sparse list of 64-bit
+ *       words.  Addresses are looked up in multi-bit tries, 8 bits per level,
+ *       that give the set of the prefixes ending in each level on the path;
+ *       a prefix alone in its subtree is kept whole rather than as a chain
+ *       of nodes.  The protocol indexes a table.  A port is looked up in a
+ *       hash table of the ports rules name exactly, and in a trie of the
+ *       aligned blocks that port ranges split into.  The rules that ignore a
+ *       field are one more set of its dimension.  The match is the lowest
+ *       rule in some set of every dimension, found by leaping the sets'
+ *       cursors forward to the furthest word any dimension has left.
+ *
+ *       A rule set is replaced by compiling a new one and publishing it;
+ *       packets being classified keep using the old one, and the update
+ *       waits for them, so the data path never takes a lock.
+ */
+
+#ifndef __NETINET_IPF_RULES__
+#define __NETINET_IPF_RULES__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stddef.h>
+#include <stdint.h>
+#ifdef KERNEL
+#include <sys/errno.h>
+#include <sys/kpi_mbuf.h>
+#include <netinet/in.h>
+#include <libkern/OSMalloc.h>
+#include <kern/clock.h>
+#else
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#endif
+
+__BEGIN_DECLS
+
+#ifdef KERNEL
+/* Exported by the kernel, but not declared by its public headers */
+extern int cpu_number(void);
+#endif
+
+/*!
+ *       @struct ipf_rule
+ *       @discussion A rule as given to ipf_rules_update().  A field that is
+ *               zero, or a port range of 0 to 65535, matches anything.
+ *               Addresses are in network byte order, an IPv4 address in the
+ *               first 4 bytes; ports are in host byte order.  A packet without
+ *               ports, such as ICMP or a non-initial fragment, has ports 0.
+ *       @field ipfr_action Returned by ipf_rules_match() for this rule.
+ *       @field ipfr_family AF_INET or AF_INET6.
+ *       @field ipfr_protocol The IP protocol, or 0 for any.
+ *       @field ipfr_src_len Source prefix length in bits, 0 for any.
+ *       @field ipfr_dst_len Destination prefix length in bits, 0 for any.
+ */
+struct ipf_rule {
+	uint32_t        ipfr_action;
+	uint8_t         ipfr_family;
+	uint8_t         ipfr_protocol;
+	uint8_t         ipfr_src_len;
+	uint8_t         ipfr_dst_len;
+	uint16_t        ipfr_sport_min;
+	uint16_t        ipfr_sport_max;
+	uint16_t        ipfr_dport_min;
+	uint16_t        ipfr_dport_max;
+	uint8_t         ipfr_src[16];
+	uint8_t         ipfr_dst[16];
+};
+
+/*!
+ *       @struct ipf_rules_key
+ *       @discussion The fields of a packet that rules match on, in the same
+ *               byte orders as struct ipf_rule.
+ */
+struct ipf_rules_key {
+	uint8_t         irk_family;
+	uint8_t         irk_protocol;
+	uint16_t        irk_sport;
+	uint16_t        irk_dport;
+	uint8_t         irk_src[16];
+	uint8_t         irk_dst[16];
+};
+
+#define IPF_RULES_NO_MATCH      0xffffffffU
+#define IPF_RULES_MAX           (1U << 24)
+
+#define IPF_RULES_DIM_SRC       0
+#define IPF_RULES_DIM_DST       1
+#define IPF_RULES_DIM_SPORT     2
+#define IPF_RULES_DIM_DPORT     3
+#define IPF_RULES_DIM_PROTO     4
+#define IPF_RULES_DIMS          5
+#define IPF_RULES_TRIES         4       /* one per dimension before PROTO */
+
+#define IPF_RULES_NODE_CHILD    0x80000000U
+#define IPF_RULES_NODE_TAIL     0x40000000U
+#define IPF_RULES_NODE_INDEX    0x3fffffffU
+
+/* sets per lookup: an IPv6 address yields at most 18 with its wildcards */
+#define IPF_RULES_CURSORS       48
+#define IPF_RULES_CHUNK         16      /* words intersected at a time */
+#define IPF_RULES_READERS       64
+
+/* a set of rules: irw_count words at irw_offset of the word arrays */
+struct ipf_rules_words {
+	uint32_t        irw_offset;
+	uint32_t        irw_count;
+};
+
+/* a prefix alone in its subtree, compared whole */
+struct ipf_rules_tail {
+	uint64_t        irl_value[2];
+	uint64_t        irl_mask[2];
+	uint32_t        irl_len;
+	uint32_t        irl_outer;      /* set of the entry the tail replaced */
+	uint32_t        irl_inner;      /* set of the prefix's own rules */
+};
+
+/*
+ * A node entry is a set, a child node or a tail.  The set of an entry has
+ * the rules of the prefixes ending in the node's level that contain it, and
+ * the set of an entry replaced by a child node moves to the child's
+ * irt_above, so a lookup takes one set from each level on its path.
+ */
+struct ipf_rules_trie {
+	uint32_t                *irt_node;      /* 256 entries per node, root first */
+	uint32_t                *irt_above;
+	struct ipf_rules_tail   *irt_tail;
+	uint32_t                irt_nnodes;
+	uint32_t                irt_node_max;
+	uint32_t                irt_above_max;
+	uint32_t                irt_ntails;
+	uint32_t                irt_tail_max;
+};
+
+struct ipf_rules_exact {
+	uint32_t        *ire_key;       /* port + 1, or 0 for an empty slot */
+	uint32_t        *ire_set;
+	uint32_t        ire_slots;      /* a power of 2 */
+};
+
+/* the rules of one address family; set 0 is empty */
+struct ipf_rules_class {
+	uint32_t                irc_count;
+	uint32_t                irc_dims;       /* dimensions some rule constrains */
+	uint32_t                *irc_rule;      /* class rule to rule list index */
+	uint32_t                irc_wild[IPF_RULES_DIMS];
+	struct ipf_rules_words  *irc_sets;
+	uint32_t                irc_nsets;
+	uint32_t                irc_sets_max;
+	uint32_t                *irc_word_index;
+	uint64_t                *irc_word_bits;
+	uint32_t                irc_nwords;
+	uint32_t                irc_index_max;
+	uint32_t                irc_bits_max;
+	struct ipf_rules_trie   irc_trie[IPF_RULES_TRIES];
+	struct ipf_rules_exact  irc_exact[2];
+	uint32_t                irc_proto[256];
+};
+
+struct ipf_ruleset {
+	uint32_t                irs_count;
+	uint32_t                *irs_action;
+	struct ipf_rules_class  irs_class[2];   /* AF_INET, AF_INET6 */
+};
+
+/* per-CPU counts of classifications begun and ended in each epoch parity */
+struct ipf_rules_reader {
+	uint64_t        irr_enter[2];
+	uint64_t        irr_exit[2];
+	uint64_t        irr_pad[4];
+} __attribute__((aligned(64)));
+
+/*!
+ *       @struct ipf_rules
+ *       @discussion The state shared by an IP filter's callbacks.  Embed it
+ *               in the filter's cookie and call ipf_rules_init() before
+ *               ipf_addv4() or ipf_addv6().
+ */
+struct ipf_rules {
+	struct ipf_rules_reader ir_readers[IPF_RULES_READERS];
+	struct ipf_ruleset      *ir_active;
+	uint32_t                ir_epoch;
+#ifdef KERNEL
+	OSMallocTag             ir_tag;
+#endif
+};
+
+static inline void *
+ipf_rules_alloc(struct ipf_rules *rules, uint64_t size)
+{
+	if (size == 0 || size > UINT32_MAX) {
+		return NULL;
+	}
+#ifdef KERNEL
+	return OSMalloc((uint32_t)size, rules->ir_tag);
+#else
+	(void)rules;
+	return malloc((size_t)size);
+#endif
+}
+
+static inline void
+ipf_rules_release(struct ipf_rules *rules, void *data, uint64_t size)
+{
+	if (data == NULL) {
+		return;
+	}
+#ifdef KERNEL
+	OSFree(data, (uint32_t)size, rules->ir_tag);
+#else
+	(void)rules;
+	(void)size;
+	free(data);
+#endif
+}
+
+/*
+ * Grows an array to hold at least needed elements, doubling its capacity.
+ */
+static inline errno_t
+ipf_rules_reserve(struct ipf_rules *rules, void **data, uint32_t *max,
+    uint64_t needed, size_t size)
+{
+	uint64_t count = *max ? *max : 16;
+	void     *grown;
+
+	if (needed <= *max) {
+		return 0;
+	}
+	while (count < needed) {
+		count *= 2;
+	}
+	if (count > UINT32_MAX) {
+		return ENOMEM;
+	}
+	grown = ipf_rules_alloc(rules, count * size);
+	if (grown == NULL) {
+		return ENOMEM;
+	}
+	if (*max) {
+		__builtin_memcpy(grown, *data, (size_t)*max * size);
+	}
+	ipf_rules_release(rules, *data, (uint64_t)*max * size);
+	*data = grown;
+	*max = (uint32_t)count;
+	return 0;
+}
+
+/*
+ * Compilation.  Sets are built at the end of the word arrays, then interned:
+ * a set equal to one already built is dropped in favor of it, so each
+ * distinct set is stored once however many entries or ports share it.
+ */
+struct ipf_rules_prefix {
+	uint32_t        irf_rule;
+	uint32_t        irf_len;
+	uint8_t         irf_bytes[16];  /* masked to irf_len bits */
+};
+
+struct ipf_rules_compiler {
+	struct ipf_rules                *irx_rules;
+	struct ipf_rules_class          *irx_class;
+	const struct ipf_rule           *irx_list;
+	uint32_t                        *irx_hash;      /* set ids, 0 for an empty slot */
+	uint32_t                        irx_hash_slots;
+	uint32_t                        *irx_set_hash;
+	uint32_t                        irx_set_hash_max;
+	uint32_t                        *irx_order;     /* irx_max entries each */
+	uint32_t                        *irx_sort;
+	uint32_t                        *irx_group;
+	uint32_t                        irx_max;
+	const struct ipf_rules_prefix   *irx_prefix;
+	int                             irx_dim;
+};
+
+static inline errno_t
+ipf_rules_compiler_reserve(struct ipf_rules_compiler *irx, uint32_t count)
+{
+	uint32_t *array[3];
+
+	if (count <= irx->irx_max) {
+		return 0;
+	}
+	for (int i = 0; i < 3; i++) {
+		array[i] = (uint32_t *)ipf_rules_alloc(irx->irx_rules, (uint64_t)count * sizeof(uint32_t));
+		if (array[i] == NULL) {
+			while (i--) {
+				ipf_rules_release(irx->irx_rules, array[i], (uint64_t)count * sizeof(uint32_t));
+			}
+			return ENOMEM;
+		}
+	}
+	ipf_rules_release(irx->irx_rules, irx->irx_order, (uint64_t)irx->irx_max * sizeof(uint32_t));
+	ipf_rules_release(irx->irx_rules, irx->irx_sort, (uint64_t)irx->irx_max * sizeof(uint32_t));
+	ipf_rules_release(irx->irx_rules, irx->irx_group, (uint64_t)irx->irx_max * sizeof(uint32_t));
+	irx->irx_order = array[0];
+	irx->irx_sort = array[1];
+	irx->irx_group = array[2];
+	irx->irx_max = count;
+	return 0;
+}
+
+static inline uint32_t
+ipf_rules_words_hash(const uint32_t *index, const uint64_t *bits, uint32_t count)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (uint32_t i = 0; i < count; i++) {
+		hash = (hash ^ index[i]) * 0x100000001b3ULL;
+		hash = (hash ^ bits[i]) * 0x100000001b3ULL;
+	}
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static inline errno_t
+ipf_rules_rehash(struct ipf_rules_compiler *irx, uint32_t slots)
+{
+	uint32_t *hash = (uint32_t *)ipf_rules_alloc(irx->irx_rules, (uint64_t)slots * sizeof(uint32_t));
+
+	if (hash == NULL) {
+		return ENOMEM;
+	}
+	__builtin_memset(hash, 0, (size_t)slots * sizeof(uint32_t));
+	for (uint32_t id = 1; id < irx->irx_class->irc_nsets; id++) {
+		uint32_t slot = irx->irx_set_hash[id] & (slots - 1);
+
+		while (hash[slot] != 0) {
+			slot = (slot + 1) & (slots - 1);
+		}
+		hash[slot] = id;
+	}
+	ipf_rules_release(irx->irx_rules, irx->irx_hash, (uint64_t)irx->irx_hash_slots * sizeof(uint32_t));
+	irx->irx_hash = hash;
+	irx->irx_hash_slots = slots;
+	return 0;
+}
+
+/*
+ * Interns the words from start to the end of the word arrays as a set.
+ */
+static inline errno_t
+ipf_rules_intern(struct ipf_rules_compiler *irx, uint32_t start, uint32_t *id)
+{
+	struct ipf_rules_class *irc = irx->irx_class;
+	uint32_t               count = irc->irc_nwords - start;
+	uint32_t               hash, slot;
+	errno_t                error;
+
+	if (count == 0) {
+		*id = 0;
+		return 0;
+	}
+	hash = ipf_rules_words_hash(&irc->irc_word_index[start], &irc->irc_word_bits[start], count);
+	for (slot = hash & (irx->irx_hash_slots - 1); irx->irx_hash[slot] != 0;
+	    slot = (slot + 1) & (irx->irx_hash_slots - 1)) {
+		const struct ipf_rules_words *set = &irc->irc_sets[irx->irx_hash[slot]];
+
+		if (irx->irx_set_hash[irx->irx_hash[slot]] == hash && set->irw_count == count &&
+		    __builtin_memcmp(&irc->irc_word_index[set->irw_offset], &irc->irc_word_index[start], count * sizeof(uint32_t)) == 0 &&
+		    __builtin_memcmp(&irc->irc_word_bits[set->irw_offset], &irc->irc_word_bits[start], count * sizeof(uint64_t)) == 0) {
+			irc->irc_nwords = start;
+			*id = irx->irx_hash[slot];
+			return 0;
+		}
+	}
+
+	if (irc->irc_nsets > IPF_RULES_NODE_INDEX) {
+		return ENOMEM;
+	}
+	error = ipf_rules_reserve(irx->irx_rules, (void **)&irc->irc_sets, &irc->irc_sets_max,
+	    irc->irc_nsets + 1, sizeof(struct ipf_rules_words));
+	if (error == 0) {
+		error = ipf_rules_reserve(irx->irx_rules, (void **)&irx->irx_set_hash, &irx->irx_set_hash_max,
+		    irc->irc_nsets + 1, sizeof(uint32_t));
+	}
+	if (error) {
+		return error;
+	}
+	*id = irc->irc_nsets++;
+	irc->irc_sets[*id].irw_offset = start;
+	irc->irc_sets[*id].irw_count = count;
+	irx->irx_set_hash[*id] = hash;
+	irx->irx_hash[slot] = *id;
+	if (irc->irc_nsets * 2 > irx->irx_hash_slots) {
+		return ipf_rules_rehash(irx, irx->irx_hash_slots * 2);
+	}
+	return 0;
+}
+
+static inline errno_t
+ipf_rules_push_word(struct ipf_rules_compiler *irx, uint32_t index, uint64_t bits)
+{
+	struct ipf_rules_class *irc = irx->irx_class;
+	errno_t                error;
+
+	error = ipf_rules_reserve(irx->irx_rules, (void **)&irc->irc_word_index, &irc->irc_index_max,
+	    irc->irc_nwords + 1, sizeof(uint32_t));
+	if (error == 0) {
+		error = ipf_rules_reserve(irx->irx_rules, (void **)&irc->irc_word_bits, &irc->irc_bits_max,
+		    irc->irc_nwords + 1, sizeof(uint64_t));
+	}
+	if (error) {
+		return error;
+	}
+	irc->irc_word_index[irc->irc_nwords] = index;
+	irc->irc_word_bits[irc->irc_nwords] = bits;
+	irc->irc_nwords++;
+	return 0;
+}
+
+/*
+ * Interns the union of an interned set and an ascending list of class rules.
+ */
+static inline errno_t
+ipf_rules_intern_union(struct ipf_rules_compiler *irx, uint32_t set, const uint32_t *list,
+    uint32_t count, uint32_t *id)
+{
+	struct ipf_rules_class *irc = irx->irx_class;
+	uint32_t               start = irc->irc_nwords;
+	uint32_t               a = irc->irc_sets[set].irw_offset;
+	uint32_t               a_end = a + irc->irc_sets[set].irw_count;
+	uint32_t               b = 0;
+	errno_t                error;
+
+	while (a < a_end || b < count) {
+		uint32_t index;
+		uint64_t bits = 0;
+
+		if (b == count || (a < a_end && irc->irc_word_index[a] < (list[b] >> 6))) {
+			index = irc->irc_word_index[a];
+		} else {
+			index = list[b] >> 6;
+		}
+		if (a < a_end && irc->irc_word_index[a] == index) {
+			bits = irc->irc_word_bits[a++];
+		}
+		for (; b < count && (list[b] >> 6) == index; b++) {
+			bits |= 1ULL << (list[b] & 63);
+		}
+		error = ipf_rules_push_word(irx, index, bits);
+		if (error) {
+			return error;
+		}
+	}
+	return ipf_rules_intern(irx, start, id);
+}
+
+/*
+ * Merge sort of indexes, stable, with a comparison on what they index.
+ */
+typedef int (*ipf_rules_compare_func)(struct ipf_rules_compiler *irx, uint32_t a, uint32_t b);
+
+static inline void
+ipf_rules_sort(struct ipf_rules_compiler *irx, uint32_t *order, uint32_t count,
+    ipf_rules_compare_func compare)
+{
+	uint32_t *src = order;
+	uint32_t *dst = irx->irx_sort;
+
+	for (uint32_t width = 1; width < count; width *= 2) {
+		for (uint32_t lo = 0; lo < count; lo += 2 * width) {
+			uint32_t mid = lo + width < count ? lo + width : count;
+			uint32_t hi = lo + 2 * width < count ? lo + 2 * width : count;
+			uint32_t a = lo, b = mid, k = lo;
+
+			while (a < mid && b < hi) {
+				dst[k++] = compare(irx, src[b], src[a]) < 0 ? src[b++] : src[a++];
+			}
+			while (a < mid) {
+				dst[k++] = src[a++];
+			}
+			while (b < hi) {
+				dst[k++] = src[b++];
+			}
+		}
+		uint32_t *swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != order) {
+		__builtin_memcpy(order, src, count * sizeof(uint32_t));
+	}
+}
+
+static inline const struct ipf_rule *
+ipf_rules_compiler_rule(struct ipf_rules_compiler *irx, uint32_t rule)
+{
+	return &irx->irx_list[irx->irx_class->irc_rule[rule]];
+}
+
+static inline int
+ipf_rules_compare_prefix(struct ipf_rules_compiler *irx, uint32_t a, uint32_t b)
+{
+	const struct ipf_rules_prefix *pa = &irx->irx_prefix[a];
+	const struct ipf_rules_prefix *pb = &irx->irx_prefix[b];
+
+	if (pa->irf_len != pb->irf_len) {
+		return pa->irf_len < pb->irf_len ? -1 : 1;
+	}
+	return __builtin_memcmp(pa->irf_bytes, pb->irf_bytes, 16);
+}
+
+static inline void
+ipf_rules_port_range(const struct ipf_rule *rule, int dim, uint32_t *min, uint32_t *max)
+{
+	*min = dim == IPF_RULES_DIM_SPORT ? rule->ipfr_sport_min : rule->ipfr_dport_min;
+	*max = dim == IPF_RULES_DIM_SPORT ? rule->ipfr_sport_max : rule->ipfr_dport_max;
+}
+
+static inline int
+ipf_rules_compare_port(struct ipf_rules_compiler *irx, uint32_t a, uint32_t b)
+{
+	uint32_t amin, amax, bmin, bmax;
+
+	ipf_rules_port_range(ipf_rules_compiler_rule(irx, a), irx->irx_dim, &amin, &amax);
+	ipf_rules_port_range(ipf_rules_compiler_rule(irx, b), irx->irx_dim, &bmin, &bmax);
+	return (int)amin - (int)bmin;
+}
+
+static inline int
+ipf_rules_wildcard(const struct ipf_rule *rule, int dim)
+{
+	switch (dim) {
+	case IPF_RULES_DIM_SRC:
+		return rule->ipfr_src_len == 0;
+	case IPF_RULES_DIM_DST:
+		return rule->ipfr_dst_len == 0;
+	case IPF_RULES_DIM_SPORT:
+		return rule->ipfr_sport_min == 0 && rule->ipfr_sport_max == 0xffff;
+	case IPF_RULES_DIM_DPORT:
+		return rule->ipfr_dport_min == 0 && rule->ipfr_dport_max == 0xffff;
+	default:
+		return rule->ipfr_protocol == 0;
+	}
+}
+
+static inline int
+ipf_rules_tail_match(const struct ipf_rules_tail *tail, const uint8_t *addr)
+{
+	uint64_t word[2];
+
+	__builtin_memcpy(word, addr, 16);
+	return (((word[0] & tail->irl_mask[0]) ^ tail->irl_value[0]) |
+	       ((word[1] & tail->irl_mask[1]) ^ tail->irl_value[1])) == 0;
+}
+
+static inline errno_t
+ipf_rules_trie_node(struct ipf_rules_compiler *irx, struct ipf_rules_trie *irt, uint32_t above,
+    uint32_t *node)
+{
+	errno_t error;
+
+	if (irt->irt_nnodes > IPF_RULES_NODE_INDEX / 256) {
+		return ENOMEM;
+	}
+	error = ipf_rules_reserve(irx->irx_rules, (void **)&irt->irt_node, &irt->irt_node_max,
+	    (uint64_t)(irt->irt_nnodes + 1) * 256, sizeof(uint32_t));
+	if (error == 0) {
+		error = ipf_rules_reserve(irx->irx_rules, (void **)&irt->irt_above, &irt->irt_above_max,
+		    irt->irt_nnodes + 1, sizeof(uint32_t));
+	}
+	if (error) {
+		return error;
+	}
+	*node = irt->irt_nnodes++;
+	__builtin_memset(&irt->irt_node[*node * 256], 0, 256 * sizeof(uint32_t));
+	irt->irt_above[*node] = above;
+	return 0;
+}
+
+/*
+ * Sets the entries that a prefix ending in a node's level covers.  They all
+ * hold the set of the shorter prefixes of the level containing the prefix,
+ * to which a list of rules is added if given.
+ */
+static inline errno_t
+ipf_rules_trie_fill(struct ipf_rules_compiler *irx, struct ipf_rules_trie *irt, uint32_t node,
+    const uint8_t *bytes, uint32_t len, const uint32_t *list, uint32_t count, uint32_t set)
+{
+	uint32_t level = (len - 1) / 8;
+	uint32_t span = 1U << (8 * (level + 1) - len);
+	uint32_t first = node * 256 + (bytes[level] & ~(span - 1));
+	errno_t  error;
+
+	if (list != NULL) {
+		error = ipf_rules_intern_union(irx, irt->irt_node[first], list, count, &set);
+		if (error) {
+			return error;
+		}
+	}
+	for (uint32_t e = 0; e < span; e++) {
+		irt->irt_node[first + e] = set;
+	}
+	return 0;
+}
+
+static inline errno_t
+ipf_rules_trie_tail(struct ipf_rules_compiler *irx, struct ipf_rules_trie *irt,
+    const struct ipf_rules_prefix *prefix, uint32_t count, uint32_t *entry)
+{
+	struct ipf_rules_tail *tail;
+	uint8_t               mask[16];
+	errno_t               error;
+
+	error = ipf_rules_reserve(irx->irx_rules, (void **)&irt->irt_tail, &irt->irt_tail_max,
+	    irt->irt_ntails + 1, sizeof(struct ipf_rules_tail));
+	if (error) {
+		return error;
+	}
+	tail = &irt->irt_tail[irt->irt_ntails];
+	for (uint32_t i = 0; i < 16; i++) {
+		mask[i] = 8 * i + 8 <= prefix->irf_len ? 0xff :
+		    8 * i < prefix->irf_len ? (uint8_t)(0xff00 >> (prefix->irf_len & 7)) : 0;
+	}
+	__builtin_memcpy(tail->irl_value, prefix->irf_bytes, 16);
+	__builtin_memcpy(tail->irl_mask, mask, 16);
+	tail->irl_len = prefix->irf_len;
+	tail->irl_outer = *entry;
+	error = ipf_rules_intern_union(irx, 0, irx->irx_group, count, &tail->irl_inner);
+	if (error) {
+		return error;
+	}
+	*entry = IPF_RULES_NODE_TAIL | irt->irt_ntails++;
+	return 0;
+}
+
+/*
+ * Builds a trie from prefixes, inserted shortest first so that the entries
+ * a prefix covers hold only sets.  A prefix that would need a new node is
+ * made a tail instead, and a tail in the way of a longer prefix is pushed
+ * down a level into a new node.
+ */
+static inline errno_t
+ipf_rules_compile_trie(struct ipf_rules_compiler *irx, struct ipf_rules_trie *irt,
+    const struct ipf_rules_prefix *prefix, uint32_t count)
+{
+	uint32_t *order = irx->irx_order;
+	uint32_t root;
+	errno_t  error;
+
+	error = ipf_rules_trie_node(irx, irt, 0, &root);
+	if (error) {
+		return error;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		order[i] = i;
+	}
+	irx->irx_prefix = prefix;
+	ipf_rules_sort(irx, order, count, ipf_rules_compare_prefix);
+
+	for (uint32_t i = 0; i < count;) {
+		const struct ipf_rules_prefix *p = &prefix[order[i]];
+		uint32_t                      level = (p->irf_len - 1) / 8;
+		uint32_t                      node = root, end = i, l;
+
+		while (end < count && ipf_rules_compare_prefix(irx, order[i], order[end]) == 0) {
+			irx->irx_group[end - i] = prefix[order[end]].irf_rule;
+			end++;
+		}
+
+		for (l = 0; l < level; l++) {
+			uint32_t entry = irt->irt_node[node * 256 + p->irf_bytes[l]];
+			uint32_t child;
+
+			if (entry & IPF_RULES_NODE_TAIL) {
+				uint32_t              index = entry & IPF_RULES_NODE_INDEX;
+				struct ipf_rules_tail tail = irt->irt_tail[index];
+				const uint8_t         *bytes = (const uint8_t *)tail.irl_value;
+
+				error = ipf_rules_trie_node(irx, irt, tail.irl_outer, &child);
+				if (error) {
+					return error;
+				}
+				if (tail.irl_len <= 8 * (l + 2)) {
+					ipf_rules_trie_fill(irx, irt, child, bytes, tail.irl_len, NULL, 0, tail.irl_inner);
+				} else {
+					irt->irt_tail[index].irl_outer = 0;
+					irt->irt_node[child * 256 + bytes[l + 1]] = IPF_RULES_NODE_TAIL | index;
+				}
+				entry = IPF_RULES_NODE_CHILD | child;
+				irt->irt_node[node * 256 + p->irf_bytes[l]] = entry;
+			} else if (!(entry & IPF_RULES_NODE_CHILD)) {
+				error = ipf_rules_trie_tail(irx, irt, p, end - i, &entry);
+				if (error) {
+					return error;
+				}
+				irt->irt_node[node * 256 + p->irf_bytes[l]] = entry;
+				break;
+			}
+			node = entry & IPF_RULES_NODE_INDEX;
+		}
+		if (l == level) {
+			error = ipf_rules_trie_fill(irx, irt, node, p->irf_bytes, p->irf_len, irx->irx_group, end - i, 0);
+			if (error) {
+				return error;
+			}
+		}
+		i = end;
+	}
+	return 0;
+}
+
+static inline errno_t
+ipf_rules_compile_address(struct ipf_rules_compiler *irx, int dim)
+{
+	struct ipf_rules_class  *irc = irx->irx_class;
+	struct ipf_rules_prefix *prefix;
+	uint32_t                count = 0;
+	errno_t                 error;
+
+	prefix = (struct ipf_rules_prefix *)ipf_rules_alloc(irx->irx_rules,
+	    (uint64_t)irc->irc_count * sizeof(*prefix));
+	if (prefix == NULL) {
+		return ENOMEM;
+	}
+	for (uint32_t i = 0; i < irc->irc_count; i++) {
+		const struct ipf_rule   *rule = ipf_rules_compiler_rule(irx, i);
+		const uint8_t           *addr = dim == IPF_RULES_DIM_SRC ? rule->ipfr_src : rule->ipfr_dst;
+		uint32_t                len = dim == IPF_RULES_DIM_SRC ? rule->ipfr_src_len : rule->ipfr_dst_len;
+		struct ipf_rules_prefix *p = &prefix[count];
+
+		if (len == 0) {
+			continue;
+		}
+		p->irf_rule = i;
+		p->irf_len = len;
+		__builtin_memset(p->irf_bytes, 0, 16);
+		__builtin_memcpy(p->irf_bytes, addr, (len + 7) / 8);
+		if (len & 7) {
+			p->irf_bytes[len / 8] &= (uint8_t)(0xff00 >> (len & 7));
+		}
+		count++;
+	}
+	error = ipf_rules_compile_trie(irx, &irc->irc_trie[dim], prefix, count);
+	ipf_rules_release(irx->irx_rules, prefix, (uint64_t)irc->irc_count * sizeof(*prefix));
+	return error;
+}
+
+static inline uint32_t
+ipf_rules_port_slot(uint32_t port, uint32_t slots)
+{
+	return (port * 0x9e3779b1U) >> 16 & (slots - 1);
+}
+
+/* the largest aligned block of ports from min not past max */
+static inline uint32_t
+ipf_rules_port_block(uint32_t min, uint32_t max)
+{
+	uint32_t size = min ? min & -min : 0x10000;
+
+	while (min + size - 1 > max) {
+		size /= 2;
+	}
+	return size;
+}
+
+/*
+ * Builds a port dimension: a hash table of the ports named exactly, and a
+ * trie of the aligned blocks each range splits into, at most 30 per range.
+ */
+static inline errno_t
+ipf_rules_compile_ports(struct ipf_rules_compiler *irx, int dim)
+{
+	struct ipf_rules_class  *irc = irx->irx_class;
+	struct ipf_rules_exact  *ire = &irc->irc_exact[dim - IPF_RULES_DIM_SPORT];
+	struct ipf_rules_prefix *prefix;
+	uint32_t                *exact = irx->irx_order;
+	uint32_t                count = 0, blocks = 0, ports = 0, slots, min, max;
+	errno_t                 error;
+
+	for (uint32_t i = 0; i < irc->irc_count; i++) {
+		ipf_rules_port_range(ipf_rules_compiler_rule(irx, i), dim, &min, &max);
+		if (min == max) {
+			exact[ports++] = i;
+		} else if (!(min == 0 && max == 0xffff)) {
+			for (; min <= max; min += ipf_rules_port_block(min, max)) {
+				blocks++;
+			}
+		}
+	}
+
+	irx->irx_dim = dim;
+	ipf_rules_sort(irx, exact, ports, ipf_rules_compare_port);
+	for (slots = 16; slots < 2 * ports; slots *= 2) {
+	}
+	ire->ire_key = (uint32_t *)ipf_rules_alloc(irx->irx_rules, (uint64_t)slots * sizeof(uint32_t));
+	ire->ire_set = (uint32_t *)ipf_rules_alloc(irx->irx_rules, (uint64_t)slots * sizeof(uint32_t));
+	if (ire->ire_key == NULL || ire->ire_set == NULL) {
+		return ENOMEM;
+	}
+	ire->ire_slots = slots;
+	__builtin_memset(ire->ire_key, 0, slots * sizeof(uint32_t));
+	for (uint32_t i = 0; i < ports;) {
+		uint32_t end = i, slot;
+
+		ipf_rules_port_range(ipf_rules_compiler_rule(irx, exact[i]), dim, &min, &max);
+		while (end < ports && ipf_rules_compare_port(irx, exact[i], exact[end]) == 0) {
+			end++;
+		}
+		for (slot = ipf_rules_port_slot(min, slots); ire->ire_key[slot] != 0; slot = (slot + 1) & (slots - 1)) {
+		}
+		ire->ire_key[slot] = min + 1;
+		error = ipf_rules_intern_union(irx, 0, &exact[i], end - i, &ire->ire_set[slot]);
+		if (error) {
+			return error;
+		}
+		i = end;
+	}
+
+	error = ipf_rules_compiler_reserve(irx, blocks);
+	if (error) {
+		return error;
+	}
+	prefix = (struct ipf_rules_prefix *)ipf_rules_alloc(irx->irx_rules, (uint64_t)blocks * sizeof(*prefix));
+	if (prefix == NULL && blocks != 0) {
+		return ENOMEM;
+	}
+	for (uint32_t i = 0; i < irc->irc_count; i++) {
+		ipf_rules_port_range(ipf_rules_compiler_rule(irx, i), dim, &min, &max);
+		if (min == max || (min == 0 && max == 0xffff)) {
+			continue;
+		}
+		while (min <= max) {
+			struct ipf_rules_prefix *p = &prefix[count++];
+			uint32_t                size = ipf_rules_port_block(min, max);
+
+			p->irf_rule = i;
+			p->irf_len = 16 - (uint32_t)__builtin_ctz(size);
+			__builtin_memset(p->irf_bytes, 0, 16);
+			p->irf_bytes[0] = (uint8_t)(min >> 8);
+			p->irf_bytes[1] = (uint8_t)min;
+			min += size;
+		}
+	}
+	error = ipf_rules_compile_trie(irx, &irc->irc_trie[dim], prefix, count);
+	ipf_rules_release(irx->irx_rules, prefix, (uint64_t)blocks * sizeof(*prefix));
+	return error;
+}
+
+static inline errno_t
+ipf_rules_compile_proto(struct ipf_rules_compiler *irx)
+{
+	struct ipf_rules_class *irc = irx->irx_class;
+	uint32_t               start[257];
+	errno_t                error;
+
+	__builtin_memset(start, 0, sizeof(start));
+	for (uint32_t i = 0; i < irc->irc_count; i++) {
+		start[ipf_rules_compiler_rule(irx, i)->ipfr_protocol + 1]++;
+	}
+	for (int p = 0; p < 256; p++) {
+		start[p + 1] += start[p];
+	}
+	for (uint32_t i = 0; i < irc->irc_count; i++) {
+		irx->irx_order[start[ipf_rules_compiler_rule(irx, i)->ipfr_protocol]++] = i;
+	}
+	for (int p = 256; p > 0; p--) {
+		start[p] = start[p - 1];
+	}
+	start[0] = 0;
+
+	irc->irc_proto[0] = 0;
+	for (int p = 1; p < 256; p++) {
+		error = ipf_rules_intern_union(irx, 0, &irx->irx_order[start[p]], start[p + 1] - start[p],
+		    &irc->irc_proto[p]);
+		if (error) {
+			return error;
+		}
+	}
+	return 0;
+}
+
+static inline void
+ipf_rules_class_free(struct ipf_rules *rules, struct ipf_rules_class *irc)
+{
+	ipf_rules_release(rules, irc->irc_rule, (uint64_t)irc->irc_count * sizeof(uint32_t));
+	ipf_rules_release(rules, irc->irc_sets, (uint64_t)irc->irc_sets_max * sizeof(struct ipf_rules_words));
+	ipf_rules_release(rules, irc->irc_word_index, (uint64_t)irc->irc_index_max * sizeof(uint32_t));
+	ipf_rules_release(rules, irc->irc_word_bits, (uint64_t)irc->irc_bits_max * sizeof(uint64_t));
+	for (int t = 0; t < IPF_RULES_TRIES; t++) {
+		struct ipf_rules_trie *irt = &irc->irc_trie[t];
+
+		ipf_rules_release(rules, irt->irt_node, (uint64_t)irt->irt_node_max * sizeof(uint32_t));
+		ipf_rules_release(rules, irt->irt_above, (uint64_t)irt->irt_above_max * sizeof(uint32_t));
+		ipf_rules_release(rules, irt->irt_tail, (uint64_t)irt->irt_tail_max * sizeof(struct ipf_rules_tail));
+	}
+	for (int e = 0; e < 2; e++) {
+		struct ipf_rules_exact *ire = &irc->irc_exact[e];
+
+		ipf_rules_release(rules, ire->ire_key, (uint64_t)ire->ire_slots * sizeof(uint32_t));
+		ipf_rules_release(rules, ire->ire_set, (uint64_t)ire->ire_slots * sizeof(uint32_t));
+	}
+}
+
+static inline errno_t
+ipf_rules_compile_class(struct ipf_rules *rules, struct ipf_rules_class *irc,
+    const struct ipf_rule *list, uint32_t count, int family)
+{
+	struct ipf_rules_compiler irx;
+	uint32_t                  n = 0;
+	errno_t                   error;
+
+	for (uint32_t i = 0; i < count; i++) {
+		n += list[i].ipfr_family == family;
+	}
+	if (n == 0) {
+		return 0;
+	}
+	irc->irc_rule = (uint32_t *)ipf_rules_alloc(rules, (uint64_t)n * sizeof(uint32_t));
+	if (irc->irc_rule == NULL) {
+		return ENOMEM;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		if (list[i].ipfr_family == family) {
+			irc->irc_rule[irc->irc_count++] = i;
+		}
+	}
+
+	__builtin_memset(&irx, 0, sizeof(irx));
+	irx.irx_rules = rules;
+	irx.irx_class = irc;
+	irx.irx_list = list;
+	error = ipf_rules_compiler_reserve(&irx, n);
+	if (error == 0) {
+		error = ipf_rules_reserve(rules, (void **)&irc->irc_sets, &irc->irc_sets_max, 1,
+		    sizeof(struct ipf_rules_words));
+	}
+	if (error == 0) {
+		error = ipf_rules_reserve(rules, (void **)&irx.irx_set_hash, &irx.irx_set_hash_max, 1,
+		    sizeof(uint32_t));
+	}
+	if (error == 0) {
+		irc->irc_sets[0].irw_offset = 0;
+		irc->irc_sets[0].irw_count = 0;
+		irc->irc_nsets = 1;
+		error = ipf_rules_rehash(&irx, 64);
+	}
+
+	for (int dim = 0; error == 0 && dim < IPF_RULES_DIMS; dim++) {
+		uint32_t wild = 0;
+
+		for (uint32_t i = 0; i < n; i++) {
+			if (ipf_rules_wildcard(ipf_rules_compiler_rule(&irx, i), dim)) {
+				irx.irx_order[wild++] = i;
+			}
+		}
+		error = ipf_rules_intern_union(&irx, 0, irx.irx_order, wild, &irc->irc_wild[dim]);
+		if (error || wild == n) {
+			continue;
+		}
+		irc->irc_dims |= 1U << dim;
+
+		switch (dim) {
+		case IPF_RULES_DIM_SRC:
+		case IPF_RULES_DIM_DST:
+			error = ipf_rules_compile_address(&irx, dim);
+			break;
+		case IPF_RULES_DIM_SPORT:
+		case IPF_RULES_DIM_DPORT:
+			error = ipf_rules_compile_ports(&irx, dim);
+			break;
+		default:
+			error = ipf_rules_compile_proto(&irx);
+			break;
+		}
+	}
+
+	ipf_rules_release(rules, irx.irx_hash, (uint64_t)irx.irx_hash_slots * sizeof(uint32_t));
+	ipf_rules_release(rules, irx.irx_set_hash, (uint64_t)irx.irx_set_hash_max * sizeof(uint32_t));
+	ipf_rules_release(rules, irx.irx_order, (uint64_t)irx.irx_max * sizeof(uint32_t));
+	ipf_rules_release(rules, irx.irx_sort, (uint64_t)irx.irx_max * sizeof(uint32_t));
+	ipf_rules_release(rules, irx.irx_group, (uint64_t)irx.irx_max * sizeof(uint32_t));
+	return error;
+}
+
+static inline void
+ipf_rules_ruleset_free(struct ipf_rules *rules, struct ipf_ruleset *irs)
+{
+	if (irs == NULL) {
+		return;
+	}
+	ipf_rules_class_free(rules, &irs->irs_class[0]);
+	ipf_rules_class_free(rules, &irs->irs_class[1]);
+	ipf_rules_release(rules, irs->irs_action, (uint64_t)irs->irs_count * sizeof(uint32_t));
+	ipf_rules_release(rules, irs, sizeof(*irs));
+}
+
+static inline errno_t
+ipf_rules_check(const struct ipf_rule *rule)
+{
+	int bits;
+
+	if (rule->ipfr_family == AF_INET) {
+		bits = 32;
+	} else if (rule->ipfr_family == AF_INET6) {
+		bits = 128;
+	} else {
+		return EINVAL;
+	}
+	if (rule->ipfr_src_len > bits || rule->ipfr_dst_len > bits ||
+	    rule->ipfr_sport_min > rule->ipfr_sport_max || rule->ipfr_dport_min > rule->ipfr_dport_max) {
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*!
+ *       @function ipf_rules_compile
+ *       @discussion Compiles a list of rules into a rule set that is not yet
+ *               in use.  Most callers use ipf_rules_update() instead.
+ *       @param rules The filter state whose allocator is used.
+ *       @param list The rules, the first matching rule taking precedence.
+ *       @param count The number of rules, at most IPF_RULES_MAX.
+ *       @param ruleset On success, the compiled rule set.
+ *       @result 0 upon success, EINVAL if a rule is malformed or there are
+ *               too many, ENOMEM if memory could not be allocated.
+ */
+static inline errno_t
+ipf_rules_compile(struct ipf_rules *rules, const struct ipf_rule *list, uint32_t count,
+    struct ipf_ruleset **ruleset)
+{
+	struct ipf_ruleset *irs;
+	errno_t            error;
+
+	if (count > IPF_RULES_MAX) {
+		return EINVAL;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		error = ipf_rules_check(&list[i]);
+		if (error) {
+			return error;
+		}
+	}
+
+	irs = (struct ipf_ruleset *)ipf_rules_alloc(rules, sizeof(*irs));
+	if (irs == NULL) {
+		return ENOMEM;
+	}
+	__builtin_memset(irs, 0, sizeof(*irs));
+	if (count) {
+		irs->irs_action = (uint32_t *)ipf_rules_alloc(rules, (uint64_t)count * sizeof(uint32_t));
+		if (irs->irs_action == NULL) {
+			ipf_rules_ruleset_free(rules, irs);
+			return ENOMEM;
+		}
+		irs->irs_count = count;
+		for (uint32_t i = 0; i < count; i++) {
+			irs->irs_action[i] = list[i].ipfr_action;
+		}
+	}
+
+	error = ipf_rules_compile_class(rules, &irs->irs_class[0], list, count, AF_INET);
+	if (error == 0) {
+		error = ipf_rules_compile_class(rules, &irs->irs_class[1], list, count, AF_INET6);
+	}
+	if (error) {
+		ipf_rules_ruleset_free(rules, irs);
+		return error;
+	}
+	*ruleset = irs;
+	return 0;
+}
+
+/*
+ * Classification.  A cursor walks the words of one set; the cursors of a
+ * dimension are consecutive, and the dimension has a word wherever any of
+ * them does.
+ */
+struct ipf_rules_cursor {
+	uint32_t        irc_pos;
+	uint32_t        irc_end;
+};
+
+struct ipf_rules_lookup {
+	const struct ipf_rules_class    *irl_class;
+	uint32_t                        irl_cursors;
+	uint32_t                        irl_dims;
+	uint32_t                        irl_dim_end[IPF_RULES_DIMS];
+	struct ipf_rules_cursor         irl_cursor[IPF_RULES_CURSORS];
+};
+
+static inline void
+ipf_rules_lookup_add(struct ipf_rules_lookup *irl, uint32_t set)
+{
+	const struct ipf_rules_words *words = &irl->irl_class->irc_sets[set];
+
+	if (set != 0) {
+		irl->irl_cursor[irl->irl_cursors].irc_pos = words->irw_offset;
+		irl->irl_cursor[irl->irl_cursors].irc_end = words->irw_offset + words->irw_count;
+		irl->irl_cursors++;
+	}
+}
+
+static inline void
+ipf_rules_lookup_trie(struct ipf_rules_lookup *irl, const struct ipf_rules_trie *irt, const uint8_t *addr)
+{
+	uint32_t node = 0;
+
+	for (int l = 0;; l++) {
+		uint32_t entry = irt->irt_node[node * 256 + addr[l]];
+
+		ipf_rules_lookup_add(irl, irt->irt_above[node]);
+		if (entry & IPF_RULES_NODE_CHILD) {
+			node = entry & IPF_RULES_NODE_INDEX;
+		} else if (entry & IPF_RULES_NODE_TAIL) {
+			const struct ipf_rules_tail *tail = &irt->irt_tail[entry & IPF_RULES_NODE_INDEX];
+
+			ipf_rules_lookup_add(irl, tail->irl_outer);
+			if (ipf_rules_tail_match(tail, addr)) {
+				ipf_rules_lookup_add(irl, tail->irl_inner);
+			}
+			return;
+		} else {
+			ipf_rules_lookup_add(irl, entry);
+			return;
+		}
+	}
+}
+
+static inline void
+ipf_rules_lookup_port(struct ipf_rules_lookup *irl, int dim, uint32_t port)
+{
+	const struct ipf_rules_exact *ire = &irl->irl_class->irc_exact[dim - IPF_RULES_DIM_SPORT];
+	uint8_t                      bytes[16] = { (uint8_t)(port >> 8), (uint8_t)port };
+
+	for (uint32_t slot = ipf_rules_port_slot(port, ire->ire_slots); ire->ire_key[slot] != 0;
+	    slot = (slot + 1) & (ire->ire_slots - 1)) {
+		if (ire->ire_key[slot] == port + 1) {
+			ipf_rules_lookup_add(irl, ire->ire_set[slot]);
+			break;
+		}
+	}
+	ipf_rules_lookup_trie(irl, &irl->irl_class->irc_trie[dim], bytes);
+}
+
+/*
+ * Advances a cursor to its first word at or after index, galloping then
+ * bisecting, and returns that word's index, or UINT32_MAX past the end.
+ */
+static inline uint32_t
+ipf_rules_cursor_seek(const uint32_t *word_index, struct ipf_rules_cursor *cursor, uint32_t index)
+{
+	uint32_t lo = cursor->irc_pos, hi, step = 1;
+
+	if (lo >= cursor->irc_end) {
+		return UINT32_MAX;
+	}
+	if (word_index[lo] >= index) {
+		return word_index[lo];
+	}
+	for (hi = lo + 1; hi < cursor->irc_end && word_index[hi] < index; hi = lo + step) {
+		lo = hi;
+		step *= 2;
+	}
+	if (hi > cursor->irc_end) {
+		hi = cursor->irc_end;
+	}
+	while (hi - lo > 1) {
+		uint32_t mid = (lo + hi) / 2;
+
+		if (word_index[mid] < index) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	cursor->irc_pos = hi;
+	return hi < cursor->irc_end ? word_index[hi] : UINT32_MAX;
+}
+
+/*!
+ *       @function ipf_rules_classify
+ *       @discussion Finds the first rule of a rule set matching a packet.
+ *               The caller keeps the rule set alive; ipf_rules_match() does so
+ *               for the filter's current rule set.
+ *       @result The index of the rule in the list it was compiled from, or
+ *               IPF_RULES_NO_MATCH.
+ */
+static inline uint32_t
+ipf_rules_classify(const struct ipf_ruleset *irs, const struct ipf_rules_key *key)
+{
+	struct ipf_rules_lookup irl;
+	const uint32_t          *word_index;
+	const uint64_t          *word_bits;
+	uint32_t                index = 0, words;
+
+	if (key->irk_family == AF_INET) {
+		irl.irl_class = &irs->irs_class[0];
+	} else if (key->irk_family == AF_INET6) {
+		irl.irl_class = &irs->irs_class[1];
+	} else {
+		return IPF_RULES_NO_MATCH;
+	}
+	if (irl.irl_class->irc_count == 0) {
+		return IPF_RULES_NO_MATCH;
+	}
+	irl.irl_cursors = 0;
+	irl.irl_dims = 0;
+	for (int dim = 0; dim < IPF_RULES_DIMS; dim++) {
+		uint32_t first = irl.irl_cursors;
+
+		if (!(irl.irl_class->irc_dims & (1U << dim))) {
+			continue;
+		}
+		switch (dim) {
+		case IPF_RULES_DIM_SRC:
+			ipf_rules_lookup_trie(&irl, &irl.irl_class->irc_trie[dim], key->irk_src);
+			break;
+		case IPF_RULES_DIM_DST:
+			ipf_rules_lookup_trie(&irl, &irl.irl_class->irc_trie[dim], key->irk_dst);
+			break;
+		case IPF_RULES_DIM_SPORT:
+			ipf_rules_lookup_port(&irl, dim, key->irk_sport);
+			break;
+		case IPF_RULES_DIM_DPORT:
+			ipf_rules_lookup_port(&irl, dim, key->irk_dport);
+			break;
+		default:
+			ipf_rules_lookup_add(&irl, irl.irl_class->irc_proto[key->irk_protocol]);
+			break;
+		}
+		ipf_rules_lookup_add(&irl, irl.irl_class->irc_wild[dim]);
+		if (irl.irl_cursors == first) {
+			return IPF_RULES_NO_MATCH;
+		}
+		irl.irl_dim_end[irl.irl_dims++] = irl.irl_cursors;
+	}
+	if (irl.irl_dims == 0) {
+		return irl.irl_class->irc_rule[0];
+	}
+
+	/*
+	 * Move index to the furthest first word of any dimension from index,
+	 * then intersect the dimensions' unions over the next words.
+	 */
+	word_index = irl.irl_class->irc_word_index;
+	word_bits = irl.irl_class->irc_word_bits;
+	words = (irl.irl_class->irc_count + 63) / 64;
+	for (;;) {
+		uint64_t match[IPF_RULES_CHUNK], any[IPF_RULES_CHUNK];
+		uint32_t next = index, end, c = 0;
+		uint64_t found = ~0ULL;
+
+		for (uint32_t d = 0; d < irl.irl_dims; d++) {
+			uint32_t first = UINT32_MAX;
+
+			for (; c < irl.irl_dim_end[d]; c++) {
+				uint32_t at = ipf_rules_cursor_seek(word_index, &irl.irl_cursor[c], index);
+
+				if (at < first) {
+					first = at;
+				}
+			}
+			if (first == UINT32_MAX) {
+				return IPF_RULES_NO_MATCH;
+			}
+			if (first > next) {
+				next = first;
+			}
+		}
+		index = next;
+		end = index + IPF_RULES_CHUNK < words ? index + IPF_RULES_CHUNK : words;
+
+		c = 0;
+		for (uint32_t d = 0; d < irl.irl_dims && found; d++) {
+			__builtin_memset(any, 0, (end - index) * sizeof(uint64_t));
+			for (; c < irl.irl_dim_end[d]; c++) {
+				struct ipf_rules_cursor *cursor = &irl.irl_cursor[c];
+
+				for (; cursor->irc_pos < cursor->irc_end && word_index[cursor->irc_pos] < end; cursor->irc_pos++) {
+					any[word_index[cursor->irc_pos] - index] |= word_bits[cursor->irc_pos];
+				}
+			}
+			found = 0;
+			for (uint32_t w = 0; w < end - index; w++) {
+				match[w] = d ? match[w] & any[w] : any[w];
+				found |= match[w];
+			}
+		}
+		if (found) {
+			for (uint32_t w = 0;; w++) {
+				if (match[w]) {
+					return irl.irl_class->irc_rule[(index + w) * 64 + (uint32_t)__builtin_ctzll(match[w])];
+				}
+			}
+		}
+		index = end;
+	}
+}
+
+static inline unsigned int
+ipf_rules_reader_slot(void)
+{
+#ifdef KERNEL
+	return (unsigned int)cpu_number() % IPF_RULES_READERS;
+#else
+	static __thread char thread_slot;
+
+	return (unsigned int)((uintptr_t)&thread_slot >> 6) % IPF_RULES_READERS;
+#endif
+}
+
+/*!
+ *       @function ipf_rules_match
+ *       @discussion Finds the first rule of the filter's current rule set
+ *               matching a packet.  Safe to call from the filter's callbacks
+ *               concurrently with each other and with ipf_rules_update(); it
+ *               neither blocks nor allocates.
+ *       @param rules The filter state.
+ *       @param key The fields of the packet, see ipf_rules_key_mbuf().
+ *       @param action On a match, set to the matching rule's ipfr_action.
+ *       @result The index of the rule in the list last given to
+ *               ipf_rules_update(), or IPF_RULES_NO_MATCH.
+ */
+static inline uint32_t
+ipf_rules_match(struct ipf_rules *rules, const struct ipf_rules_key *key, uint32_t *action)
+{
+	struct ipf_rules_reader  *reader = &rules->ir_readers[ipf_rules_reader_slot()];
+	const struct ipf_ruleset *irs;
+	uint32_t                 parity, rule = IPF_RULES_NO_MATCH;
+
+	parity = __atomic_load_n(&rules->ir_epoch, __ATOMIC_RELAXED) & 1;
+	__atomic_fetch_add(&reader->irr_enter[parity], 1, __ATOMIC_SEQ_CST);
+	irs = __atomic_load_n(&rules->ir_active, __ATOMIC_SEQ_CST);
+	if (irs != NULL) {
+		rule = ipf_rules_classify(irs, key);
+		if (rule != IPF_RULES_NO_MATCH) {
+			*action = irs->irs_action[rule];
+		}
+	}
+	__atomic_fetch_add(&reader->irr_exit[parity], 1, __ATOMIC_RELEASE);
+	return rule;
+}
+
+/*
+ * Waits until every classification begun in an epoch parity has ended.
+ * Exits are summed before entries, so a classification moving between slots
+ * is never counted as ended but not begun.
+ */
+static inline void
+ipf_rules_wait(struct ipf_rules *rules, uint32_t parity)
+{
+	for (;;) {
+		uint64_t exits = 0, enters = 0;
+
+		for (int i = 0; i < IPF_RULES_READERS; i++) {
+			exits += __atomic_load_n(&rules->ir_readers[i].irr_exit[parity], __ATOMIC_ACQUIRE);
+		}
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		for (int i = 0; i < IPF_RULES_READERS; i++) {
+			enters += __atomic_load_n(&rules->ir_readers[i].irr_enter[parity], __ATOMIC_SEQ_CST);
+		}
+		if (enters == exits) {
+			return;
+		}
+#ifdef KERNEL
+		uint64_t deadline;
+
+		clock_interval_to_deadline(100, 1000 /* NSEC_PER_USEC */, &deadline);
+		clock_delay_until(deadline);
+#else
+		sched_yield();
+#endif
+	}
+}
+
+/*!
+ *       @function ipf_rules_init
+ *       @discussion Initializes filter state with an empty rule set, which
+ *               matches no packet.
+ *       @param rules The filter state.
+ *       @result 0 upon success, ENOMEM if the allocation tag could not be
+ *               created.
+ */
+static inline errno_t
+ipf_rules_init(struct ipf_rules *rules)
+{
+	__builtin_memset(rules, 0, sizeof(*rules));
+#ifdef KERNEL
+	rules->ir_tag = OSMalloc_Tagalloc("com.apple.ipf_rules", OSMT_DEFAULT);
+	if (rules->ir_tag == NULL) {
+		return ENOMEM;
+	}
+#endif
+	return 0;
+}
+
+/*!
+ *       @function ipf_rules_update
+ *       @discussion Compiles a list of rules and makes it the filter's rule
+ *               set.  Packets classified from then on use the new rules; the
+ *               call returns once no packet is still being classified with
+ *               the old ones, and frees them.  May block; calls to
+ *               ipf_rules_update() and ipf_rules_destroy() must be serialized
+ *               by the caller.
+ *       @param rules The filter state.
+ *       @param list The rules, the first matching rule taking precedence.
+ *               The list is not referenced after the call.
+ *       @param count The number of rules, at most IPF_RULES_MAX.
+ *       @result 0 upon success, or an error from ipf_rules_compile(), in
+ *               which case the current rule set stays in use.
+ */
+static inline errno_t
+ipf_rules_update(struct ipf_rules *rules, const struct ipf_rule *list, uint32_t count)
+{
+	struct ipf_ruleset *irs, *old;
+	uint32_t           epoch;
+	errno_t            error;
+
+	error = ipf_rules_compile(rules, list, count, &irs);
+	if (error) {
+		return error;
+	}
+
+	old = rules->ir_active;
+	__atomic_store_n(&rules->ir_active, irs, __ATOMIC_SEQ_CST);
+
+	/*
+	 * A classification that read the epoch before the previous update may
+	 * count itself in the other parity only now; wait for that parity
+	 * first, then flip to it and wait for the current one.  Either way a
+	 * classification not seen by the wait reads the new rule set.
+	 */
+	epoch = rules->ir_epoch;
+	ipf_rules_wait(rules, (epoch + 1) & 1);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	__atomic_store_n(&rules->ir_epoch, epoch + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	ipf_rules_wait(rules, epoch & 1);
+
+	ipf_rules_ruleset_free(rules, old);
+	return 0;
+}
+
+/*!
+ *       @function ipf_rules_destroy
+ *       @discussion Frees the filter's rule set.  The filter must be detached
+ *               and its callbacks returned, as when its ipf_detach_func is
+ *               called.
+ *       @param rules The filter state.
+ */
+static inline void
+ipf_rules_destroy(struct ipf_rules *rules)
+{
+	ipf_rules_ruleset_free(rules, rules->ir_active);
+	rules->ir_active = NULL;
+#ifdef KERNEL
+	if (rules->ir_tag != NULL) {
+		OSMalloc_Tagfree(rules->ir_tag);
+		rules->ir_tag = NULL;
+	}
+#endif
+}
+
+#ifdef KERNEL
+/*!
+ *       @function ipf_rules_key_mbuf
+ *       @discussion Extracts the fields rules match on from an IP packet.
+ *       @param data The packet, starting with its IP header.
+ *       @param offset The offset of the transport header, as passed to an
+ *               ipf_input_func; for an ipf_output_func, the IPv4 header length
+ *               or the length of the IPv6 header and its extension headers.
+ *       @param protocol The transport protocol, as passed to an
+ *               ipf_input_func.
+ *       @param key Receives the fields.
+ *       @result 0 upon success, EINVAL if the packet is too short or not IP.
+ */
+static inline errno_t
+ipf_rules_key_mbuf(mbuf_t data, int offset, u_int8_t protocol, struct ipf_rules_key *key)
+{
+	uint8_t header[40];
+	int     fragment = 0;
+
+	__builtin_memset(key, 0, sizeof(*key));
+	if (mbuf_copydata(data, 0, 1, header) != 0) {
+		return EINVAL;
+	}
+	if ((header[0] >> 4) == 4) {
+		if (mbuf_copydata(data, 0, 20, header) != 0) {
+			return EINVAL;
+		}
+		key->irk_family = AF_INET;
+		__builtin_memcpy(key->irk_src, &header[12], 4);
+		__builtin_memcpy(key->irk_dst, &header[16], 4);
+		fragment = ((header[6] & 0x1f) | header[7]) != 0;
+	} else if ((header[0] >> 4) == 6) {
+		if (mbuf_copydata(data, 0, 40, header) != 0) {
+			return EINVAL;
+		}
+		key->irk_family = AF_INET6;
+		__builtin_memcpy(key->irk_src, &header[8], 16);
+		__builtin_memcpy(key->irk_dst, &header[24], 16);
+	} else {
+		return EINVAL;
+	}
+
+	key->irk_protocol = protocol;
+	if ((protocol == IPPROTO_TCP || protocol == IPPROTO_UDP) && !fragment &&
+	    mbuf_copydata(data, offset, 4, header) == 0) {
+		key->irk_sport = (uint16_t)(header[0] << 8 | header[1]);
+		key->irk_dport = (uint16_t)(header[2] << 8 | header[3]);
+	}
+	return 0;
+}
+#endif /* KERNEL */
+
+__END_DECLS
+#endif /* __NETINET_IPF_RULES__ */
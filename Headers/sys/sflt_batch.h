@@ -0,0 +1,842 @@
+/*
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+/*!
+ *       @header sflt_batch.h
+ *       Batched inspection of inbound data for socket filters, and a
+ *       streaming multi-pattern matcher to inspect it with.
+ *
+ *       A content-inspecting filter's sf_data_in_func is called for every
+ *       mbuf chain delivered to the socket, often one small segment at a
+ *       time.  With sflt_batch, the filter's sf_data_in_func hands the data
+ *       to sflt_batch_data_in(), which holds it, returning EJUSTRETURN, until
+ *       a byte threshold or a delay is reached.  The filter's inspection
+ *       function then runs once over all the data held, and the data is
+ *       reinjected in order with sock_inject_data_in(), or dropped.
+ *
+ *       The matcher is an Aho-Corasick automaton compiled into a table with
+ *       one row per state and one column per class of bytes that patterns
+ *       tell apart.  Its state is a single integer that carries over from
+ *       one piece of data to the next, so a batch is scanned mbuf by mbuf,
+ *       and a match may span mbufs, records and batches.  The matcher has no
+ *       kernel dependencies apart from the mbuf scan and allocation.
+ */
+
+#ifndef __SYS_SFLT_BATCH__
+#define __SYS_SFLT_BATCH__
+
+#include <sys/types.h>
+#include <stdint.h>
+#ifdef KERNEL
+#include <sys/errno.h>
+#include <sys/socket.h>
+#include <sys/kpi_mbuf.h>
+#include <sys/kpi_socketfilter.h>
+#include <libkern/OSMalloc.h>
+#include <kern/locks.h>
+#include <kern/thread.h>
+#include <kern/clock.h>
+#include <kern/thread_call.h>
+#else
+#include <errno.h>
+#include <stdlib.h>
+#endif
+
+__BEGIN_DECLS
+
+/*!
+ *       @struct sflt_ac_pattern
+ *       @field sap_bytes The bytes to find.
+ *       @field sap_len Number of bytes, at least 1.
+ */
+struct sflt_ac_pattern {
+	const void      *sap_bytes;
+	uint32_t        sap_len;
+};
+
+#define SFLT_AC_NOCASE          0x1     /* ASCII letters match either case */
+
+#define SFLT_AC_OUTPUT          0x80000000U     /* row ends some pattern */
+#define SFLT_AC_MAX_TABLE       0x7fffffffU     /* entries, rows times classes */
+
+/*!
+ *       @struct sflt_ac
+ *       @discussion A compiled set of patterns.  Transitions hold the offset
+ *               of the next state's row, with SFLT_AC_OUTPUT set when some
+ *               pattern ends in that state.  The patterns ending in a state
+ *               are listed in sa_patterns from sa_first[state] up to
+ *               sa_first[state + 1], and sa_dict[state] is the next state
+ *               down its failure chain that ends patterns, or 0.
+ */
+struct sflt_ac {
+	uint32_t        sa_nstates;
+	uint32_t        sa_nclasses;
+	uint32_t        sa_npatterns;
+	uint8_t         sa_class[256];
+	uint32_t        *sa_delta;
+	uint32_t        *sa_first;
+	uint32_t        *sa_dict;
+	uint32_t        *sa_patterns;
+#ifdef KERNEL
+	OSMallocTag     sa_tag;
+#endif
+};
+
+/*!
+ *       @typedef sflt_ac_match_func
+ *       @discussion Called for each match found by a scan.
+ *       @param ctx The context passed to the scan.
+ *       @param pattern Index of the pattern in the list compiled.
+ *       @param end Stream offset just past the last byte of the match.
+ *       @result 0 to go on, anything else to stop the scan.
+ */
+typedef int (*sflt_ac_match_func)(void *ctx, uint32_t pattern, uint64_t end);
+
+static inline void *
+sflt_ac_alloc(struct sflt_ac *ac, uint64_t size)
+{
+	if (size == 0 || size > UINT32_MAX) {
+		return NULL;
+	}
+#ifdef KERNEL
+	return OSMalloc((uint32_t)size, ac->sa_tag);
+#else
+	(void)ac;
+	return malloc((size_t)size);
+#endif
+}
+
+static inline void
+sflt_ac_release(struct sflt_ac *ac, void *data, uint64_t size)
+{
+	if (data == NULL) {
+		return;
+	}
+#ifdef KERNEL
+	OSFree(data, (uint32_t)size, ac->sa_tag);
+#else
+	(void)ac;
+	(void)size;
+	free(data);
+#endif
+}
+
+static inline uint8_t
+sflt_ac_fold(uint8_t byte, uint32_t flags)
+{
+	if ((flags & SFLT_AC_NOCASE) && byte >= 'A' && byte <= 'Z') {
+		return (uint8_t)(byte + ('a' - 'A'));
+	}
+	return byte;
+}
+
+/*!
+ *       @function sflt_ac_free
+ *       @discussion Frees the tables of a compiled set.
+ */
+static inline void
+sflt_ac_free(struct sflt_ac *ac)
+{
+	uint64_t entries = (uint64_t)ac->sa_nstates * ac->sa_nclasses;
+
+	sflt_ac_release(ac, ac->sa_delta, entries * sizeof(uint32_t));
+	sflt_ac_release(ac, ac->sa_first, ((uint64_t)ac->sa_nstates + 1) * sizeof(uint32_t));
+	sflt_ac_release(ac, ac->sa_dict, (uint64_t)ac->sa_nstates * sizeof(uint32_t));
+	sflt_ac_release(ac, ac->sa_patterns, (uint64_t)ac->sa_npatterns * sizeof(uint32_t));
+	ac->sa_delta = NULL;
+	ac->sa_first = NULL;
+	ac->sa_dict = NULL;
+	ac->sa_patterns = NULL;
+	ac->sa_nstates = 0;
+#ifdef KERNEL
+	if (ac->sa_tag != NULL) {
+		OSMalloc_Tagfree(ac->sa_tag);
+		ac->sa_tag = NULL;
+	}
+#endif
+}
+
+/*!
+ *       @function sflt_ac_compile
+ *       @discussion Compiles patterns into an automaton.  The table takes
+ *               4 bytes per state and class: a state per distinct prefix of
+ *               the patterns, and a class per distinct byte in them, plus one
+ *               for the bytes in none.
+ *       @param ac The set, uninitialized.
+ *       @param patterns The patterns; a pattern listed twice is reported
+ *               under both indexes.
+ *       @param count Number of patterns.
+ *       @param flags SFLT_AC_NOCASE, or 0.
+ *       @result 0 upon success, EINVAL for an empty pattern or list, E2BIG
+ *               if the table would be too large, ENOMEM.
+ */
+static inline errno_t
+sflt_ac_compile(struct sflt_ac *ac, const struct sflt_ac_pattern *patterns,
+    uint32_t count, uint32_t flags)
+{
+	uint8_t         used[256];
+	uint64_t        bound = 1, entries;
+	uint32_t        nclasses = 1, nstates = 1;
+	uint32_t        *trie = NULL, *fail = NULL, *ends = NULL, *queue = NULL;
+	uint32_t        head, tail;
+	errno_t         error = ENOMEM;
+
+	__builtin_memset(ac, 0, sizeof(*ac));
+	if (count == 0) {
+		return EINVAL;
+	}
+#ifdef KERNEL
+	ac->sa_tag = OSMalloc_Tagalloc("com.apple.sflt_ac", OSMT_DEFAULT);
+	if (ac->sa_tag == NULL) {
+		return ENOMEM;
+	}
+#endif
+
+	/* Bytes no pattern holds share class 0. */
+	__builtin_memset(used, 0, sizeof(used));
+	for (uint32_t p = 0; p < count; p++) {
+		const uint8_t *bytes = (const uint8_t *)patterns[p].sap_bytes;
+
+		if (patterns[p].sap_len == 0 || bytes == NULL) {
+			error = EINVAL;
+			goto done;
+		}
+		for (uint32_t i = 0; i < patterns[p].sap_len; i++) {
+			used[sflt_ac_fold(bytes[i], flags)] = 1;
+		}
+		bound += patterns[p].sap_len;
+	}
+	for (uint32_t byte = 0; byte < 256; byte++) {
+		if (used[byte]) {
+			ac->sa_class[byte] = (uint8_t)nclasses++;
+		}
+	}
+	if (flags & SFLT_AC_NOCASE) {
+		for (uint32_t byte = 'A'; byte <= 'Z'; byte++) {
+			ac->sa_class[byte] = ac->sa_class[byte + ('a' - 'A')];
+		}
+	}
+	if (bound * nclasses > SFLT_AC_MAX_TABLE) {
+		error = E2BIG;
+		goto done;
+	}
+
+	/* The trie, with 0 for a missing edge, since no edge leads to the root. */
+	trie = (uint32_t *)sflt_ac_alloc(ac, bound * nclasses * sizeof(uint32_t));
+	ends = (uint32_t *)sflt_ac_alloc(ac, (uint64_t)count * sizeof(uint32_t));
+	if (trie == NULL || ends == NULL) {
+		goto done;
+	}
+	__builtin_memset(trie, 0, bound * nclasses * sizeof(uint32_t));
+	for (uint32_t p = 0; p < count; p++) {
+		const uint8_t *bytes = (const uint8_t *)patterns[p].sap_bytes;
+		uint32_t      state = 0;
+
+		for (uint32_t i = 0; i < patterns[p].sap_len; i++) {
+			uint32_t *edge = &trie[(uint64_t)state * nclasses + ac->sa_class[bytes[i]]];
+
+			if (*edge == 0) {
+				*edge = nstates++;
+			}
+			state = *edge;
+		}
+		ends[p] = state;
+	}
+
+	entries = (uint64_t)nstates * nclasses;
+	ac->sa_nstates = nstates;
+	ac->sa_nclasses = nclasses;
+	ac->sa_npatterns = count;
+	ac->sa_delta = (uint32_t *)sflt_ac_alloc(ac, entries * sizeof(uint32_t));
+	ac->sa_first = (uint32_t *)sflt_ac_alloc(ac, ((uint64_t)nstates + 1) * sizeof(uint32_t));
+	ac->sa_dict = (uint32_t *)sflt_ac_alloc(ac, (uint64_t)nstates * sizeof(uint32_t));
+	ac->sa_patterns = (uint32_t *)sflt_ac_alloc(ac, (uint64_t)count * sizeof(uint32_t));
+	fail = (uint32_t *)sflt_ac_alloc(ac, (uint64_t)nstates * sizeof(uint32_t));
+	queue = (uint32_t *)sflt_ac_alloc(ac, (uint64_t)nstates * sizeof(uint32_t));
+	if (ac->sa_delta == NULL || ac->sa_first == NULL || ac->sa_dict == NULL ||
+	    ac->sa_patterns == NULL || fail == NULL || queue == NULL) {
+		goto done;
+	}
+
+	/* Patterns grouped by end state, in list order within a state. */
+	__builtin_memset(ac->sa_first, 0, ((uint64_t)nstates + 1) * sizeof(uint32_t));
+	for (uint32_t p = 0; p < count; p++) {
+		ac->sa_first[ends[p] + 1]++;
+	}
+	for (uint32_t state = 0; state < nstates; state++) {
+		ac->sa_first[state + 1] += ac->sa_first[state];
+	}
+	for (uint32_t p = 0; p < count; p++) {
+		ac->sa_patterns[ac->sa_first[ends[p]]++] = p;
+	}
+	for (uint32_t state = nstates; state > 0; state--) {
+		ac->sa_first[state] = ac->sa_first[state - 1];
+	}
+	ac->sa_first[0] = 0;
+
+	/*
+	 * Breadth first, so the failure state of a state, being shallower, has
+	 * its row complete when the state's row borrows from it.
+	 */
+	fail[0] = 0;
+	ac->sa_dict[0] = 0;
+	head = tail = 0;
+	queue[tail++] = 0;
+	while (head < tail) {
+		uint32_t state = queue[head++];
+		uint32_t *row = &ac->sa_delta[(uint64_t)state * nclasses];
+		uint32_t *fallback = &ac->sa_delta[(uint64_t)fail[state] * nclasses];
+
+		for (uint32_t c = 0; c < nclasses; c++) {
+			uint32_t next = trie[(uint64_t)state * nclasses + c];
+
+			if (next == 0) {
+				row[c] = (state == 0) ? 0 : fallback[c];
+				continue;
+			}
+			fail[next] = (state == 0) ? 0 : fallback[c];
+			ac->sa_dict[next] = (ac->sa_first[fail[next] + 1] > ac->sa_first[fail[next]]) ?
+			    fail[next] : ac->sa_dict[fail[next]];
+			row[c] = next;
+			queue[tail++] = next;
+		}
+	}
+
+	/* States become row offsets, flagged when they end patterns. */
+	for (uint64_t i = 0; i < entries; i++) {
+		uint32_t next = ac->sa_delta[i] & ~SFLT_AC_OUTPUT;
+		uint32_t flag = (ac->sa_first[next + 1] > ac->sa_first[next] || ac->sa_dict[next]) ?
+		    SFLT_AC_OUTPUT : 0;
+
+		ac->sa_delta[i] = next * nclasses | flag;
+	}
+	error = 0;
+
+done:
+	sflt_ac_release(ac, trie, bound * nclasses * sizeof(uint32_t));
+	sflt_ac_release(ac, ends, (uint64_t)count * sizeof(uint32_t));
+	sflt_ac_release(ac, fail, (uint64_t)nstates * sizeof(uint32_t));
+	sflt_ac_release(ac, queue, (uint64_t)nstates * sizeof(uint32_t));
+	if (error) {
+		sflt_ac_free(ac);
+	}
+	return error;
+}
+
+static inline int
+sflt_ac_report(const struct sflt_ac *ac, uint32_t state, uint64_t end,
+    sflt_ac_match_func match, void *ctx)
+{
+	for (; state != 0; state = ac->sa_dict[state]) {
+		for (uint32_t i = ac->sa_first[state]; i < ac->sa_first[state + 1]; i++) {
+			if (match(ctx, ac->sa_patterns[i], end)) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*!
+ *       @function sflt_ac_scan
+ *       @discussion Scans a piece of a stream.
+ *       @param ac The compiled set.
+ *       @param state The stream's state, 0 at the start of the stream, updated.
+ *       @param data The bytes.
+ *       @param len Number of bytes.
+ *       @param offset Stream offset of the first byte.
+ *       @param match Called for each match, in the order the matches end.
+ *       @param ctx Passed to match.
+ *       @result 0 when the whole piece was scanned, 1 when match stopped
+ *               the scan, with state left after the last byte matched.
+ */
+static inline int
+sflt_ac_scan(const struct sflt_ac *ac, uint32_t *state, const void *data, size_t len,
+    uint64_t offset, sflt_ac_match_func match, void *ctx)
+{
+	const uint8_t   *bytes = (const uint8_t *)data;
+	const uint32_t  *delta = ac->sa_delta;
+	const uint8_t   *classes = ac->sa_class;
+	uint32_t        current = *state;
+
+	for (size_t i = 0; i < len; i++) {
+		uint32_t next = delta[current + classes[bytes[i]]];
+
+		if (__builtin_expect((next & SFLT_AC_OUTPUT) != 0, 0)) {
+			next &= ~SFLT_AC_OUTPUT;
+			if (sflt_ac_report(ac, next / ac->sa_nclasses, offset + i + 1, match, ctx)) {
+				*state = next;
+				return 1;
+			}
+		}
+		current = next;
+	}
+	*state = current;
+	return 0;
+}
+
+#ifdef KERNEL
+/*!
+ *       @function sflt_ac_scan_mbuf
+ *       @discussion Scans the data mbufs of a chain in place, skipping
+ *               control and address mbufs.
+ *       @param offset Stream offset of the chain's first data byte, advanced
+ *               past the bytes scanned.
+ *       @result As sflt_ac_scan().
+ */
+static inline int
+sflt_ac_scan_mbuf(const struct sflt_ac *ac, uint32_t *state, mbuf_t chain,
+    uint64_t *offset, sflt_ac_match_func match, void *ctx)
+{
+	for (mbuf_t m = chain; m != NULL; m = mbuf_next(m)) {
+		mbuf_type_t type = mbuf_type(m);
+		size_t      len = mbuf_len(m);
+
+		if (type != MBUF_TYPE_DATA && type != MBUF_TYPE_HEADER && type != MBUF_TYPE_OOBDATA) {
+			continue;
+		}
+		if (sflt_ac_scan(ac, state, mbuf_data(m), len, *offset, match, ctx)) {
+			*offset += len;
+			return 1;
+		}
+		*offset += len;
+	}
+	return 0;
+}
+
+#define SFLT_BATCH_RECORDS      32
+
+/*!
+ *       @struct sflt_batch_record
+ *       @discussion Data held for one sf_data_in_func call.
+ *       @field sbr_data The data, possibly with control mbufs.
+ *       @field sbr_control Separate control mbufs, or NULL.
+ *       @field sbr_from A copy of the source address, or NULL.
+ *       @field sbr_flags The sflt_data_flag_t flags.
+ *       @field sbr_len Bytes of data in sbr_data.
+ */
+struct sflt_batch_record {
+	mbuf_t                  sbr_data;
+	mbuf_t                  sbr_control;
+	struct sockaddr         *sbr_from;
+	sflt_data_flag_t        sbr_flags;
+	uint32_t                sbr_len;
+};
+
+/*!
+ *       @typedef sflt_batch_inspect_func
+ *       @discussion Inspects a batch of inbound data.  Runs in a thread call,
+ *               or in sf_data_in_func for data let through at once.
+ *               Calls for one socket never overlap.
+ *       @param cookie The cookie given to sflt_batch_attach().
+ *       @param so The socket.
+ *       @param records The records, oldest first.
+ *       @param count Number of records.
+ *       @param offset Stream offset of the first record's data.
+ *       @result 0 to deliver the batch, anything else to drop it.
+ */
+typedef errno_t (*sflt_batch_inspect_func)(void *cookie, socket_t so,
+    const struct sflt_batch_record *records, uint32_t count, uint64_t offset);
+
+/*!
+ *       @struct sflt_batch_params
+ *       @field sbp_max_bytes Bytes held before a batch is inspected; data
+ *               arriving in larger pieces with nothing held is inspected and
+ *               let through at once.
+ *       @field sbp_max_delay Microseconds the oldest data held may wait.
+ */
+struct sflt_batch_params {
+	uint32_t        sbp_max_bytes;
+	uint32_t        sbp_max_delay;
+};
+
+#define SFLT_BATCH_DEFAULT_BYTES        16384
+#define SFLT_BATCH_DEFAULT_DELAY        2000
+
+/*!
+ *       @struct sflt_batch_filter
+ *       @discussion What the sockets of one socket filter share.
+ */
+struct sflt_batch_filter {
+	struct sflt_batch_params        sbf_params;
+	sflt_batch_inspect_func         sbf_inspect;
+	lck_grp_t                       *sbf_lock_group;
+	OSMallocTag                     sbf_tag;
+};
+
+/*!
+ *       @struct sflt_batch
+ *       @discussion The state of one socket.  Embed it in the filter's
+ *               cookie.  sb_delivering is set while a thread call inspects
+ *               and reinjects records taken off the queue; data arriving
+ *               meanwhile is queued behind them.
+ */
+struct sflt_batch {
+	const struct sflt_batch_filter  *sb_filter;
+	socket_t                        sb_socket;
+	void                            *sb_cookie;
+	lck_mtx_t                       *sb_lock;
+	thread_call_t                   sb_call;
+	thread_t                        sb_injecting;
+	struct sflt_batch_record        sb_records[SFLT_BATCH_RECORDS];
+	uint32_t                        sb_count;
+	uint32_t                        sb_delivering;
+	uint64_t                        sb_bytes;
+	uint64_t                        sb_offset;
+	uint64_t                        sb_batches;
+	uint64_t                        sb_inline;
+};
+
+/*!
+ *       @function sflt_batch_filter_init
+ *       @discussion Prepares the shared state; call before sflt_register().
+ *       @param name Name of the lock group and malloc tag.
+ *       @param params Thresholds, or NULL for the defaults.
+ *       @param inspect The inspection function.
+ *       @result 0 upon success, EINVAL, ENOMEM.
+ */
+static inline errno_t
+sflt_batch_filter_init(struct sflt_batch_filter *filter, const char *name,
+    const struct sflt_batch_params *params, sflt_batch_inspect_func inspect)
+{
+	__builtin_memset(filter, 0, sizeof(*filter));
+	if (name == NULL || inspect == NULL) {
+		return EINVAL;
+	}
+
+	if (params != NULL) {
+		filter->sbf_params = *params;
+	} else {
+		filter->sbf_params.sbp_max_bytes = SFLT_BATCH_DEFAULT_BYTES;
+		filter->sbf_params.sbp_max_delay = SFLT_BATCH_DEFAULT_DELAY;
+	}
+	filter->sbf_inspect = inspect;
+	filter->sbf_lock_group = lck_grp_alloc_init(name, LCK_GRP_ATTR_NULL);
+	filter->sbf_tag = OSMalloc_Tagalloc(name, OSMT_DEFAULT);
+	if (filter->sbf_lock_group == NULL || filter->sbf_tag == NULL) {
+		if (filter->sbf_lock_group != NULL) {
+			lck_grp_free(filter->sbf_lock_group);
+		}
+		if (filter->sbf_tag != NULL) {
+			OSMalloc_Tagfree(filter->sbf_tag);
+		}
+		return ENOMEM;
+	}
+	return 0;
+}
+
+/*!
+ *       @function sflt_batch_filter_destroy
+ *       @discussion Frees the shared state once sflt_unregister() has
+ *               completed and every socket has been detached.
+ */
+static inline void
+sflt_batch_filter_destroy(struct sflt_batch_filter *filter)
+{
+	if (filter->sbf_lock_group != NULL) {
+		lck_grp_free(filter->sbf_lock_group);
+	}
+	if (filter->sbf_tag != NULL) {
+		OSMalloc_Tagfree(filter->sbf_tag);
+	}
+	filter->sbf_lock_group = NULL;
+	filter->sbf_tag = NULL;
+}
+
+static inline uint32_t
+sflt_batch_length(mbuf_t chain)
+{
+	uint64_t len = 0;
+
+	for (mbuf_t m = chain; m != NULL; m = mbuf_next(m)) {
+		mbuf_type_t type = mbuf_type(m);
+
+		if (type == MBUF_TYPE_DATA || type == MBUF_TYPE_HEADER || type == MBUF_TYPE_OOBDATA) {
+			len += mbuf_len(m);
+		}
+	}
+	return len > UINT32_MAX ? UINT32_MAX : (uint32_t)len;
+}
+
+static inline void
+sflt_batch_release(struct sflt_batch *sb, struct sflt_batch_record *record, int data)
+{
+	if (data) {
+		if (record->sbr_data != NULL) {
+			mbuf_freem(record->sbr_data);
+		}
+		if (record->sbr_control != NULL) {
+			mbuf_freem(record->sbr_control);
+		}
+	}
+	if (record->sbr_from != NULL) {
+		OSFree(record->sbr_from, record->sbr_from->sa_len, sb->sb_filter->sbf_tag);
+	}
+	__builtin_memset(record, 0, sizeof(*record));
+}
+
+/*
+ * Takes the queue, then inspects and reinjects it without the lock, since
+ * reinjected data comes back through sf_data_in_func in this thread.
+ */
+static inline void
+sflt_batch_deliver(struct sflt_batch *sb)
+{
+	struct sflt_batch_record records[SFLT_BATCH_RECORDS];
+	uint32_t                 count;
+	uint64_t                 offset, bytes;
+	errno_t                  verdict;
+
+	lck_mtx_lock(sb->sb_lock);
+	while (sb->sb_count != 0 && !sb->sb_delivering) {
+		count = sb->sb_count;
+		offset = sb->sb_offset;
+		bytes = sb->sb_bytes;
+		__builtin_memcpy(records, sb->sb_records, count * sizeof(records[0]));
+		sb->sb_count = 0;
+		sb->sb_bytes = 0;
+		sb->sb_offset += bytes;
+		sb->sb_delivering = 1;
+		sb->sb_batches++;
+		lck_mtx_unlock(sb->sb_lock);
+
+		verdict = sb->sb_filter->sbf_inspect(sb->sb_cookie, sb->sb_socket, records, count, offset);
+		for (uint32_t i = 0; i < count; i++) {
+			struct sflt_batch_record *record = &records[i];
+
+			if (verdict == 0) {
+				/* Data reinjected comes back through sf_data_in_func. */
+				__atomic_store_n(&sb->sb_injecting, current_thread(), __ATOMIC_RELAXED);
+				if (sock_inject_data_in(sb->sb_socket, record->sbr_from, record->sbr_data,
+				    record->sbr_control, record->sbr_flags) == 0) {
+					record->sbr_data = NULL;
+					record->sbr_control = NULL;
+				}
+				__atomic_store_n(&sb->sb_injecting, NULL, __ATOMIC_RELAXED);
+			}
+			sflt_batch_release(sb, record, 1);
+		}
+
+		lck_mtx_lock(sb->sb_lock);
+		sb->sb_delivering = 0;
+	}
+	lck_mtx_unlock(sb->sb_lock);
+}
+
+static inline void
+sflt_batch_call(thread_call_param_t param0, thread_call_param_t param1)
+{
+	(void)param1;
+	sflt_batch_deliver((struct sflt_batch *)param0);
+}
+
+/*!
+ *       @function sflt_batch_attach
+ *       @discussion Prepares a socket's state; call from sf_attach_func.
+ *       @param cookie Passed to the inspection function.
+ *       @result 0 upon success, ENOMEM.
+ */
+static inline errno_t
+sflt_batch_attach(struct sflt_batch *sb, const struct sflt_batch_filter *filter,
+    socket_t so, void *cookie)
+{
+	__builtin_memset(sb, 0, sizeof(*sb));
+	sb->sb_filter = filter;
+	sb->sb_socket = so;
+	sb->sb_cookie = cookie;
+	sb->sb_lock = lck_mtx_alloc_init(filter->sbf_lock_group, LCK_ATTR_NULL);
+	sb->sb_call = thread_call_allocate(sflt_batch_call, sb);
+	if (sb->sb_lock == NULL || sb->sb_call == NULL) {
+		if (sb->sb_lock != NULL) {
+			lck_mtx_free(sb->sb_lock, filter->sbf_lock_group);
+		}
+		if (sb->sb_call != NULL) {
+			thread_call_free(sb->sb_call);
+		}
+		return ENOMEM;
+	}
+	return 0;
+}
+
+/*!
+ *       @function sflt_batch_detach
+ *       @discussion Waits for a delivery in progress and frees the data
+ *               still held; call from sf_detach_func.  Held data is dropped,
+ *               not delivered.  A socket that closes has had it delivered by
+ *               sflt_batch_notify() at sock_evt_closing; a filter detached
+ *               from a socket that stays open, with sflt_detach(), must call
+ *               sflt_batch_flush() first, outside sf_detach_func.
+ */
+static inline void
+sflt_batch_detach(struct sflt_batch *sb)
+{
+	if (sb->sb_lock == NULL) {
+		return;
+	}
+	thread_call_cancel_wait(sb->sb_call);
+	thread_call_free(sb->sb_call);
+	for (uint32_t i = 0; i < sb->sb_count; i++) {
+		sflt_batch_release(sb, &sb->sb_records[i], 1);
+	}
+	lck_mtx_free(sb->sb_lock, sb->sb_filter->sbf_lock_group);
+	sb->sb_lock = NULL;
+	sb->sb_count = 0;
+}
+
+/*!
+ *       @function sflt_batch_flush
+ *       @discussion Inspects and reinjects the data held now, in the calling
+ *               thread.  Must not be called from sf_data_in_func.
+ */
+static inline void
+sflt_batch_flush(struct sflt_batch *sb)
+{
+	thread_call_cancel(sb->sb_call);
+	sflt_batch_deliver(sb);
+}
+
+/*!
+ *       @function sflt_batch_notify
+ *       @discussion Delivers the data held before the socket stops
+ *               receiving, and drops it when the receive buffer is flushed;
+ *               call from sf_notify_func.
+ */
+static inline void
+sflt_batch_notify(struct sflt_batch *sb, sflt_event_t event)
+{
+	switch (event) {
+	case sock_evt_cantrecvmore:
+	case sock_evt_disconnecting:
+	case sock_evt_closing:
+		sflt_batch_flush(sb);
+		break;
+	case sock_evt_flush_read:
+		lck_mtx_lock(sb->sb_lock);
+		for (uint32_t i = 0; i < sb->sb_count; i++) {
+			sb->sb_offset += sb->sb_records[i].sbr_len;
+			sflt_batch_release(sb, &sb->sb_records[i], 1);
+		}
+		sb->sb_count = 0;
+		sb->sb_bytes = 0;
+		lck_mtx_unlock(sb->sb_lock);
+		break;
+	default:
+		break;
+	}
+}
+
+/*!
+ *       @function sflt_batch_data_in
+ *       @discussion Holds or inspects inbound data; call from
+ *               sf_data_in_func with its arguments and return the result.
+ *       @result 0 when the data was inspected and may go on, EJUSTRETURN
+ *               when it is held, or the inspection function's verdict, or
+ *               ENOMEM for an address that could not be copied.
+ */
+static inline errno_t
+sflt_batch_data_in(struct sflt_batch *sb, const struct sockaddr *from,
+    mbuf_t *data, mbuf_t *control, sflt_data_flag_t flags)
+{
+	const struct sflt_batch_params *params = &sb->sb_filter->sbf_params;
+	struct sflt_batch_record       *record;
+	mbuf_t                         controls = (control != NULL) ? *control : NULL;
+	uint32_t                       len;
+	errno_t                        verdict;
+
+	if (__atomic_load_n(&sb->sb_injecting, __ATOMIC_RELAXED) == current_thread()) {
+		return 0;
+	}
+
+	len = sflt_batch_length(*data);
+	lck_mtx_lock(sb->sb_lock);
+
+	/* Large data with nothing ahead of it needs no holding. */
+	if (sb->sb_count == 0 && !sb->sb_delivering && len >= params->sbp_max_bytes) {
+		struct sflt_batch_record now = { *data, controls, (struct sockaddr *)(uintptr_t)from, flags, len };
+
+		verdict = sb->sb_filter->sbf_inspect(sb->sb_cookie, sb->sb_socket, &now, 1, sb->sb_offset);
+		sb->sb_offset += len;
+		sb->sb_inline++;
+		lck_mtx_unlock(sb->sb_lock);
+		return verdict;
+	}
+
+	if (sb->sb_count == SFLT_BATCH_RECORDS) {
+		/*
+		 * Full while the thread call is pending or delivering.  Plain
+		 * stream data joins the last record; a datagram is dropped.
+		 */
+		record = &sb->sb_records[SFLT_BATCH_RECORDS - 1];
+		if (from != NULL || controls != NULL || record->sbr_from != NULL ||
+		    record->sbr_control != NULL || record->sbr_flags != flags ||
+		    (flags & sock_data_filt_flag_record) != 0 ||
+		    (uint64_t)record->sbr_len + len > UINT32_MAX) {
+			lck_mtx_unlock(sb->sb_lock);
+			return ENOBUFS;
+		}
+		if (mbuf_flags(record->sbr_data) & MBUF_PKTHDR) {
+			mbuf_pkthdr_adjustlen(record->sbr_data, (int)len);
+		}
+		record->sbr_data = mbuf_concatenate(record->sbr_data, *data);
+		record->sbr_len += len;
+		sb->sb_bytes += len;
+		lck_mtx_unlock(sb->sb_lock);
+		return EJUSTRETURN;
+	}
+
+	record = &sb->sb_records[sb->sb_count];
+	if (from != NULL) {
+		record->sbr_from = (struct sockaddr *)OSMalloc(from->sa_len, sb->sb_filter->sbf_tag);
+		if (record->sbr_from == NULL) {
+			lck_mtx_unlock(sb->sb_lock);
+			return ENOMEM;
+		}
+		__builtin_memcpy(record->sbr_from, from, from->sa_len);
+	}
+	record->sbr_data = *data;
+	record->sbr_control = controls;
+	record->sbr_flags = flags;
+	record->sbr_len = len;
+	if (control != NULL) {
+		*control = NULL;
+	}
+	sb->sb_bytes += len;
+
+	if (sb->sb_count++ == 0 && sb->sb_bytes < params->sbp_max_bytes) {
+		uint64_t deadline;
+
+		clock_interval_to_deadline(params->sbp_max_delay, NSEC_PER_USEC, &deadline);
+		thread_call_enter_delayed(sb->sb_call, deadline);
+	} else if (sb->sb_bytes >= params->sbp_max_bytes || sb->sb_count == SFLT_BATCH_RECORDS) {
+		thread_call_enter(sb->sb_call);
+	}
+	lck_mtx_unlock(sb->sb_lock);
+
+	return EJUSTRETURN;
+}
+#endif /* KERNEL */
+
+__END_DECLS
+#endif /* __SYS_SFLT_BATCH__ */